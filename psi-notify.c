@@ -1,137 +1,352 @@
 #include <ctype.h>
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <fnmatch.h>
+#include <getopt.h>
+#include <grp.h>
 #include <inttypes.h>
 #include <libnotify/notify.h>
+#include <linux/genetlink.h>
 #include <linux/limits.h>
+#include <linux/netlink.h>
+#include <linux/taskstats.h>
+#include <malloc.h>
+#include <pthread.h>
 #include <pwd.h>
 #include <signal.h>
+#include <stdarg.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/un.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>) && defined(SYS_io_uring_setup)
+#include <linux/io_uring.h>
+#define HAVE_IO_URING
+#endif
+#endif
+
 #include "psi-notify.h"
 
-static volatile sig_atomic_t config_reload_pending = 0; /* SIGHUP */
-static volatile sig_atomic_t run = 1;                   /* SIGTERM, SIGINT */
+static bool config_reloading = false; /* Handling SIGHUP */
 
 static Config cfg;
 static char output_buf[512];
 static Resource *all_res[] = {&cfg.cpu, &cfg.memory, &cfg.io};
+static const char *const res_keys[] = {"cpu", "memory", "io"}; /* As config */
 static bool using_seat = false;
+static bool system_mode = false; /* --system, see seats */
 static const time_t expiry_sec = 10;
 static const double alert_clear_hysteresis = 5.0;
 
-#define DEFAULT_ALERT_STATE {NULL, 0, A_INACTIVE}
+#define DEFAULT_ALERT_STATE {0, 0, A_INACTIVE, false}
 static Alert active_notif[] = {
     [RT_CPU] = DEFAULT_ALERT_STATE,
     [RT_MEMORY] = DEFAULT_ALERT_STATE,
     [RT_IO] = DEFAULT_ALERT_STATE,
 };
 
+static SampleHistory sample_history[NR_RESOURCES];
+static Alert rule_alerts[RULES_MAX]; /* Same order as cfg.rules */
+
+/* Kept whether or not anything exports them, see metrics_render() */
+static struct {
+    uint64_t transitions[NR_RESOURCES][A_ERROR]; /* By the state moved to */
+    uint64_t checks;
+    uint64_t check_usec_total;
+    uint64_t check_usec_max;
+
+    /* How long we take ourselves, see self_stats_dump() */
+    LatencyHistogram pressure_check;
+    LatencyHistogram blocked_tasks;
+    LatencyHistogram notify_show; /* Written by the sender thread */
+    LatencyHistogram notify_close;
+    LatencyHistogram update;
+    LatencyHistogram timer_late;
+    uint64_t cpu_usec_total; /* Over whole loop iterations, not just checks */
+    uint64_t cpu_usec_last;
+    uint64_t rw_syscalls_start; /* See self_rw_syscalls() */
+} stats;
+
+static size_t latency_bucket(uint64_t usec) {
+    unsigned int shift;
+
+    if (usec < LATENCY_SUB_BUCKETS) {
+        return (size_t)usec;
+    }
+
+    if (usec > UINT32_MAX) {
+        usec = UINT32_MAX;
+    }
+    shift = (unsigned int)(63 - __builtin_clzll(usec)) - LATENCY_SUB_BUCKET_BITS;
+    return (shift + 1) * LATENCY_SUB_BUCKETS +
+           ((usec >> shift) & (LATENCY_SUB_BUCKETS - 1));
+}
+
+/* The highest value that goes in a bucket */
+static uint64_t latency_bucket_max(size_t idx) {
+    unsigned int shift;
+
+    if (idx < LATENCY_SUB_BUCKETS) {
+        return idx;
+    }
+
+    shift = (unsigned int)(idx / LATENCY_SUB_BUCKETS) - 1;
+    return ((LATENCY_SUB_BUCKETS + idx % LATENCY_SUB_BUCKETS + 1) << shift) - 1;
+}
+
+#define LATENCY_INC(field)                                                     \
+    atomic_store_explicit(                                                     \
+        &(field), atomic_load_explicit(&(field), memory_order_relaxed) + 1,    \
+        memory_order_relaxed)
+
+static void latency_record(LatencyHistogram *h, uint64_t usec) {
+    LATENCY_INC(h->counts[latency_bucket(usec)]);
+    LATENCY_INC(h->count);
+    if (usec > atomic_load_explicit(&h->max, memory_order_relaxed)) {
+        atomic_store_explicit(&h->max, usec, memory_order_relaxed);
+    }
+}
+
+/* pct is 0 to 100. Rounds up to the top of the bucket, but never past max. */
+static uint64_t latency_percentile(const LatencyHistogram *h, double pct) {
+    uint64_t count = atomic_load_explicit(&h->count, memory_order_relaxed);
+    uint64_t max = atomic_load_explicit(&h->max, memory_order_relaxed);
+    uint64_t want = (uint64_t)((double)count * pct / 100 + 0.5), seen = 0;
+    size_t i;
+
+    if (want == 0) {
+        want = 1;
+    }
+
+    for (i = 0; i < LATENCY_BUCKETS; i++) {
+        seen += atomic_load_explicit(&h->counts[i], memory_order_relaxed);
+        if (seen >= want) {
+            uint64_t top = latency_bucket_max(i);
+            return top < max ? top : max;
+        }
+    }
+
+    return max;
+}
+
+#define SEC_TO_USEC 1000000
+#define SEC_TO_NSEC 1000000000
+#define MSEC_TO_USEC 1000
+
+/*
+ * Replaying a recording, see --replay. Time comes from the samples rather than
+ * the clock, and state changes are printed instead of notified.
+ */
+static struct {
+    bool active;
+    uint64_t now_usec;
+    FILE *out;
+    int64_t first_ts, last_ts;
+    size_t samples, transitions;
+    ReplayAvgs avgs[NR_RESOURCES][2];
+} replay;
+
+static const char *const alert_state_names[] = {
+    [A_INACTIVE] = "inactive",
+    [A_ACTIVE] = "active",
+    [A_STABILISING] = "stabilising",
+    [A_RISING] = "rising",
+};
+
+static uint64_t now_usec(void) {
+    struct timespec ts;
+
+    if (replay.active) {
+        return replay.now_usec;
+    }
+
+    expect(clock_gettime(CLOCK_MONOTONIC, &ts) == 0);
+    return (uint64_t)ts.tv_sec * SEC_TO_USEC + (uint64_t)ts.tv_nsec / 1000;
+}
+
+/*
+ * systemd notifications. The socket is connected once, and messages are
+ * gathered up and sent as one datagram by sd_notify_flush(), which
+ * run_checks() does once per update. STATUS= is only sent by itself when the
+ * part of it that matters changes, and the watchdog is only pinged as often
+ * as it needs to be.
+ */
 #define NOTIFY_MAX 256
-static void sd_notify(const char *message) {
+#define NOTIFY_BATCH_MAX 512
+
+static struct {
+    bool opened;
+    int fd; /* -1 if not started by systemd with Type=notify */
+    char buf[NOTIFY_BATCH_MAX];
+    size_t len;
+    char status[NOTIFY_MAX]; /* Latest, sent or not */
+    size_t status_key_len;   /* How much of it needs to change to send it */
+    char sent_status[NOTIFY_MAX];
+    bool status_changed;
+    uint64_t watchdog_usec; /* What we last asked systemd for */
+    uint64_t max_interval_usec; /* Longest we may go between updates */
+    uint64_t last_ping_usec;
+} sdn = {.fd = -1};
+
+static void sd_notify_open(void) {
     const char *notify_path = getenv("NOTIFY_SOCKET");
     struct sockaddr_un addr = {.sun_family = AF_UNIX};
-    int fd;
-    if (!notify_path) {
+    socklen_t addr_len;
+    size_t len;
+
+    sdn.opened = true;
+
+    if (!notify_path || !*notify_path) {
         return;
     }
-    fd = socket(AF_UNIX, SOCK_DGRAM, 0);
-    expect(fd >= 0);
-    snprintf_check(addr.sun_path, sizeof(addr.sun_path), "%s", notify_path);
-    expect(connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0);
-    expect(write(fd, message, strlen(message)) == (ssize_t)strlen(message));
-    close(fd);
-}
 
-static void request_reload_config(int sig) {
-    (void)sig;
-    config_reload_pending = 1;
+    len = strlen(notify_path);
+    if (len >= sizeof(addr.sun_path)) {
+        warn("NOTIFY_SOCKET is too long: %s\n", notify_path);
+        return;
+    }
+    memcpy(addr.sun_path, notify_path, len);
+    if (addr.sun_path[0] == '@') {
+        addr.sun_path[0] = '\0'; /* Abstract namespace */
+    }
+    addr_len = (socklen_t)(offsetof(struct sockaddr_un, sun_path) + len);
+
+    sdn.fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    expect(sdn.fd >= 0);
+    if (connect(sdn.fd, (struct sockaddr *)&addr, addr_len) < 0) {
+        warn("Can't connect to NOTIFY_SOCKET %s: %s\n", notify_path,
+             strerror(errno));
+        close(sdn.fd);
+        sdn.fd = -1;
+    }
 }
 
-static void request_exit(int sig) {
-    if (!run) {
-        /* Asked to quit twice now, skip teardown. */
-        _exit(128 + sig);
+/* Queues message, which is one or more lines of VAR=value, for the next flush */
+static void sd_notify(const char *message) {
+    size_t len = strlen(message);
+
+    if (!sdn.opened) {
+        sd_notify_open();
     }
 
-    run = 0;
-}
+    if (sdn.fd < 0) {
+        return;
+    }
 
-static void configure_signal_handlers(void) {
-    const struct sigaction sa_exit = {
-        .sa_handler = request_exit,
-    };
-    expect(
-        sigaction(SIGHUP,
-                  &(const struct sigaction){.sa_handler = request_reload_config,
-                                            .sa_flags = SA_RESTART},
-                  NULL) == 0);
-    expect(sigaction(SIGTERM, &sa_exit, NULL) == 0);
-    expect(sigaction(SIGINT, &sa_exit, NULL) == 0);
+    if (sdn.len + len + 1 >= sizeof(sdn.buf)) {
+        warn("%s\n", "Too much to tell systemd at once, dropping some");
+        return;
+    }
+
+    memcpy(sdn.buf + sdn.len, message, len);
+    sdn.len += len;
+    sdn.buf[sdn.len++] = '\n';
 }
 
-static void alert_destroy(NotifyNotification *n) {
-    (void)notify_notification_close(n, NULL);
-    g_object_unref(G_OBJECT(n));
+/*
+ * Sets the status to show in systemctl status. It's only sent by itself when
+ * its first key_len bytes change, otherwise it goes with whatever is sent next.
+ */
+static void sd_notify_status(const char *status, size_t key_len) {
+    if (sdn.status_key_len != key_len ||
+        strncmp(sdn.sent_status, status, key_len) != 0) {
+        sdn.status_changed = true;
+    }
+    snprintf_check(sdn.status, sizeof(sdn.status), "%s", status);
+    sdn.status_key_len = key_len;
 }
 
-#define TITLE_MAX sizeof("High memory pressure!")
+/*
+ * Pings the watchdog if it might otherwise go off before the next update gets
+ * a chance to, with time to spare.
+ */
+static void sd_notify_watchdog(void) {
+    uint64_t now = now_usec();
+
+    if (sdn.watchdog_usec &&
+        now - sdn.last_ping_usec + sdn.max_interval_usec <
+            sdn.watchdog_usec / 2) {
+        return;
+    }
 
-static NotifyNotification *alert_user(const char *resource) {
-    char title[TITLE_MAX];
-    NotifyNotification *n;
-    GError *err = NULL;
+    sd_notify("WATCHDOG=1");
+    sdn.last_ping_usec = now;
+}
 
-    expect(notify_is_initted());
+static void sd_notify_flush(void) {
+    ssize_t ret;
 
-    snprintf_check(title, TITLE_MAX, "High %s pressure!", resource);
-    n = notify_notification_new(
-        title, "Consider reducing demand on this resource.", NULL);
-    notify_notification_set_urgency(n, NOTIFY_URGENCY_CRITICAL);
+    if (sdn.fd < 0) {
+        sdn.len = 0;
+        return;
+    }
 
-    if (!notify_notification_show(n, &err)) {
-        warn("Cannot display notification: %s\n", err->message);
-        g_error_free(err);
-        alert_destroy(n);
-        n = NULL;
+    if ((sdn.status_changed || sdn.len > 0) &&
+        !streq(sdn.status, sdn.sent_status)) {
+        char line[NOTIFY_MAX + sizeof("STATUS=")];
+        snprintf_check(line, sizeof(line), "STATUS=%s", sdn.status);
+        sd_notify(line);
+        memcpy(sdn.sent_status, sdn.status, sizeof(sdn.sent_status));
     }
+    sdn.status_changed = false;
 
-    return n;
+    if (sdn.len == 0) {
+        return;
+    }
+
+    ret = send(sdn.fd, sdn.buf, sdn.len, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (ret < 0) {
+        warn("Can't notify systemd: %s\n", strerror(errno));
+    }
+    sdn.len = 0;
 }
 
-static void alert_destroy_all_active(void) {
-    size_t i;
-    for_each_arr(i, active_notif) {
-        if (active_notif[i].notif) {
-            NotifyNotification *n = active_notif[i].notif;
-            active_notif[i].notif = NULL;
-            alert_destroy(n);
-        }
+static void sd_notify_close(void) {
+    if (sdn.fd >= 0) {
+        close(sdn.fd);
     }
+    sdn.fd = -1;
+    sdn.opened = false;
 }
 
 #define PRESSURE_FILE_PATH_MAX sizeof("memory.pressure")
 
+static void get_seat_cgroup_path(char *out) {
+    snprintf_check(
+        out, PATH_MAX, "/sys/fs/cgroup/user.slice/user-%d.slice", getuid());
+}
+
 static int get_psi_dir_fd(void) {
     int dir_fd;
     char dir_path[PATH_MAX];
 
-    snprintf_check(dir_path,
-                   PATH_MAX,
-                   "/sys/fs/cgroup/user.slice/user-%d.slice",
-                   getuid());
+    get_seat_cgroup_path(dir_path);
 
-    if ((dir_fd = open(dir_path, O_RDONLY)) >= 0) {
+    /* In system mode, seats are sampled separately, see seats. */
+    if (!system_mode && (dir_fd = open(dir_path, O_RDONLY | O_CLOEXEC)) >= 0) {
         using_seat = true;
         return dir_fd;
-    } else if ((dir_fd = open("/proc/pressure", O_RDONLY)) >= 0) {
+    } else if ((dir_fd = open("/proc/pressure", O_RDONLY | O_CLOEXEC)) >= 0) {
         return dir_fd;
     }
 
@@ -156,12 +371,115 @@ static char *get_psi_filename(const char *resource, bool in_test) {
     return path;
 }
 
+#define MIN_PSI 1.0
+
+static double psi_hysteresis_by(double orig_psi, double hysteresis) {
+    const double penalised_psi = orig_psi - hysteresis;
+
+    if (penalised_psi < MIN_PSI) {
+        /* Too small to make granular volatility decisions. */
+        return MIN_PSI;
+    }
+
+    return penalised_psi;
+}
+
+static double psi_hysteresis(double orig_psi) {
+    return psi_hysteresis_by(orig_psi, alert_clear_hysteresis);
+}
+
 #define CONFIG_LINE_MAX 256
 
+static ssize_t custom_window_find(const Resource *r, unsigned int window_sec) {
+    size_t i;
+
+    for (i = 0; i < r->nr_windows; i++) {
+        if (r->windows[i].window_sec == window_sec) {
+            return (ssize_t)i;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Custom windows, like avg1 or avg3, are calculated by us from the total=
+ * stall counter rather than by the kernel, so they can react much more quickly
+ * than avg10. Returns the thresholds for this window, creating it if needed.
+ */
+static TimeResourcePressure *custom_window_thresholds(Resource *r,
+                                                      unsigned int window_sec) {
+    ssize_t found = custom_window_find(r, window_sec);
+    CustomWindow *w;
+
+    if (found >= 0) {
+        return &r->windows[found].thresholds;
+    }
+
+    if (r->nr_windows == CUSTOM_WINDOWS_MAX) {
+        return NULL;
+    }
+
+    w = &r->windows[r->nr_windows++];
+    w->window_sec = window_sec;
+    memset(&w->thresholds, 0xff, sizeof(w->thresholds)); /* -nan */
+    memset(&w->current, 0xff, sizeof(w->current));
+    return &w->thresholds;
+}
+
+static Resource *resource_from_name(const char *name) {
+    if (streq(name, "cpu")) {
+        return &cfg.cpu;
+    } else if (streq(name, "memory")) {
+        return &cfg.memory;
+    } else if (streq(name, "io")) {
+        return &cfg.io;
+    }
+    return NULL;
+}
+
+static TimeResourcePressure *kernel_window_thresholds(Pressure *p,
+                                                      const char *interval) {
+    if (streq(interval, "avg10")) {
+        return &p->avg10;
+    } else if (streq(interval, "avg60")) {
+        return &p->avg60;
+    } else if (streq(interval, "avg300")) {
+        return &p->avg300;
+    }
+    return NULL;
+}
+
+/*
+ * Checked before a custom window is looked up, so that a bad line doesn't take
+ * one up, and have it computed every update for nothing.
+ */
+static bool config_threshold_type_valid(const char *resource,
+                                        const char *type) {
+    if (streq(type, "full") && streq(resource, "cpu")) {
+        warn("Full interval for %s is bogus, ignoring.\n", resource);
+        return false;
+    } else if (!streq(type, "some") && !streq(type, "full")) {
+        warn("Invalid type in config, ignoring: '%s'\n", type);
+        return false;
+    }
+    return true;
+}
+
+static void config_set_threshold_type(TimeResourcePressure *t,
+                                      const char *type, double threshold) {
+    if (streq(type, "some")) {
+        t->some = threshold;
+    } else {
+        t->full = threshold;
+    }
+}
+
 static void config_update_threshold(const char *line) {
     char resource[CONFIG_LINE_MAX], type[CONFIG_LINE_MAX],
         interval[CONFIG_LINE_MAX];
     double threshold;
+    unsigned int window_sec;
+    char trailing;
     Resource *r;
     TimeResourcePressure *t;
 
@@ -182,138 +500,878 @@ static void config_update_threshold(const char *line) {
         return;
     }
 
-    if (streq(resource, "cpu")) {
-        r = &cfg.cpu;
-    } else if (streq(resource, "memory")) {
-        r = &cfg.memory;
-    } else if (streq(resource, "io")) {
-        r = &cfg.io;
-    } else {
+    r = resource_from_name(resource);
+    if (!r) {
         warn("Invalid resource in config, ignoring: '%s'\n", resource);
         return;
     }
 
-    if (streq(interval, "avg10")) {
-        t = &r->thresholds.avg10;
-    } else if (streq(interval, "avg60")) {
-        t = &r->thresholds.avg60;
-    } else if (streq(interval, "avg300")) {
-        t = &r->thresholds.avg300;
-    } else {
-        warn("Invalid interval in config, ignoring: '%s'\n", interval);
+    if (!config_threshold_type_valid(resource, type)) {
         return;
     }
 
-    if (streq(type, "some")) {
-        t->some = threshold;
-    } else if (streq(type, "full")) {
-        if (streq(resource, "cpu")) {
-            warn("Full interval for %s is bogus, ignoring.\n", resource);
+    t = kernel_window_thresholds(&r->thresholds, interval);
+    if (t) {
+        /* Nothing more to do, it's one of the kernel's. */
+    } else if (sscanf(interval, "avg%u%c", &window_sec, &trailing) == 1 &&
+               window_sec >= 1 && window_sec <= CUSTOM_WINDOW_MAX_SEC) {
+        t = custom_window_thresholds(r, window_sec);
+        if (!t) {
+            warn("Too many custom windows for %s, ignoring: '%s'\n",
+                 resource,
+                 interval);
             return;
         }
-        t->full = threshold;
     } else {
-        warn("Invalid type in config, ignoring: '%s'\n", type);
+        warn("Invalid interval in config, ignoring: '%s'\n", interval);
         return;
     }
+
+    config_set_threshold_type(t, type, threshold);
 }
 
-static void config_update_interval(const char *line) {
-    int32_t rvalue;
-    if (sscanf(line, "%*s %" SCNd32, &rvalue) != 1) {
-        warn("Invalid config line, ignoring: %s", line);
+static CgroupProfile *cgroup_profile_get(const char *pattern) {
+    size_t i;
+    CgroupProfile *p;
+
+    for (i = 0; i < cfg.nr_cgroup_profiles; i++) {
+        if (streq(cfg.cgroup_profiles[i].pattern, pattern)) {
+            return &cfg.cgroup_profiles[i];
+        }
+    }
+
+    if (cfg.nr_cgroup_profiles == CGROUP_PROFILES_MAX ||
+        strlen(pattern) >= sizeof(p->pattern)) {
+        return NULL;
+    }
+
+    p = &cfg.cgroup_profiles[cfg.nr_cgroup_profiles++];
+    snprintf_check(p->pattern, sizeof(p->pattern), "%s", pattern);
+    /* A profile replaces the global thresholds entirely, so start empty. */
+    memset(&p->thresholds, 0xff, sizeof(p->thresholds)); /* -nan */
+    return p;
+}
+
+/* cgroup_threshold <glob> <resource> <some|full> <avg10|avg60|avg300> <val> */
+static void config_update_cgroup_threshold(const char *line) {
+    char pattern[CONFIG_LINE_MAX], resource[CONFIG_LINE_MAX],
+        type[CONFIG_LINE_MAX], interval[CONFIG_LINE_MAX];
+    double threshold;
+    CgroupProfile *p;
+    Resource *r;
+    TimeResourcePressure *t;
+
+    if (sscanf(line,
+               "%*s %s %s %s %s %lf",
+               pattern,
+               resource,
+               type,
+               interval,
+               &threshold) != 5) {
+        warn("Invalid cgroup threshold, ignoring: %s", line);
         return;
     }
 
-    if (rvalue < 0) {
-        warn("Ignoring <0 update interval: %" PRId32 "\n", rvalue);
+    if (!(threshold >= 0)) {
+        warn("Invalid threshold for %s, ignoring: %f\n", pattern, threshold);
         return;
     }
 
-    if (rvalue > 1800) {
-        /* WATCHDOG_USEC must still fit in a uint */
-        warn("Clamping update interval to 1800 from %" PRId32 ".\n", rvalue);
-        rvalue = 1800;
+    r = resource_from_name(resource);
+    if (!r) {
+        warn("Invalid resource in config, ignoring: '%s'\n", resource);
+        return;
+    }
+
+    p = cgroup_profile_get(pattern);
+    if (!p) {
+        warn("Too many or too long cgroup patterns, ignoring: '%s'\n",
+             pattern);
+        return;
+    }
+
+    /* Custom windows would need history for every cgroup, so not for now. */
+    t = kernel_window_thresholds(&p->thresholds[r->type], interval);
+    if (!t) {
+        warn("Invalid interval for cgroup threshold, ignoring: '%s'\n",
+             interval);
+        return;
     }
 
-    /* Signed at first to avoid %u shenanigans with negatives */
-    cfg.update_interval = (time_t)rvalue;
+    if (config_threshold_type_valid(resource, type)) {
+        config_set_threshold_type(t, type, threshold);
+    }
 }
 
-static void config_update_log_pressures(const char *line) {
+static void config_update_cgroup_root(const char *line) {
     char rvalue[CONFIG_LINE_MAX];
-    int ret;
 
-    if (sscanf(line, "%*s %s", rvalue) != 1) {
-        warn("Invalid config line, ignoring: %s", line);
+    if (sscanf(line, "%*s %s", rvalue) != 1 || rvalue[0] != '/') {
+        warn("Invalid cgroup root, must be an absolute path: %s", line);
         return;
     }
 
-    ret = parse_boolean(rvalue);
-    if (ret < 0) {
-        warn("Invalid bool for log_pressures, ignoring: %s\n", rvalue);
-        return;
+    snprintf_check(cfg.cgroup_root, sizeof(cfg.cgroup_root), "%s", rvalue);
+}
+
+/*
+ * The rule compiler, a recursive descent parser which emits code as it goes:
+ *
+ *   or     := and ("||" and)*
+ *   and    := not ("&&" not)*
+ *   not    := "!" not | cmp
+ *   cmp    := term ((">" | ">=" | "<" | "<=") term)?
+ *   term   := number | metric | ("min" | "max") "(" or ("," or)+ ")"
+ *           | "(" or ")"
+ *   metric := resource "." ("some" | "full") "." "avg" seconds
+ *
+ * Comparisons are true while the left side is above (or below) the right,
+ * less the rule's hysteresis once the alert is active. Where the right side is
+ * a constant, as it usually is, the hysteresis is folded into it here.
+ */
+typedef struct {
+    const char *p;
+    Rule *rule;
+    double hysteresis;
+    size_t depth;
+    bool culprits_set;
+    /*
+     * Custom windows the rule uses which don't exist yet. Each one costs work
+     * every update, so they're only created once the whole rule compiles.
+     */
+    struct {
+        Resource *r;
+        unsigned int window_sec;
+    } new_windows[NR_RESOURCES * CUSTOM_WINDOWS_MAX];
+    size_t nr_new_windows;
+} RuleParser;
+
+static int rule_parse_or(RuleParser *rp);
+
+static bool rule_accept(RuleParser *rp, const char *tok) {
+    size_t len = strlen(tok);
+
+    while (isspace((unsigned char)*rp->p)) {
+        rp->p++;
     }
 
-    cfg.log_pressures = ret;
+    if (strncmp(rp->p, tok, len) != 0) {
+        return false;
+    }
+
+    rp->p += len;
+    return true;
 }
 
-static void config_reset_user_facing(void) {
-    cfg.update_interval = 5;
-    cfg.log_pressures = false;
+static int rule_emit(RuleParser *rp, RuleOp op, uint32_t metric, double imm,
+                     double imm_hyst) {
+    Rule *rule = rp->rule;
 
-    /* -nan */
-    memset(&cfg.cpu.thresholds, 0xff, sizeof(cfg.cpu.thresholds));
-    memset(&cfg.memory.thresholds, 0xff, sizeof(cfg.memory.thresholds));
-    memset(&cfg.io.thresholds, 0xff, sizeof(cfg.io.thresholds));
-}
+    if (rule->nr_insns == RULE_INSNS_MAX) {
+        warn("Rule %s is too long\n", rule->name);
+        return -E2BIG;
+    }
 
-#define WATCHDOG_GRACE_PERIOD_SEC 5
-#define SEC_TO_USEC 1000000
-static void watchdog_update_usec(void) {
-    char message[NOTIFY_MAX];
-    snprintf_check(message,
-                   sizeof(message),
-                   "WATCHDOG_USEC=%" PRIdMAX,
-                   ((intmax_t)cfg.update_interval + WATCHDOG_GRACE_PERIOD_SEC) *
-                       SEC_TO_USEC);
-    sd_notify(message);
+    if (op == ROP_LOAD || op == ROP_CONST) {
+        if (++rp->depth > RULE_STACK_MAX) {
+            warn("Rule %s is nested too deeply\n", rule->name);
+            return -E2BIG;
+        }
+    } else if (op != ROP_NOT) {
+        rp->depth--;
+    }
+
+    rule->insns[rule->nr_insns++] =
+        (RuleInsn){.op = op, .metric = metric, .imm = {imm, imm_hyst}};
+    return 0;
 }
 
-static void config_get_path(char *out) {
-    const char *base_dir = getenv("XDG_CONFIG_DIR");
-    const struct passwd *pw = NULL;
+/*
+ * The slot window_sec will have once the rule's new windows are created, which
+ * happens in order after the existing ones.
+ */
+static int rule_window_slot(RuleParser *rp, Resource *r,
+                            unsigned int window_sec, uint32_t *slot) {
+    ssize_t found = custom_window_find(r, window_sec);
+    size_t i, nr = r->nr_windows;
 
-    if (base_dir) {
-        snprintf_check(out, PATH_MAX, "%s/psi-notify", base_dir);
-    } else {
-        base_dir = getenv("HOME");
-        if (!base_dir) {
-            pw = getpwuid(getuid());
-            if (pw) {
-                base_dir = pw->pw_dir;
-            } else {
-                warn("%s\n",
-                     "No $XDG_CONFIG_DIR, $HOME, or entry in /etc/passwd?");
-                base_dir = "/";
-            }
+    if (found >= 0) {
+        *slot = (uint32_t)found;
+        return 0;
+    }
+
+    for (i = 0; i < rp->nr_new_windows; i++) {
+        if (rp->new_windows[i].r != r) {
+            continue;
+        }
+        if (rp->new_windows[i].window_sec == window_sec) {
+            *slot = (uint32_t)nr;
+            return 0;
         }
+        nr++;
+    }
 
-        snprintf_check(out, PATH_MAX, "%s/.config/psi-notify", base_dir);
+    if (nr == CUSTOM_WINDOWS_MAX) {
+        return -ENOSPC;
     }
+
+    rp->new_windows[rp->nr_new_windows].r = r;
+    rp->new_windows[rp->nr_new_windows].window_sec = window_sec;
+    rp->nr_new_windows++;
+    *slot = (uint32_t)nr;
+    return 0;
 }
 
-static int config_update_from_file(FILE **override_config) {
-    char line[CONFIG_LINE_MAX];
-    char config_path[PATH_MAX] = "";
-    FILE *f;
-    int ret = 0;
+/* Registered with no thresholds, so they're only calculated. */
+static void rule_windows_register(const RuleParser *rp) {
+    size_t i;
 
-    if (override_config) {
-        f = *override_config;
-    } else {
-        config_get_path(config_path);
-        f = fopen(config_path, "re");
+    for (i = 0; i < rp->nr_new_windows; i++) {
+        expect(custom_window_thresholds(rp->new_windows[i].r,
+                                        rp->new_windows[i].window_sec));
+    }
+}
+
+static int rule_parse_metric(RuleParser *rp) {
+    char resource[8], type[8], trailing;
+    unsigned int window_sec;
+    size_t len = strspn(rp->p, "abcdefghijklmnopqrstuvwxyz0123456789.");
+    char word[CONFIG_LINE_MAX];
+    uint32_t slot;
+    Resource *r;
+    bool full;
+
+    snprintf_check(word, sizeof(word), "%.*s", (int)len, rp->p);
+    rp->p += len;
+
+    if (sscanf(word, "%7[a-z].%7[a-z].avg%u%c", resource, type, &window_sec,
+               &trailing) != 3 ||
+        !(r = resource_from_name(resource)) ||
+        (!streq(type, "some") && !streq(type, "full"))) {
+        warn("Invalid metric in rule %s: '%s'\n", rp->rule->name, word);
+        return -EINVAL;
+    }
+
+    full = streq(type, "full");
+    if (full && !r->has_full) {
+        warn("Full interval for %s is bogus in rule %s\n", resource,
+             rp->rule->name);
+        return -EINVAL;
+    }
+
+    if (window_sec == 10) {
+        slot = 0;
+    } else if (window_sec == 60) {
+        slot = 1;
+    } else if (window_sec == 300) {
+        slot = 2;
+    } else if (window_sec >= 1 && window_sec <= CUSTOM_WINDOW_MAX_SEC &&
+               rule_window_slot(rp, r, window_sec, &slot) == 0) {
+        slot += 3;
+    } else {
+        warn("Invalid or too many windows in rule %s: '%s'\n", rp->rule->name,
+             word);
+        return -EINVAL;
+    }
+
+    if (!rp->culprits_set) {
+        rp->rule->culprits = r->type;
+        rp->culprits_set = true;
+    }
+
+    return rule_emit(rp,
+                     ROP_LOAD,
+                     ((uint32_t)r->type * 2 + full) * RULE_WINDOWS + slot,
+                     0,
+                     0);
+}
+
+static int rule_parse_term(RuleParser *rp) {
+    char *end;
+    double val;
+    int ret;
+
+    if (rule_accept(rp, "(")) {
+        ret = rule_parse_or(rp);
+        if (ret == 0 && !rule_accept(rp, ")")) {
+            warn("Missing ')' in rule %s\n", rp->rule->name);
+            return -EINVAL;
+        }
+        return ret;
+    }
+
+    if (rule_accept(rp, "min(") || rule_accept(rp, "max(")) {
+        RuleOp op = rp->p[-2] == 'n' ? ROP_MIN : ROP_MAX;
+        size_t nr = 0;
+
+        do {
+            ret = rule_parse_or(rp);
+            if (ret == 0 && nr++ > 0) {
+                ret = rule_emit(rp, op, 0, 0, 0);
+            }
+            if (ret < 0) {
+                return ret;
+            }
+        } while (rule_accept(rp, ","));
+
+        if (!rule_accept(rp, ")") || nr < 2) {
+            warn("min() and max() take two or more arguments in rule %s\n",
+                 rp->rule->name);
+            return -EINVAL;
+        }
+        return 0;
+    }
+
+    if (isalpha((unsigned char)*rp->p)) {
+        return rule_parse_metric(rp);
+    }
+
+    errno = 0;
+    val = strtod(rp->p, &end);
+    if (end == rp->p || errno || val < 0) {
+        warn("Expected a number or metric in rule %s: '%.*s'\n",
+             rp->rule->name,
+             (int)strcspn(rp->p, "\n"),
+             rp->p);
+        return -EINVAL;
+    }
+    rp->p = end;
+
+    return rule_emit(rp, ROP_CONST, 0, val, val);
+}
+
+static int rule_parse_cmp(RuleParser *rp) {
+    RuleInsn *last;
+    RuleOp op;
+    int ret;
+
+    ret = rule_parse_term(rp);
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (rule_accept(rp, ">=")) {
+        op = ROP_GE;
+    } else if (rule_accept(rp, ">")) {
+        op = ROP_GT;
+    } else if (rule_accept(rp, "<=")) {
+        op = ROP_LE;
+    } else if (rule_accept(rp, "<")) {
+        op = ROP_LT;
+    } else {
+        return 0;
+    }
+
+    ret = rule_parse_term(rp);
+    if (ret < 0) {
+        return ret;
+    }
+
+    last = &rp->rule->insns[rp->rule->nr_insns - 1];
+    if (last->op == ROP_CONST) {
+        last->imm[1] = op == ROP_GT || op == ROP_GE
+                           ? psi_hysteresis_by(last->imm[0], rp->hysteresis)
+                           : last->imm[0] + rp->hysteresis;
+        return rule_emit(rp, op, 0, 0, 0);
+    }
+
+    return rule_emit(rp, op, 0, 0, rp->hysteresis);
+}
+
+static int rule_parse_not(RuleParser *rp) {
+    int ret;
+
+    if (!rule_accept(rp, "!")) {
+        return rule_parse_cmp(rp);
+    }
+
+    ret = rule_parse_not(rp);
+    return ret < 0 ? ret : rule_emit(rp, ROP_NOT, 0, 0, 0);
+}
+
+static int rule_parse_and(RuleParser *rp) {
+    int ret = rule_parse_not(rp);
+
+    while (ret == 0 && rule_accept(rp, "&&")) {
+        ret = rule_parse_not(rp);
+        if (ret == 0) {
+            ret = rule_emit(rp, ROP_AND, 0, 0, 0);
+        }
+    }
+
+    return ret;
+}
+
+static int rule_parse_or(RuleParser *rp) {
+    int ret = rule_parse_and(rp);
+
+    while (ret == 0 && rule_accept(rp, "||")) {
+        ret = rule_parse_and(rp);
+        if (ret == 0) {
+            ret = rule_emit(rp, ROP_OR, 0, 0, 0);
+        }
+    }
+
+    return ret;
+}
+
+static int rule_compile(Rule *rule, const char *expr, double hysteresis) {
+    RuleParser rp = {.p = expr, .rule = rule, .hysteresis = hysteresis};
+    int ret;
+
+    rule->nr_insns = 0;
+    ret = rule_parse_or(&rp);
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (!rule_accept(&rp, "#") && *rp.p) {
+        warn("Unexpected '%.*s' in rule %s\n",
+             (int)strcspn(rp.p, "\n"),
+             rp.p,
+             rule->name);
+        return -EINVAL;
+    }
+
+    expect(rp.depth == 1);
+    rule_windows_register(&rp);
+    return 0;
+}
+
+static void config_update_rule(const char *line) {
+    char name[CONFIG_LINE_MAX];
+    double hysteresis = alert_clear_hysteresis;
+    const char *expr;
+    Rule *rule;
+    size_t len;
+    int pos = 0;
+
+    if (sscanf(line, "%*s %s %n", name, &pos) != 1 || !pos) {
+        warn("Invalid rule, ignoring: %s", line);
+        return;
+    }
+    expr = line + pos;
+
+    if (strlen(name) >= RULE_NAME_MAX) {
+        warn("Rule name is too long, ignoring: %s\n", name);
+        return;
+    }
+
+    if (strncmp(expr, "hysteresis ", strlen("hysteresis ")) == 0) {
+        if (sscanf(expr, "%*s %lf %n", &hysteresis, &pos) != 1 ||
+            hysteresis < 0) {
+            warn("Invalid hysteresis for rule %s, ignoring: %s", name, line);
+            return;
+        }
+        expr += pos;
+    }
+
+    if (cfg.nr_rules == RULES_MAX) {
+        warn("Too many rules, ignoring: %s\n", name);
+        return;
+    }
+
+    rule = &cfg.rules[cfg.nr_rules];
+    snprintf_check(rule->name, sizeof(rule->name), "%s", name);
+    len = strcspn(expr, "#\n");
+    while (len > 0 && isspace((unsigned char)expr[len - 1])) {
+        len--;
+    }
+    snprintf_check(rule->expr, sizeof(rule->expr), "%.*s", (int)len, expr);
+
+    if (rule_compile(rule, expr, hysteresis) < 0) {
+        warn("Invalid rule, ignoring: %s", line);
+        return;
+    }
+
+    cfg.nr_rules++;
+}
+
+#define ACTION_COOLDOWN_MAX_SEC 86400
+
+/*
+ * action <resource> [cooldown <secs>] set <cgroup> <file> <value>
+ * action <resource> [cooldown <secs>] exec <path> [args...]
+ *
+ * Relative cgroups are under /sys/fs/cgroup.
+ */
+static void config_update_action(const char *line) {
+    char resource[CONFIG_LINE_MAX], kind[CONFIG_LINE_MAX];
+    char cgroup[CONFIG_LINE_MAX], file[CONFIG_LINE_MAX];
+    double cooldown = ACTION_DEFAULT_COOLDOWN_SEC;
+    const char *rest;
+    const Resource *r;
+    Action *action;
+    size_t len;
+    int pos = 0;
+
+    if (sscanf(line, "%*s %s %n", resource, &pos) != 1 || !pos) {
+        warn("Invalid action, ignoring: %s", line);
+        return;
+    }
+    rest = line + pos;
+
+    r = resource_from_name(resource);
+    if (!r) {
+        warn("Invalid resource in config, ignoring: '%s'\n", resource);
+        return;
+    }
+
+    if (strncmp(rest, "cooldown ", strlen("cooldown ")) == 0) {
+        pos = 0;
+        /* Negated to also catch NaN */
+        if (sscanf(rest, "%*s %lf %n", &cooldown, &pos) != 1 || !pos ||
+            !(cooldown >= 0)) {
+            warn("Invalid cooldown for action, ignoring: %s", line);
+            return;
+        }
+        rest += pos;
+    }
+
+    if (cooldown > ACTION_COOLDOWN_MAX_SEC) {
+        warn("Clamping action cooldown to %d from %g.\n",
+             ACTION_COOLDOWN_MAX_SEC, cooldown);
+        cooldown = ACTION_COOLDOWN_MAX_SEC;
+    }
+
+    pos = 0;
+    if (sscanf(rest, "%s %n", kind, &pos) != 1 || !pos) {
+        warn("Invalid action, ignoring: %s", line);
+        return;
+    }
+    rest += pos;
+
+    if (cfg.nr_actions == ACTIONS_MAX) {
+        warn("Too many actions, ignoring: %s", line);
+        return;
+    }
+
+    action = &cfg.actions[cfg.nr_actions];
+    action->resource = r->type;
+    action->cooldown_usec = (uint64_t)(cooldown * SEC_TO_USEC);
+
+    if (streq(kind, "set")) {
+        pos = 0;
+        if (sscanf(rest, "%s %s %n", cgroup, file, &pos) != 2 || !pos ||
+            strchr(file, '/')) {
+            warn("Invalid set action, ignoring: %s", line);
+            return;
+        }
+        rest += pos;
+        action->kind = ACTION_SET;
+        snprintf_check(action->path, sizeof(action->path), "%s%s/%s",
+                       cgroup[0] == '/' ? "" : "/sys/fs/cgroup/", cgroup, file);
+    } else if (streq(kind, "exec")) {
+        pos = 0;
+        if (sscanf(rest, "%s %n", file, &pos) != 1 || !pos || file[0] != '/') {
+            warn("Invalid exec action, must be an absolute path: %s", line);
+            return;
+        }
+        rest += pos;
+        action->kind = ACTION_EXEC;
+        snprintf_check(action->path, sizeof(action->path), "%s", file);
+    } else {
+        warn("Invalid action, must be set or exec: %s", line);
+        return;
+    }
+
+    len = strcspn(rest, "#\n");
+    while (len > 0 && isspace((unsigned char)rest[len - 1])) {
+        len--;
+    }
+    if (action->kind == ACTION_SET && len == 0) {
+        warn("Missing value for set action, ignoring: %s", line);
+        return;
+    }
+    snprintf_check(action->arg, sizeof(action->arg), "%.*s", (int)len, rest);
+
+    cfg.nr_actions++;
+}
+
+static void config_update_metrics_socket(const char *line) {
+    char rvalue[CONFIG_LINE_MAX];
+
+    if (sscanf(line, "%*s %s", rvalue) != 1 || rvalue[0] != '/') {
+        warn("Invalid metrics socket, must be an absolute path: %s", line);
+        return;
+    }
+
+    snprintf_check(cfg.metrics_path, sizeof(cfg.metrics_path), "%s", rvalue);
+}
+
+static void config_update_subscribe_socket(const char *line) {
+    char rvalue[CONFIG_LINE_MAX];
+
+    if (sscanf(line, "%*s %s", rvalue) != 1 || rvalue[0] != '/') {
+        warn("Invalid subscribe socket, must be an absolute path: %s", line);
+        return;
+    }
+
+    snprintf_check(
+        cfg.subscribe_path, sizeof(cfg.subscribe_path), "%s", rvalue);
+}
+
+static void config_update_record(const char *line) {
+    char rvalue[CONFIG_LINE_MAX];
+
+    if (sscanf(line, "%*s %s", rvalue) != 1 || rvalue[0] != '/') {
+        warn("Invalid record file, must be an absolute path: %s", line);
+        return;
+    }
+
+    snprintf_check(cfg.record_path, sizeof(cfg.record_path), "%s", rvalue);
+}
+
+#define SEC_TO_MSEC 1000
+
+static void config_update_interval(const char *line) {
+    double rvalue;
+    if (sscanf(line, "%*s %lf", &rvalue) != 1) {
+        warn("Invalid config line, ignoring: %s", line);
+        return;
+    }
+
+    /* Negated to also catch NaN */
+    if (!(rvalue >= 0)) {
+        warn("Ignoring <0 update interval: %g\n", rvalue);
+        return;
+    }
+
+    if (rvalue > 1800) {
+        /* WATCHDOG_USEC must still fit in a uint */
+        warn("Clamping update interval to 1800 from %g.\n", rvalue);
+        rvalue = 1800;
+    }
+
+    /* Fractional intervals are allowed for sub-second sampling. */
+    cfg.update_interval_ms = (int64_t)(rvalue * SEC_TO_MSEC + 0.5);
+}
+
+/* update_adaptive <min> <max>, both in seconds like update */
+static void config_update_adaptive(const char *line) {
+    double min, max;
+
+    if (sscanf(line, "%*s %lf %lf", &min, &max) != 2) {
+        warn("Invalid config line, ignoring: %s", line);
+        return;
+    }
+
+    /* Negated to also catch NaN */
+    if (!(min > 0 && min <= max)) {
+        warn("Invalid adaptive update range, ignoring: %g to %g\n", min, max);
+        return;
+    }
+
+    if (max > 1800) {
+        /* WATCHDOG_USEC must still fit in a uint */
+        warn("Clamping adaptive update maximum to 1800 from %g.\n", max);
+        max = 1800;
+    }
+
+    cfg.update_min_ms = (int64_t)(min * SEC_TO_MSEC + 0.5);
+    cfg.update_max_ms = (int64_t)(max * SEC_TO_MSEC + 0.5);
+}
+
+#define PREDICT_HORIZON_MAX_SEC 60
+
+/* predict <horizon>, in seconds */
+static void config_update_predict(const char *line) {
+    double horizon;
+
+    if (sscanf(line, "%*s %lf", &horizon) != 1) {
+        warn("Invalid config line, ignoring: %s", line);
+        return;
+    }
+
+    /* Negated to also catch NaN */
+    if (!(horizon >= 0)) {
+        warn("Invalid prediction horizon, ignoring: %g\n", horizon);
+        return;
+    }
+
+    if (horizon > PREDICT_HORIZON_MAX_SEC) {
+        warn("Clamping prediction horizon to %d from %g.\n",
+             PREDICT_HORIZON_MAX_SEC, horizon);
+        horizon = PREDICT_HORIZON_MAX_SEC;
+    }
+
+    cfg.predict_horizon_sec = horizon;
+}
+
+static void config_update_log_pressures(const char *line) {
+    char rvalue[CONFIG_LINE_MAX];
+    int ret;
+
+    if (sscanf(line, "%*s %s", rvalue) != 1) {
+        warn("Invalid config line, ignoring: %s", line);
+        return;
+    }
+
+    ret = parse_boolean(rvalue);
+    if (ret < 0) {
+        warn("Invalid bool for log_pressures, ignoring: %s\n", rvalue);
+        return;
+    }
+
+    cfg.log_pressures = ret;
+}
+
+static void config_update_lock_memory(const char *line) {
+    char rvalue[CONFIG_LINE_MAX];
+    int ret;
+
+    if (sscanf(line, "%*s %s", rvalue) != 1) {
+        warn("Invalid config line, ignoring: %s", line);
+        return;
+    }
+
+    ret = parse_boolean(rvalue);
+    if (ret < 0) {
+        warn("Invalid bool for lock_memory, ignoring: %s\n", rvalue);
+        return;
+    }
+
+    cfg.lock_memory = ret;
+}
+
+static void config_update_triggers(const char *line) {
+    char rvalue[CONFIG_LINE_MAX];
+    int ret;
+
+    if (sscanf(line, "%*s %s", rvalue) != 1) {
+        warn("Invalid config line, ignoring: %s", line);
+        return;
+    }
+
+    ret = parse_boolean(rvalue);
+    if (ret < 0) {
+        warn("Invalid bool for triggers, ignoring: %s\n", rvalue);
+        return;
+    }
+
+    cfg.use_triggers = ret;
+}
+
+static void config_update_io_uring(const char *line) {
+    char rvalue[CONFIG_LINE_MAX];
+    int ret;
+
+    if (sscanf(line, "%*s %s", rvalue) != 1) {
+        warn("Invalid config line, ignoring: %s", line);
+        return;
+    }
+
+    ret = parse_boolean(rvalue);
+    if (ret < 0) {
+        warn("Invalid bool for io_uring, ignoring: %s\n", rvalue);
+        return;
+    }
+
+    cfg.use_io_uring = ret;
+}
+
+static void config_reset_user_facing(void) {
+    size_t i;
+
+    cfg.update_interval_ms = 5 * SEC_TO_MSEC;
+    cfg.update_min_ms = 0;
+    cfg.update_max_ms = 0;
+    cfg.predict_horizon_sec = 0;
+    cfg.log_pressures = false;
+    cfg.use_triggers = false;
+    cfg.lock_memory = false;
+    cfg.use_io_uring = false;
+
+    /* -nan */
+    memset(&cfg.cpu.thresholds, 0xff, sizeof(cfg.cpu.thresholds));
+    memset(&cfg.memory.thresholds, 0xff, sizeof(cfg.memory.thresholds));
+    memset(&cfg.io.thresholds, 0xff, sizeof(cfg.io.thresholds));
+
+    cfg.cpu.nr_windows = 0;
+    cfg.memory.nr_windows = 0;
+    cfg.io.nr_windows = 0;
+
+    /* Start predicting afresh, the horizon or thresholds may have changed */
+    for_each_arr(i, all_res) {
+        memset(all_res[i]->trends, 0, sizeof(all_res[i]->trends));
+        all_res[i]->trends[0].eta_sec = all_res[i]->trends[1].eta_sec = -1;
+    }
+
+    cfg.cgroup_root[0] = '\0';
+    cfg.nr_cgroup_profiles = 0;
+    cfg.record_path[0] = '\0';
+    cfg.metrics_path[0] = '\0';
+    cfg.subscribe_path[0] = '\0';
+    cfg.nr_rules = 0;
+    cfg.nr_actions = 0;
+}
+
+/*
+ * When waiting on PSI triggers and nothing is happening, we still need to wake
+ * up occasionally to pet the systemd watchdog.
+ */
+#define TRIGGER_IDLE_TIMEOUT_SEC 60
+
+#define WATCHDOG_GRACE_PERIOD_SEC 5
+static void watchdog_update_usec(void) {
+    char message[NOTIFY_MAX];
+    int64_t max_interval_ms = cfg.update_interval_ms;
+
+    if (max_interval_ms < cfg.update_max_ms) {
+        max_interval_ms = cfg.update_max_ms;
+    }
+
+    if (cfg.use_triggers &&
+        max_interval_ms < TRIGGER_IDLE_TIMEOUT_SEC * SEC_TO_MSEC) {
+        max_interval_ms = TRIGGER_IDLE_TIMEOUT_SEC * SEC_TO_MSEC;
+    }
+
+    sdn.max_interval_usec = (uint64_t)max_interval_ms * MSEC_TO_USEC;
+    sdn.watchdog_usec =
+        sdn.max_interval_usec + WATCHDOG_GRACE_PERIOD_SEC * SEC_TO_USEC;
+    snprintf_check(message,
+                   sizeof(message),
+                   "WATCHDOG_USEC=%" PRIu64,
+                   sdn.watchdog_usec);
+    sd_notify(message);
+}
+
+static void config_get_path(char *out) {
+    const char *base_dir = getenv("XDG_CONFIG_DIR");
+    const struct passwd *pw = NULL;
+
+    if (system_mode) {
+        snprintf_check(out, PATH_MAX, "%s", "/etc/psi-notify");
+    } else if (base_dir) {
+        snprintf_check(out, PATH_MAX, "%s/psi-notify", base_dir);
+    } else {
+        base_dir = getenv("HOME");
+        if (!base_dir) {
+            pw = getpwuid(getuid());
+            if (pw) {
+                base_dir = pw->pw_dir;
+            } else {
+                warn("%s\n",
+                     "No $XDG_CONFIG_DIR, $HOME, or entry in /etc/passwd?");
+                base_dir = "/";
+            }
+        }
+
+        snprintf_check(out, PATH_MAX, "%s/.config/psi-notify", base_dir);
+    }
+}
+
+static int config_update_from_file(FILE **override_config) {
+    char line[CONFIG_LINE_MAX];
+    char config_path[PATH_MAX] = "";
+    FILE *f;
+    int ret = 0;
+
+    if (override_config) {
+        f = *override_config;
+    } else {
+        config_get_path(config_path);
+        f = fopen(config_path, "re");
     }
 
     if (f) {
@@ -321,514 +1379,7448 @@ static int config_update_from_file(FILE **override_config) {
     } else {
         ret = -errno;
 
-        if (config_reload_pending) {
-            /* This was from a SIGHUP, so we already have a config. Keep it. */
-            warn("Config reload request ignored, cannot open %s: %s\n",
-                 config_path,
-                 strerror(errno));
-            return ret;
-        }
+        if (config_reloading) {
+            /* This was from a SIGHUP, so we already have a config. Keep it. */
+            warn("Config reload request ignored, cannot open %s: %s\n",
+                 config_path,
+                 strerror(errno));
+            return ret;
+        }
+
+        if (*config_path) {
+            if (errno == ENOENT) {
+                info("No config at %s, using defaults.\n", config_path);
+            } else {
+                warn("Using default config, cannot open %s: %s\n",
+                     config_path,
+                     strerror(errno));
+            }
+        }
+
+        config_reset_user_facing();
+
+        cfg.cpu.thresholds.avg10.some = 50.00;
+        cfg.memory.thresholds.avg10.some = 10.00;
+        cfg.io.thresholds.avg10.full = 15.00;
+
+        watchdog_update_usec();
+        return ret;
+    }
+
+    while (fgets(line, sizeof(line), f)) {
+        char lvalue[CONFIG_LINE_MAX];
+        size_t len = strlen(line);
+
+        if (blank_line_or_comment(line)) {
+            continue;
+        }
+
+        if (len == CONFIG_LINE_MAX - 1 && line[len - 1] != '\n') {
+            int ch;
+            warn("Config line is too long to be valid, ignoring: %s\n", line);
+            while ((ch = fgetc(f)) != EOF && ch != '\n')
+                ;
+            continue;
+        }
+
+        if (sscanf(line, "%s", lvalue) != 1) {
+            warn("Invalid config line, ignoring: %s", line);
+            continue;
+        }
+
+        if (streq(lvalue, "threshold")) {
+            config_update_threshold(line);
+        } else if (streq(lvalue, "update")) {
+            config_update_interval(line);
+        } else if (streq(lvalue, "log_pressures")) {
+            config_update_log_pressures(line);
+        } else if (streq(lvalue, "triggers")) {
+            config_update_triggers(line);
+        } else if (streq(lvalue, "lock_memory")) {
+            config_update_lock_memory(line);
+        } else if (streq(lvalue, "io_uring")) {
+            config_update_io_uring(line);
+        } else if (streq(lvalue, "record")) {
+            config_update_record(line);
+        } else if (streq(lvalue, "rule")) {
+            config_update_rule(line);
+        } else if (streq(lvalue, "action")) {
+            config_update_action(line);
+        } else if (streq(lvalue, "metrics_socket")) {
+            config_update_metrics_socket(line);
+        } else if (streq(lvalue, "subscribe_socket")) {
+            config_update_subscribe_socket(line);
+        } else if (streq(lvalue, "update_adaptive")) {
+            config_update_adaptive(line);
+        } else if (streq(lvalue, "predict")) {
+            config_update_predict(line);
+        } else if (streq(lvalue, "cgroup_root")) {
+            config_update_cgroup_root(line);
+        } else if (streq(lvalue, "cgroup_threshold")) {
+            config_update_cgroup_threshold(line);
+        } else {
+            warn("Invalid config line, ignoring: %s", line);
+            continue;
+        }
+    }
+
+    fclose(f);
+    watchdog_update_usec();
+    return ret;
+}
+
+static int config_init(FILE **override_config) {
+    int psi_dir_fd;
+    static bool already_ran = false;
+
+    expect(!already_ran);
+    already_ran = true;
+
+    cfg = (Config){0};
+
+    psi_dir_fd = get_psi_dir_fd();
+    /* Tests should pass even with CONFIG_PSI=n */
+    if (psi_dir_fd < 0 && !override_config) {
+        warn("%s\n",
+             "No pressure dir found. "
+             "Are you using kernel >=4.20 with CONFIG_PSI=y?");
+        return psi_dir_fd;
+    }
+    cfg.psi_dir_fd = psi_dir_fd;
+
+    cfg.cpu.filename = get_psi_filename("cpu", !!override_config);
+    cfg.cpu.fd = -1;
+    cfg.cpu.type = RT_CPU;
+    cfg.cpu.human_name = "CPU";
+    cfg.cpu.has_full = false;
+
+    cfg.memory.filename = get_psi_filename("memory", !!override_config);
+    cfg.memory.fd = -1;
+    cfg.memory.type = RT_MEMORY;
+    cfg.memory.human_name = "memory";
+    cfg.memory.has_full = true;
+
+    cfg.io.filename = get_psi_filename("io", !!override_config);
+    cfg.io.fd = -1;
+    cfg.io.type = RT_IO;
+    cfg.io.human_name = "I/O";
+    cfg.io.has_full = true;
+
+    /* Currently not user configurable, file an issue if you need it to be. */
+    cfg.io_min_blocked_tasks = 2;
+
+    (void)config_update_from_file(override_config);
+
+    return 0;
+}
+
+/*
+ * The cgroups below the seat, when using_seat. Used to count blocked tasks
+ * and to name the culprits in alerts.
+ */
+static CgroupSet seat_cgroups = {
+    .root_fd = -1, .inotify_fd = -1, .root_wd = -1, .track_tasks = true};
+
+#define PROC_STAT_BUF_INITIAL 8192
+
+/*
+ * Fallback when the seat cgroups aren't available. /proc/stat is kept open and
+ * read in one go, since its size varies with the number of CPUs and IRQs, and
+ * then searched with strstr(), which glibc vectorises.
+ */
+static int32_t get_nr_blocked_tasks_system(void) {
+    static const char key[] = "\nprocs_blocked ";
+    static int fd = -1;
+    static char *buf;
+    static size_t buf_len;
+    const char *pos;
+    ssize_t len;
+    long procs_blocked;
+
+    if (fd < 0) {
+        fd = open("/proc/stat", O_RDONLY | O_CLOEXEC);
+        expect(fd >= 0);
+    }
+
+    for (;;) {
+        if (!buf) {
+            buf_len = PROC_STAT_BUF_INITIAL;
+            buf = malloc(buf_len);
+            expect(buf);
+        }
+
+        len = pread(fd, buf, buf_len - 1, 0);
+        expect(len >= 0);
+        if ((size_t)len < buf_len - 1) {
+            break;
+        }
+
+        /* Might have been truncated, try again with more room. */
+        buf_len *= 2;
+        buf = realloc(buf, buf_len);
+        expect(buf);
+    }
+    buf[len] = '\0';
+
+    pos = strstr(buf, key);
+    if (!pos) {
+        return -ENODATA;
+    }
+
+    procs_blocked = strtol(pos + sizeof(key) - 1, NULL, 10);
+    return procs_blocked > INT32_MAX ? INT32_MAX : (int32_t)procs_blocked;
+}
+
+/* FNV-1a, for noticing changes and for hash tables we fill ourselves. */
+static uint64_t hash_buf(const char *buf, size_t len) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    size_t i;
+    for (i = 0; i < len; i++) {
+        hash = (hash ^ (unsigned char)buf[i]) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/*
+ * cgroup.threads is mostly in creation order already, so this is close to
+ * linear, and unlike qsort() it never allocates.
+ */
+static void sort_tids(pid_t *tids, size_t nr) {
+    size_t i, j;
+    for (i = 1; i < nr; i++) {
+        const pid_t tid = tids[i];
+        for (j = i; j > 0 && tids[j - 1] > tid; j--) {
+            tids[j] = tids[j - 1];
+        }
+        tids[j] = tid;
+    }
+}
+
+static void task_list_reserve(TaskList *tl, size_t cap) {
+    pid_t *tids;
+    int *fds;
+
+    if (cap <= tl->cap) {
+        return;
+    }
+
+    tids = realloc(tl->tids, cap * sizeof(*tids));
+    expect(tids);
+    tl->tids = tids;
+    fds = realloc(tl->fds, cap * sizeof(*fds));
+    expect(fds);
+    tl->fds = fds;
+    tl->cap = cap;
+}
+
+static void task_list_destroy(TaskList *tl) {
+    size_t i;
+    for (i = 0; i < tl->nr; i++) {
+        if (tl->fds[i] >= 0) {
+            close(tl->fds[i]);
+        }
+    }
+    free(tl->tids);
+    free(tl->fds);
+    *tl = (TaskList){0};
+}
+
+static int task_stat_open(pid_t tid) {
+    char path[sizeof("/proc/2147483647/stat")];
+    snprintf_check(path, sizeof(path), "/proc/%d/stat", tid);
+    return open(path, O_RDONLY | O_CLOEXEC);
+}
+
+/*
+ * Updates tl to the tids listed in buf (the contents of cgroup.threads),
+ * keeping the /proc/<tid>/stat fds for tasks which are still there, and only
+ * opening ones for new tasks.
+ */
+static void task_list_update(TaskList *tl, const char *buf, size_t len) {
+    /*
+     * Built here and then swapped with tl, so buffers get passed around
+     * rather than allocated each time, and only ever grow.
+     */
+    static TaskList next;
+    TaskList tmp;
+    uint64_t hash = hash_buf(buf, len);
+    size_t cap = 0, old = 0, i;
+    const char *p;
+
+    if (tl->valid && hash == tl->hash) {
+        return;
+    }
+
+    for (p = buf; p < buf + len; p++) {
+        cap += *p == '\n';
+    }
+
+    task_list_reserve(&next, cap ? cap : 1);
+    next.nr = 0;
+
+    for (p = buf; p < buf + len && next.nr < cap;) {
+        char *end;
+        long tid = strtol(p, &end, 10);
+        if (end == p) {
+            break;
+        }
+        next.tids[next.nr++] = (pid_t)tid;
+        p = end + 1;
+    }
+
+    sort_tids(next.tids, next.nr);
+
+    /* Both are sorted, so walk them together to reuse fds. */
+    for (i = 0; i < next.nr; i++) {
+        while (old < tl->nr && tl->tids[old] < next.tids[i]) {
+            if (tl->fds[old] >= 0) {
+                close(tl->fds[old]);
+            }
+            old++;
+        }
+
+        if (old < tl->nr && tl->tids[old] == next.tids[i]) {
+            next.fds[i] = tl->fds[old++];
+        } else {
+            next.fds[i] = task_stat_open(next.tids[i]);
+        }
+    }
+    for (; old < tl->nr; old++) {
+        if (tl->fds[old] >= 0) {
+            close(tl->fds[old]);
+        }
+    }
+
+    next.hash = hash;
+    next.valid = true;
+
+    tmp = *tl;
+    *tl = next;
+    next = tmp;
+}
+
+static int32_t task_list_nr_blocked(TaskList *tl) {
+    int32_t blocked = 0;
+    size_t i;
+
+    for (i = 0; i < tl->nr; i++) {
+        char buf[512];
+        const char *state;
+        ssize_t len;
+
+        if (tl->fds[i] < 0) {
+            continue;
+        }
+
+        len = pread(tl->fds[i], buf, sizeof(buf) - 1, 0);
+        if (len <= 0) {
+            /*
+             * Exited, but if cgroup.threads is unchanged the tid was reused,
+             * and this fd is the dead task's. Either way, the next update
+             * sees the tid as it is now.
+             */
+            close(tl->fds[i]);
+            tl->fds[i] = task_stat_open(tl->tids[i]);
+            continue;
+        }
+        buf[len] = '\0';
+
+        /* comm can contain anything, so the state is after the last ')' */
+        state = strrchr(buf, ')');
+        if (state && state[1] == ' ' && state[2] == 'D') {
+            blocked++;
+        }
+    }
+
+    return blocked;
+}
+
+/* 64KiB of "tid\n" is thousands of threads, more isn't worth counting. */
+#define CGROUP_THREADS_BUF_LEN 65536
+
+static int32_t get_nr_blocked_tasks_seat(CgroupSet *set) {
+    static char buf[CGROUP_THREADS_BUF_LEN];
+    int32_t blocked = 0;
+    size_t i;
+
+    for (i = 0; i < set->nr; i++) {
+        ssize_t len;
+
+        if (set->threads_fds[i] < 0) {
+            continue;
+        }
+
+        len = pread(set->threads_fds[i], buf, sizeof(buf), 0);
+        if (len < 0) {
+            continue;
+        }
+        if ((size_t)len == sizeof(buf)) {
+            return -E2BIG;
+        }
+
+        task_list_update(&set->tasks[i], buf, (size_t)len);
+        blocked += task_list_nr_blocked(&set->tasks[i]);
+    }
+
+    return blocked;
+}
+
+static int32_t get_nr_blocked_tasks(void) {
+    uint64_t start = now_usec();
+    int32_t ret = -1;
+
+    if (seat_cgroups.root_fd >= 0) {
+        ret = get_nr_blocked_tasks_seat(&seat_cgroups);
+    }
+    if (ret < 0) {
+        ret = get_nr_blocked_tasks_system();
+    }
+
+    latency_record(&stats.blocked_tasks, now_usec() - start);
+    return ret;
+}
+
+/*
+ * Enough for both lines at their widest, that is, "some avg10=100.00
+ * avg60=100.00 avg300=100.00 total=18446744073709551615\n" twice, and then
+ * some, in case the kernel adds more fields at the end.
+ */
+#define PRESSURE_BUF_LEN 256
+
+#define COMPARE_THRESH(threshold, current)                                     \
+    (threshold >= 0 && current > threshold)
+
+/*
+ * The kernel prints percentages as "%lu.%02lu", so parse them as fixed point
+ * instead of going through the much slower strtod()/scanf() machinery.
+ * Dividing the exact integer by 100.0 gives the same double strtod() would.
+ */
+static const char *parse_centi(const char *s, double *out) {
+    uint32_t centi = 0;
+    int digits = 0, frac_digits = 0;
+
+    while (isdigit((unsigned char)*s) && digits < 3) {
+        centi = centi * 10 + (uint32_t)(*s++ - '0');
+        digits++;
+    }
+
+    if (digits == 0) {
+        return NULL;
+    }
+
+    if (*s == '.') {
+        s++;
+        while (isdigit((unsigned char)*s) && frac_digits < 2) {
+            centi = centi * 10 + (uint32_t)(*s++ - '0');
+            frac_digits++;
+        }
+    }
+
+    for (; frac_digits < 2; frac_digits++) {
+        centi *= 10;
+    }
+
+    if (isdigit((unsigned char)*s)) {
+        return NULL;
+    }
+
+    *out = centi / 100.0;
+    return s;
+}
+
+static const char *parse_u64(const char *s, uint64_t *out) {
+    uint64_t val = 0;
+    const char *start = s;
+
+    while (isdigit((unsigned char)*s)) {
+        uint64_t digit = (uint64_t)(*s++ - '0');
+        if (val > (UINT64_MAX - digit) / 10) {
+            return NULL;
+        }
+        val = val * 10 + digit;
+    }
+
+    if (s == start) {
+        return NULL;
+    }
+
+    *out = val;
+    return s;
+}
+
+static const char *parse_key(const char *s, const char *key, size_t len) {
+    if (!s || strncmp(s, key, len) != 0) {
+        return NULL;
+    }
+    return s + len;
+}
+
+#define parse_key_lit(s, key) parse_key(s, key, sizeof(key) - 1)
+
+/*
+ * Parses one "some avg10=0.00 avg60=0.00 avg300=0.00 total=0" line into the
+ * matching half of out. Returns where the next line starts, or NULL if the
+ * line is invalid.
+ */
+static const char *parse_pressure_line(const char *s, PressureSample *out,
+                                       bool *full) {
+    PressureLine l;
+
+    if (strncmp(s, "some ", 5) == 0) {
+        *full = false;
+    } else if (strncmp(s, "full ", 5) == 0) {
+        *full = true;
+    } else {
+        return NULL;
+    }
+
+    s = parse_key_lit(s + 5, "avg10=");
+    s = s ? parse_centi(s, &l.avg10) : NULL;
+    s = parse_key_lit(s, " avg60=");
+    s = s ? parse_centi(s, &l.avg60) : NULL;
+    s = parse_key_lit(s, " avg300=");
+    s = s ? parse_centi(s, &l.avg300) : NULL;
+    s = parse_key_lit(s, " total=");
+    s = s ? parse_u64(s, &l.total) : NULL;
+
+    if (!s) {
+        return NULL;
+    }
+
+    /* Tolerate any fields added after total= in future. */
+    while (*s && *s != '\n') {
+        s++;
+    }
+    if (*s == '\n') {
+        s++;
+    }
+
+    if (*full) {
+        out->full = l;
+    } else {
+        out->some = l;
+    }
+
+    return s;
+}
+
+#define PRESSURE_HAS_SOME (1 << 0)
+#define PRESSURE_HAS_FULL (1 << 1)
+
+/* Returns a mask of PRESSURE_HAS_* for the lines found, or <0 on error. */
+static int parse_pressures(const char *s, PressureSample *out) {
+    int found = 0;
+
+    while (*s) {
+        bool full;
+        s = parse_pressure_line(s, out, &full);
+        if (!s) {
+            return -EINVAL;
+        }
+        found |= full ? PRESSURE_HAS_FULL : PRESSURE_HAS_SOME;
+    }
+
+    return found;
+}
+
+static void totals_history_add(TotalsHistory *h, uint64_t ts_usec,
+                               const PressureSample *s) {
+    h->head = (h->head + 1) % TOTALS_HISTORY_LEN;
+    h->samples[h->head] = (TotalsSample){ts_usec, s->some.total, s->full.total};
+    if (h->count < TOTALS_HISTORY_LEN) {
+        h->count++;
+    }
+}
+
+/*
+ * Finds the newest sample which is at least window_usec old. If the history
+ * doesn't go back that far, fall back to the oldest sample we have, which
+ * gives a shorter window rather than none at all.
+ */
+static const TotalsSample *totals_history_at(const TotalsHistory *h,
+                                             uint64_t window_usec) {
+    const TotalsSample *newest = &h->samples[h->head], *cand = NULL;
+    size_t i;
+
+    for (i = 1; i < h->count; i++) {
+        cand = &h->samples[(h->head + TOTALS_HISTORY_LEN - i) %
+                           TOTALS_HISTORY_LEN];
+        if (newest->ts_usec - cand->ts_usec >= window_usec) {
+            break;
+        }
+    }
+
+    return cand;
+}
+
+static double stall_pct(uint64_t then, uint64_t now, uint64_t elapsed_usec) {
+    double pct;
+
+    if (now < then) {
+        /* Counter went backwards, probably a new cgroup with the same name */
+        return 0;
+    }
+
+    pct = (double)(now - then) * 100 / (double)elapsed_usec;
+    return pct > 100 ? 100 : pct;
+}
+
+/*
+ * Timers fire a little late, so a gap this much longer than a window is still
+ * treated as covering it.
+ */
+#define CUSTOM_WINDOW_SLACK 1.25
+
+static void custom_windows_update(Resource *r, uint64_t ts_usec) {
+    const TotalsSample *now, *then, *prev = NULL;
+    size_t i;
+
+    if (r->nr_windows == 0) {
+        return;
+    }
+
+    totals_history_add(&r->history, ts_usec, &r->current);
+    now = &r->history.samples[r->history.head];
+    if (r->history.count > 1) {
+        prev = &r->history.samples[(r->history.head + TOTALS_HISTORY_LEN - 1) %
+                                   TOTALS_HISTORY_LEN];
+    }
+
+    for (i = 0; i < r->nr_windows; i++) {
+        CustomWindow *w = &r->windows[i];
+        const uint64_t window_usec = (uint64_t)w->window_sec * SEC_TO_USEC;
+
+        then = totals_history_at(&r->history, window_usec);
+        /*
+         * If the last gap is longer than the window, say after sleeping on
+         * triggers or backing off, a short stall would be averaged over all
+         * of it. Better to say we don't know.
+         */
+        if (!then || now->ts_usec == then->ts_usec ||
+            (double)(now->ts_usec - prev->ts_usec) >
+                (double)window_usec * CUSTOM_WINDOW_SLACK) {
+            /* -nan, so nothing compares above it until we know more */
+            memset(&w->current, 0xff, sizeof(w->current));
+            continue;
+        }
+
+        w->current.some =
+            stall_pct(then->some, now->some, now->ts_usec - then->ts_usec);
+        w->current.full =
+            stall_pct(then->full, now->full, now->ts_usec - then->ts_usec);
+    }
+}
+
+/*
+ * The kernel updates its averages every 2 seconds, decaying avg10, avg60, and
+ * avg300 by these fixed point factors.
+ */
+#define PSI_AVG_PERIOD_SEC 2
+static const double psi_avg_decay[] = {1677.0 / 2048, 1981.0 / 2048,
+                                       2034.0 / 2048};
+
+/*
+ * How quickly the trend follows the stall rate. The level needs to keep up
+ * with bursts, the slope is slower so that one noisy sample doesn't swing it.
+ */
+#define TREND_LEVEL_TAU_SEC 2.0
+#define TREND_SLOPE_TAU_SEC 5.0
+
+/* x to the nth by squaring, since we don't link libm. */
+static double pow_uint(double x, uint64_t n) {
+    double ret = 1;
+
+    for (; n; n >>= 1) {
+        if (n & 1) {
+            ret *= x;
+        }
+        x *= x;
+    }
+    return ret;
+}
+
+/*
+ * How many of periods 1 to nr come before the rate u + v * k reaches lim. The
+ * same for either sign of v, since dividing by a negative one flips the
+ * comparison.
+ */
+static uint64_t trend_periods_before(double u, double v, double lim,
+                                     uint64_t nr) {
+    const double x = (lim - u) / v;
+    uint64_t k;
+
+    if (!(x > 1)) {
+        return 0;
+    }
+    if (x > (double)nr) {
+        return nr;
+    }
+    k = (uint64_t)x;
+    return (double)k < x ? k : k - 1;
+}
+
+/*
+ * With the rate fed in as u + v * n for periods 1 to len, the average after n
+ * periods is alpha + v * n + decay^n * (avg - alpha): a line it lags behind,
+ * and what's left of where it started, decaying away. So it either only rises,
+ * only falls, or turns once, and whether it's above thresh can be bisected on.
+ * Returns the first period it is, or 0, and moves avg on to the end.
+ */
+static uint64_t trend_segment_eta(double *avg, double u, double v,
+                                  double decay, double thresh, uint64_t len) {
+    const double alpha = u - decay * v / (1 - decay);
+    const double c = *avg - alpha;
+    uint64_t lo = 1, hi = len, mid;
+
+    if (len == 0) {
+        return 0;
+    }
+    *avg = alpha + v * (double)len + pow_uint(decay, len) * c;
+
+    /*
+     * Rising, then falling: only up to the peak, the last period to still
+     * rise, which is where decay^(n - 1) is still above y.
+     */
+    if (c < 0 && v < 0) {
+        const double y = v / ((1 - decay) * c);
+
+        if (!(y < 1)) {
+            return 0;
+        }
+        while (lo < hi) {
+            mid = lo + (hi - lo + 1) / 2;
+            if (pow_uint(decay, mid - 1) > y) {
+                lo = mid;
+            } else {
+                hi = mid - 1;
+            }
+        }
+        hi = lo;
+        lo = 1;
+    }
+
+    /* Anything falling first stays below where it started, so below thresh */
+    if (!(alpha + v * (double)hi + pow_uint(decay, hi) * c > thresh)) {
+        return 0;
+    }
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (alpha + v * (double)mid + pow_uint(decay, mid) * c > thresh) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    return lo;
+}
+
+/*
+ * Where the kernel's average gets to, fed with the stall rate the trend
+ * predicts for each period up to the horizon. The rate is clamped to 0 and
+ * 100, so it's done in up to three pieces, each in closed form. Returns how
+ * long until it passes thresh, or -1 if it doesn't.
+ */
+static double trend_eta_one(const PressureTrend *t, double avg, double decay,
+                            double thresh) {
+    /* The rate for period k, at its midpoint, is u + v * k */
+    const double v = t->slope * PSI_AVG_PERIOD_SEC;
+    const double u = t->level - v / 2;
+    const uint64_t nr =
+        (uint64_t)(cfg.predict_horizon_sec / PSI_AVG_PERIOD_SEC);
+    struct {
+        uint64_t end;
+        double u, v;
+    } segs[3];
+    size_t nr_segs = 0, i;
+    uint64_t start = 0;
+
+    if (!(thresh >= 0)) {
+        return -1;
+    }
+    if (avg > thresh) {
+        return 0;
+    }
+
+    if (v == 0) {
+        segs[nr_segs].end = nr;
+        segs[nr_segs].u = u < 0 ? 0 : u > 100 ? 100 : u;
+        segs[nr_segs++].v = 0;
+    } else {
+        const uint64_t b0 = trend_periods_before(u, v, 0, nr);
+        const uint64_t b100 = trend_periods_before(u, v, 100, nr);
+
+        segs[nr_segs].end = v > 0 ? b0 : b100;
+        segs[nr_segs].u = v > 0 ? 0 : 100;
+        segs[nr_segs++].v = 0;
+        segs[nr_segs].end = v > 0 ? b100 : b0;
+        segs[nr_segs].u = u;
+        segs[nr_segs++].v = v;
+        segs[nr_segs].end = nr;
+        segs[nr_segs].u = v > 0 ? 100 : 0;
+        segs[nr_segs++].v = 0;
+    }
+
+    for (i = 0; i < nr_segs; i++) {
+        const uint64_t n = trend_segment_eta(
+            &avg, segs[i].u + segs[i].v * (double)start, segs[i].v, decay,
+            thresh, segs[i].end - start);
+
+        if (n) {
+            return (double)((start + n) * PSI_AVG_PERIOD_SEC);
+        }
+        start = segs[i].end;
+    }
+
+    return -1;
+}
+
+static double trend_eta(const PressureTrend *t, const PressureLine *l,
+                        const Pressure *thresholds, bool full) {
+    const double avgs[] = {l->avg10, l->avg60, l->avg300};
+    const double t10 = full ? thresholds->avg10.full : thresholds->avg10.some;
+    const double t60 = full ? thresholds->avg60.full : thresholds->avg60.some;
+    const double t300 =
+        full ? thresholds->avg300.full : thresholds->avg300.some;
+    const double threshs[] = {t10, t60, t300};
+    double eta = -1;
+    size_t i;
+
+    if (!t->valid) {
+        return -1;
+    }
+
+    for_each_arr(i, avgs) {
+        double tmp = trend_eta_one(t, avgs[i], psi_avg_decay[i], threshs[i]);
+        if (tmp >= 0 && (eta < 0 || tmp < eta)) {
+            eta = tmp;
+        }
+    }
+
+    return eta;
+}
+
+/*
+ * Holt's linear method, with the smoothing factors scaled by how long it's
+ * been since the last sample, since update_adaptive means that varies.
+ */
+static void trend_update(PressureTrend *t, uint64_t total, uint64_t ts_usec) {
+    double dt, rate, level, a, b;
+
+    if (t->last_usec == 0 || ts_usec <= t->last_usec ||
+        total < t->last_total) {
+        /* Nothing to take a delta from, or the counter went backwards */
+        t->valid = false;
+        t->last_total = total;
+        t->last_usec = ts_usec;
+        return;
+    }
+
+    dt = (double)(ts_usec - t->last_usec) / SEC_TO_USEC;
+    rate = stall_pct(t->last_total, total, ts_usec - t->last_usec);
+    t->last_total = total;
+    t->last_usec = ts_usec;
+
+    if (!t->valid) {
+        t->level = rate;
+        t->slope = 0;
+        t->valid = true;
+        return;
+    }
+
+    a = dt / (TREND_LEVEL_TAU_SEC + dt);
+    b = dt / (TREND_SLOPE_TAU_SEC + dt);
+    level = t->level + t->slope * dt;
+    level += a * (rate - level);
+    t->slope += b * ((level - t->level) / dt - t->slope);
+    t->level = level;
+}
+
+static void trends_update(Resource *r, uint64_t ts_usec) {
+    const PressureLine *lines[] = {&r->current.some, &r->current.full};
+    size_t full;
+
+    for_each_arr(full, lines) {
+        PressureTrend *t = &r->trends[full];
+        trend_update(t, lines[full]->total, ts_usec);
+        t->eta_sec = trend_eta(t, lines[full], &r->thresholds, full);
+    }
+}
+
+/* The soonest either line is predicted to pass a threshold, or -1 */
+static double resource_eta(const Resource *r) {
+    const double some = r->trends[0].eta_sec, full = r->trends[1].eta_sec;
+
+    if (!r->has_full || full < 0) {
+        return some;
+    }
+    return some < 0 || full < some ? full : some;
+}
+
+static uint16_t pct_to_centi(double pct) {
+    if (!(pct > 0)) {
+        return 0;
+    }
+    return pct >= 100 ? 10000 : (uint16_t)(pct * 100 + 0.5);
+}
+
+/*
+ * Only the monitoring thread writes, and it never waits for readers. Instead,
+ * readers check how far the writer got once they're done copying, and throw
+ * away anything which may have been overwritten under them.
+ */
+static void sample_history_add(SampleHistory *h, uint64_t ts_usec,
+                               const PressureSample *s) {
+    uint64_t n = atomic_load_explicit(&h->written, memory_order_relaxed);
+    size_t slot = n % SAMPLE_HISTORY_LEN;
+
+    h->ts_usec[slot] = ts_usec;
+    h->some_avg[0][slot] = pct_to_centi(s->some.avg10);
+    h->some_avg[1][slot] = pct_to_centi(s->some.avg60);
+    h->some_avg[2][slot] = pct_to_centi(s->some.avg300);
+    h->full_avg[0][slot] = pct_to_centi(s->full.avg10);
+    h->full_avg[1][slot] = pct_to_centi(s->full.avg60);
+    h->full_avg[2][slot] = pct_to_centi(s->full.avg300);
+    h->some_total[slot] = s->some.total;
+    h->full_total[slot] = s->full.total;
+
+    atomic_store_explicit(&h->written, n + 1, memory_order_release);
+}
+
+/*
+ * Copies the history into out, oldest first from index 0, and returns how
+ * many samples are in it. Safe to call from any thread while sampling goes on.
+ */
+static size_t sample_history_snapshot(SampleHistory *h, SampleHistory *out) {
+    uint64_t start, end, first_safe, i;
+    size_t nr, j, k;
+
+    end = atomic_load_explicit(&h->written, memory_order_acquire);
+    start = end > SAMPLE_HISTORY_LEN ? end - SAMPLE_HISTORY_LEN : 0;
+
+    for (i = start; i < end; i++) {
+        size_t slot = i % SAMPLE_HISTORY_LEN;
+        j = i - start;
+        out->ts_usec[j] = h->ts_usec[slot];
+        for (k = 0; k < 3; k++) {
+            out->some_avg[k][j] = h->some_avg[k][slot];
+            out->full_avg[k][j] = h->full_avg[k][slot];
+        }
+        out->some_total[j] = h->some_total[slot];
+        out->full_total[j] = h->full_total[slot];
+    }
+
+    /* The writer may be partway through the slot after its last count too */
+    atomic_thread_fence(memory_order_acquire);
+    end = atomic_load_explicit(&h->written, memory_order_relaxed) + 1;
+    first_safe = end > SAMPLE_HISTORY_LEN ? end - SAMPLE_HISTORY_LEN : 0;
+    if (first_safe <= start) {
+        return (size_t)(i - start);
+    }
+    if (first_safe >= i) {
+        return 0;
+    }
+
+    nr = (size_t)(i - first_safe);
+    j = (size_t)(first_safe - start);
+    memmove(out->ts_usec, out->ts_usec + j, nr * sizeof(out->ts_usec[0]));
+    for (k = 0; k < 3; k++) {
+        memmove(out->some_avg[k], out->some_avg[k] + j,
+                nr * sizeof(out->some_avg[k][0]));
+        memmove(out->full_avg[k], out->full_avg[k] + j,
+                nr * sizeof(out->full_avg[k][0]));
+    }
+    memmove(out->some_total, out->some_total + j,
+            nr * sizeof(out->some_total[0]));
+    memmove(out->full_total, out->full_total + j,
+            nr * sizeof(out->full_total[0]));
+
+    return nr;
+}
+
+static bool custom_windows_above(const Resource *r, bool full,
+                                 bool hysteresis) {
+    size_t i;
+
+    for (i = 0; i < r->nr_windows; i++) {
+        const CustomWindow *w = &r->windows[i];
+        double thresh = full ? w->thresholds.full : w->thresholds.some;
+        double current = full ? w->current.full : w->current.some;
+
+        if (hysteresis) {
+            thresh = psi_hysteresis(thresh);
+        }
+
+        if (COMPARE_THRESH(thresh, current)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+#define CUSTOM_WINDOWS_LOG_MAX (CUSTOM_WINDOWS_MAX * sizeof(" avg300=100.00"))
+
+static void log_custom_windows(const Resource *r, bool full) {
+    char buf[CUSTOM_WINDOWS_LOG_MAX] = "";
+    size_t i, len = 0;
+
+    if (r->nr_windows == 0) {
+        return;
+    }
+
+    for (i = 0; i < r->nr_windows; i++) {
+        const CustomWindow *w = &r->windows[i];
+        snprintf_check(buf + len,
+                       sizeof(buf) - len,
+                       " avg%u=%.2f",
+                       w->window_sec,
+                       full ? w->current.full : w->current.some);
+        len += strlen(buf + len);
+    }
+
+    info("Current %s pressures: %s%s\n",
+         strnull(r->human_name),
+         full ? "full" : "some",
+         buf);
+}
+
+static AlertState thresholds_state(const Pressure *t, const PressureLine *l,
+                                   bool full) {
+    const double t10 = full ? t->avg10.full : t->avg10.some;
+    const double t60 = full ? t->avg60.full : t->avg60.some;
+    const double t300 = full ? t->avg300.full : t->avg300.some;
+
+    if (COMPARE_THRESH(t10, l->avg10) || COMPARE_THRESH(t60, l->avg60) ||
+        COMPARE_THRESH(t300, l->avg300)) {
+        return A_ACTIVE;
+    }
+
+    if (COMPARE_THRESH(psi_hysteresis(t10), l->avg10) ||
+        COMPARE_THRESH(psi_hysteresis(t60), l->avg60) ||
+        COMPARE_THRESH(psi_hysteresis(t300), l->avg300)) {
+        return A_STABILISING;
+    }
+
+    return A_INACTIVE;
+}
+
+static AlertState pressure_check_single_line(const Resource *r,
+                                             const PressureLine *l,
+                                             bool full) {
+    AlertState state;
+
+    if (cfg.log_pressures) {
+        info("Current %s pressures: %s avg10=%.2f avg60=%.2f avg300=%.2f\n",
+             strnull(r->human_name),
+             full ? "full" : "some",
+             l->avg10,
+             l->avg60,
+             l->avg300);
+        log_custom_windows(r, full);
+    }
+
+    if (full && r->type == RT_IO && !replay.active &&
+        (active_notif[r->type].last_state == A_INACTIVE ||
+         active_notif[r->type].last_state == A_RISING)) {
+        int32_t ret;
+
+        /*
+         * On a desktop system there's usually very few runnable tasks, which
+         * means that a single task doing slow I/O can disproportionately bump
+         * IO full for the whole system or user scope. To work around this,
+         * require that at least two tasks are blocked to issue warnings based
+         * on IO metrics. Checking if the last state was inactive avoids
+         * flapping if the blocked number varies repeatedly. Recordings
+         * don't have the count, so replays can't do this.
+         */
+        ret = get_nr_blocked_tasks();
+        if (ret >= 0 && ret < cfg.io_min_blocked_tasks) {
+            return A_INACTIVE;
+        }
+    }
+
+    state = thresholds_state(&r->thresholds, l, full);
+
+    if (state != A_ACTIVE && custom_windows_above(r, full, false)) {
+        state = A_ACTIVE;
+    } else if (state == A_INACTIVE && custom_windows_above(r, full, true)) {
+        state = A_STABILISING;
+    }
+
+    /* Even within hysteresis, see alert_rising() for when already alerting */
+    if (state != A_ACTIVE && cfg.predict_horizon_sec > 0 &&
+        r->trends[full].eta_sec >= 0) {
+        state = A_RISING;
+    }
+
+    return state;
+}
+
+static int openat_psi(const char *fn, int flags) {
+    int fd = openat(cfg.psi_dir_fd, fn, flags | O_CLOEXEC);
+    if (fd >= 0) {
+        return fd;
+    }
+
+    if (errno == EACCES || errno == EPERM) {
+        /* The file is still there, we just can't open it with these flags. */
+        return -errno;
+    }
+
+    /* Maybe the cgroup or proc filesystem backing this disappeared? */
+    warn("PSI dir (%s) seems to have gone away, reopening\n",
+         using_seat ? "logind seat" : "global");
+    close(cfg.psi_dir_fd);
+
+    cfg.psi_dir_fd = get_psi_dir_fd();
+    if (cfg.psi_dir_fd < 0) {
+        die("%s\n", "PSI dir disappeared and can't be found again, exiting");
+    }
+
+    fd = openat(cfg.psi_dir_fd, fn, flags | O_CLOEXEC);
+    if (fd >= 0) {
+        return fd;
+    }
+
+    return -EINVAL;
+}
+
+/*
+ * With "io_uring true", every pressure file read in a tick goes to the kernel
+ * as one batch and is reaped with a single io_uring_enter(), rather than a
+ * pread() each. That matters with cgroup_root or in system mode, where there
+ * are three reads per cgroup. The files and buffers are registered with the
+ * ring, so the kernel doesn't have to look them up or pin pages on each read.
+ * Results are only good for the tick they were read in, and are taken once
+ * with read_batch_take(). Anything not batched, or which failed, is read with
+ * pread() as before, and so is everything if io_uring isn't available.
+ *
+ * This saves our own syscalls, not necessarily CPU time: the kernel still does
+ * each read, on its io-wq workers, which is why it's not on by default.
+ */
+#define READ_BATCH_INITIAL_CAP 64
+#define READ_BATCH_ENTRIES_MAX 4096 /* Bigger batches are submitted in parts */
+
+static struct {
+    int ring_fd;
+    bool unavailable; /* Setup failed, don't keep trying */
+    bool fixed_files;
+    bool fixed_bufs;
+    bool files_stale; /* Some fd was closed, maybe reused, since registering */
+    size_t cap;
+    size_t nr; /* Slots in use this tick */
+    size_t nr_registered;
+    int *fds;        /* To read for each slot, or -1 */
+    int *registered; /* What the ring's file table has in each slot */
+    int32_t *res;    /* Length read, -errno, or -EAGAIN if taken or unread */
+    char *bufs;      /* PRESSURE_BUF_LEN per slot */
+#ifdef HAVE_IO_URING
+    unsigned sq_entries;
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_len, cq_ring_len, sqes_len;
+    unsigned in_flight; /* Submitted but not reaped when a submit failed */
+#endif
+} read_batch = {.ring_fd = -1};
+
+/* Must be called whenever a batched fd is closed, since it may be reused. */
+static void read_batch_forget_fds(void) { read_batch.files_stale = true; }
+
+/* Length and text of what slot read this tick, or -errno. */
+static ssize_t read_batch_take(size_t slot, const char **buf) {
+    ssize_t ret;
+
+    if (slot >= read_batch.nr) {
+        return -EAGAIN;
+    }
+
+    ret = read_batch.res[slot];
+    read_batch.res[slot] = -EAGAIN;
+    if (ret >= 0) {
+        *buf = read_batch.bufs + slot * PRESSURE_BUF_LEN;
+    }
+    return ret;
+}
+
+#ifdef HAVE_IO_URING
+static void read_batch_ring_close(void) {
+    if (read_batch.ring_fd < 0) {
+        return;
+    }
+
+    if (read_batch.sqes) {
+        munmap(read_batch.sqes, read_batch.sqes_len);
+    }
+    if (read_batch.cq_ring && read_batch.cq_ring != read_batch.sq_ring) {
+        munmap(read_batch.cq_ring, read_batch.cq_ring_len);
+    }
+    if (read_batch.sq_ring) {
+        munmap(read_batch.sq_ring, read_batch.sq_ring_len);
+    }
+    read_batch.sqes = NULL;
+    read_batch.sq_ring = read_batch.cq_ring = NULL;
+
+    /* Also drops the registered files and buffers */
+    close(read_batch.ring_fd);
+    read_batch.ring_fd = -1;
+    read_batch.nr_registered = 0;
+}
+
+static void *read_batch_map(size_t len, off_t offset) {
+    void *ptr = mmap(NULL,
+                     len,
+                     PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE,
+                     read_batch.ring_fd,
+                     offset);
+    return ptr == MAP_FAILED ? NULL : ptr;
+}
+
+static int read_batch_ring_open(void) {
+    struct io_uring_params p = {0};
+    struct iovec iov;
+    unsigned entries = read_batch.cap < READ_BATCH_ENTRIES_MAX
+                           ? (unsigned)read_batch.cap
+                           : READ_BATCH_ENTRIES_MAX;
+    char *sq, *cq;
+    size_t i;
+    int ret;
+
+    read_batch.ring_fd = (int)syscall(SYS_io_uring_setup, entries, &p);
+    if (read_batch.ring_fd < 0) {
+        return -errno;
+    }
+
+    read_batch.sq_entries = p.sq_entries;
+    read_batch.sq_ring_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    read_batch.cq_ring_len =
+        p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (read_batch.cq_ring_len > read_batch.sq_ring_len) {
+            read_batch.sq_ring_len = read_batch.cq_ring_len;
+        }
+        read_batch.cq_ring_len = read_batch.sq_ring_len;
+    }
+    read_batch.sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    read_batch.sq_ring =
+        read_batch_map(read_batch.sq_ring_len, IORING_OFF_SQ_RING);
+    read_batch.cq_ring =
+        p.features & IORING_FEAT_SINGLE_MMAP
+            ? read_batch.sq_ring
+            : read_batch_map(read_batch.cq_ring_len, IORING_OFF_CQ_RING);
+    read_batch.sqes = read_batch_map(read_batch.sqes_len, IORING_OFF_SQES);
+    if (!read_batch.sq_ring || !read_batch.cq_ring || !read_batch.sqes) {
+        ret = -errno;
+        read_batch_ring_close();
+        return ret;
+    }
+
+    sq = read_batch.sq_ring;
+    cq = read_batch.cq_ring;
+    read_batch.sq_tail = (unsigned *)(void *)(sq + p.sq_off.tail);
+    read_batch.sq_mask = (unsigned *)(void *)(sq + p.sq_off.ring_mask);
+    read_batch.sq_array = (unsigned *)(void *)(sq + p.sq_off.array);
+    read_batch.cq_head = (unsigned *)(void *)(cq + p.cq_off.head);
+    read_batch.cq_tail = (unsigned *)(void *)(cq + p.cq_off.tail);
+    read_batch.cq_mask = (unsigned *)(void *)(cq + p.cq_off.ring_mask);
+    read_batch.cqes = (struct io_uring_cqe *)(void *)(cq + p.cq_off.cqes);
+
+    /*
+     * Both are optimisations the kernel may refuse, say for RLIMIT_MEMLOCK,
+     * in which case plain reads still batch just as well.
+     */
+    for (i = 0; i < read_batch.cap; i++) {
+        read_batch.registered[i] = -1;
+    }
+    read_batch.fixed_files =
+        syscall(SYS_io_uring_register,
+                read_batch.ring_fd,
+                IORING_REGISTER_FILES,
+                read_batch.registered,
+                (unsigned)read_batch.cap) == 0;
+    read_batch.files_stale = false;
+
+    iov.iov_base = read_batch.bufs;
+    iov.iov_len = read_batch.cap * PRESSURE_BUF_LEN;
+    read_batch.fixed_bufs = syscall(SYS_io_uring_register,
+                                    read_batch.ring_fd,
+                                    IORING_REGISTER_BUFFERS,
+                                    &iov,
+                                    1) == 0;
+
+    return 0;
+}
+
+/* Brings the ring's file table in line with this tick's fds, in one go. */
+static void read_batch_update_files(void) {
+    size_t i, lo = SIZE_MAX, hi = 0;
+    size_t end = read_batch.nr > read_batch.nr_registered
+                     ? read_batch.nr
+                     : read_batch.nr_registered;
+    struct io_uring_files_update up = {0};
+
+    for (i = 0; i < end; i++) {
+        int want = i < read_batch.nr ? read_batch.fds[i] : -1;
+        if (read_batch.files_stale || want != read_batch.registered[i]) {
+            if (lo == SIZE_MAX) {
+                lo = i;
+            }
+            hi = i;
+            read_batch.registered[i] = want;
+        }
+    }
+
+    read_batch.files_stale = false;
+    read_batch.nr_registered = read_batch.nr;
+    if (lo == SIZE_MAX) {
+        return;
+    }
+
+    up.offset = (uint32_t)lo;
+    up.fds = (uint64_t)(uintptr_t)(read_batch.registered + lo);
+    if (syscall(SYS_io_uring_register,
+                read_batch.ring_fd,
+                IORING_REGISTER_FILES_UPDATE,
+                &up,
+                (unsigned)(hi - lo + 1)) < 0) {
+        read_batch.fixed_files = false;
+    }
+}
+
+static unsigned read_batch_reap(void) {
+    unsigned head = *read_batch.cq_head, tail, n = 0;
+
+    tail = atomic_load_explicit((_Atomic unsigned *)read_batch.cq_tail,
+                                memory_order_acquire);
+    for (; head != tail; head++, n++) {
+        const struct io_uring_cqe *cqe =
+            &read_batch.cqes[head & *read_batch.cq_mask];
+        size_t slot = (size_t)cqe->user_data;
+
+        read_batch.res[slot] = cqe->res;
+        if (cqe->res >= 0) {
+            read_batch.bufs[slot * PRESSURE_BUF_LEN + (size_t)cqe->res] = '\0';
+        }
+    }
+    atomic_store_explicit(
+        (_Atomic unsigned *)read_batch.cq_head, head, memory_order_release);
+
+    return n;
+}
+
+/* Submits slots [start, end) and waits for all of them. */
+static int read_batch_submit_range(size_t start, size_t end) {
+    unsigned tail = *read_batch.sq_tail, queued = 0, submitted = 0, reaped = 0;
+    size_t slot;
+
+    for (slot = start; slot < end; slot++) {
+        unsigned idx = tail & *read_batch.sq_mask;
+        struct io_uring_sqe *sqe = &read_batch.sqes[idx];
+
+        if (read_batch.fds[slot] < 0) {
+            continue;
+        }
+
+        memset(sqe, 0, sizeof(*sqe));
+        if (read_batch.fixed_bufs) {
+            sqe->opcode = IORING_OP_READ_FIXED;
+            sqe->buf_index = 0;
+        } else {
+            sqe->opcode = IORING_OP_READ;
+        }
+        /*
+         * Pressure files can't be read without blocking, so would otherwise
+         * be tried inline, fail with EAGAIN, and only then be handed to the
+         * kernel's workers. Going straight there is ~10x cheaper.
+         */
+        sqe->flags = IOSQE_ASYNC;
+        if (read_batch.fixed_files) {
+            sqe->fd = (int)slot;
+            sqe->flags |= IOSQE_FIXED_FILE;
+        } else {
+            sqe->fd = read_batch.fds[slot];
+        }
+        sqe->addr = (uint64_t)(uintptr_t)(read_batch.bufs +
+                                          slot * PRESSURE_BUF_LEN);
+        sqe->len = PRESSURE_BUF_LEN - 1;
+        sqe->off = 0;
+        sqe->user_data = slot;
+        read_batch.sq_array[idx] = idx;
+        tail++;
+        queued++;
+    }
+    atomic_store_explicit(
+        (_Atomic unsigned *)read_batch.sq_tail, tail, memory_order_release);
+
+    while (reaped < queued) {
+        long ret = syscall(SYS_io_uring_enter,
+                           read_batch.ring_fd,
+                           queued - submitted,
+                           queued - reaped,
+                           IORING_ENTER_GETEVENTS,
+                           NULL,
+                           0);
+        if (ret < 0 && errno != EINTR) {
+            ret = -errno;
+            reaped += read_batch_reap();
+            read_batch.in_flight = submitted - reaped;
+            return (int)ret;
+        }
+        if (ret > 0) {
+            submitted += (unsigned)ret;
+        }
+        reaped += read_batch_reap();
+    }
+
+    return 0;
+}
+#endif /* HAVE_IO_URING */
+
+static void read_batch_close(void) {
+#ifdef HAVE_IO_URING
+    read_batch_ring_close();
+#endif
+    free(read_batch.fds);
+    free(read_batch.registered);
+    free(read_batch.res);
+    free(read_batch.bufs);
+    read_batch.fds = read_batch.registered = NULL;
+    read_batch.res = NULL;
+    read_batch.bufs = NULL;
+    read_batch.cap = read_batch.nr = 0;
+}
+
+/* Also lets go of the batch once io_uring is turned off */
+static bool read_batch_wanted(void) {
+    if (!cfg.use_io_uring) {
+        if (read_batch.cap) {
+            read_batch_close();
+        }
+        return false;
+    }
+    return !read_batch.unavailable;
+}
+
+/* Starts a batch of up to nr reads, added with read_batch_add(). */
+static void read_batch_begin(size_t nr) {
+    size_t cap = read_batch.cap ? read_batch.cap : READ_BATCH_INITIAL_CAP;
+
+    read_batch.nr = 0;
+    if (nr <= read_batch.cap) {
+        return;
+    }
+
+    while (cap < nr) {
+        cap *= 2;
+    }
+
+    /* The ring has the old buffers and file table registered */
+#ifdef HAVE_IO_URING
+    read_batch_ring_close();
+#endif
+
+#define READ_BATCH_REALLOC(field, size)                                        \
+    do {                                                                       \
+        void *tmp = realloc(field, (size) * sizeof(*(field)));                 \
+        expect(tmp);                                                           \
+        field = tmp;                                                           \
+    } while (0)
+
+    READ_BATCH_REALLOC(read_batch.fds, cap);
+    READ_BATCH_REALLOC(read_batch.registered, cap);
+    READ_BATCH_REALLOC(read_batch.res, cap);
+    READ_BATCH_REALLOC(read_batch.bufs, cap * PRESSURE_BUF_LEN);
+
+#undef READ_BATCH_REALLOC
+
+    read_batch.cap = cap;
+}
+
+/* Returns the slot fd will be read into. fd may be -1 to leave a gap. */
+static size_t read_batch_add(int fd) {
+    size_t slot = read_batch.nr++;
+
+    expect(slot < read_batch.cap);
+    read_batch.fds[slot] = fd;
+    read_batch.res[slot] = -EAGAIN;
+    return slot;
+}
+
+/* Reads everything added since read_batch_begin(), see read_batch. */
+static void read_batch_submit(void) {
+#ifdef HAVE_IO_URING
+    size_t start;
+    int ret = 0;
+
+    if (read_batch.ring_fd < 0) {
+        ret = read_batch_ring_open();
+    }
+
+    if (ret == 0) {
+        if (read_batch.fixed_files) {
+            read_batch_update_files();
+        }
+        for (start = 0; start < read_batch.nr && ret == 0;
+             start += read_batch.sq_entries) {
+            size_t end = start + read_batch.sq_entries;
+            ret = read_batch_submit_range(
+                start, end < read_batch.nr ? end : read_batch.nr);
+        }
+    }
+
+    if (ret < 0) {
+        warn("Cannot use io_uring, reading pressures with pread(): %s\n",
+             strerror(-ret));
+        /*
+         * The kernel's workers may still write into reads we didn't reap,
+         * even after the ring is closed, so those buffers can never be freed.
+         * It's once, since we don't try again.
+         */
+        if (read_batch.in_flight) {
+            read_batch.bufs = NULL;
+        }
+        read_batch_close();
+        read_batch.unavailable = true;
+    }
+#else
+    warn("%s\n", "Built without io_uring, reading pressures with pread().");
+    read_batch_close();
+    read_batch.unavailable = true;
+#endif
+}
+
+/* Results from earlier ticks mustn't be taken for later ones. */
+static void read_batch_end(void) { read_batch.nr = 0; }
+
+/*
+ * Pressure files are kept open for the life of the daemon, so reading them is
+ * a single pread(). If the cgroup went away underneath us we get ENODEV, in
+ * which case go through openat_psi() again to find the new one.
+ */
+static ssize_t pressure_read(Resource *r, char *buf, size_t len) {
+    ssize_t ret = -EINVAL;
+    int attempt;
+
+    for (attempt = 0; attempt < 2; attempt++) {
+        if (r->fd < 0) {
+            r->fd = openat_psi(r->filename, O_RDONLY);
+            if (r->fd < 0) {
+                return r->fd;
+            }
+        }
+
+        ret = pread(r->fd, buf, len - 1, 0);
+        if (ret >= 0) {
+            buf[ret] = '\0';
+            return ret;
+        }
+
+        ret = -errno;
+        close(r->fd);
+        r->fd = -1;
+        read_batch_forget_fds();
+
+        if (ret != -ENODEV) {
+            break;
+        }
+    }
+
+    return ret;
+}
+
+/* See AlertState, A_ERROR if the pressures can't be read */
+static AlertState pressure_check(Resource *r, FILE *override_file) {
+    char buf[PRESSURE_BUF_LEN];
+    const char *text = buf;
+    AlertState ret;
+    uint64_t ts;
+    int found;
+
+    if (!r->filename && !override_file) {
+        return A_INACTIVE;
+    }
+
+    if (override_file) {
+        size_t len = fread(buf, 1, sizeof(buf) - 1, override_file);
+        buf[len] = '\0';
+        fclose(override_file);
+    } else if (read_batch_take(r->type, &text) < 0) {
+        ssize_t len = pressure_read(r, buf, sizeof(buf));
+        if (len < 0) {
+            warn("Can't read %s: %s\n", r->filename, strerror((int)-len));
+            return A_ERROR;
+        }
+        text = buf;
+    }
+
+    r->previous = r->current;
+    found = parse_pressures(text, &r->current);
+    if (found < 0 || !(found & PRESSURE_HAS_SOME)) {
+        warn("Can't parse pressures from %s\n", strnull(r->filename));
+        return A_ERROR;
+    }
+
+    ts = now_usec();
+    sample_history_add(&sample_history[r->type], ts, &r->current);
+    custom_windows_update(r, ts);
+    if (cfg.predict_horizon_sec > 0) {
+        trends_update(r, ts);
+    }
+
+    ret = pressure_check_single_line(r, &r->current.some, false);
+    if ((ret == A_INACTIVE || ret == A_RISING) && r->has_full) {
+        AlertState full_ret;
+
+        if (!(found & PRESSURE_HAS_FULL)) {
+            warn("Can't parse full pressures from %s\n",
+                 strnull(r->filename));
+            return A_ERROR;
+        }
+        full_ret = pressure_check_single_line(r, &r->current.full, true);
+        if (ret == A_INACTIVE || full_ret == A_ACTIVE) {
+            ret = full_ret;
+        }
+    }
+
+    return ret;
+}
+
+/*
+ * Talking to the notification daemon over D-Bus is slowest exactly when we
+ * need it, under memory pressure, and the daemon might even be swapped out.
+ * To never hold up sampling for that, notifications are shown and closed from
+ * their own thread. The monitoring thread is the only producer, so requests
+ * go over a lock free single producer/single consumer ring, with an eventfd
+ * to wake the sender. Notifications are referred to by id, since the
+ * NotifyNotification objects only ever live on the sender thread.
+ */
+#define TITLE_MAX (sizeof("Rising  pressure!") + RULE_NAME_MAX)
+#define BODY_MAX (PATH_MAX + 384)
+#define NOTIFY_QUEUE_LEN 32 /* Power of 2 */
+#define NOTIFY_SLOW_USEC (1 * SEC_TO_USEC)
+
+typedef enum { NOTIFY_SHOW, NOTIFY_CLOSE, NOTIFY_SKIP, NOTIFY_STOP } NotifyOp;
+
+typedef struct {
+    NotifyOp op;
+    uint32_t id;
+    uid_t uid; /* Whose session to show it in, in system mode */
+    uint64_t queued_usec;
+    char title[TITLE_MAX];
+    char body[BODY_MAX];
+} NotifyRequest;
+
+typedef struct {
+    uint32_t id;
+    NotifyNotification *n; /* NULL in system mode, the helper has it */
+    uid_t uid;
+    pid_t helper;
+} LiveNotification;
+
+/*
+ * In system mode we can't talk to other users' session buses ourselves, and
+ * don't want glib around for it anyway. Instead, a helper is started as the
+ * user for as long as they have notifications up, see seat_helper_spawn().
+ * Requests are passed to it as is over a SOCK_SEQPACKET socket.
+ */
+typedef struct {
+    uid_t uid;
+    pid_t pid;
+    int fd;
+    size_t nr_live;
+} SeatHelper;
+
+static struct {
+    NotifyRequest ring[NOTIFY_QUEUE_LEN];
+    atomic_size_t head; /* Only written by the monitoring thread */
+    atomic_size_t tail; /* Only written by the sender thread */
+    int event_fd;
+    pthread_t thread;
+    bool started;
+    uint32_t next_id;
+    /* Owned by the sender thread */
+    LiveNotification *live;
+    size_t nr_live;
+    SeatHelper *helpers;
+    size_t nr_helpers;
+    /* Owned by the monitoring thread, requests waiting for room, in order */
+    NotifyRequest *pending;
+    size_t nr_pending;
+    size_t pending_cap;
+    /* Written by the sender thread, read at exit */
+    uint64_t delivered;
+    uint64_t latency_max_usec;
+    uint64_t latency_total_usec;
+} sender = {.event_fd = -1};
+
+static void sender_live_add(LiveNotification live) {
+    LiveNotification *tmp =
+        realloc(sender.live, (sender.nr_live + 1) * sizeof(*sender.live));
+    expect(tmp);
+    sender.live = tmp;
+    sender.live[sender.nr_live++] = live;
+}
+
+static bool sender_live_take(uint32_t id, LiveNotification *out) {
+    size_t i;
+    for (i = 0; i < sender.nr_live; i++) {
+        if (sender.live[i].id == id) {
+            *out = sender.live[i];
+            sender.live[i] = sender.live[--sender.nr_live];
+            return true;
+        }
+    }
+    return false;
+}
+
+static void sender_delivered(const NotifyRequest *req) {
+    uint64_t latency = now_usec() - req->queued_usec;
+
+    sender.delivered++;
+    sender.latency_total_usec += latency;
+    if (latency > sender.latency_max_usec) {
+        sender.latency_max_usec = latency;
+    }
+    if (latency > NOTIFY_SLOW_USEC) {
+        warn("Notification took %.1fs to be delivered.\n",
+             (double)latency / SEC_TO_USEC);
+    }
+}
+
+static void notification_destroy(NotifyNotification *n) {
+    (void)notify_notification_close(n, NULL);
+    g_object_unref(G_OBJECT(n));
+}
+
+static void sender_show(const NotifyRequest *req) {
+    NotifyNotification *n;
+    GError *err = NULL;
+    uint64_t start = now_usec();
+    bool shown;
+
+    n = notify_notification_new(req->title, req->body, NULL);
+    notify_notification_set_urgency(n, NOTIFY_URGENCY_CRITICAL);
+    shown = notify_notification_show(n, &err);
+    latency_record(&stats.notify_show, now_usec() - start);
+
+    if (!shown) {
+        warn("Cannot display notification: %s\n", err->message);
+        g_error_free(err);
+        notification_destroy(n);
+        return;
+    }
+
+    sender_live_add((LiveNotification){.id = req->id, .n = n});
+    sender_delivered(req);
+}
+
+#define SEAT_HELPER_GROUPS_MAX 64
+#define SEAT_HELPER_ENV_MAX (PATH_MAX + 32)
+
+static SeatHelper *seat_helper_find(uid_t uid) {
+    size_t i;
+    for (i = 0; i < sender.nr_helpers; i++) {
+        if (sender.helpers[i].uid == uid) {
+            return &sender.helpers[i];
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Runs psi-notify --notify-helper as uid, talking to their session bus. Only
+ * async-signal-safe calls are made between fork() and exec, since other
+ * threads may hold locks. Everything we open is O_CLOEXEC, so none of it leaks
+ * to the helper.
+ */
+static SeatHelper *seat_helper_spawn(uid_t uid) {
+    char bus[SEAT_HELPER_ENV_MAX], runtime_dir[SEAT_HELPER_ENV_MAX];
+    char home[SEAT_HELPER_ENV_MAX], user[SEAT_HELPER_ENV_MAX];
+    char arg0[] = "psi-notify", arg1[] = "--notify-helper";
+    char *const argv[] = {arg0, arg1, NULL};
+    char *const envp[] = {bus, runtime_dir, home, user, NULL};
+    gid_t groups[SEAT_HELPER_GROUPS_MAX];
+    int nr_groups = SEAT_HELPER_GROUPS_MAX;
+    struct passwd pw, *pwp = NULL;
+    char pw_buf[4096];
+    struct stat st;
+    SeatHelper *tmp;
+    sigset_t none;
+    int sv[2];
+    pid_t pid;
+
+    snprintf_check(runtime_dir, sizeof(runtime_dir),
+                   "XDG_RUNTIME_DIR=/run/user/%u", (unsigned)uid);
+    snprintf_check(bus, sizeof(bus), "DBUS_SESSION_BUS_ADDRESS=unix:path=%s/bus",
+                   runtime_dir + strlen("XDG_RUNTIME_DIR="));
+    if (stat(bus + strlen("DBUS_SESSION_BUS_ADDRESS=unix:path="), &st) < 0) {
+        info("No session bus for uid %u, not notifying: %s\n", (unsigned)uid,
+             strerror(errno));
+        return NULL;
+    }
+
+    if (getpwuid_r(uid, &pw, pw_buf, sizeof(pw_buf), &pwp) != 0 || !pwp) {
+        warn("Cannot find uid %u in the user database, not notifying\n",
+             (unsigned)uid);
+        return NULL;
+    }
+    if (getgrouplist(pw.pw_name, pw.pw_gid, groups, &nr_groups) < 0) {
+        nr_groups = SEAT_HELPER_GROUPS_MAX; /* The rest are dropped */
+    }
+    snprintf_check(home, sizeof(home), "HOME=%s", pw.pw_dir);
+    snprintf_check(user, sizeof(user), "USER=%s", pw.pw_name);
+
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0) {
+        warn("Cannot create socket for notification helper: %s\n",
+             strerror(errno));
+        return NULL;
+    }
+    sigemptyset(&none);
+
+    pid = fork();
+    if (pid < 0) {
+        warn("Cannot start notification helper: %s\n", strerror(errno));
+        close(sv[0]);
+        close(sv[1]);
+        return NULL;
+    }
+
+    if (pid == 0) {
+        if (setgroups((size_t)nr_groups, groups) < 0 ||
+            setregid(pw.pw_gid, pw.pw_gid) < 0 ||
+            setreuid(uid, uid) < 0 ||
+            dup2(sv[1], STDIN_FILENO) < 0) {
+            _exit(1);
+        }
+#ifdef SYS_close_range
+        (void)syscall(SYS_close_range, STDERR_FILENO + 1, ~0U, 0);
+#endif
+        (void)sigprocmask(SIG_SETMASK, &none, NULL);
+        execve("/proc/self/exe", argv, envp);
+        _exit(127);
+    }
+
+    close(sv[1]);
+
+    tmp = realloc(sender.helpers,
+                  (sender.nr_helpers + 1) * sizeof(*sender.helpers));
+    expect(tmp);
+    sender.helpers = tmp;
+    sender.helpers[sender.nr_helpers] =
+        (SeatHelper){.uid = uid, .pid = pid, .fd = sv[0]};
+    return &sender.helpers[sender.nr_helpers++];
+}
+
+/* It exits once it sees EOF, and is reaped from loop_handle_signal(). */
+static void seat_helper_drop(SeatHelper *h) {
+    close(h->fd);
+    *h = sender.helpers[--sender.nr_helpers];
+}
+
+static bool seat_helper_send(SeatHelper *h, const NotifyRequest *req) {
+    if (send(h->fd, req, sizeof(*req), MSG_DONTWAIT | MSG_NOSIGNAL) ==
+        (ssize_t)sizeof(*req)) {
+        return true;
+    }
+    warn("Cannot pass notification to helper for uid %u: %s\n",
+         (unsigned)h->uid, strerror(errno));
+    return false;
+}
+
+static void seat_helper_show(const NotifyRequest *req) {
+    SeatHelper *h = seat_helper_find(req->uid);
+
+    if (!h) {
+        h = seat_helper_spawn(req->uid);
+        if (!h) {
+            return;
+        }
+    }
+
+    if (!seat_helper_send(h, req)) {
+        /* Probably died, the next one will get a fresh helper. */
+        seat_helper_drop(h);
+        return;
+    }
+
+    h->nr_live++;
+    sender_live_add((LiveNotification){
+        .id = req->id, .uid = req->uid, .helper = h->pid});
+    sender_delivered(req);
+}
+
+static void seat_helper_close(const LiveNotification *live,
+                              const NotifyRequest *req) {
+    SeatHelper *h = seat_helper_find(live->uid);
+
+    /* If it's a different helper, this one went down with the old one. */
+    if (!h || h->pid != live->helper) {
+        return;
+    }
+
+    if (!seat_helper_send(h, req) || --h->nr_live == 0) {
+        seat_helper_drop(h);
+    }
+}
+
+/* Everything but NOTIFY_STOP, for the sender thread and --notify-helper. */
+static void sender_handle(const NotifyRequest *req) {
+    LiveNotification live;
+
+    switch (req->op) {
+        case NOTIFY_SHOW:
+            if (system_mode) {
+                seat_helper_show(req);
+            } else {
+                sender_show(req);
+            }
+            break;
+        case NOTIFY_CLOSE:
+            if (!sender_live_take(req->id, &live)) {
+                break;
+            }
+            if (system_mode) {
+                seat_helper_close(&live, req);
+            } else {
+                uint64_t start = now_usec();
+                notification_destroy(live.n);
+                latency_record(&stats.notify_close, now_usec() - start);
+            }
+            break;
+        case NOTIFY_SKIP:
+            break;
+        default:
+            unreachable();
+    }
+}
+
+/*
+ * If a notification is both shown and closed in what's pending, it was never
+ * seen by the user, so neither need to go over D-Bus.
+ */
+static void sender_coalesce(size_t tail, size_t head) {
+    size_t i, j;
+
+    for (i = tail; i != head; i++) {
+        NotifyRequest *show = &sender.ring[i % NOTIFY_QUEUE_LEN];
+        if (show->op != NOTIFY_SHOW) {
+            continue;
+        }
+        for (j = i + 1; j != head; j++) {
+            NotifyRequest *close_req = &sender.ring[j % NOTIFY_QUEUE_LEN];
+            if (close_req->op == NOTIFY_CLOSE && close_req->id == show->id) {
+                show->op = NOTIFY_SKIP;
+                close_req->op = NOTIFY_SKIP;
+                break;
+            }
+        }
+    }
+}
+
+static void *sender_main(void *arg) {
+    (void)arg;
+
+    for (;;) {
+        size_t tail = atomic_load_explicit(&sender.tail, memory_order_relaxed);
+        size_t head = atomic_load_explicit(&sender.head, memory_order_acquire);
+        uint64_t count;
+
+        if (tail == head) {
+            if (read(sender.event_fd, &count, sizeof(count)) < 0) {
+                expect(errno == EINTR);
+            }
+            continue;
+        }
+
+        sender_coalesce(tail, head);
+
+        for (; tail != head; tail++) {
+            const NotifyRequest *req = &sender.ring[tail % NOTIFY_QUEUE_LEN];
+
+            if (req->op == NOTIFY_STOP) {
+                atomic_store_explicit(
+                    &sender.tail, tail + 1, memory_order_release);
+                return NULL;
+            }
+
+            sender_handle(req);
+
+            /* Let the slot be reused only once we're done with it. */
+            atomic_store_explicit(&sender.tail, tail + 1, memory_order_release);
+        }
+    }
+}
+
+static bool sender_full(void) {
+    size_t head = atomic_load_explicit(&sender.head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&sender.tail, memory_order_acquire);
+    return head - tail == NOTIFY_QUEUE_LEN;
+}
+
+/* Never blocks. Returns NULL if the ring is full, see sender_push(). */
+static NotifyRequest *sender_reserve(NotifyOp op, uint32_t id) {
+    size_t head = atomic_load_explicit(&sender.head, memory_order_relaxed);
+    NotifyRequest *req;
+
+    if (sender_full()) {
+        return NULL;
+    }
+
+    req = &sender.ring[head % NOTIFY_QUEUE_LEN];
+    req->op = op;
+    req->id = id;
+    req->queued_usec = now_usec();
+    return req;
+}
+
+static void sender_commit(void) {
+    const uint64_t one = 1;
+    size_t head = atomic_load_explicit(&sender.head, memory_order_relaxed);
+
+    atomic_store_explicit(&sender.head, head + 1, memory_order_release);
+    if (sender.event_fd >= 0) {
+        expect(write(sender.event_fd, &one, sizeof(one)) == sizeof(one));
+    }
+}
+
+static void sender_pending_drop(size_t nr) {
+    if (nr > 0) {
+        sender.nr_pending -= nr;
+        memmove(sender.pending,
+                sender.pending + nr,
+                sender.nr_pending * sizeof(*sender.pending));
+    }
+}
+
+/*
+ * Neither shows nor closes can be dropped: the alert would be active with
+ * nothing shown, or its notification would stay up forever. Any which don't
+ * fit in the ring wait here, in order, and are moved over as room frees up: on
+ * the next request, the next update, or at exit.
+ */
+static void sender_flush(void) {
+    size_t i;
+
+    for (i = 0; i < sender.nr_pending && !sender_full(); i++) {
+        size_t head = atomic_load_explicit(&sender.head, memory_order_relaxed);
+        sender.ring[head % NOTIFY_QUEUE_LEN] = sender.pending[i];
+        sender_commit();
+    }
+
+    sender_pending_drop(i);
+}
+
+static void sender_push(const NotifyRequest *req) {
+    sender_flush();
+
+    if (sender.nr_pending == 0 && !sender_full()) {
+        size_t head = atomic_load_explicit(&sender.head, memory_order_relaxed);
+        sender.ring[head % NOTIFY_QUEUE_LEN] = *req;
+        sender_commit();
+        return;
+    }
+
+    if (sender.nr_pending == sender.pending_cap) {
+        NotifyRequest *tmp;
+        sender.pending_cap =
+            sender.pending_cap ? sender.pending_cap * 2 : NOTIFY_QUEUE_LEN;
+        tmp = realloc(sender.pending, sender.pending_cap * sizeof(*tmp));
+        expect(tmp);
+        sender.pending = tmp;
+    }
+    sender.pending[sender.nr_pending++] = *req;
+}
+
+static void sender_close(uint32_t id) {
+    NotifyRequest req = {.op = NOTIFY_CLOSE, .id = id};
+    size_t i;
+
+    /* Never shown yet, so it's enough that it never will be */
+    for (i = 0; i < sender.nr_pending; i++) {
+        if (sender.pending[i].op == NOTIFY_SHOW && sender.pending[i].id == id) {
+            memmove(sender.pending + i,
+                    sender.pending + i + 1,
+                    (sender.nr_pending - i - 1) * sizeof(*sender.pending));
+            sender.nr_pending--;
+            return;
+        }
+    }
+
+    req.queued_usec = now_usec();
+    sender_push(&req);
+}
+
+static void sender_start(void) {
+    int ret;
+
+    sender.event_fd = eventfd(0, EFD_CLOEXEC);
+    expect(sender.event_fd >= 0);
+
+    /* So that a burst of alerts doesn't have to allocate, see lock_memory */
+    if (!sender.pending) {
+        sender.pending_cap = NOTIFY_QUEUE_LEN;
+        sender.pending = calloc(sender.pending_cap, sizeof(*sender.pending));
+        expect(sender.pending);
+    }
+
+    ret = pthread_create(&sender.thread, NULL, sender_main, NULL);
+    if (ret != 0) {
+        die("Cannot start notification thread: %s\n", strerror(ret));
+    }
+    sender.started = true;
+}
+
+static void sender_stop(void) {
+    if (!sender.started) {
+        return;
+    }
+
+    /* Spin until there's room, we're exiting anyway. */
+    while (sender.nr_pending > 0) {
+        sender_flush();
+        sched_yield();
+    }
+    while (!sender_reserve(NOTIFY_STOP, 0)) {
+        sched_yield();
+    }
+    sender_commit();
+
+    expect(pthread_join(sender.thread, NULL) == 0);
+    close(sender.event_fd);
+    sender.event_fd = -1;
+    while (sender.nr_helpers > 0) {
+        seat_helper_drop(&sender.helpers[0]);
+    }
+    free(sender.helpers);
+    free(sender.live);
+    free(sender.pending);
+    sender.pending = NULL;
+    sender.pending_cap = 0;
+    sender.started = false;
+
+    if (sender.delivered > 0) {
+        info("Delivered %" PRIu64 " notifications, latency: mean %.1fms, "
+             "max %.1fms\n",
+             sender.delivered,
+             (double)sender.latency_total_usec / (double)sender.delivered /
+                 MSEC_TO_USEC,
+             (double)sender.latency_max_usec / MSEC_TO_USEC);
+    }
+}
+
+/*
+ * Actions are run on their own thread too, so that a slow cgroup write or
+ * hook never holds up sampling. Requests go over the same kind of ring as
+ * notifications. What was applied, and what it replaced, lives on the action
+ * thread, so an undo only needs the id it was applied with, even if the
+ * config has been reloaded since.
+ */
+#define ACTION_QUEUE_LEN 32 /* Power of 2 */
+#define ACTION_ARGV_MAX 32
+#define ACTION_ENV_MAX 128
+#define ACTION_PSI_VARS 8
+
+typedef enum { ACTION_APPLY, ACTION_UNDO, ACTION_STOP } ActionOp;
+
+typedef struct {
+    ActionOp op;
+    uint32_t id;             /* Pairs an undo with its apply */
+    Action action;           /* Only for ACTION_APPLY */
+    PressureSample pressures[NR_RESOURCES]; /* As of the transition */
+} ActionRequest;
+
+typedef struct {
+    uint32_t id;
+    Action action;
+    char saved[ACTION_ARG_MAX]; /* What ACTION_SET replaced */
+    bool has_saved;
+} AppliedAction;
+
+typedef struct {
+    uint32_t id;
+    PressureSample pressures[NR_RESOURCES];
+} PendingUndo;
+
+extern char **environ;
+
+static struct {
+    ActionRequest ring[ACTION_QUEUE_LEN];
+    atomic_size_t head; /* Only written by the monitoring thread */
+    atomic_size_t tail; /* Only written by the action thread */
+    int event_fd;
+    pthread_t thread;
+    bool started;
+    /* Owned by the monitoring thread, same order as cfg.actions */
+    uint32_t next_id;
+    uint32_t applied_id[ACTIONS_MAX]; /* 0 if not applied */
+    uint64_t last_usec[ACTIONS_MAX];  /* When last applied, 0 if never */
+    uint64_t keys[ACTIONS_MAX];       /* See action_key() */
+    size_t nr_keys;
+    /* Undos waiting for room, oldest first, see actions_undo() */
+    PendingUndo pending[ACTIONS_MAX];
+    size_t nr_pending;
+    /* Owned by the action thread */
+    AppliedAction applied[ACTIONS_MAX];
+    size_t nr_applied;
+} actions = {.event_fd = -1};
+
+static int action_write(const char *path, const char *value) {
+    size_t len = strlen(value);
+    int fd = open(path, O_WRONLY | O_TRUNC | O_CLOEXEC);
+    ssize_t ret;
+
+    if (fd < 0) {
+        return -errno;
+    }
+    ret = write(fd, value, len);
+    if (ret < 0) {
+        ret = -errno;
+    } else if ((size_t)ret != len) {
+        ret = -EIO;
+    }
+    close(fd);
+    return ret < 0 ? (int)ret : 0;
+}
+
+/* Whatever's there now, without the trailing newline, so it can be put back */
+static bool action_read(const char *path, char *out, size_t len) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    ssize_t ret;
+
+    if (fd < 0) {
+        return false;
+    }
+    ret = read(fd, out, len - 1);
+    close(fd);
+    if (ret < 0) {
+        return false;
+    }
+    while (ret > 0 && isspace((unsigned char)out[ret - 1])) {
+        ret--;
+    }
+    out[ret] = '\0';
+    return true;
+}
+
+/*
+ * Runs the hook with the pressures in its environment, and doesn't wait for
+ * it: it's reaped from loop_handle_signal() like seat helpers. Only
+ * async-signal-safe calls are made between fork() and exec.
+ */
+static void action_exec(const Action *action, const PressureSample *p,
+                        bool active) {
+    char args[ACTION_ARG_MAX], path[PATH_MAX];
+    char vars[ACTION_PSI_VARS][64];
+    char *argv[ACTION_ARGV_MAX + 2];
+    char *envp[ACTION_ENV_MAX + ACTION_PSI_VARS + 1];
+    const PressureLine *lines[] = {&p->some, &p->full};
+    size_t argc = 0, envc = 0, i;
+    char *tok, *save = NULL;
+    sigset_t none;
+    pid_t pid;
+
+    snprintf_check(path, sizeof(path), "%s", action->path);
+    snprintf_check(args, sizeof(args), "%s", action->arg);
+    argv[argc++] = path;
+    for (tok = strtok_r(args, " \t", &save); tok;
+         tok = strtok_r(NULL, " \t", &save)) {
+        if (argc == ACTION_ARGV_MAX + 1) {
+            warn("Too many arguments for %s, dropping the rest\n", path);
+            break;
+        }
+        argv[argc++] = tok;
+    }
+    argv[argc] = NULL;
+
+    for (i = 0; environ && environ[i] && envc < ACTION_ENV_MAX; i++) {
+        if (strncmp(environ[i], "PSI_", strlen("PSI_")) != 0) {
+            envp[envc++] = environ[i];
+        }
+    }
+    snprintf_check(vars[0], sizeof(vars[0]), "PSI_RESOURCE=%s",
+                   res_keys[action->resource]);
+    snprintf_check(vars[1], sizeof(vars[1]), "PSI_STATE=%s",
+                   active ? "active" : "inactive");
+    for_each_arr(i, lines) {
+        const char *type = i ? "FULL" : "SOME";
+        snprintf_check(vars[2 + i * 3], sizeof(vars[0]), "PSI_%s_AVG10=%.2f",
+                       type, lines[i]->avg10);
+        snprintf_check(vars[3 + i * 3], sizeof(vars[0]), "PSI_%s_AVG60=%.2f",
+                       type, lines[i]->avg60);
+        snprintf_check(vars[4 + i * 3], sizeof(vars[0]), "PSI_%s_AVG300=%.2f",
+                       type, lines[i]->avg300);
+    }
+    for_each_arr(i, vars) {
+        envp[envc++] = vars[i];
+    }
+    envp[envc] = NULL;
+    sigemptyset(&none);
+
+    pid = fork();
+    if (pid < 0) {
+        warn("Cannot run action %s: %s\n", path, strerror(errno));
+        return;
+    }
+
+    if (pid == 0) {
+#ifdef SYS_close_range
+        (void)syscall(SYS_close_range, STDERR_FILENO + 1, ~0U, 0);
+#endif
+        (void)sigprocmask(SIG_SETMASK, &none, NULL);
+        execve(path, argv, envp);
+        _exit(127);
+    }
+}
+
+static void action_apply(const ActionRequest *req) {
+    AppliedAction *a;
+    int ret;
+
+    if (actions.nr_applied == ACTIONS_MAX) {
+        warn("Too many actions applied, not running %s\n", req->action.path);
+        return;
+    }
+
+    a = &actions.applied[actions.nr_applied];
+    a->id = req->id;
+    a->action = req->action;
+
+    if (a->action.kind == ACTION_EXEC) {
+        action_exec(&a->action, &req->pressures[a->action.resource], true);
+        actions.nr_applied++;
+        return;
+    }
+
+    a->has_saved = action_read(a->action.path, a->saved, sizeof(a->saved));
+    ret = action_write(a->action.path, a->action.arg);
+    if (ret < 0) {
+        warn("Cannot set %s to %s: %s\n", a->action.path, a->action.arg,
+             strerror(-ret));
+        return;
+    }
+    if (!a->has_saved) {
+        warn("Cannot read %s, so it won't be put back\n", a->action.path);
+    }
+    info("Set %s to %s.\n", a->action.path, a->action.arg);
+    actions.nr_applied++;
+}
+
+static void action_undo(const ActionRequest *req) {
+    AppliedAction *a = NULL;
+    size_t i;
+    int ret;
+
+    for (i = 0; i < actions.nr_applied; i++) {
+        if (actions.applied[i].id == req->id) {
+            a = &actions.applied[i];
+            break;
+        }
+    }
+
+    /* It failed to apply, so there's nothing to put back. */
+    if (!a) {
+        return;
+    }
+
+    if (a->action.kind == ACTION_EXEC) {
+        action_exec(&a->action, &req->pressures[a->action.resource], false);
+    } else if (a->has_saved) {
+        ret = action_write(a->action.path, a->saved);
+        if (ret < 0) {
+            warn("Cannot put %s back to %s: %s\n", a->action.path, a->saved,
+                 strerror(-ret));
+        } else {
+            info("Put %s back to %s.\n", a->action.path, a->saved);
+        }
+    }
+
+    *a = actions.applied[--actions.nr_applied];
+}
+
+/* Everything but ACTION_STOP, for the action thread and tests. */
+static void action_handle(const ActionRequest *req) {
+    switch (req->op) {
+        case ACTION_APPLY:
+            action_apply(req);
+            break;
+        case ACTION_UNDO:
+            action_undo(req);
+            break;
+        default:
+            unreachable();
+    }
+}
+
+static void *actions_main(void *arg) {
+    (void)arg;
+
+    for (;;) {
+        size_t tail = atomic_load_explicit(&actions.tail, memory_order_relaxed);
+        size_t head = atomic_load_explicit(&actions.head, memory_order_acquire);
+        uint64_t count;
+
+        if (tail == head) {
+            if (read(actions.event_fd, &count, sizeof(count)) < 0) {
+                expect(errno == EINTR);
+            }
+            continue;
+        }
+
+        for (; tail != head; tail++) {
+            const ActionRequest *req = &actions.ring[tail % ACTION_QUEUE_LEN];
+
+            if (req->op == ACTION_STOP) {
+                atomic_store_explicit(
+                    &actions.tail, tail + 1, memory_order_release);
+                return NULL;
+            }
+
+            action_handle(req);
+            atomic_store_explicit(
+                &actions.tail, tail + 1, memory_order_release);
+        }
+    }
+}
+
+/* Never blocks. Returns NULL if there's no room. */
+static ActionRequest *actions_reserve(ActionOp op, uint32_t id) {
+    size_t head = atomic_load_explicit(&actions.head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&actions.tail, memory_order_acquire);
+    ActionRequest *req;
+
+    if (head - tail == ACTION_QUEUE_LEN) {
+        return NULL;
+    }
+
+    req = &actions.ring[head % ACTION_QUEUE_LEN];
+    req->op = op;
+    req->id = id;
+    return req;
+}
+
+static void actions_commit(void) {
+    const uint64_t one = 1;
+    size_t head = atomic_load_explicit(&actions.head, memory_order_relaxed);
+
+    atomic_store_explicit(&actions.head, head + 1, memory_order_release);
+    if (actions.event_fd >= 0) {
+        expect(write(actions.event_fd, &one, sizeof(one)) == sizeof(one));
+    }
+}
+
+/*
+ * An undo can never be dropped, or a cgroup could be left frozen. The action
+ * thread may well be stuck in a slow write under pressure, so any which don't
+ * fit in the ring wait here and are moved over as room frees up: on the next
+ * request, the next update, or at exit.
+ */
+static void actions_flush(void) {
+    size_t i;
+
+    for (i = 0; i < actions.nr_pending; i++) {
+        ActionRequest *req =
+            actions_reserve(ACTION_UNDO, actions.pending[i].id);
+        if (!req) {
+            break;
+        }
+        memcpy(req->pressures, actions.pending[i].pressures,
+               sizeof(req->pressures));
+        actions_commit();
+    }
+
+    if (i > 0) {
+        actions.nr_pending -= i;
+        memmove(actions.pending,
+                actions.pending + i,
+                actions.nr_pending * sizeof(*actions.pending));
+    }
+}
+
+/*
+ * Applies can be skipped if there's no room, they're only tried again on the
+ * next transition. They also wait for any pending undos, so that those never
+ * outnumber the ACTIONS_MAX ids which can be applied at once.
+ */
+static bool actions_apply(uint32_t id, const Action *action) {
+    ActionRequest *req;
+    size_t i;
+
+    actions_flush();
+    req = actions.nr_pending == 0 ? actions_reserve(ACTION_APPLY, id) : NULL;
+    if (!req) {
+        warn("Action queue is full, not running %s\n", action->path);
+        return false;
+    }
+
+    req->action = *action;
+    for_each_arr(i, all_res) {
+        req->pressures[i] = all_res[i]->current;
+    }
+    actions_commit();
+    return true;
+}
+
+static void actions_undo(uint32_t id) {
+    PendingUndo *p;
+    size_t i;
+
+    actions_flush();
+    expect(actions.nr_pending < ACTIONS_MAX);
+    p = &actions.pending[actions.nr_pending++];
+    p->id = id;
+    for_each_arr(i, all_res) {
+        p->pressures[i] = all_res[i]->current;
+    }
+    actions_flush();
+}
+
+/*
+ * Called on every alert transition for a resource. Actions are applied when
+ * it goes active, at most once per cooldown, and undone once it's inactive.
+ * Stabilising leaves them be.
+ */
+static void actions_transition(const Resource *r, AlertState before,
+                               AlertState after) {
+    uint64_t now;
+    size_t i;
+
+    if (replay.active || before == after) {
+        return;
+    }
+
+    now = now_usec();
+    for (i = 0; i < cfg.nr_actions; i++) {
+        const Action *action = &cfg.actions[i];
+
+        if (action->resource != r->type) {
+            continue;
+        }
+
+        if (after == A_ACTIVE && !actions.applied_id[i]) {
+            if (actions.last_usec[i] &&
+                now - actions.last_usec[i] < action->cooldown_usec) {
+                info("Not running %s action on %s, still cooling down.\n",
+                     res_keys[r->type], action->path);
+                continue;
+            }
+
+            if (++actions.next_id == 0) {
+                actions.next_id++;
+            }
+            if (actions_apply(actions.next_id, action)) {
+                actions.applied_id[i] = actions.next_id;
+                actions.last_usec[i] = now;
+            }
+        } else if (after == A_INACTIVE && actions.applied_id[i]) {
+            actions_undo(actions.applied_id[i]);
+            actions.applied_id[i] = 0;
+        }
+    }
+}
+
+static void actions_undo_all(void) {
+    size_t i;
+
+    for_each_arr(i, actions.applied_id) {
+        if (actions.applied_id[i]) {
+            actions_undo(actions.applied_id[i]);
+            actions.applied_id[i] = 0;
+        }
+        actions.last_usec[i] = 0;
+    }
+}
+
+static void actions_start(void) {
+    int ret;
+
+    actions.event_fd = eventfd(0, EFD_CLOEXEC);
+    expect(actions.event_fd >= 0);
+
+    ret = pthread_create(&actions.thread, NULL, actions_main, NULL);
+    if (ret != 0) {
+        die("Cannot start action thread: %s\n", strerror(ret));
+    }
+    actions.started = true;
+}
+
+/* Identifies an action across reloads. The cooldown may change under it. */
+static uint64_t action_key(const Action *action) {
+    return hash_buf(action->path, strlen(action->path)) ^
+           hash_buf(action->arg, strlen(action->arg)) * 31 ^
+           ((uint64_t)action->resource << 8 | (uint64_t)action->kind);
+}
+
+/*
+ * Called at startup and after each config reload. Actions which are still
+ * there carry on as they were, so a reload neither undoes them nor skips their
+ * cooldown. Anything else applied is undone.
+ */
+static void actions_apply_config(void) {
+    uint32_t applied_id[ACTIONS_MAX] = {0};
+    uint64_t last_usec[ACTIONS_MAX] = {0};
+    bool carried[ACTIONS_MAX] = {false};
+    size_t i, j;
+
+    for (i = 0; i < cfg.nr_actions; i++) {
+        const uint64_t key = action_key(&cfg.actions[i]);
+
+        for (j = 0; j < actions.nr_keys; j++) {
+            if (!carried[j] && actions.keys[j] == key) {
+                carried[j] = true;
+                applied_id[i] = actions.applied_id[j];
+                last_usec[i] = actions.last_usec[j];
+                actions.applied_id[j] = 0;
+                break;
+            }
+        }
+    }
+
+    actions_undo_all();
+    for (i = 0; i < cfg.nr_actions; i++) {
+        actions.applied_id[i] = applied_id[i];
+        actions.last_usec[i] = last_usec[i];
+        actions.keys[i] = action_key(&cfg.actions[i]);
+    }
+    actions.nr_keys = cfg.nr_actions;
+
+    if (cfg.nr_actions > 0 && !actions.started) {
+        actions_start();
+    }
+
+    for_each_arr(i, all_res) {
+        if (active_notif[i].last_state == A_ACTIVE) {
+            actions_transition(all_res[i], A_INACTIVE, A_ACTIVE);
+        }
+    }
+}
+
+/* Puts back everything still applied, we shouldn't leave a cgroup frozen. */
+static void actions_stop(void) {
+    if (!actions.started) {
+        return;
+    }
+
+    actions_undo_all();
+    /* Spin until there's room, we're exiting anyway. */
+    while (actions.nr_pending > 0) {
+        actions_flush();
+        sched_yield();
+    }
+    while (!actions_reserve(ACTION_STOP, 0)) {
+        sched_yield();
+    }
+    actions_commit();
+
+    expect(pthread_join(actions.thread, NULL) == 0);
+    close(actions.event_fd);
+    actions.event_fd = -1;
+    actions.started = false;
+}
+
+/*
+ * --notify-helper, see SeatHelper. Shows and closes what it's sent until the
+ * socket on stdin is closed, then closes anything still up.
+ */
+static int notify_helper_main(void) {
+    NotifyRequest req;
+    ssize_t len;
+
+    expect(notify_init("psi-notify"));
+
+    while ((len = recv(STDIN_FILENO, &req, sizeof(req), 0)) != 0) {
+        if (len < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            warn("Cannot read notification requests: %s\n", strerror(errno));
+            break;
+        }
+        if ((size_t)len == sizeof(req) &&
+            (req.op == NOTIFY_SHOW || req.op == NOTIFY_CLOSE)) {
+            sender_handle(&req);
+        }
+    }
+
+    while (sender.nr_live > 0) {
+        notification_destroy(sender.live[--sender.nr_live].n);
+    }
+    free(sender.live);
+    notify_uninit();
+    return 0;
+}
+
+/* Seats are named user-<uid>.slice, see get_seat_cgroup_path(). */
+static bool seat_uid(const char *cgroup, uid_t *uid) {
+    unsigned int val;
+    int end = 0;
+
+    if (sscanf(cgroup, "user-%u.slice%n", &val, &end) != 1 ||
+        cgroup[end] != '\0') {
+        return false;
+    }
+    *uid = (uid_t)val;
+    return true;
+}
+
+/*
+ * Returns the id to later close it with, or 0 if there's nobody to show it
+ * to. In system mode, only seat alerts have someone to go to. eta_sec is -1,
+ * or for an early warning, when a threshold is predicted to be passed.
+ */
+static uint32_t alert_user(const char *resource, const char *cgroup,
+                           const char *culprits, double eta_sec) {
+    NotifyRequest req = {.op = NOTIFY_SHOW};
+    char eta[64] = "";
+    uid_t uid = 0;
+    uint32_t id;
+
+    if (replay.active) {
+        return 0;
+    }
+
+    if (system_mode) {
+        if (!cgroup || !seat_uid(cgroup, &uid)) {
+            return 0;
+        }
+        cgroup = NULL; /* It's their own seat, like without system mode */
+    } else {
+        expect(notify_is_initted());
+    }
+
+    id = ++sender.next_id;
+    if (id == 0) {
+        id = ++sender.next_id;
+    }
+
+    req.id = id;
+    req.uid = uid;
+    req.queued_usec = now_usec();
+
+    if (eta_sec >= 0) {
+        snprintf_check(eta, sizeof(eta),
+                       "Likely to pass its threshold in %.0fs. ", eta_sec);
+    }
+    snprintf_check(req.title, TITLE_MAX, "%s %s pressure!",
+                   eta_sec >= 0 ? "Rising" : "High", resource);
+    snprintf_check(req.body,
+                   BODY_MAX,
+                   "%s%s%s%s%sConsider reducing demand on this resource.",
+                   cgroup ? "In " : "",
+                   cgroup ? cgroup : "",
+                   cgroup ? ". " : "",
+                   eta,
+                   culprits);
+    sender_push(&req);
+
+    return id;
+}
+
+static void alert_destroy(uint32_t id) { sender_close(id); }
+
+#define LOG_ALERT_STATE(name, cgroup, state)                                   \
+    do {                                                                       \
+        expect(*name);                                                         \
+        if (!replay.active) {                                                  \
+            info("%c%s alert%s%s: %s\n",                                       \
+                 toupper(name[0]),                                             \
+                 name + 1,                                                     \
+                 cgroup ? " in " : "",                                         \
+                 cgroup ? cgroup : "",                                         \
+                 state);                                                       \
+        }                                                                      \
+    } while (0)
+
+/*
+ * A small pool of threads to spread sampling over when there's a lot of it to
+ * do, like in container host mode with thousands of cgroups. Work is split
+ * into one contiguous slice per thread, and the calling thread takes a slice
+ * too.
+ */
+#define WORKERS_MAX 4
+#define WORKERS_MIN_ITEMS 1024 /* Threads cost more than they save below this */
+
+typedef void (*WorkFn)(size_t start, size_t end, void *arg);
+
+static struct {
+    pthread_t threads[WORKERS_MAX];
+    size_t nr;
+    bool started;
+    bool stopping;
+    pthread_mutex_t lock;
+    pthread_cond_t start_cond;
+    pthread_cond_t done_cond;
+    uint64_t generation;
+    size_t pending;
+    WorkFn fn;
+    void *arg;
+    size_t items;
+} workers = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .start_cond = PTHREAD_COND_INITIALIZER,
+    .done_cond = PTHREAD_COND_INITIALIZER,
+};
+
+static void workers_slice(size_t idx, size_t items, size_t *start,
+                          size_t *end) {
+    const size_t parts = workers.nr + 1;
+    *start = items * idx / parts;
+    *end = items * (idx + 1) / parts;
+}
+
+static void *worker_main(void *arg) {
+    const size_t idx = (size_t)(uintptr_t)arg;
+    uint64_t seen = 0;
+
+    for (;;) {
+        size_t start, end;
+
+        expect(pthread_mutex_lock(&workers.lock) == 0);
+        while (workers.generation == seen && !workers.stopping) {
+            expect(pthread_cond_wait(&workers.start_cond, &workers.lock) == 0);
+        }
+        if (workers.stopping) {
+            expect(pthread_mutex_unlock(&workers.lock) == 0);
+            return NULL;
+        }
+        seen = workers.generation;
+        expect(pthread_mutex_unlock(&workers.lock) == 0);
+
+        workers_slice(idx, workers.items, &start, &end);
+        workers.fn(start, end, workers.arg);
+
+        expect(pthread_mutex_lock(&workers.lock) == 0);
+        if (--workers.pending == 0) {
+            expect(pthread_cond_signal(&workers.done_cond) == 0);
+        }
+        expect(pthread_mutex_unlock(&workers.lock) == 0);
+    }
+}
+
+/* Must be called with all signals blocked, so only we get them. */
+static void workers_start(void) {
+    long nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t want = nr_cpus > 1 ? (size_t)nr_cpus - 1 : 0;
+
+    workers.started = true;
+
+    if (want > WORKERS_MAX) {
+        want = WORKERS_MAX;
+    }
+
+    while (workers.nr < want) {
+        int ret = pthread_create(&workers.threads[workers.nr],
+                                 NULL,
+                                 worker_main,
+                                 (void *)(uintptr_t)(workers.nr + 1));
+        if (ret != 0) {
+            warn("Cannot start worker thread: %s\n", strerror(ret));
+            break;
+        }
+        workers.nr++;
+    }
+}
+
+static void workers_stop(void) {
+    size_t i;
+
+    expect(pthread_mutex_lock(&workers.lock) == 0);
+    workers.stopping = true;
+    expect(pthread_cond_broadcast(&workers.start_cond) == 0);
+    expect(pthread_mutex_unlock(&workers.lock) == 0);
+
+    for (i = 0; i < workers.nr; i++) {
+        expect(pthread_join(workers.threads[i], NULL) == 0);
+    }
+
+    workers.nr = 0;
+    workers.started = false;
+    workers.stopping = false;
+}
+
+/* min_items is where the work is worth spreading, usually WORKERS_MIN_ITEMS */
+static void workers_run(WorkFn fn, void *arg, size_t items, size_t min_items) {
+    size_t start, end;
+
+    if (items >= min_items && !workers.started) {
+        workers_start();
+    }
+
+    if (items < min_items || workers.nr == 0) {
+        fn(0, items, arg);
+        return;
+    }
+
+    expect(pthread_mutex_lock(&workers.lock) == 0);
+    workers.fn = fn;
+    workers.arg = arg;
+    workers.items = items;
+    workers.pending = workers.nr;
+    workers.generation++;
+    expect(pthread_cond_broadcast(&workers.start_cond) == 0);
+    expect(pthread_mutex_unlock(&workers.lock) == 0);
+
+    workers_slice(0, items, &start, &end);
+    fn(start, end, arg);
+
+    expect(pthread_mutex_lock(&workers.lock) == 0);
+    while (workers.pending > 0) {
+        expect(pthread_cond_wait(&workers.done_cond, &workers.lock) == 0);
+    }
+    expect(pthread_mutex_unlock(&workers.lock) == 0);
+}
+
+/*
+ * Container host mode. With cgroup_root set, every cgroup below it is
+ * monitored as well, each with its own alert state. Everything is kept in
+ * flat arrays indexed by cgroup, so that a tick is a tight loop of pread()s,
+ * and cgroups coming and going are found with inotify rather than by
+ * rescanning the tree.
+ */
+static CgroupSet cgroups = {.root_fd = -1, .inotify_fd = -1, .root_wd = -1};
+
+/*
+ * In system mode, every user's seat, sampled together by one instance rather
+ * than one per user. Alerts go to the seat's owner, see alert_user().
+ */
+#define SEATS_ROOT "/sys/fs/cgroup/user.slice"
+static CgroupSet seats = {.root_fd = -1,
+                          .inotify_fd = -1,
+                          .root_wd = -1,
+                          .match = "user-*.slice"};
+
+static const char *const cgroup_pressure_files[] = {
+    [RT_CPU] = "cpu.pressure",
+    [RT_MEMORY] = "memory.pressure",
+    [RT_IO] = "io.pressure",
+};
+
+/* 0 is the global thresholds, otherwise index + 1 into cfg.cgroup_profiles */
+static uint16_t cgroup_profile_match(const char *path) {
+    size_t i;
+    for (i = 0; i < cfg.nr_cgroup_profiles; i++) {
+        if (fnmatch(cfg.cgroup_profiles[i].pattern, path, 0) == 0) {
+            return (uint16_t)(i + 1);
+        }
+    }
+    return 0;
+}
+
+static const Pressure *cgroup_thresholds(uint16_t profile, ResourceType rt) {
+    if (profile == 0) {
+        return &all_res[rt]->thresholds;
+    }
+    return &cfg.cgroup_profiles[profile - 1].thresholds[rt];
+}
+
+#define CGROUPS_INITIAL_CAP 64
+
+/*
+ * Inotify events and rescans look cgroups up by wd and by path, which with
+ * thousands of them can't be a walk over the arrays. Both indexes are linear
+ * probing tables of idx + 1 with 2 * cap slots, so they never fill up, and cap
+ * is always a power of two.
+ */
+static size_t cgroups_wd_hash(int wd) {
+    return (size_t)(((uint64_t)(uint32_t)wd * 0x9e3779b97f4a7c15ULL) >> 32);
+}
+
+static size_t cgroups_path_hash(const char *path) {
+    return (size_t)hash_buf(path, strlen(path));
+}
+
+static size_t cgroups_index_hash(const CgroupSet *set, const size_t *index,
+                                 size_t idx) {
+    return index == set->wd_index ? cgroups_wd_hash(set->wds[idx])
+                                  : cgroups_path_hash(set->paths[idx]);
+}
+
+static void cgroups_index_insert(CgroupSet *set, size_t *index, size_t idx) {
+    size_t mask = set->cap * 2 - 1;
+    size_t pos = cgroups_index_hash(set, index, idx) & mask;
+
+    while (index[pos]) {
+        pos = (pos + 1) & mask;
+    }
+    index[pos] = idx + 1;
+}
+
+/* Where idx is in the index, it must be there. */
+static size_t cgroups_index_pos(const CgroupSet *set, const size_t *index,
+                                size_t idx) {
+    size_t mask = set->cap * 2 - 1;
+    size_t pos = cgroups_index_hash(set, index, idx) & mask;
+
+    while (index[pos] != idx + 1) {
+        expect(index[pos]);
+        pos = (pos + 1) & mask;
+    }
+    return pos;
+}
+
+/* Shifts later entries back into the hole, so lookups need no tombstones. */
+static void cgroups_index_delete(CgroupSet *set, size_t *index, size_t idx) {
+    size_t mask = set->cap * 2 - 1;
+    size_t hole = cgroups_index_pos(set, index, idx), pos = hole;
+
+    for (pos = (pos + 1) & mask; index[pos]; pos = (pos + 1) & mask) {
+        size_t home = cgroups_index_hash(set, index, index[pos] - 1) & mask;
+        /* It can move back unless its home is between the hole and it */
+        if (((pos - home) & mask) >= ((pos - hole) & mask)) {
+            index[hole] = index[pos];
+            hole = pos;
+        }
+    }
+    index[hole] = 0;
+}
+
+static void cgroups_index_rebuild(CgroupSet *set) {
+    size_t i;
+
+    free(set->wd_index);
+    free(set->path_index);
+    set->wd_index = calloc(set->cap * 2, sizeof(*set->wd_index));
+    set->path_index = calloc(set->cap * 2, sizeof(*set->path_index));
+    expect(set->wd_index && set->path_index);
+
+    for (i = 0; i < set->nr; i++) {
+        cgroups_index_insert(set, set->path_index, i);
+        if (set->wds[i] >= 0) {
+            cgroups_index_insert(set, set->wd_index, i);
+        }
+    }
+}
+
+static void cgroups_grow(CgroupSet *set) {
+    size_t cap = set->cap ? set->cap * 2 : CGROUPS_INITIAL_CAP;
+    size_t rt;
+
+#define CGROUPS_REALLOC(field)                                                 \
+    do {                                                                       \
+        void *tmp = realloc(field, cap * sizeof(*(field)));                    \
+        expect(tmp);                                                           \
+        field = tmp;                                                           \
+    } while (0)
+
+    CGROUPS_REALLOC(set->paths);
+    CGROUPS_REALLOC(set->wds);
+    CGROUPS_REALLOC(set->profiles);
+    CGROUPS_REALLOC(set->threads_fds);
+    CGROUPS_REALLOC(set->procs_fds);
+    CGROUPS_REALLOC(set->tasks);
+    for (rt = 0; rt < NR_RESOURCES; rt++) {
+        CGROUPS_REALLOC(set->fds[rt]);
+        CGROUPS_REALLOC(set->alerts[rt]);
+        CGROUPS_REALLOC(set->next[rt]);
+        CGROUPS_REALLOC(set->totals[rt]);
+        CGROUPS_REALLOC(set->deltas[rt]);
+    }
+
+#undef CGROUPS_REALLOC
+
+    set->cap = cap;
+    cgroups_index_rebuild(set);
+}
+
+static ssize_t cgroups_find_wd(const CgroupSet *set, int wd) {
+    size_t mask = set->cap * 2 - 1, pos;
+
+    if (!set->cap) {
+        return -1;
+    }
+
+    for (pos = cgroups_wd_hash(wd) & mask; set->wd_index[pos];
+         pos = (pos + 1) & mask) {
+        size_t idx = set->wd_index[pos] - 1;
+        if (set->wds[idx] == wd) {
+            return (ssize_t)idx;
+        }
+    }
+    return -1;
+}
+
+static ssize_t cgroups_find_path(const CgroupSet *set, const char *path) {
+    size_t mask = set->cap * 2 - 1, pos;
+
+    if (!set->cap) {
+        return -1;
+    }
+
+    for (pos = cgroups_path_hash(path) & mask; set->path_index[pos];
+         pos = (pos + 1) & mask) {
+        size_t idx = set->path_index[pos] - 1;
+        if (streq(set->paths[idx], path)) {
+            return (ssize_t)idx;
+        }
+    }
+    return -1;
+}
+
+static void cgroups_watch(CgroupSet *set, size_t idx) {
+    char abs_path[PATH_MAX];
+
+    if (set->inotify_fd < 0) {
+        set->wds[idx] = -1;
+        return;
+    }
+
+    snprintf_check(
+        abs_path, sizeof(abs_path), "%s/%s", set->root_path, set->paths[idx]);
+    /* With match, children are only watched to know when they go away. */
+    set->wds[idx] = inotify_add_watch(
+        set->inotify_fd,
+        abs_path,
+        (set->match ? IN_DELETE_SELF : IN_CREATE) | IN_ONLYDIR |
+            IN_EXCL_UNLINK);
+    if (set->wds[idx] >= 0) {
+        cgroups_index_insert(set, set->wd_index, idx);
+    } else if (!set->watch_warned) {
+        /* Most likely ENOSPC from fs.inotify.max_user_watches */
+        warn("Cannot watch %s for new cgroups: %s\n",
+             abs_path,
+             strerror(errno));
+        set->watch_warned = true;
+    }
+}
+
+static ssize_t cgroups_add(CgroupSet *set, const char *path) {
+    size_t idx, rt;
+    int dir_fd;
+
+    dir_fd = openat(set->root_fd, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd < 0) {
+        /* Raced with removal, nothing to do. */
+        return -errno;
+    }
+
+    if (set->nr == set->cap) {
+        cgroups_grow(set);
+    }
+
+    idx = set->nr++;
+    set->paths[idx] = strdup(path);
+    expect(set->paths[idx]);
+    cgroups_index_insert(set, set->path_index, idx);
+    set->profiles[idx] = cgroup_profile_match(path);
+
+    for (rt = 0; rt < NR_RESOURCES; rt++) {
+        set->fds[rt][idx] = openat(
+            dir_fd, cgroup_pressure_files[rt], O_RDONLY | O_CLOEXEC);
+        set->alerts[rt][idx] = (Alert)DEFAULT_ALERT_STATE;
+        set->next[rt][idx] = A_INACTIVE;
+        set->totals[rt][idx] = UINT64_MAX;
+        set->deltas[rt][idx] = 0;
+    }
+
+    set->threads_fds[idx] =
+        set->track_tasks
+            ? openat(dir_fd, "cgroup.threads", O_RDONLY | O_CLOEXEC)
+            : -1;
+    set->procs_fds[idx] =
+        set->track_tasks
+            ? openat(dir_fd, "cgroup.procs", O_RDONLY | O_CLOEXEC)
+            : -1;
+    set->tasks[idx] = (TaskList){0};
+
+    close(dir_fd);
+    cgroups_watch(set, idx);
+
+    return (ssize_t)idx;
+}
+
+static void cgroups_remove(CgroupSet *set, size_t idx) {
+    size_t last = set->nr - 1, rt;
+
+    for (rt = 0; rt < NR_RESOURCES; rt++) {
+        Alert *a = &set->alerts[rt][idx];
+        if (a->last_state != A_INACTIVE) {
+            LOG_ALERT_STATE(all_res[rt]->human_name, set->paths[idx], "gone");
+        }
+        if (a->notif_id) {
+            alert_destroy(a->notif_id);
+        }
+        if (set->fds[rt][idx] >= 0) {
+            close(set->fds[rt][idx]);
+            read_batch_forget_fds();
+        }
+    }
+
+    if (set->wds[idx] >= 0) {
+        /* Might already be gone with IN_IGNORED, that's fine */
+        (void)inotify_rm_watch(set->inotify_fd, set->wds[idx]);
+        cgroups_index_delete(set, set->wd_index, idx);
+    }
+    cgroups_index_delete(set, set->path_index, idx);
+
+    if (set->threads_fds[idx] >= 0) {
+        close(set->threads_fds[idx]);
+    }
+    if (set->procs_fds[idx] >= 0) {
+        close(set->procs_fds[idx]);
+    }
+    task_list_destroy(&set->tasks[idx]);
+    free(set->paths[idx]);
+
+    /* Keep the arrays dense by moving the last cgroup into the hole. */
+    if (idx != last) {
+        set->path_index[cgroups_index_pos(set, set->path_index, last)] =
+            idx + 1;
+        if (set->wds[last] >= 0) {
+            set->wd_index[cgroups_index_pos(set, set->wd_index, last)] =
+                idx + 1;
+        }
+    }
+    set->paths[idx] = set->paths[last];
+    set->wds[idx] = set->wds[last];
+    set->profiles[idx] = set->profiles[last];
+    set->threads_fds[idx] = set->threads_fds[last];
+    set->procs_fds[idx] = set->procs_fds[last];
+    set->tasks[idx] = set->tasks[last];
+    for (rt = 0; rt < NR_RESOURCES; rt++) {
+        set->fds[rt][idx] = set->fds[rt][last];
+        set->alerts[rt][idx] = set->alerts[rt][last];
+        set->next[rt][idx] = set->next[rt][last];
+        set->totals[rt][idx] = set->totals[rt][last];
+        set->deltas[rt][idx] = set->deltas[rt][last];
+    }
+
+    set->nr--;
+    /* Cgroups moved, so this tick's batched reads are no longer theirs */
+    set->batch_nr = 0;
+}
+
+/* Adds every cgroup below path (relative to the root, "." for the root). */
+static void cgroups_scan(CgroupSet *set, const char *path, bool check_dup) {
+    struct dirent *ent;
+    DIR *dir;
+    int dir_fd;
+
+    dir_fd = openat(set->root_fd, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd < 0) {
+        return;
+    }
+
+    dir = fdopendir(dir_fd);
+    expect(dir);
+
+    while ((ent = readdir(dir))) {
+        char child[PATH_MAX];
+
+        if (ent->d_type != DT_DIR || streq(ent->d_name, ".") ||
+            streq(ent->d_name, "..") ||
+            (set->match && fnmatch(set->match, ent->d_name, 0) != 0)) {
+            continue;
+        }
+
+        if (streq(path, ".")) {
+            snprintf_check(child, sizeof(child), "%s", ent->d_name);
+        } else {
+            snprintf_check(child, sizeof(child), "%s/%s", path, ent->d_name);
+        }
+
+        /* Already known ones might still have new children */
+        if (((check_dup && cgroups_find_path(set, child) >= 0) ||
+             cgroups_add(set, child) >= 0) &&
+            !set->match) {
+            cgroups_scan(set, child, check_dup);
+        }
+    }
+
+    closedir(dir);
+}
+
+static void cgroups_destroy(CgroupSet *set) {
+    const bool track_tasks = set->track_tasks;
+    const char *match = set->match;
+    size_t rt;
+
+    while (set->nr > 0) {
+        cgroups_remove(set, set->nr - 1);
+    }
+
+    free(set->paths);
+    free(set->wds);
+    free(set->wd_index);
+    free(set->path_index);
+    free(set->profiles);
+    free(set->threads_fds);
+    free(set->procs_fds);
+    free(set->tasks);
+    for (rt = 0; rt < NR_RESOURCES; rt++) {
+        free(set->fds[rt]);
+        free(set->alerts[rt]);
+        free(set->next[rt]);
+        free(set->totals[rt]);
+        free(set->deltas[rt]);
+    }
+
+    if (set->inotify_fd >= 0) {
+        close(set->inotify_fd);
+    }
+    if (set->root_fd >= 0) {
+        close(set->root_fd);
+    }
+
+    *set = (CgroupSet){.root_fd = -1,
+                       .inotify_fd = -1,
+                       .root_wd = -1,
+                       .track_tasks = track_tasks,
+                       .match = match};
+}
+
+static void alert_destroy_all_active(void) {
+    CgroupSet *const sets[] = {&cgroups, &seats};
+    size_t i, j;
+    ResourceType rt;
+
+    for_each_arr(i, active_notif) {
+        if (active_notif[i].notif_id) {
+            uint32_t id = active_notif[i].notif_id;
+            active_notif[i].notif_id = 0;
+            alert_destroy(id);
+        }
+    }
+    for_each_arr(i, rule_alerts) {
+        if (rule_alerts[i].notif_id) {
+            uint32_t id = rule_alerts[i].notif_id;
+            rule_alerts[i].notif_id = 0;
+            alert_destroy(id);
+        }
+    }
+    for_each_arr(j, sets) {
+        for (rt = RT_CPU; rt < NR_RESOURCES; rt++) {
+            for (i = 0; i < sets[j]->nr; i++) {
+                Alert *a = &sets[j]->alerts[rt][i];
+                if (a->notif_id) {
+                    uint32_t id = a->notif_id;
+                    a->notif_id = 0;
+                    alert_destroy(id);
+                }
+            }
+        }
+    }
+}
+
+static int cgroups_init(CgroupSet *set, const char *root) {
+    struct rlimit rl;
+
+    expect(set->root_fd < 0);
+
+    set->root_fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (set->root_fd < 0) {
+        int ret = -errno;
+        warn("Cannot open cgroup root %s: %s\n", root, strerror(errno));
+        return ret;
+    }
+    snprintf_check(set->root_path, sizeof(set->root_path), "%s", root);
+
+    /* Each cgroup needs 3 fds, so we will need more than the default 1024. */
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        (void)setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    set->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (set->inotify_fd < 0) {
+        warn("Cannot watch for new cgroups, only using existing ones: %s\n",
+             strerror(errno));
+    } else {
+        set->root_wd = inotify_add_watch(
+            set->inotify_fd, root, IN_CREATE | IN_ONLYDIR | IN_EXCL_UNLINK);
+    }
+
+    cgroups_scan(set, ".", false);
+    return 0;
+}
+
+/*
+ * After missed events, drops what's gone and adds what's new. Everything else
+ * keeps its alerts, so nothing still under pressure alerts again.
+ */
+static void cgroups_rescan(CgroupSet *set) {
+    size_t i;
+
+    /* Backwards, since removal moves the last cgroup into the hole */
+    for (i = set->nr; i > 0; i--) {
+        struct stat st;
+        if (fstatat(set->root_fd, set->paths[i - 1], &st,
+                    AT_SYMLINK_NOFOLLOW) < 0 &&
+            errno == ENOENT) {
+            if (set->match) {
+                info("No longer monitoring %s.\n", set->paths[i - 1]);
+            }
+            cgroups_remove(set, i - 1);
+        }
+    }
+
+    cgroups_scan(set, ".", true);
+}
+
+static void cgroups_handle_event(CgroupSet *set,
+                                 const struct inotify_event *ev) {
+    ssize_t idx;
+
+    if (ev->mask & IN_Q_OVERFLOW) {
+        warn("%s\n", "Missed cgroup events, rescanning the cgroup root");
+        cgroups_rescan(set);
+        return;
+    }
+
+    if (ev->wd == set->root_wd) {
+        idx = -1;
+    } else {
+        idx = cgroups_find_wd(set, ev->wd);
+        if (idx < 0) {
+            return;
+        }
+    }
+
+    if (ev->mask & IN_IGNORED) {
+        /* The watch went away, which means the cgroup was removed. */
+        if (idx >= 0) {
+            if (set->match) {
+                info("No longer monitoring %s.\n", set->paths[idx]);
+            }
+            cgroups_index_delete(set, set->wd_index, (size_t)idx);
+            set->wds[idx] = -1;
+            cgroups_remove(set, (size_t)idx);
+        }
+    } else if ((ev->mask & IN_CREATE) && (ev->mask & IN_ISDIR) && ev->len) {
+        char child[PATH_MAX];
+
+        if (set->match &&
+            (idx >= 0 || fnmatch(set->match, ev->name, 0) != 0)) {
+            return;
+        }
+
+        if (idx < 0) {
+            snprintf_check(child, sizeof(child), "%s", ev->name);
+        } else {
+            snprintf_check(
+                child, sizeof(child), "%s/%s", set->paths[idx], ev->name);
+        }
+
+        /* We might have already found it while scanning its parent. */
+        if (cgroups_find_path(set, child) >= 0 ||
+            cgroups_add(set, child) < 0) {
+            return;
+        }
+
+        if (set->match) {
+            info("Now monitoring %s.\n", child);
+        } else {
+            cgroups_scan(set, child, true);
+        }
+    }
+}
+
+#define INOTIFY_BUF_LEN 65536
+
+static void cgroups_process_events(CgroupSet *set) {
+    static char buf[INOTIFY_BUF_LEN]
+        __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    while (set->inotify_fd >= 0) {
+        ssize_t len = read(set->inotify_fd, buf, sizeof(buf));
+        char *ptr;
+
+        if (len <= 0) {
+            expect(len == 0 || errno == EAGAIN || errno == EINTR);
+            return;
+        }
+
+        for (ptr = buf; ptr < buf + len;) {
+            const struct inotify_event *ev = (struct inotify_event *)ptr;
+            ptr += sizeof(struct inotify_event) + ev->len;
+            cgroups_handle_event(set, ev);
+        }
+    }
+}
+
+/* What the read_batch read for a cgroup this tick, or -errno. */
+static ssize_t cgroup_batched_read(const CgroupSet *set, size_t idx,
+                                   ResourceType rt, const char **buf) {
+    if (idx >= set->batch_nr) {
+        return -EAGAIN;
+    }
+    return read_batch_take(set->batch_base + idx * NR_RESOURCES + rt, buf);
+}
+
+static AlertState cgroup_check_single(const CgroupSet *set, size_t idx,
+                                      ResourceType rt) {
+    char buf[PRESSURE_BUF_LEN];
+    const char *text = buf;
+    const Pressure *t;
+    PressureSample sample;
+    AlertState ret;
+    ssize_t len;
+    int found;
+
+    if (set->fds[rt][idx] < 0) {
+        return A_INACTIVE;
+    }
+
+    if (cgroup_batched_read(set, idx, rt, &text) < 0) {
+        len = pread(set->fds[rt][idx], buf, sizeof(buf) - 1, 0);
+        if (len < 0) {
+            /* Probably removed, inotify will tell us soon. */
+            return A_ERROR;
+        }
+        buf[len] = '\0';
+        text = buf;
+    }
+
+    found = parse_pressures(text, &sample);
+    if (found < 0 || !(found & PRESSURE_HAS_SOME)) {
+        return A_ERROR;
+    }
+
+    t = cgroup_thresholds(set->profiles[idx], rt);
+    ret = thresholds_state(t, &sample.some, false);
+    if (ret == A_INACTIVE && all_res[rt]->has_full &&
+        (found & PRESSURE_HAS_FULL)) {
+        ret = thresholds_state(t, &sample.full, true);
+    }
+
+    return ret;
+}
+
+/* Runs on worker threads, so only touches this slice of the arrays. */
+static void cgroups_sample_range(size_t start, size_t end, void *arg) {
+    CgroupSet *set = arg;
+    size_t i;
+    ResourceType rt;
+
+    for (i = start; i < end; i++) {
+        for (rt = RT_CPU; rt < NR_RESOURCES; rt++) {
+            set->next[rt][i] = cgroup_check_single(set, i, rt);
+        }
+    }
+}
+
+/*
+ * Culprit attribution. When a seat alert fires, the notification names the
+ * units under the seat which stalled the most since the last sample, so there
+ * is no need to go digging through systemd-cgtop while the machine is
+ * thrashing. The seat's cgroups are tracked with a CgroupSet too, so fds stay
+ * open and the tree is only updated incrementally through inotify: finding the
+ * culprits costs one pread() per unit and no allocations.
+ */
+#define CULPRITS_TOP 3
+#define CULPRITS_DESC_MAX 256
+
+static const char *cgroup_basename(const char *path) {
+    const char *slash = strrchr(path, '/');
+    return slash ? slash + 1 : path;
+}
+
+/*
+ * Only units are interesting, and not user@.service itself, since that's the
+ * parent of nearly everything and would always be top.
+ */
+static bool cgroup_is_culprit_candidate(const char *path) {
+    const char *name = cgroup_basename(path);
+    return (fnmatch("*.scope", name, 0) == 0 ||
+            fnmatch("*.service", name, 0) == 0) &&
+           fnmatch("user@*", name, 0) != 0;
+}
+
+/* Records how much each cgroup stalled on rt since the last call. */
+static void culprits_sample(CgroupSet *set, ResourceType rt) {
+    uint64_t now = now_usec();
+    size_t i;
+
+    if (set->root_fd < 0) {
+        return;
+    }
+
+    cgroups_process_events(set);
+
+    for (i = 0; i < set->nr; i++) {
+        char buf[PRESSURE_BUF_LEN];
+        const char *text = buf;
+        PressureSample sample;
+        ssize_t len;
+
+        set->deltas[rt][i] = 0;
+
+        if (set->fds[rt][i] < 0 ||
+            !cgroup_is_culprit_candidate(set->paths[i])) {
+            continue;
+        }
+
+        if (cgroup_batched_read(set, i, rt, &text) < 0) {
+            len = pread(set->fds[rt][i], buf, sizeof(buf) - 1, 0);
+            if (len < 0) {
+                continue;
+            }
+            buf[len] = '\0';
+            text = buf;
+        }
+
+        if (parse_pressures(text, &sample) < 0) {
+            continue;
+        }
+
+        /* New cgroups have no baseline yet, so can't be blamed this time. */
+        if (set->totals[rt][i] != UINT64_MAX &&
+            sample.some.total >= set->totals[rt][i]) {
+            set->deltas[rt][i] = sample.some.total - set->totals[rt][i];
+        }
+        set->totals[rt][i] = sample.some.total;
+    }
+
+    set->elapsed_usec[rt] =
+        set->sampled_usec[rt] ? now - set->sampled_usec[rt] : 0;
+    set->sampled_usec[rt] = now;
+}
+
+/* Fills top with up to CULPRITS_TOP indexes, biggest stall first. */
+static size_t culprits_find(const CgroupSet *set, ResourceType rt,
+                            size_t *top) {
+    size_t i, nr = 0;
+
+    for (i = 0; i < set->nr; i++) {
+        size_t pos;
+
+        if (set->deltas[rt][i] == 0) {
+            continue;
+        }
+
+        for (pos = nr; pos > 0; pos--) {
+            if (set->deltas[rt][top[pos - 1]] >= set->deltas[rt][i]) {
+                break;
+            }
+            if (pos < CULPRITS_TOP) {
+                top[pos] = top[pos - 1];
+            }
+        }
+
+        if (pos < CULPRITS_TOP) {
+            top[pos] = i;
+            if (nr < CULPRITS_TOP) {
+                nr++;
+            }
+        }
+    }
+
+    return nr;
+}
+
+static void culprits_describe(const CgroupSet *set, const Resource *r,
+                              char *buf, size_t len) {
+    char list[CULPRITS_DESC_MAX] = "";
+    size_t top[CULPRITS_TOP], nr, i, off = 0;
+    const uint64_t elapsed = set->elapsed_usec[r->type];
+
+    if (set->root_fd < 0 || elapsed == 0) {
+        return;
+    }
+
+    nr = culprits_find(set, r->type, top);
+    if (nr == 0) {
+        return;
+    }
+
+    for (i = 0; i < nr && off < sizeof(list); i++) {
+        int ret = snprintf(list + off,
+                           sizeof(list) - off,
+                           "%s%s (%.0f%%)",
+                           i ? ", " : "",
+                           cgroup_basename(set->paths[top[i]]),
+                           stall_pct(0, set->deltas[r->type][top[i]], elapsed));
+        expect(ret >= 0);
+        off += (size_t)ret;
+    }
+
+    info("Most %s stalled since last check: %s\n", r->human_name, list);
+    snprintf(buf, len, "Most stalled: %s. ", list);
+}
+
+/*
+ * Per-process attribution, for memory and I/O alerts on the seat. Culprit
+ * units say where the stall is, but a unit can be a whole browser or IDE, so
+ * the processes in the seat which waited the longest are named too. That comes
+ * from delay accounting through taskstats, which needs CAP_NET_ADMIN and
+ * kernel.task_delayacct=1. The processes are queried in batches of messages
+ * per send(), and only while a memory or I/O alert is close or active, since
+ * otherwise nobody will ask. Baselines older than a few updates are thrown
+ * away, since pids may have been reused since and the deltas would span hours.
+ * Everything is sized up front, so sampling never allocates, see
+ * procstall_init() and procstall_describe().
+ */
+#define PROCSTALL_MAX 4096  /* Processes, more in a seat aren't looked at */
+#define PROCSTALL_BATCH 32  /* Requests per send(), replies are ~400 bytes */
+#define PROCSTALL_TOP 3
+#define PROCSTALL_DESC_MAX 256
+#define PROCSTALL_RECV_LEN 65536
+#define PROCSTALL_STALE_UPDATES 3
+
+/* NLA_ALIGN() and NLA_HDRLEN, but unsigned. NLA_ALIGNTO is 4. */
+#define NLA_ALIGN_U(len) (((size_t)(len) + 3) & ~(size_t)3)
+#define NLA_HDRLEN_U NLA_ALIGN_U(sizeof(struct nlattr))
+
+static struct {
+    int fd; /* NETLINK_GENERIC, or -1 */
+    bool unavailable;
+    uint16_t family;
+    uint32_t seq;
+    ProcStall *procs; /* Sorted by tgid, room for PROCSTALL_MAX */
+    ProcStall *next;  /* Where the next list is built, likewise */
+    pid_t *tgids;     /* Scratch for sorting, likewise */
+    size_t nr;
+    uint64_t sampled_check; /* stats.checks when last sampled, + 1 */
+    uint64_t sampled_usec;
+    uint64_t elapsed_usec;
+} procstall = {.fd = -1};
+
+static void procstall_close(void) {
+    if (procstall.fd >= 0) {
+        close(procstall.fd);
+    }
+    free(procstall.procs);
+    free(procstall.next);
+    free(procstall.tgids);
+    procstall.procs = procstall.next = NULL;
+    procstall.tgids = NULL;
+    procstall.fd = -1;
+    procstall.nr = 0;
+    procstall.sampled_check = procstall.sampled_usec = 0;
+}
+
+static void procstall_disable(const char *why) {
+    warn("Cannot name stalled processes, %s\n", why);
+    procstall_close();
+    procstall.unavailable = true;
+}
+
+static struct nlattr *nla_next(struct nlattr *nla, size_t *left) {
+    size_t len = NLA_ALIGN_U(nla->nla_len);
+    if (len > *left) {
+        *left = 0;
+        return NULL;
+    }
+    *left -= len;
+    return (struct nlattr *)(void *)((char *)nla + len);
+}
+
+static bool nla_ok(const struct nlattr *nla, size_t left) {
+    return left >= sizeof(*nla) && nla->nla_len >= sizeof(*nla) &&
+           nla->nla_len <= left;
+}
+
+/* Finds attribute type in [nla, nla + left), or NULL. */
+static struct nlattr *nla_find(struct nlattr *nla, size_t left, int type) {
+    for (; nla && nla_ok(nla, left); nla = nla_next(nla, &left)) {
+        if ((nla->nla_type & NLA_TYPE_MASK) == type) {
+            return nla;
+        }
+    }
+    return NULL;
+}
+
+static void *nla_data(struct nlattr *nla) {
+    return (char *)nla + NLA_HDRLEN_U;
+}
+
+/* Appends a genetlink request with one attribute to buf at off. */
+static size_t procstall_put_msg(char *buf, size_t off, uint16_t type,
+                                uint8_t cmd, uint16_t attr, const void *data,
+                                uint16_t data_len) {
+    struct nlmsghdr *nlh = (struct nlmsghdr *)(void *)(buf + off);
+    struct genlmsghdr *genl = NLMSG_DATA(nlh);
+    struct nlattr *nla =
+        (struct nlattr *)(void *)((char *)genl + GENL_HDRLEN);
+    const size_t len =
+        NLMSG_LENGTH(GENL_HDRLEN + NLA_HDRLEN_U + NLA_ALIGN_U(data_len));
+
+    memset(nlh, 0, NLMSG_ALIGN(len));
+    nlh->nlmsg_len = (uint32_t)len;
+    nlh->nlmsg_type = type;
+    nlh->nlmsg_flags = NLM_F_REQUEST;
+    nlh->nlmsg_seq = procstall.seq++;
+    genl->cmd = cmd;
+    genl->version = 1;
+    nla->nla_type = attr;
+    nla->nla_len = (uint16_t)(NLA_HDRLEN_U + data_len);
+    memcpy(nla_data(nla), data, data_len);
+
+    return off + NLMSG_ALIGN(len);
+}
+
+static int procstall_open(void) {
+    static const char family_name[] = TASKSTATS_GENL_NAME;
+    char buf[PROCSTALL_RECV_LEN / 16];
+    struct nlmsghdr *nlh = (struct nlmsghdr *)(void *)buf;
+    char delayacct = '0';
+    ssize_t len;
+    int fd;
+
+    fd = open("/proc/sys/kernel/task_delayacct", O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        if (read(fd, &delayacct, 1) != 1) {
+            delayacct = '0';
+        }
+        close(fd);
+    }
+    if (delayacct == '0') {
+        return -ENOTSUP;
+    }
+
+    procstall.fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_GENERIC);
+    if (procstall.fd < 0) {
+        return -errno;
+    }
+
+    len = (ssize_t)procstall_put_msg(buf, 0, GENL_ID_CTRL, CTRL_CMD_GETFAMILY,
+                                     CTRL_ATTR_FAMILY_NAME, family_name,
+                                     sizeof(family_name));
+    if (send(procstall.fd, buf, (size_t)len, 0) != len) {
+        return -errno;
+    }
+
+    len = recv(procstall.fd, buf, sizeof(buf), 0);
+    if (len < 0) {
+        return -errno;
+    }
+    if (!NLMSG_OK(nlh, (size_t)len) || nlh->nlmsg_type == NLMSG_ERROR) {
+        return -ENOENT;
+    } else {
+        struct genlmsghdr *genl = NLMSG_DATA(nlh);
+        struct nlattr *nla =
+            nla_find((struct nlattr *)(void *)((char *)genl + GENL_HDRLEN),
+                     (size_t)(nlh->nlmsg_len - NLMSG_LENGTH(GENL_HDRLEN)),
+                     CTRL_ATTR_FAMILY_ID);
+        if (!nla) {
+            return -ENOENT;
+        }
+        memcpy(&procstall.family, nla_data(nla), sizeof(procstall.family));
+    }
+
+    return 0;
+}
+
+/* The start time field of /proc/<pid>/stat, or 0 if it's gone. */
+static uint64_t proc_start_time(pid_t pid) {
+    char path[sizeof("/proc/2147483647/stat")], buf[512];
+    const char *p;
+    ssize_t len = -1;
+    int fd, field;
+
+    snprintf_check(path, sizeof(path), "/proc/%d/stat", pid);
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        len = read(fd, buf, sizeof(buf) - 1);
+        close(fd);
+    }
+    if (len <= 0) {
+        return 0;
+    }
+    buf[len] = '\0';
+
+    /* comm can contain anything, so count from the last ')', field 2 */
+    p = strrchr(buf, ')');
+    for (field = 2; field < 22 && p; field++) {
+        p = strchr(p + 1, ' ');
+    }
+    return p ? strtoull(p + 1, NULL, 10) : 0;
+}
+
+/* Only done for the processes we name, so not on every sample. */
+static void procstall_read_comm(ProcStall *p) {
+    char path[sizeof("/proc/2147483647/comm")];
+    ssize_t len = -1;
+    int fd;
+
+    snprintf_check(path, sizeof(path), "/proc/%d/comm", p->tgid);
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        len = read(fd, p->comm, sizeof(p->comm) - 1);
+        close(fd);
+    }
+    if (len <= 0) {
+        snprintf_check(p->comm, sizeof(p->comm), "%s", "?");
+        return;
+    }
+    p->comm[len] = '\0';
+    p->comm[strcspn(p->comm, "\n")] = '\0';
+}
+
+/*
+ * Whether p is still who we sampled, so that it can be named. A cached name is
+ * only kept while the start time matches, otherwise the pid was reused and the
+ * delta is against another process' totals. One which has exited since keeps
+ * its name.
+ */
+static bool procstall_identify(ProcStall *p) {
+    uint64_t start_time = proc_start_time(p->tgid);
+
+    if (p->comm[0]) {
+        return !start_time || start_time == p->start_time;
+    }
+
+    p->start_time = start_time;
+    procstall_read_comm(p);
+    return true;
+}
+
+/*
+ * Updates procstall.procs to the processes in set, keeping the totals and
+ * names of ones we already knew about. Like task_list_update(), the new list is
+ * built separately and then swapped in.
+ */
+static size_t procstall_update_list(const CgroupSet *set) {
+    static char buf[CGROUP_THREADS_BUF_LEN];
+    ProcStall *tmp;
+    size_t nr = 0, i, old = 0;
+
+    for (i = 0; i < set->nr; i++) {
+        const char *p;
+        ssize_t len;
+
+        if (set->procs_fds[i] < 0) {
+            continue;
+        }
+        len = pread(set->procs_fds[i], buf, sizeof(buf) - 1, 0);
+        if (len <= 0) {
+            continue;
+        }
+        buf[len] = '\0';
+
+        for (p = buf; *p && nr < PROCSTALL_MAX;) {
+            char *end;
+            long tgid = strtol(p, &end, 10);
+            if (end == p) {
+                break;
+            }
+            procstall.tgids[nr++] = (pid_t)tgid;
+            p = end;
+        }
+    }
+
+    sort_tids(procstall.tgids, nr);
+
+    /* Both are sorted, so walk them together to carry totals over. */
+    for (i = 0; i < nr; i++) {
+        const pid_t tgid = procstall.tgids[i];
+
+        while (old < procstall.nr && procstall.procs[old].tgid < tgid) {
+            old++;
+        }
+        if (old < procstall.nr && procstall.procs[old].tgid == tgid) {
+            procstall.next[i] = procstall.procs[old++];
+        } else {
+            procstall.next[i] = (ProcStall){.tgid = tgid};
+        }
+    }
+
+    tmp = procstall.procs;
+    procstall.procs = procstall.next;
+    procstall.next = tmp;
+    procstall.nr = nr;
+
+    return nr;
+}
+
+static void procstall_record(ProcStall *p, const struct taskstats *ts) {
+    uint64_t totals[NR_RESOURCES] = {0};
+    ResourceType rt;
+
+    totals[RT_MEMORY] = ts->swapin_delay_total + ts->freepages_delay_total +
+                        ts->thrashing_delay_total;
+    totals[RT_IO] = ts->blkio_delay_total;
+
+    for (rt = RT_MEMORY; rt < NR_RESOURCES; rt++) {
+        p->deltas[rt] = p->baseline && totals[rt] >= p->totals[rt]
+                            ? totals[rt] - p->totals[rt]
+                            : 0;
+        p->totals[rt] = totals[rt];
+    }
+    p->baseline = true;
+}
+
+/* Handles the replies to requests first_seq onwards, for procs from start. */
+static int procstall_handle_replies(const char *buf, size_t len,
+                                    uint32_t first_seq, size_t start,
+                                    size_t *pending) {
+    const struct nlmsghdr *nlh = (const struct nlmsghdr *)(const void *)buf;
+
+    for (; NLMSG_OK(nlh, len); nlh = NLMSG_NEXT(nlh, len)) {
+        const size_t idx = start + (nlh->nlmsg_seq - first_seq);
+        ProcStall *p;
+
+        if (nlh->nlmsg_seq - first_seq >= PROCSTALL_BATCH ||
+            idx >= procstall.nr) {
+            continue; /* Not ours, or from a batch we gave up on */
+        }
+        p = &procstall.procs[idx];
+        (*pending)--;
+
+        if (nlh->nlmsg_type == NLMSG_ERROR) {
+            const struct nlmsgerr *err = NLMSG_DATA(nlh);
+            if (err->error == -EPERM || err->error == -EACCES) {
+                return err->error;
+            }
+            /* Probably exited, cgroup.procs will tell us next time */
+            memset(p->deltas, 0, sizeof(p->deltas));
+            p->baseline = false;
+        } else if (nlh->nlmsg_type == procstall.family) {
+            const struct genlmsghdr *genl = NLMSG_DATA(nlh);
+            struct nlattr *aggr, *stats;
+            struct taskstats ts = {0};
+            size_t left = nlh->nlmsg_len - NLMSG_LENGTH(GENL_HDRLEN);
+
+            aggr = nla_find((struct nlattr *)(void *)((char *)genl +
+                                                       GENL_HDRLEN),
+                            left, TASKSTATS_TYPE_AGGR_TGID);
+            stats = aggr ? nla_find((struct nlattr *)nla_data(aggr),
+                                    aggr->nla_len - NLA_HDRLEN_U,
+                                    TASKSTATS_TYPE_STATS)
+                         : NULL;
+            if (!stats) {
+                continue;
+            }
+
+            /* Older kernels send less of it, the rest stays 0 */
+            left = stats->nla_len - NLA_HDRLEN_U;
+            memcpy(&ts, nla_data(stats), left < sizeof(ts) ? left : sizeof(ts));
+            procstall_record(p, &ts);
+        }
+    }
+
+    return 0;
+}
+
+/* Queries taskstats for every process in procstall.procs, in batches. */
+static int procstall_query(void) {
+    static char buf[PROCSTALL_RECV_LEN];
+    size_t start;
+
+    for (start = 0; start < procstall.nr; start += PROCSTALL_BATCH) {
+        const size_t end = start + PROCSTALL_BATCH < procstall.nr
+                               ? start + PROCSTALL_BATCH
+                               : procstall.nr;
+        const uint32_t first_seq = procstall.seq;
+        size_t off = 0, i, pending = end - start;
+        ssize_t len;
+
+        for (i = start; i < end; i++) {
+            const uint32_t tgid = (uint32_t)procstall.procs[i].tgid;
+            off = procstall_put_msg(buf, off, procstall.family,
+                                    TASKSTATS_CMD_GET, TASKSTATS_CMD_ATTR_TGID,
+                                    &tgid, sizeof(tgid));
+        }
+        if (send(procstall.fd, buf, off, 0) != (ssize_t)off) {
+            return -errno;
+        }
+
+        /* The kernel answers inside send(), so these are all queued now */
+        while (pending > 0) {
+            int ret;
+
+            len = recv(procstall.fd, buf, sizeof(buf), MSG_DONTWAIT);
+            if (len < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                /* Some replies went missing, they're caught up next time */
+                break;
+            }
+            ret = procstall_handle_replies(
+                buf, (size_t)len, first_seq, start, &pending);
+            if (ret < 0) {
+                return ret;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Opens taskstats and sizes the lists. Called at startup so that it's done
+ * before lock_memory, but also works later. Returns false if unavailable.
+ */
+static bool procstall_init(void) {
+    int ret;
+
+    if (procstall.unavailable) {
+        return false;
+    }
+    if (procstall.fd >= 0) {
+        return true;
+    }
+
+    ret = procstall_open();
+    if (ret == -ENOTSUP) {
+        procstall_disable("kernel.task_delayacct is off.");
+        return false;
+    }
+    if (ret < 0) {
+        warn("Cannot name stalled processes, taskstats is unavailable: %s\n",
+             strerror(-ret));
+        procstall_close();
+        procstall.unavailable = true;
+        return false;
+    }
+
+    procstall.procs = calloc(PROCSTALL_MAX, sizeof(*procstall.procs));
+    procstall.next = calloc(PROCSTALL_MAX, sizeof(*procstall.next));
+    procstall.tgids = calloc(PROCSTALL_MAX, sizeof(*procstall.tgids));
+    expect(procstall.procs && procstall.next && procstall.tgids);
+    return true;
+}
+
+static uint64_t procstall_stale_usec(void) {
+    int64_t ms = cfg.update_interval_ms > cfg.update_max_ms
+                     ? cfg.update_interval_ms
+                     : cfg.update_max_ms;
+    return (uint64_t)ms * MSEC_TO_USEC * PROCSTALL_STALE_UPDATES;
+}
+
+/* Samples the seat's processes, at most once per update. */
+static void procstall_sample(void) {
+    uint64_t now;
+    int ret;
+
+    if (seat_cgroups.root_fd < 0 || procstall.unavailable ||
+        procstall.sampled_check == stats.checks + 1) {
+        return;
+    }
+    procstall.sampled_check = stats.checks + 1;
+
+    if (procstall.fd < 0 && !procstall_init()) {
+        return;
+    }
+
+    /* Too long ago to compare against, so start again from a new baseline */
+    now = now_usec();
+    if (procstall.sampled_usec &&
+        now - procstall.sampled_usec > procstall_stale_usec()) {
+        procstall.nr = 0;
+        procstall.sampled_usec = 0;
+    }
+
+    if (procstall_update_list(&seat_cgroups) == 0) {
+        return;
+    }
+
+    ret = procstall_query();
+    if (ret == -EPERM || ret == -EACCES) {
+        procstall_disable("querying taskstats needs CAP_NET_ADMIN.");
+        return;
+    }
+
+    now = now_usec();
+    procstall.elapsed_usec =
+        procstall.sampled_usec ? now - procstall.sampled_usec : 0;
+    procstall.sampled_usec = now;
+}
+
+/* Appends the processes which waited longest on r to buf, if there are any. */
+static void procstall_describe(const Resource *r, char *buf, size_t len) {
+    char list[PROCSTALL_DESC_MAX] = "";
+    size_t top[PROCSTALL_TOP], nr = 0, i, off = 0;
+    const ResourceType rt = r->type;
+
+    if (rt == RT_CPU) {
+        return;
+    }
+
+    procstall_sample();
+    if (procstall.elapsed_usec == 0) {
+        return;
+    }
+
+again:
+    nr = 0;
+    for (i = 0; i < procstall.nr; i++) {
+        size_t pos;
+
+        if (procstall.procs[i].deltas[rt] == 0) {
+            continue;
+        }
+
+        for (pos = nr; pos > 0; pos--) {
+            if (procstall.procs[top[pos - 1]].deltas[rt] >=
+                procstall.procs[i].deltas[rt]) {
+                break;
+            }
+            if (pos < PROCSTALL_TOP) {
+                top[pos] = top[pos - 1];
+            }
+        }
+
+        if (pos < PROCSTALL_TOP) {
+            top[pos] = i;
+            if (nr < PROCSTALL_TOP) {
+                nr++;
+            }
+        }
+    }
+
+    if (nr == 0) {
+        return;
+    }
+
+    for (i = 0; i < nr; i++) {
+        ProcStall *p = &procstall.procs[top[i]];
+        if (!procstall_identify(p)) {
+            *p = (ProcStall){.tgid = p->tgid};
+            goto again;
+        }
+    }
+
+    for (i = 0; i < nr && off < sizeof(list); i++) {
+        const ProcStall *p = &procstall.procs[top[i]];
+        const double sec = (double)p->deltas[rt] / SEC_TO_NSEC;
+        int ret;
+
+        ret = snprintf(list + off,
+                       sizeof(list) - off,
+                       sec < 1 ? "%s%s[%d] (%.0fms)" : "%s%s[%d] (%.1fs)",
+                       i ? ", " : "",
+                       p->comm,
+                       p->tgid,
+                       sec < 1 ? sec * 1000 : sec);
+        expect(ret >= 0);
+        off += (size_t)ret;
+    }
+
+    info("Processes waiting most on %s since last check: %s\n",
+         r->human_name,
+         list);
+    off = strlen(buf);
+    if (off < len) {
+        snprintf(buf + off, len - off, "Waited most: %s. ", list);
+    }
+}
+
+/*
+ * The functions below drive the state machine for a single alert. name is what
+ * it's shown as, usually the resource's human_name, and r is the resource
+ * whose culprits are named. cgroup is NULL for the seat or system-wide
+ * pressures, otherwise it's the cgroup (in container host mode) this alert is
+ * for.
+ */
+
+/* 0 means already active, 1 means newly active. */
+static int alert_user_if_new(Alert *a, const char *name, const Resource *r,
+                             const char *cgroup) {
+    if (a->last_state == A_ACTIVE) {
+        return 0;
+    }
+
+    LOG_ALERT_STATE(name, cgroup, "active");
+
+    /* An early warning is replaced, since it says something different */
+    if (a->notif_id && !a->alerted) {
+        alert_destroy(a->notif_id);
+        a->notif_id = 0;
+    }
+    a->alerted = true;
+
+    /* A_STABILISING -> A_ACTIVE reuses the existing notification */
+    if (!a->notif_id) {
+        char culprits[CULPRITS_DESC_MAX + PROCSTALL_DESC_MAX] = "";
+
+        if (!cgroup) {
+            culprits_describe(&seat_cgroups, r, culprits, sizeof(culprits));
+            procstall_describe(r, culprits, sizeof(culprits));
+        }
+
+        a->notif_id = alert_user(name, cgroup, culprits, -1);
+    }
+
+    /*
+     * Time based rather than a number of intervals, since with
+     * update_adaptive the interval isn't fixed.
+     */
+    a->expires_usec = now_usec() + (uint64_t)expiry_sec * SEC_TO_USEC;
+    return 1;
+}
+
+/*
+ * An early warning, see predict. This never replaces an alert that's already
+ * been raised, it only keeps it from being closed while pressure is rising.
+ */
+static AlertState alert_rising(Alert *a, const char *name, const Resource *r,
+                               const char *cgroup) {
+    if (a->alerted) {
+        if (a->last_state == A_ACTIVE) {
+            LOG_ALERT_STATE(name, cgroup, "stabilising");
+        }
+        return A_STABILISING;
+    }
+
+    if (a->last_state != A_RISING) {
+        LOG_ALERT_STATE(name, cgroup, "rising");
+    }
+
+    if (!a->notif_id) {
+        char culprits[CULPRITS_DESC_MAX] = "";
+
+        if (!cgroup) {
+            culprits_describe(&seat_cgroups, r, culprits, sizeof(culprits));
+        }
+
+        a->notif_id = alert_user(name, cgroup, culprits, resource_eta(r));
+    }
+
+    a->expires_usec = now_usec() + (uint64_t)expiry_sec * SEC_TO_USEC;
+    return A_RISING;
+}
+
+static void alert_stabilising(const Alert *a, const char *name,
+                              const char *cgroup) {
+    if (a->last_state == A_STABILISING) {
+        return;
+    }
+
+    if (a->last_state == A_ACTIVE) {
+        LOG_ALERT_STATE(name, cgroup, "stabilising");
+    }
+}
+
+static AlertState alert_stop(Alert *a, const char *name, const char *cgroup) {
+    uint32_t id = a->notif_id;
+
+    if (a->last_state == A_INACTIVE) {
+        return A_INACTIVE;
+    }
+
+    if (now_usec() < a->expires_usec) {
+        /* Still got some more iterations to go before this can be closed. */
+        alert_stabilising(a, name, cgroup);
+        return A_STABILISING;
+    }
+
+    LOG_ALERT_STATE(name, cgroup, "inactive");
+    a->notif_id = 0;
+    a->alerted = false;
+    if (id) {
+        alert_destroy(id);
+    }
+
+    return A_INACTIVE;
+}
+
+static void alert_update(Alert *a, const char *name, const Resource *r,
+                         const char *cgroup, AlertState ret) {
+    bool time_stabilising = false;
+
+    switch (ret) {
+        case A_INACTIVE:
+            time_stabilising = alert_stop(a, name, cgroup) == A_STABILISING;
+            break;
+        case A_ACTIVE:
+            alert_user_if_new(a, name, r, cgroup);
+            break;
+        case A_STABILISING:
+            /* Grace period where we are hands-off, to avoid volatility. */
+            alert_stabilising(a, name, cgroup);
+            break;
+        case A_RISING:
+            ret = alert_rising(a, name, r, cgroup);
+            break;
+        case A_ERROR:
+            /* Already warned inside pressure_check(). */
+            return;
+        default:
+            unreachable();
+    }
+
+    if (time_stabilising) {
+        ret = A_STABILISING;
+    }
+
+    if (replay.active && ret != a->last_state) {
+        fprintf(replay.out, "%" PRIu64 " %s%s%s: %s -> %s\n",
+                replay.now_usec / SEC_TO_USEC, name, cgroup ? " in " : "",
+                cgroup ? cgroup : "", alert_state_names[a->last_state],
+                alert_state_names[ret]);
+        replay.transitions++;
+    }
+
+    a->last_state = ret;
+}
+
+static void cgroups_check_all(CgroupSet *set) {
+    size_t i;
+    ResourceType rt;
+
+    cgroups_process_events(set);
+
+    workers_run(cgroups_sample_range, set, set->nr, WORKERS_MIN_ITEMS);
+
+    for (i = 0; i < set->nr; i++) {
+        for (rt = RT_CPU; rt < NR_RESOURCES; rt++) {
+            alert_update(&set->alerts[rt][i],
+                         all_res[rt]->human_name,
+                         all_res[rt],
+                         set->paths[i],
+                         set->next[rt][i]);
+        }
+    }
+}
+
+/*
+ * Puts every pressure file read for this tick into one read_batch: the
+ * system-wide ones, then each CgroupSet's. Cgroup events are handled first,
+ * since they move cgroups around in the arrays.
+ */
+static void tick_reads_batch(void) {
+    CgroupSet *const sets[] = {&cgroups, &seats, &seat_cgroups};
+    size_t i, idx, nr = NR_RESOURCES;
+    ResourceType rt;
+
+    if (!read_batch_wanted()) {
+        return;
+    }
+
+    for_each_arr(i, sets) {
+        sets[i]->batch_nr = 0;
+        if (sets[i]->root_fd >= 0) {
+            cgroups_process_events(sets[i]);
+            nr += sets[i]->nr * NR_RESOURCES;
+        }
+    }
+
+    read_batch_begin(nr);
+
+    for_each_arr(i, all_res) {
+        Resource *r = all_res[i];
+        if (r->filename && r->fd < 0) {
+            r->fd = openat_psi(r->filename, O_RDONLY);
+        }
+        (void)read_batch_add(r->fd);
+    }
+
+    for_each_arr(i, sets) {
+        CgroupSet *set = sets[i];
+
+        if (set->root_fd < 0) {
+            continue;
+        }
+
+        set->batch_base = read_batch.nr;
+        for (idx = 0; idx < set->nr; idx++) {
+            /* Culprits are only ever looked for in some units */
+            bool skip = set == &seat_cgroups &&
+                        !cgroup_is_culprit_candidate(set->paths[idx]);
+            for (rt = RT_CPU; rt < NR_RESOURCES; rt++) {
+                (void)read_batch_add(skip ? -1 : set->fds[rt][idx]);
+            }
+        }
+        set->batch_nr = set->nr;
+    }
+
+    read_batch_submit();
+}
+
+static void pressure_check_notify_if_new(Resource *r, FILE *override_file) {
+    Alert *a = &active_notif[r->type];
+    uint64_t start = now_usec();
+    AlertState state = pressure_check(r, override_file);
+    AlertState before = a->last_state;
+
+    latency_record(&stats.pressure_check, now_usec() - start);
+
+    /*
+     * With nothing stalled there's nobody to blame, so save reading every
+     * unit. The next sample's elapsed_usec covers the gap.
+     */
+    if (r->current.some.avg10 > 0) {
+        culprits_sample(&seat_cgroups, r->type);
+    }
+    alert_update(a, r->human_name, r, NULL, state);
+    if (a->last_state != before) {
+        stats.transitions[r->type][a->last_state]++;
+        actions_transition(r, before, a->last_state);
+    }
+}
+
+/*
+ * Rules run on a vector of every pressure we have, filled in once per update,
+ * so evaluating one is a single pass over its instructions with no lookups.
+ */
+static double rule_pressures[RULE_NR_METRICS];
+
+static void rule_pressures_update(double *out) {
+    size_t i, w;
+
+    for_each_arr(i, all_res) {
+        const Resource *r = all_res[i];
+        const PressureLine *lines[] = {&r->current.some, &r->current.full};
+        size_t full;
+
+        for_each_arr(full, lines) {
+            double *v = out + (i * 2 + full) * RULE_WINDOWS;
+            v[0] = lines[full]->avg10;
+            v[1] = lines[full]->avg60;
+            v[2] = lines[full]->avg300;
+            for (w = 0; w < r->nr_windows; w++) {
+                v[3 + w] = full ? r->windows[w].current.full
+                                : r->windows[w].current.some;
+            }
+        }
+    }
+}
+
+static bool rule_eval(const Rule *rule, const double *pressures,
+                      bool hysteresis) {
+    double stack[RULE_STACK_MAX], a, b;
+    size_t i, sp = 0;
+
+    for (i = 0; i < rule->nr_insns; i++) {
+        const RuleInsn *in = &rule->insns[i];
+        const double imm = in->imm[hysteresis];
+
+        switch (in->op) {
+            case ROP_LOAD:
+                stack[sp++] = pressures[in->metric];
+                continue;
+            case ROP_CONST:
+                stack[sp++] = imm;
+                continue;
+            case ROP_NOT:
+                stack[sp - 1] = stack[sp - 1] == 0;
+                continue;
+            default:
+                break;
+        }
+
+        /* Everything else is binary, and replaces its operands */
+        a = stack[sp - 2];
+        b = stack[--sp];
+
+        switch (in->op) {
+            case ROP_MIN:
+                stack[sp - 1] = a < b ? a : b;
+                break;
+            case ROP_MAX:
+                stack[sp - 1] = a > b ? a : b;
+                break;
+            case ROP_GT:
+                stack[sp - 1] = a > b - imm;
+                break;
+            case ROP_GE:
+                stack[sp - 1] = a >= b - imm;
+                break;
+            case ROP_LT:
+                stack[sp - 1] = a < b + imm;
+                break;
+            case ROP_LE:
+                stack[sp - 1] = a <= b + imm;
+                break;
+            case ROP_AND:
+                stack[sp - 1] = a != 0 && b != 0;
+                break;
+            case ROP_OR:
+                stack[sp - 1] = a != 0 || b != 0;
+                break;
+            default:
+                unreachable();
+        }
+    }
+
+    return stack[0] != 0;
+}
+
+static AlertState rule_state(const Rule *rule, const double *pressures) {
+    if (rule_eval(rule, pressures, false)) {
+        return A_ACTIVE;
+    } else if (rule_eval(rule, pressures, true)) {
+        return A_STABILISING;
+    }
+    return A_INACTIVE;
+}
+
+static void rules_check_all(void) {
+    size_t i;
+
+    rule_pressures_update(rule_pressures);
+
+    for (i = 0; i < cfg.nr_rules; i++) {
+        const Rule *rule = &cfg.rules[i];
+        alert_update(&rule_alerts[i],
+                     rule->name,
+                     all_res[rule->culprits],
+                     NULL,
+                     rule_state(rule, rule_pressures));
+    }
+}
+
+/* Identifies a rule across reloads: its name and its compiled program. */
+static uint64_t rule_key(const Rule *rule) {
+    uint64_t key = hash_buf(rule->name, strlen(rule->name));
+    size_t i;
+
+    for (i = 0; i < rule->nr_insns; i++) {
+        const RuleInsn *in = &rule->insns[i];
+        char buf[sizeof(uint32_t) * 2 + sizeof(in->imm)];
+        uint32_t op = (uint32_t)in->op;
+
+        memcpy(buf, &op, sizeof(op));
+        memcpy(buf + sizeof(op), &in->metric, sizeof(in->metric));
+        memcpy(buf + sizeof(op) * 2, in->imm, sizeof(in->imm));
+        key = key * 31 ^ hash_buf(buf, sizeof(buf));
+    }
+    return key ^ (uint64_t)rule->culprits;
+}
+
+/*
+ * Called at startup and after each config reload. Rules which are unchanged
+ * keep their alerts, so a reload doesn't close and reraise them. Anything
+ * else starts over.
+ */
+static void rules_apply_config(void) {
+    static uint64_t keys[RULES_MAX];
+    static size_t nr_keys;
+    Alert carried[RULES_MAX];
+    bool taken[RULES_MAX] = {false};
+    size_t i, j;
+
+    for (i = 0; i < cfg.nr_rules; i++) {
+        const uint64_t key = rule_key(&cfg.rules[i]);
+
+        carried[i] = (Alert)DEFAULT_ALERT_STATE;
+        for (j = 0; j < nr_keys; j++) {
+            if (!taken[j] && keys[j] == key) {
+                taken[j] = true;
+                carried[i] = rule_alerts[j];
+                break;
+            }
+        }
+    }
+
+    for_each_arr(i, rule_alerts) {
+        if (!taken[i] && rule_alerts[i].notif_id) {
+            alert_destroy(rule_alerts[i].notif_id);
+        }
+        rule_alerts[i] = (Alert)DEFAULT_ALERT_STATE;
+    }
+    for (i = 0; i < cfg.nr_rules; i++) {
+        rule_alerts[i] = carried[i];
+        keys[i] = rule_key(&cfg.rules[i]);
+    }
+    nr_keys = cfg.nr_rules;
+}
+
+/* Called at startup and after each config reload. */
+static void cgroups_apply_config(void) {
+    size_t i;
+
+    if (cgroups.root_fd >= 0 && !streq(cgroups.root_path, cfg.cgroup_root)) {
+        cgroups_destroy(&cgroups);
+    }
+
+    if (!*cfg.cgroup_root) {
+        return;
+    }
+
+    if (cgroups.root_fd < 0) {
+        if (cgroups_init(&cgroups, cfg.cgroup_root) == 0) {
+            info("Monitoring %zu cgroups below %s.\n",
+                 cgroups.nr,
+                 cfg.cgroup_root);
+        }
+        return;
+    }
+
+    /* Same root, but the patterns might have changed. */
+    for (i = 0; i < cgroups.nr; i++) {
+        cgroups.profiles[i] = cgroup_profile_match(cgroups.paths[i]);
+    }
+}
+
+/* Called at startup and after each config reload, in system mode. */
+static int seats_apply_config(void) {
+    size_t i;
+
+    if (seats.root_fd < 0) {
+        int ret = cgroups_init(&seats, SEATS_ROOT);
+        if (ret == 0) {
+            info("Monitoring %zu seats below %s.\n", seats.nr, SEATS_ROOT);
+        }
+        return ret;
+    }
+
+    for (i = 0; i < seats.nr; i++) {
+        seats.profiles[i] = cgroup_profile_match(seats.paths[i]);
+    }
+    return 0;
+}
+
+/*
+ * Unprivileged users can only register PSI triggers with a window that is a
+ * multiple of 2s, so use the smallest window we can to keep latency low.
+ */
+#define TRIGGER_WINDOW_USEC (2 * SEC_TO_USEC)
+#define TRIGGER_LINE_MAX sizeof("some 2000000 2000000")
+#define TRIGGERS_MAX 6 /* {cpu, memory, io} * {some, full} */
+
+static int triggers[TRIGGERS_MAX];
+static size_t nr_triggers = 0;
+
+/*
+ * Everything we wait on goes in one epoll set: the timer for the next update,
+ * a signalfd, PSI triggers, and the metrics and subscription sockets. The
+ * bottom half of data.u64 says which one fired, and for subscribers, the top
+ * half says which one.
+ */
+typedef enum {
+    EV_TIMER,
+    EV_SIGNAL,
+    EV_TRIGGER,
+    EV_METRICS,
+    EV_SUBSCRIBE,
+    EV_SUBSCRIBER
+} EventSource;
+
+static struct {
+    int epoll_fd;
+    int timer_fd;
+    int signal_fd;
+    int64_t armed_ms; /* Current timer period, 0 if disarmed */
+    uint64_t armed_usec; /* When it was armed, to know when it should fire */
+} loop = {.epoll_fd = -1, .timer_fd = -1, .signal_fd = -1};
+
+static void loop_ctl(int op, int fd, uint32_t events, EventSource source,
+                     uint32_t idx) {
+    struct epoll_event ev = {.events = events,
+                             .data.u64 = (uint64_t)idx << 32 | source};
+    expect(epoll_ctl(loop.epoll_fd, op, fd, &ev) == 0);
+}
+
+static void loop_add(int fd, uint32_t events, EventSource source) {
+    loop_ctl(EPOLL_CTL_ADD, fd, events, source, 0);
+}
+
+/*
+ * Triggers only tell us when to look, the real decision is still made by
+ * pressure_check(). As such, wake up for the most sensitive configured
+ * threshold of this type, whichever time period it is for.
+ */
+static double trigger_threshold(const Resource *r, bool full) {
+    size_t i;
+    double min = -1;
+    const double candidates[] = {
+        full ? r->thresholds.avg10.full : r->thresholds.avg10.some,
+        full ? r->thresholds.avg60.full : r->thresholds.avg60.some,
+        full ? r->thresholds.avg300.full : r->thresholds.avg300.some,
+    };
+
+    for_each_arr(i, candidates) {
+        if (candidates[i] >= 0 && (min < 0 || candidates[i] < min)) {
+            min = candidates[i];
+        }
+    }
+
+    for (i = 0; i < r->nr_windows; i++) {
+        const TimeResourcePressure *t = &r->windows[i].thresholds;
+        const double thresh = full ? t->full : t->some;
+        if (thresh >= 0 && (min < 0 || thresh < min)) {
+            min = thresh;
+        }
+    }
+
+    return min;
+}
+
+static int trigger_register(const Resource *r, const char *type,
+                            double threshold) {
+    char line[TRIGGER_LINE_MAX];
+    uint64_t stall_usec = (uint64_t)(threshold / 100 * TRIGGER_WINDOW_USEC);
+    int fd;
+
+    expect(nr_triggers < TRIGGERS_MAX);
+
+    /* The kernel rejects stalls of 0 or longer than the window. */
+    if (stall_usec < 1) {
+        stall_usec = 1;
+    } else if (stall_usec > TRIGGER_WINDOW_USEC) {
+        stall_usec = TRIGGER_WINDOW_USEC;
+    }
+
+    fd = openat_psi(r->filename, O_RDWR | O_NONBLOCK);
+    if (fd < 0) {
+        return fd;
+    }
+
+    snprintf_check(line,
+                   sizeof(line),
+                   "%s %" PRIu64 " %" PRIu64,
+                   type,
+                   stall_usec,
+                   (uint64_t)TRIGGER_WINDOW_USEC);
+
+    if (write(fd, line, strlen(line) + 1) < 0) {
+        int ret = -errno;
+        close(fd);
+        return ret;
+    }
+
+    if (loop.epoll_fd >= 0) {
+        loop_add(fd, EPOLLPRI, EV_TRIGGER);
+    }
+
+    triggers[nr_triggers++] = fd;
+    return 0;
+}
+
+static void triggers_unregister_all(void) {
+    size_t i;
+    for (i = 0; i < nr_triggers; i++) {
+        /* Also removes it from the epoll set */
+        close(triggers[i]);
+    }
+    nr_triggers = 0;
+}
+
+static int triggers_register_resource(const Resource *r) {
+    double threshold;
+    int ret;
+
+    threshold = trigger_threshold(r, false);
+    if (threshold >= 0 && (ret = trigger_register(r, "some", threshold)) < 0) {
+        return ret;
+    }
+
+    threshold = trigger_threshold(r, true);
+    if (r->has_full && threshold >= 0 &&
+        (ret = trigger_register(r, "full", threshold)) < 0) {
+        return ret;
+    }
+
+    return 0;
+}
+
+/* Falls back to regular polling on any failure. */
+static void triggers_register_all(void) {
+    size_t i;
+
+    triggers_unregister_all();
+
+    if (!cfg.use_triggers) {
+        return;
+    }
+
+    for_each_arr(i, all_res) {
+        int ret = triggers_register_resource(all_res[i]);
+        if (ret < 0) {
+            warn("Cannot register %s PSI trigger, polling every %gs "
+                 "instead: %s\n",
+                 all_res[i]->human_name,
+                 (double)cfg.update_interval_ms / SEC_TO_MSEC,
+                 strerror(-ret));
+            triggers_unregister_all();
+            return;
+        }
+    }
+
+    if (nr_triggers == 0) {
+        warn("%s\n", "No thresholds to register PSI triggers for, polling.");
+    }
+}
+
+static bool alerts_all_inactive(void) {
+    size_t i;
+    for_each_arr(i, active_notif) {
+        if (active_notif[i].last_state != A_INACTIVE) {
+            return false;
+        }
+    }
+    for (i = 0; i < cfg.nr_rules; i++) {
+        if (rule_alerts[i].last_state != A_INACTIVE) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * Whether it's safe to sleep until a trigger fires. The triggers are only on
+ * the system-wide pressures, so cgroups and seats have to keep being polled,
+ * both to alert and to stabilise and close their alerts. They're also only
+ * derived from thresholds: a rule can compare against anything, including
+ * being below a value, so no trigger can stand in for it. Prediction needs
+ * samples from before a threshold is passed, which a trigger never gives.
+ */
+static bool triggers_idle_ok(void) {
+    if (nr_triggers == 0 || cgroups.root_fd >= 0 || seats.root_fd >= 0 ||
+        cfg.nr_rules > 0 || cfg.predict_horizon_sec > 0 ||
+        sender.nr_pending > 0 || actions.nr_pending > 0) {
+        return false;
+    }
+    return alerts_all_inactive();
+}
+
+#define MSEC_TO_NSEC 1000000
+
+/*
+ * With update_adaptive, the interval depends on how close we are to alerting:
+ * when everything is far below its thresholds it backs off towards the
+ * maximum, and when anything is close, rising, or alerting it drops straight
+ * to the minimum.
+ */
+typedef enum { D_FAR, D_MID, D_NEAR } Distance;
+
+#define ADAPTIVE_FAR_FRACTION 0.5
+
+static Distance threshold_distance(double thresh, double current) {
+    if (!(thresh >= 0)) {
+        return D_FAR;
+    } else if (COMPARE_THRESH(psi_hysteresis(thresh), current)) {
+        return D_NEAR;
+    } else if (current > psi_hysteresis(thresh) * ADAPTIVE_FAR_FRACTION) {
+        return D_MID;
+    }
+    return D_FAR;
+}
+
+static Distance line_distance(const TimeResourcePressure *avg10,
+                              const TimeResourcePressure *avg60,
+                              const TimeResourcePressure *avg300,
+                              const PressureLine *cur,
+                              const PressureLine *prev, bool full) {
+    Distance d = D_FAR, tmp;
+
+#define DISTANCE_UPDATE(t, c)                                                  \
+    do {                                                                       \
+        tmp = threshold_distance(full ? (t)->full : (t)->some, c);             \
+        d = tmp > d ? tmp : d;                                                 \
+    } while (0)
+
+    DISTANCE_UPDATE(avg10, cur->avg10);
+    DISTANCE_UPDATE(avg60, cur->avg60);
+    DISTANCE_UPDATE(avg300, cur->avg300);
+
+#undef DISTANCE_UPDATE
+
+    /* Not there yet, but heading towards it: look more closely. */
+    if (d == D_MID && cur->avg10 > prev->avg10) {
+        d = D_NEAR;
+    }
+
+    return d;
+}
+
+static Distance resource_distance(const Resource *r) {
+    const Pressure *t = &r->thresholds;
+    Distance d, tmp;
+    size_t i;
+
+    if (!r->filename || r->fd < 0) {
+        return D_MID;
+    }
+
+    d = line_distance(&t->avg10,
+                      &t->avg60,
+                      &t->avg300,
+                      &r->current.some,
+                      &r->previous.some,
+                      false);
+    if (r->has_full) {
+        tmp = line_distance(&t->avg10,
+                            &t->avg60,
+                            &t->avg300,
+                            &r->current.full,
+                            &r->previous.full,
+                            true);
+        d = tmp > d ? tmp : d;
+    }
+
+    for (i = 0; i < r->nr_windows; i++) {
+        const CustomWindow *w = &r->windows[i];
+        tmp = threshold_distance(w->thresholds.some, w->current.some);
+        d = tmp > d ? tmp : d;
+        tmp = threshold_distance(w->thresholds.full, w->current.full);
+        d = tmp > d ? tmp : d;
+    }
+
+    return d;
+}
+
+static int64_t adaptive_interval_ms(void) {
+    static int64_t interval_ms;
+    const int64_t min_ms = cfg.update_min_ms < cfg.update_interval_ms
+                               ? cfg.update_min_ms
+                               : cfg.update_interval_ms;
+    Distance d = D_FAR, tmp;
+    size_t i;
+
+    if (cfg.update_min_ms == 0) {
+        return cfg.update_interval_ms;
+    }
+
+    for_each_arr(i, all_res) {
+        if (active_notif[i].last_state != A_INACTIVE) {
+            d = D_NEAR;
+            break;
+        }
+        tmp = resource_distance(all_res[i]);
+        d = tmp > d ? tmp : d;
+    }
+
+    /* Cgroup pressures aren't considered, so don't back off for them. */
+    if (d == D_FAR && cgroups.root_fd >= 0) {
+        d = D_MID;
+    }
+
+    switch (d) {
+        case D_NEAR:
+            interval_ms = min_ms;
+            break;
+        case D_MID:
+            interval_ms = cfg.update_interval_ms;
+            break;
+        case D_FAR:
+            /* Back off gradually, we might be just over D_MID */
+            interval_ms =
+                interval_ms ? interval_ms * 2 : cfg.update_interval_ms;
+            if (interval_ms > cfg.update_max_ms) {
+                interval_ms = cfg.update_max_ms;
+            }
+            break;
+        default:
+            unreachable();
+    }
+
+    return interval_ms;
+}
+
+
+static void loop_init(void) {
+    sigset_t mask;
+
+    loop.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    expect(loop.epoll_fd >= 0);
+
+    loop.timer_fd =
+        timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    expect(loop.timer_fd >= 0);
+    loop_add(loop.timer_fd, EPOLLIN, EV_TIMER);
+
+    /* Already blocked by block_all_signals(), so they'll only go here. */
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGHUP);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGUSR1);
+    sigaddset(&mask, SIGCHLD); /* Seat helpers and action hooks */
+    loop.signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    expect(loop.signal_fd >= 0);
+    loop_add(loop.signal_fd, EPOLLIN, EV_SIGNAL);
+}
+
+static void loop_destroy(void) {
+    close(loop.signal_fd);
+    close(loop.timer_fd);
+    close(loop.epoll_fd);
+    loop.epoll_fd = loop.timer_fd = loop.signal_fd = -1;
+}
+
+/*
+ * The timer is periodic, so the kernel keeps the schedule without drift and
+ * we only need to touch it when the interval changes. 0 disarms it.
+ */
+static void loop_set_interval(int64_t interval_ms) {
+    struct itimerspec its = {{0, 0}, {0, 0}};
+
+    if (interval_ms == loop.armed_ms) {
+        return;
+    }
+
+    its.it_interval.tv_sec = interval_ms / SEC_TO_MSEC;
+    its.it_interval.tv_nsec = (interval_ms % SEC_TO_MSEC) * MSEC_TO_NSEC;
+    its.it_value = its.it_interval;
+    expect(timerfd_settime(loop.timer_fd, 0, &its, NULL) == 0);
+    loop.armed_ms = interval_ms;
+    loop.armed_usec = now_usec();
+}
+
+static atomic_flag history_dumping = ATOMIC_FLAG_INIT;
+
+/*
+ * Each line is written whole with write() rather than through stdio, so that
+ * stdout's lock is never held while a slow reader keeps us blocked. The main
+ * thread's lines can come in between, but never in the middle of one.
+ */
+static void __attribute__((format(printf, 1, 2)))
+history_dump_line(const char *fmt, ...) {
+    char line[256];
+    size_t off = 0, len;
+    va_list ap;
+    int needed;
+
+    va_start(ap, fmt);
+    needed = vsnprintf(line, sizeof(line), fmt, ap);
+    va_end(ap);
+    expect(needed >= 0 && (size_t)needed < sizeof(line));
+    len = (size_t)needed;
+
+    while (off < len) {
+        ssize_t ret = write(STDOUT_FILENO, line + off, len - off);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+        off += (size_t)ret;
+    }
+}
+
+static void history_dump_one(const Resource *r, const SampleHistory *snap,
+                             size_t nr, uint64_t now) {
+    size_t i;
+
+    history_dump_line("INFO: %s sample history, oldest first (%zu samples):\n",
+                      r->human_name, nr);
+    history_dump_line("INFO: %s\n",
+                      "secs_ago some_avg10 some_avg60 some_avg300 some_total "
+                      "full_avg10 full_avg60 full_avg300 full_total");
+
+    for (i = 0; i < nr; i++) {
+        uint64_t ago_ms = (now - snap->ts_usec[i]) / MSEC_TO_USEC;
+        history_dump_line(
+            "-%" PRIu64 ".%" PRIu64 " %u.%02u %u.%02u %u.%02u %" PRIu64
+            " %u.%02u %u.%02u %u.%02u %" PRIu64 "\n",
+            ago_ms / SEC_TO_MSEC, ago_ms % SEC_TO_MSEC / 100,
+            snap->some_avg[0][i] / 100, snap->some_avg[0][i] % 100,
+            snap->some_avg[1][i] / 100, snap->some_avg[1][i] % 100,
+            snap->some_avg[2][i] / 100, snap->some_avg[2][i] % 100,
+            snap->some_total[i], snap->full_avg[0][i] / 100,
+            snap->full_avg[0][i] % 100, snap->full_avg[1][i] / 100,
+            snap->full_avg[1][i] % 100, snap->full_avg[2][i] / 100,
+            snap->full_avg[2][i] % 100, snap->full_total[i]);
+    }
+}
+
+/* Runs on its own thread, so a big dump to a slow stdout can't delay checks */
+static void *history_dump_main(void *arg) {
+    SampleHistory *snap = malloc(sizeof(*snap));
+    uint64_t now = now_usec();
+    size_t i;
+
+    (void)arg;
+
+    if (!snap) {
+        warn("%s\n", "No memory to dump sample history");
+        atomic_flag_clear(&history_dumping);
+        return NULL;
+    }
+
+    /* Anything already buffered goes first */
+    fflush(stdout);
+    for_each_arr(i, all_res) {
+        const Resource *r = all_res[i];
+        size_t nr = sample_history_snapshot(&sample_history[r->type], snap);
+        history_dump_one(r, snap, nr, now);
+    }
+
+    free(snap);
+    atomic_flag_clear(&history_dumping);
+    return NULL;
+}
+
+static void history_dump_start(void) {
+    pthread_attr_t attr;
+    pthread_t thread;
+
+    if (atomic_flag_test_and_set(&history_dumping)) {
+        info("%s\n", "Already dumping sample history, ignoring SIGUSR1.");
+        return;
+    }
+
+    expect(pthread_attr_init(&attr) == 0);
+    expect(pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED) == 0);
+    if (pthread_create(&thread, &attr, history_dump_main, NULL) != 0) {
+        warn("%s\n", "Can't start thread to dump sample history");
+        atomic_flag_clear(&history_dumping);
+    }
+    pthread_attr_destroy(&attr);
+}
+
+/*
+ * Our read and write style syscalls so far, from syscr and syscw in
+ * /proc/self/io, or 0 if it can't be read. Other syscalls, like epoll_wait()
+ * or sendmsg(), aren't counted there. It's a syscall itself, so it's only read
+ * at startup, on SIGUSR1, and at exit.
+ */
+static uint64_t self_rw_syscalls(void) {
+    char buf[256];
+    const char *r, *w;
+    ssize_t len = -1;
+    int fd = open("/proc/self/io", O_RDONLY | O_CLOEXEC);
+
+    if (fd >= 0) {
+        len = read(fd, buf, sizeof(buf) - 1);
+        close(fd);
+    }
+    if (len <= 0) {
+        return 0;
+    }
+    buf[len] = '\0';
+
+    r = strstr(buf, "syscr: ");
+    w = strstr(buf, "syscw: ");
+    if (!r || !w) {
+        return 0;
+    }
+    return strtoull(r + strlen("syscr: "), NULL, 10) +
+           strtoull(w + strlen("syscw: "), NULL, 10);
+}
+
+/* Our own CPU time since the last update, so over a whole loop iteration. */
+static void self_usage_update(void) {
+    static uint64_t last_cpu_usec;
+    struct timespec ts;
+    uint64_t cpu_usec;
+
+    expect(clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts) == 0);
+    cpu_usec = (uint64_t)ts.tv_sec * SEC_TO_USEC + (uint64_t)ts.tv_nsec / 1000;
+    if (last_cpu_usec) {
+        stats.cpu_usec_last = cpu_usec - last_cpu_usec;
+        stats.cpu_usec_total += stats.cpu_usec_last;
+    } else {
+        stats.rw_syscalls_start = self_rw_syscalls();
+    }
+    last_cpu_usec = cpu_usec;
+}
+
+static void self_stats_dump_one(const char *name, const LatencyHistogram *h) {
+    uint64_t count = atomic_load_explicit(&h->count, memory_order_relaxed);
+
+    if (!count) {
+        return;
+    }
+
+    info("  %-16s %8" PRIu64 " %8" PRIu64 " %8" PRIu64 " %8" PRIu64
+         " %8" PRIu64 "\n",
+         name, count, latency_percentile(h, 50), latency_percentile(h, 90),
+         latency_percentile(h, 99), latency_percentile(h, 100));
+}
+
+/* For SIGUSR1 and exit */
+static void self_stats_dump(void) {
+    info("%s\n", "How long psi-notify takes itself, in microseconds:");
+    info("  %-16s %8s %8s %8s %8s %8s\n", "", "count", "p50", "p90", "p99",
+         "max");
+    self_stats_dump_one("pressure_check", &stats.pressure_check);
+    self_stats_dump_one("blocked_tasks", &stats.blocked_tasks);
+    self_stats_dump_one("notify_show", &stats.notify_show);
+    self_stats_dump_one("notify_close", &stats.notify_close);
+    self_stats_dump_one("update", &stats.update);
+    self_stats_dump_one("timer_late", &stats.timer_late);
+
+    if (stats.checks > 1) {
+        uint64_t rw = self_rw_syscalls();
+
+        info("  Per update: %.0fus CPU on average, the last %" PRIu64 "us\n",
+             (double)stats.cpu_usec_total / (double)(stats.checks - 1),
+             stats.cpu_usec_last);
+        if (rw && stats.rw_syscalls_start) {
+            info("  Per update: %.1f read/write syscalls on average\n",
+                 (double)(rw - stats.rw_syscalls_start) /
+                     (double)(stats.checks - 1));
+        }
+    }
+}
+
+/*
+ * OpenMetrics exporter, see the metrics_socket option. The text is rendered
+ * once after each update, so answering a scrape is just accept(), one send()
+ * and close(), none of which wait on the client or allocate.
+ */
+#define METRICS_BUF_LEN 16384
+#define METRICS_BACKLOG 16
+
+static struct {
+    int listen_fd;
+    char path[PATH_MAX];
+    char buf[METRICS_BUF_LEN];
+    size_t len;
+} metrics = {.listen_fd = -1};
+
+static void __attribute__((format(printf, 1, 2)))
+metrics_append(const char *fmt, ...) {
+    size_t avail = sizeof(metrics.buf) - metrics.len;
+    va_list ap;
+    int needed;
+
+    va_start(ap, fmt);
+    needed = vsnprintf(metrics.buf + metrics.len, avail, fmt, ap);
+    va_end(ap);
+
+    expect(needed >= 0 && (size_t)needed < avail);
+    metrics.len += (size_t)needed;
+}
+
+static void metrics_family(const char *name, const char *type,
+                           const char *help) {
+    metrics_append("# TYPE %s %s\n# HELP %s %s\n", name, type, name, help);
+}
+
+/* Kernel windows first, then custom ones, for pressures or thresholds */
+static void metrics_append_windows(const char *name, const Resource *r,
+                                   bool full, bool thresholds) {
+    const Pressure *p = thresholds ? &r->thresholds : NULL;
+    const PressureLine *cur = full ? &r->current.full : &r->current.some;
+    const char *kind = full ? "full" : "some";
+    const double kernel[] = {
+        p ? (full ? p->avg10.full : p->avg10.some) : cur->avg10,
+        p ? (full ? p->avg60.full : p->avg60.some) : cur->avg60,
+        p ? (full ? p->avg300.full : p->avg300.some) : cur->avg300,
+    };
+    const unsigned int kernel_sec[] = {10, 60, 300};
+    size_t i;
+
+    for_each_arr(i, kernel) {
+        if (kernel[i] >= 0) {
+            metrics_append("%s{resource=\"%s\",kind=\"%s\",window=\"avg%u\"} "
+                           "%.2f\n",
+                           name, res_keys[r->type], kind, kernel_sec[i],
+                           kernel[i]);
+        }
+    }
+
+    for (i = 0; i < r->nr_windows; i++) {
+        const CustomWindow *w = &r->windows[i];
+        const TimeResourcePressure *t =
+            thresholds ? &w->thresholds : &w->current;
+        double val = full ? t->full : t->some;
+
+        if (val >= 0) {
+            metrics_append("%s{resource=\"%s\",kind=\"%s\",window=\"avg%u\"} "
+                           "%.2f\n",
+                           name, res_keys[r->type], kind, w->window_sec, val);
+        }
+    }
+}
+
+static void metrics_render(void) {
+    char seat_path[PATH_MAX];
+    size_t i, j;
+
+    metrics.len = 0;
+
+    metrics_family("psi_notify_source", "info", "Where pressures are read.");
+    if (using_seat) {
+        get_seat_cgroup_path(seat_path);
+        metrics_append("psi_notify_source_info{scope=\"seat\",path=\"%s\"} 1\n",
+                       seat_path);
+    } else {
+        metrics_append("%s\n", "psi_notify_source_info{scope=\"system\","
+                               "path=\"/proc/pressure\"} 1");
+    }
+
+    metrics_family("psi_notify_pressure_percent", "gauge",
+                   "Stall percentage as of the last update.");
+    for_each_arr(i, all_res) {
+        if (all_res[i]->filename) {
+            metrics_append_windows("psi_notify_pressure_percent", all_res[i],
+                                   false, false);
+            if (all_res[i]->has_full) {
+                metrics_append_windows("psi_notify_pressure_percent",
+                                       all_res[i], true, false);
+            }
+        }
+    }
+
+    metrics_family("psi_notify_stall_seconds", "counter",
+                   "Total stall time, from total=.");
+    for_each_arr(i, all_res) {
+        const Resource *r = all_res[i];
+        if (r->filename) {
+            metrics_append("psi_notify_stall_seconds_total{resource=\"%s\","
+                           "kind=\"some\"} %.6f\n",
+                           res_keys[i],
+                           (double)r->current.some.total / SEC_TO_USEC);
+            if (r->has_full) {
+                metrics_append("psi_notify_stall_seconds_total{resource=\"%s\","
+                               "kind=\"full\"} %.6f\n",
+                               res_keys[i],
+                               (double)r->current.full.total / SEC_TO_USEC);
+            }
+        }
+    }
+
+    metrics_family("psi_notify_threshold_percent", "gauge",
+                   "Configured alert thresholds.");
+    for_each_arr(i, all_res) {
+        metrics_append_windows("psi_notify_threshold_percent", all_res[i],
+                               false, true);
+        if (all_res[i]->has_full) {
+            metrics_append_windows("psi_notify_threshold_percent", all_res[i],
+                                   true, true);
+        }
+    }
+
+    metrics_family("psi_notify_alert", "stateset", "Alert state.");
+    for_each_arr(i, active_notif) {
+        for_each_arr(j, alert_state_names) {
+            metrics_append("psi_notify_alert{resource=\"%s\","
+                           "psi_notify_alert=\"%s\"} %d\n",
+                           res_keys[i], alert_state_names[j],
+                           active_notif[i].last_state == (AlertState)j);
+        }
+    }
+
+    metrics_family("psi_notify_alert_transitions", "counter",
+                   "Alert state changes, by the state changed to.");
+    for_each_arr(i, active_notif) {
+        for_each_arr(j, alert_state_names) {
+            metrics_append("psi_notify_alert_transitions_total{resource=\"%s\","
+                           "state=\"%s\"} %" PRIu64 "\n",
+                           res_keys[i], alert_state_names[j],
+                           stats.transitions[i][j]);
+        }
+    }
+
+    metrics_family("psi_notify_check_duration_seconds", "summary",
+                   "Time taken by each update.");
+    metrics_append("psi_notify_check_duration_seconds_count %" PRIu64 "\n"
+                   "psi_notify_check_duration_seconds_sum %.6f\n",
+                   stats.checks,
+                   (double)stats.check_usec_total / SEC_TO_USEC);
+    metrics_family("psi_notify_check_duration_max_seconds", "gauge",
+                   "Longest time taken by an update.");
+    metrics_append("psi_notify_check_duration_max_seconds %.6f\n",
+                   (double)stats.check_usec_max / SEC_TO_USEC);
+
+    metrics_family("psi_notify_update_interval_seconds", "gauge",
+                   "Current update interval, 0 if waiting for triggers.");
+    metrics_append("psi_notify_update_interval_seconds %.3f\n",
+                   (double)loop.armed_ms / SEC_TO_MSEC);
+
+    metrics_append("%s\n", "# EOF");
+}
+
+/*
+ * Sets O_CLOEXEC as the fd is made, or a seat helper or action forked on
+ * another thread meanwhile would inherit it. accept4() itself is only declared
+ * with _GNU_SOURCE.
+ */
+static int accept_cloexec(int listen_fd) {
+    return (int)syscall(
+        SYS_accept4, listen_fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+}
+
+/* Clients get the whole thing on connect, no request needed. */
+static void metrics_serve(void) {
+    int fd;
+
+    while ((fd = accept_cloexec(metrics.listen_fd)) >= 0) {
+        /* If it doesn't fit in the socket buffer, they get a short read */
+        (void)send(fd, metrics.buf, metrics.len, MSG_DONTWAIT | MSG_NOSIGNAL);
+        close(fd);
+    }
+}
+
+static int metrics_open(const char *path) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    struct stat st;
+    int fd, ret;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        warn("Metrics socket path is too long: %s\n", path);
+        return -ENAMETOOLONG;
+    }
+    snprintf_check(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+
+    /* Probably left behind by an earlier run which didn't exit cleanly */
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        (void)unlink(path);
+    }
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(fd, METRICS_BACKLOG) < 0) {
+        ret = -errno;
+        warn("Can't listen on %s: %s\n", path, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        return ret;
+    }
+
+    metrics.listen_fd = fd;
+    snprintf_check(metrics.path, sizeof(metrics.path), "%s", path);
+    loop_add(fd, EPOLLIN, EV_METRICS);
+
+    return 0;
+}
+
+static void metrics_close(void) {
+    if (metrics.listen_fd < 0) {
+        return;
+    }
+
+    close(metrics.listen_fd);
+    (void)unlink(metrics.path);
+    metrics.listen_fd = -1;
+    metrics.path[0] = '\0';
+}
+
+static void metrics_apply_config(void) {
+    if (metrics.listen_fd >= 0 && !streq(metrics.path, cfg.metrics_path)) {
+        metrics_close();
+    }
+
+    if (*cfg.metrics_path && metrics.listen_fd < 0 &&
+        metrics_open(cfg.metrics_path) == 0) {
+        info("Serving metrics on %s.\n", cfg.metrics_path);
+    }
+}
+
+/*
+ * Subscribers, see the subscribe_socket option. Clients get a line for every
+ * alert state change, and with "samples on", every sample too. Output goes
+ * through a fixed size buffer per client, and clients which let it fill up are
+ * dropped, so nobody can make us wait or allocate.
+ */
+#define SUBSCRIBERS_MAX 64
+#define SUBSCRIBER_BUF_LEN 4096
+#define SUBSCRIBER_CMD_MAX 32
+#define SUBSCRIBER_LINE_MAX 256
+#define SUBSCRIBE_BACKLOG 16
+
+typedef struct {
+    bool used;
+    bool samples;     /* Asked for every sample, not just alerts */
+    bool read_closed; /* They shut down their side, but may still read */
+    bool want_out;    /* Registered for EPOLLOUT */
+    int fd;
+    size_t in_len;
+    size_t out_len;
+    char in[SUBSCRIBER_CMD_MAX];
+    char out[SUBSCRIBER_BUF_LEN];
+} Subscriber;
+
+static struct {
+    int listen_fd;
+    char path[PATH_MAX];
+    Subscriber clients[SUBSCRIBERS_MAX];
+    AlertState published[NR_RESOURCES]; /* What subscribers were last told */
+    bool full_warned;
+} subs = {.listen_fd = -1};
+
+static void subscriber_drop(Subscriber *c) {
+    close(c->fd);
+    c->used = false;
+}
+
+static void subscriber_update_events(Subscriber *c) {
+    bool want_out = c->out_len > 0;
+    uint32_t events = (c->read_closed ? 0 : EPOLLIN) |
+                      (want_out ? EPOLLOUT : 0);
+
+    loop_ctl(EPOLL_CTL_MOD,
+             c->fd,
+             events,
+             EV_SUBSCRIBER,
+             (uint32_t)(c - subs.clients));
+    c->want_out = want_out;
+}
+
+static void subscriber_flush(Subscriber *c) {
+    size_t done = 0;
+
+    while (done < c->out_len) {
+        ssize_t n = send(c->fd, c->out + done, c->out_len - done,
+                         MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            subscriber_drop(c);
+            return;
+        }
+        done += (size_t)n;
+    }
+
+    memmove(c->out, c->out + done, c->out_len - done);
+    c->out_len -= done;
+
+    if (c->want_out != (c->out_len > 0)) {
+        subscriber_update_events(c);
+    }
+}
+
+/* Queues a line, without sending it yet. Returns false if c was dropped. */
+static bool subscriber_queue(Subscriber *c, const char *line, size_t len) {
+    if (c->out_len + len > sizeof(c->out)) {
+        warn("%s\n", "Dropping subscriber which isn't keeping up");
+        subscriber_drop(c);
+        return false;
+    }
+
+    memcpy(c->out + c->out_len, line, len);
+    c->out_len += len;
+    return true;
+}
+
+static size_t subscriber_alert_line(char *buf, ResourceType rt,
+                                    AlertState state) {
+    int len = snprintf(buf, SUBSCRIBER_LINE_MAX, "alert %s %s\n", res_keys[rt],
+                       alert_state_names[state]);
+    expect(len > 0 && len < SUBSCRIBER_LINE_MAX);
+    return (size_t)len;
+}
+
+static size_t subscriber_sample_line(char *buf, const Resource *r) {
+    const PressureLine *some = &r->current.some, *full = &r->current.full;
+    int len;
+
+    if (r->has_full) {
+        len = snprintf(buf, SUBSCRIBER_LINE_MAX,
+                       "sample %s some avg10=%.2f avg60=%.2f avg300=%.2f "
+                       "total=%" PRIu64 " full avg10=%.2f avg60=%.2f "
+                       "avg300=%.2f total=%" PRIu64 "\n",
+                       res_keys[r->type], some->avg10, some->avg60,
+                       some->avg300, some->total, full->avg10, full->avg60,
+                       full->avg300, full->total);
+    } else {
+        len = snprintf(buf, SUBSCRIBER_LINE_MAX,
+                       "sample %s some avg10=%.2f avg60=%.2f avg300=%.2f "
+                       "total=%" PRIu64 "\n",
+                       res_keys[r->type], some->avg10, some->avg60,
+                       some->avg300, some->total);
+    }
+
+    expect(len > 0 && len < SUBSCRIBER_LINE_MAX);
+    return (size_t)len;
+}
+
+static void subscriber_command(Subscriber *c, const char *cmd) {
+    static const char unknown[] = "error unknown command\n";
+
+    if (streq(cmd, "samples on")) {
+        c->samples = true;
+    } else if (streq(cmd, "samples off")) {
+        c->samples = false;
+    } else if (!subscriber_queue(c, unknown, sizeof(unknown) - 1)) {
+        return;
+    }
+
+    subscriber_flush(c);
+}
+
+static void subscriber_read(Subscriber *c) {
+    char buf[SUBSCRIBER_CMD_MAX];
+    ssize_t n, i;
+
+    n = recv(c->fd, buf, sizeof(buf), MSG_DONTWAIT);
+    if (n == 0) {
+        c->read_closed = true;
+        subscriber_update_events(c);
+        return;
+    } else if (n < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            subscriber_drop(c);
+        }
+        return;
+    }
+
+    for (i = 0; i < n && c->used; i++) {
+        if (buf[i] != '\n') {
+            if (c->in_len == sizeof(c->in) - 1) {
+                warn("%s\n", "Dropping subscriber which sent a bad command");
+                subscriber_drop(c);
+                return;
+            }
+            c->in[c->in_len++] = buf[i];
+            continue;
+        }
+
+        c->in[c->in_len] = '\0';
+        c->in_len = 0;
+        subscriber_command(c, c->in);
+    }
+}
+
+static void subscriber_event(uint32_t idx, uint32_t events) {
+    Subscriber *c;
+
+    expect(idx < SUBSCRIBERS_MAX);
+    c = &subs.clients[idx];
+
+    /* Dropped earlier in this epoll_wait() batch */
+    if (!c->used) {
+        return;
+    }
+
+    if (events & EPOLLIN) {
+        subscriber_read(c);
+    }
+    if (c->used && (events & EPOLLOUT)) {
+        subscriber_flush(c);
+    }
+    if (c->used && (events & (EPOLLERR | EPOLLHUP))) {
+        subscriber_drop(c);
+    }
+}
+
+/* New subscribers start with the current state of every alert. */
+static void subscribers_accept(void) {
+    char line[SUBSCRIBER_LINE_MAX];
+    int fd;
+
+    while ((fd = accept_cloexec(subs.listen_fd)) >= 0) {
+        Subscriber *c = NULL;
+        size_t i;
+
+        for_each_arr(i, subs.clients) {
+            if (!subs.clients[i].used) {
+                c = &subs.clients[i];
+                break;
+            }
+        }
+
+        if (!c) {
+            if (!subs.full_warned) {
+                warn("Already have %d subscribers, refusing more\n",
+                     SUBSCRIBERS_MAX);
+                subs.full_warned = true;
+            }
+            close(fd);
+            continue;
+        }
+
+        *c = (Subscriber){.used = true, .fd = fd};
+        loop_ctl(EPOLL_CTL_ADD, fd, EPOLLIN, EV_SUBSCRIBER, (uint32_t)i);
+
+        for_each_arr(i, subs.published) {
+            size_t len = subscriber_alert_line(line, (ResourceType)i,
+                                               subs.published[i]);
+            expect(subscriber_queue(c, line, len));
+        }
+        subscriber_flush(c);
+    }
+}
+
+/* Called after each update to tell subscribers what changed. */
+static void subscribers_publish(void) {
+    char line[SUBSCRIBER_LINE_MAX];
+    size_t i, j, len;
+
+    for_each_arr(i, all_res) {
+        AlertState state = active_notif[i].last_state;
+
+        if (state != subs.published[i]) {
+            len = subscriber_alert_line(line, (ResourceType)i, state);
+            for_each_arr(j, subs.clients) {
+                if (subs.clients[j].used) {
+                    subscriber_queue(&subs.clients[j], line, len);
+                }
+            }
+            subs.published[i] = state;
+        }
+
+        if (!all_res[i]->filename) {
+            continue;
+        }
+
+        len = subscriber_sample_line(line, all_res[i]);
+        for_each_arr(j, subs.clients) {
+            if (subs.clients[j].used && subs.clients[j].samples) {
+                subscriber_queue(&subs.clients[j], line, len);
+            }
+        }
+    }
+
+    for_each_arr(j, subs.clients) {
+        if (subs.clients[j].used && subs.clients[j].out_len > 0) {
+            subscriber_flush(&subs.clients[j]);
+        }
+    }
+}
+
+static int subscribers_open(const char *path) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    struct stat st;
+    size_t i;
+    int fd, ret;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        warn("Subscription socket path is too long: %s\n", path);
+        return -ENAMETOOLONG;
+    }
+    snprintf_check(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+
+    /* Probably left behind by an earlier run which didn't exit cleanly */
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        (void)unlink(path);
+    }
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(fd, SUBSCRIBE_BACKLOG) < 0) {
+        ret = -errno;
+        warn("Can't listen on %s: %s\n", path, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        return ret;
+    }
+
+    subs.listen_fd = fd;
+    snprintf_check(subs.path, sizeof(subs.path), "%s", path);
+    for_each_arr(i, subs.published) {
+        subs.published[i] = active_notif[i].last_state;
+    }
+    loop_add(fd, EPOLLIN, EV_SUBSCRIBE);
+
+    return 0;
+}
+
+static void subscribers_close(void) {
+    size_t i;
+
+    if (subs.listen_fd < 0) {
+        return;
+    }
+
+    for_each_arr(i, subs.clients) {
+        if (subs.clients[i].used) {
+            subscriber_drop(&subs.clients[i]);
+        }
+    }
+
+    close(subs.listen_fd);
+    (void)unlink(subs.path);
+    subs.listen_fd = -1;
+    subs.path[0] = '\0';
+    subs.full_warned = false;
+}
+
+static void subscribers_apply_config(void) {
+    if (subs.listen_fd >= 0 && !streq(subs.path, cfg.subscribe_path)) {
+        subscribers_close();
+    }
+
+    if (*cfg.subscribe_path && subs.listen_fd < 0 &&
+        subscribers_open(cfg.subscribe_path) == 0) {
+        info("Accepting subscribers on %s.\n", cfg.subscribe_path);
+    }
+}
+
+/* In increasing order of precedence when several things happen at once */
+typedef enum { LOOP_NONE, LOOP_TICK, LOOP_RELOAD, LOOP_EXIT } LoopAction;
+
+static LoopAction loop_handle_signal(void) {
+    struct signalfd_siginfo si;
+    LoopAction action = LOOP_NONE;
+
+    while (read(loop.signal_fd, &si, sizeof(si)) == sizeof(si)) {
+        if (si.ssi_signo == SIGUSR1) {
+            self_stats_dump();
+            history_dump_start();
+        } else if (si.ssi_signo == SIGCHLD) {
+            /* Several exits may be merged into one signal */
+            while (waitpid(-1, NULL, WNOHANG) > 0)
+                ;
+        } else if (si.ssi_signo == SIGHUP) {
+            action = action == LOOP_EXIT ? LOOP_EXIT : LOOP_RELOAD;
+        } else {
+            action = LOOP_EXIT;
+        }
+    }
+
+    return action;
+}
+
+static void loop_handle_timer(void) {
+    uint64_t expirations;
+
+    if (read(loop.timer_fd, &expirations, sizeof(expirations)) !=
+        sizeof(expirations)) {
+        return;
+    }
+
+    /* It fires every armed_ms from when it was armed, so this is how late */
+    if (loop.armed_ms > 0) {
+        latency_record(&stats.timer_late,
+                       (now_usec() - loop.armed_usec) %
+                           ((uint64_t)loop.armed_ms * MSEC_TO_USEC));
+    }
+
+    if (expirations > 1) {
+        warn("Timer elapsed %" PRIu64 " times before we completed one event "
+             "loop.\n",
+             expirations);
+    }
+}
+
+/* Waits until it's time for the next update, or a signal. */
+static LoopAction loop_wait(void) {
+    struct epoll_event events[TRIGGERS_MAX + 3];
+    int64_t interval_ms = adaptive_interval_ms();
+    int nr, i, timeout = -1;
+    bool accept_subscribers = false;
+    LoopAction action = LOOP_NONE;
+
+    if (triggers_idle_ok()) {
+        /* Nothing to clear up, so just wait for the kernel to tell us. */
+        interval_ms = sdn.fd >= 0 ? TRIGGER_IDLE_TIMEOUT_SEC * SEC_TO_MSEC : 0;
+    } else if (interval_ms == 0) {
+        /* update 0: don't wait at all, but still pick up any signals */
+        timeout = 0;
+    }
+
+    loop_set_interval(interval_ms);
+
+    /*
+     * Some signals, like SIGUSR1, scrapes, and subscribers are handled here
+     * without another check.
+     */
+    while (action == LOOP_NONE) {
+        nr = epoll_wait(loop.epoll_fd,
+                        events,
+                        (int)(sizeof(events) / sizeof(events[0])),
+                        timeout);
+        if (nr < 0) {
+            expect(errno == EINTR);
+            return LOOP_TICK;
+        }
+        if (nr == 0) {
+            return LOOP_TICK;
+        }
+
+        for (i = 0; i < nr; i++) {
+            uint32_t idx = (uint32_t)(events[i].data.u64 >> 32);
+            LoopAction signal_action;
+
+            switch ((EventSource)(events[i].data.u64 & UINT32_MAX)) {
+                case EV_TIMER:
+                    loop_handle_timer();
+                    action = action > LOOP_TICK ? action : LOOP_TICK;
+                    break;
+                case EV_SIGNAL:
+                    signal_action = loop_handle_signal();
+                    action = action > signal_action ? action : signal_action;
+                    break;
+                case EV_TRIGGER:
+                    action = action > LOOP_TICK ? action : LOOP_TICK;
+                    if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                        /* Probably the cgroup went away, so the triggers too */
+                        warn("%s\n",
+                             "PSI trigger went away, registering again");
+                        triggers_register_all();
+                        /* Other events may refer to closed fds now, stop. */
+                        return action;
+                    }
+                    break;
+                case EV_METRICS:
+                    metrics_serve();
+                    break;
+                case EV_SUBSCRIBE:
+                    /* After the rest, so slots aren't reused under them */
+                    accept_subscribers = true;
+                    break;
+                case EV_SUBSCRIBER:
+                    subscriber_event(idx, events[i].events);
+                    break;
+                default:
+                    unreachable();
+            }
+        }
+
+        if (accept_subscribers) {
+            subscribers_accept();
+            accept_subscribers = false;
+        }
+    }
+
+    return action;
+}
+
+/* If running under AFL, just run the code and exit. Returns 1 if fuzzing. */
+static int check_fuzzers(void) {
+    const char *const fuzz_config_file = getenv("FUZZ_CONFIGS");
+    const char *const fuzz_pressure_file = getenv("FUZZ_PRESSURES");
+
+    if (fuzz_pressure_file) {
+        Resource r = {.fd = -1};
+        FILE *f = fopen(fuzz_pressure_file, "re");
+
+        expect(f);
+        (void)pressure_check(&r, f);
+        return 1;
+    }
+
+    if (fuzz_config_file) {
+        FILE *f = fopen(fuzz_config_file, "re");
+
+        expect(f);
+        expect(config_init(&f) == 0);
+        free(cfg.cpu.filename);
+        free(cfg.memory.filename);
+        free(cfg.io.filename);
+        return 1;
+    }
+
+    return 0;
+}
+
+#define print_single_thresh(res, time, type)                                   \
+    expect(*res->human_name);                                                  \
+    if (res->thresholds.time.type >= 0)                                        \
+    printf("        - %c%s %s %s: %.2f\n",                                     \
+           toupper(res->human_name[0]),                                        \
+           res->human_name + 1,                                                \
+           #time,                                                              \
+           #type,                                                              \
+           res->thresholds.time.type)
+
+#define print_profile_thresh(res, thresh, time, type)                          \
+    if ((thresh)->time.type >= 0)                                              \
+    printf("        - %c%s %s %s: %.2f\n",                                     \
+           toupper(res->human_name[0]),                                        \
+           res->human_name + 1,                                                \
+           #time,                                                              \
+           #type,                                                              \
+           (thresh)->time.type)
+
+static void print_custom_thresh(const Resource *r) {
+    size_t i;
+    for (i = 0; i < r->nr_windows; i++) {
+        const CustomWindow *w = &r->windows[i];
+        const double thresh[] = {w->thresholds.some, w->thresholds.full};
+        const char *const type[] = {"some", "full"};
+        size_t j;
+
+        for_each_arr(j, thresh) {
+            if (thresh[j] >= 0) {
+                printf("        - %c%s avg%u %s: %.2f\n",
+                       toupper(r->human_name[0]),
+                       r->human_name + 1,
+                       w->window_sec,
+                       type[j],
+                       thresh[j]);
+            }
+        }
+
+        if (cfg.update_interval_ms > 0 &&
+            (int64_t)w->window_sec * SEC_TO_MSEC / cfg.update_interval_ms >=
+                TOTALS_HISTORY_LEN) {
+            warn("avg%u is too long to track at this update interval, it "
+                 "will be shortened\n",
+                 w->window_sec);
+        }
+
+        if ((int64_t)w->window_sec * SEC_TO_MSEC < cfg.update_interval_ms ||
+            (int64_t)w->window_sec * SEC_TO_MSEC < cfg.update_max_ms) {
+            warn("avg%u is shorter than the update interval, it won't be "
+                 "checked while updates are further apart\n",
+                 w->window_sec);
+        }
+    }
+}
+
+static void print_config(void) {
+    size_t i;
+    const char *header = "Config";
+
+    if (config_reloading) {
+        header = "Config reloaded. New config after reload";
+    }
+
+    info("%s:\n\n", header);
+
+    printf("      Log pressures: %s\n", cfg.log_pressures ? "true" : "false");
+    printf("      Update interval: %gs\n",
+           (double)cfg.update_interval_ms / SEC_TO_MSEC);
+    if (cfg.update_min_ms) {
+        printf("      Adaptive update interval: %gs to %gs\n",
+               (double)cfg.update_min_ms / SEC_TO_MSEC,
+               (double)cfg.update_max_ms / SEC_TO_MSEC);
+    }
+    if (cfg.predict_horizon_sec > 0) {
+        printf("      Prediction horizon: %gs\n", cfg.predict_horizon_sec);
+    }
+    printf("      PSI triggers: %s\n", cfg.use_triggers ? "true" : "false");
+    printf("      io_uring: %s\n", cfg.use_io_uring ? "true" : "false");
+    printf("      Lock memory: %s\n\n", cfg.lock_memory ? "true" : "false");
+
+    printf("      Thresholds:\n");
+    for_each_arr(i, all_res) {
+        const Resource *r = all_res[i];
+        print_single_thresh(r, avg10, some);
+        print_single_thresh(r, avg10, full);
+        print_single_thresh(r, avg60, some);
+        print_single_thresh(r, avg60, full);
+        print_single_thresh(r, avg300, some);
+        print_single_thresh(r, avg300, full);
+        print_custom_thresh(r);
+    }
+
+    if (cfg.nr_rules > 0) {
+        printf("\n      Rules:\n");
+        for (i = 0; i < cfg.nr_rules; i++) {
+            printf("        - %s: %s\n", cfg.rules[i].name, cfg.rules[i].expr);
+        }
+    }
+
+    if (cfg.nr_actions > 0) {
+        printf("\n      Actions:\n");
+        for (i = 0; i < cfg.nr_actions; i++) {
+            const Action *action = &cfg.actions[i];
+            printf("        - %s: %s %s %s (cooldown %" PRIu64 "s)\n",
+                   res_keys[action->resource],
+                   action->kind == ACTION_SET ? "set" : "exec",
+                   action->path,
+                   action->arg,
+                   action->cooldown_usec / SEC_TO_USEC);
+        }
+    }
+
+    if (*cfg.record_path) {
+        printf("\n      Recording to: %s\n", cfg.record_path);
+    }
+
+    if (*cfg.metrics_path) {
+        printf("\n      Metrics socket: %s\n", cfg.metrics_path);
+    }
+
+    if (*cfg.subscribe_path) {
+        printf("\n      Subscription socket: %s\n", cfg.subscribe_path);
+    }
+
+    if (*cfg.cgroup_root) {
+        printf("\n      Cgroup root: %s\n", cfg.cgroup_root);
+        for (i = 0; i < cfg.nr_cgroup_profiles; i++) {
+            const CgroupProfile *p = &cfg.cgroup_profiles[i];
+            size_t rt;
+
+            printf("      Cgroup thresholds for %s:\n", p->pattern);
+            for (rt = 0; rt < NR_RESOURCES; rt++) {
+                const Resource *r = all_res[rt];
+                const Pressure *t = &p->thresholds[rt];
+                print_profile_thresh(r, t, avg10, some);
+                print_profile_thresh(r, t, avg10, full);
+                print_profile_thresh(r, t, avg60, some);
+                print_profile_thresh(r, t, avg60, full);
+                print_profile_thresh(r, t, avg300, some);
+                print_profile_thresh(r, t, avg300, full);
+            }
+        }
+    }
+
+    printf("\n");
+}
+
+/*
+ * Recording: samples go to an mmapped file as they're taken, and are rolled up
+ * into per-minute and per-hour records. Each tier is a ring of blocks, so old
+ * data is overwritten once it fills up, giving bounded retention in a fixed
+ * amount of space.
+ */
+static const uint32_t record_tier_blocks[NR_TIERS] = {
+    [TIER_SECOND] = 512, /* About a day, depending on how noisy totals are */
+    [TIER_MINUTE] = 256, /* About a month */
+    [TIER_HOUR] = 64,    /* Most of a year */
+};
+static const int64_t record_tier_sec[NR_TIERS] = {1, 60, 3600};
+static const char *const record_tier_names[NR_TIERS] = {"1s", "1m", "1h"};
+
+#define RECORD_PAYLOAD_SIZE (RECORD_BLOCK_SIZE - sizeof(RecordBlockHeader))
+#define VARINT_MAX 10
+#define RECORD_SAMPLE_MAX ((RECORD_NR_VALUES + 1) * VARINT_MAX)
+
+static struct {
+    int fd;
+    char path[PATH_MAX];
+    uint8_t *map;
+    size_t map_len;
+    bool block_open[NR_TIERS]; /* We start a new block for each tier on open */
+    RecordSample last[NR_TIERS]; /* Previous sample in the open block */
+    RecordSample rollup[NR_TIERS]; /* Being accumulated, minute and hour only */
+    bool rollup_valid[NR_TIERS];
+} recorder = {.fd = -1};
+
+static size_t varint_put(uint8_t *p, uint64_t v) {
+    size_t n = 0;
+
+    while (v >= 0x80) {
+        p[n++] = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    p[n++] = (uint8_t)v;
+
+    return n;
+}
+
+/* Returns the number of bytes used, or 0 if it runs past len. */
+static size_t varint_get(const uint8_t *p, size_t len, uint64_t *v) {
+    size_t n;
+
+    *v = 0;
+    for (n = 0; n < len && n < VARINT_MAX; n++) {
+        *v |= (uint64_t)(p[n] & 0x7f) << (7 * n);
+        if (!(p[n] & 0x80)) {
+            return n + 1;
+        }
+    }
+
+    return 0;
+}
+
+static uint64_t zigzag(uint64_t cur, uint64_t prev) {
+    int64_t d = (int64_t)(cur - prev);
+    return ((uint64_t)d << 1) ^ (uint64_t)(d >> 63);
+}
+
+static uint64_t unzigzag(uint64_t z, uint64_t prev) {
+    return prev + ((z >> 1) ^ (uint64_t)-(int64_t)(z & 1));
+}
+
+static size_t record_block_offset(const RecordFileHeader *h, RecordTier tier,
+                                  uint32_t idx) {
+    size_t blocks = 1; /* The file header */
+    size_t t;
+
+    for (t = 0; t < (size_t)tier; t++) {
+        blocks += h->nr_blocks[t];
+    }
+
+    return (blocks + idx) * RECORD_BLOCK_SIZE;
+}
+
+static size_t record_file_len(const uint32_t *nr_blocks) {
+    size_t blocks = 1, t;
+
+    for (t = 0; t < NR_TIERS; t++) {
+        blocks += nr_blocks[t];
+    }
+
+    return blocks * RECORD_BLOCK_SIZE;
+}
+
+static bool record_header_valid(const RecordFileHeader *h, size_t len) {
+    size_t t;
+
+    if (memcmp(h->magic, RECORD_MAGIC, sizeof(RECORD_MAGIC)) != 0 ||
+        h->version != RECORD_VERSION || h->block_size != RECORD_BLOCK_SIZE ||
+        record_file_len(h->nr_blocks) != len) {
+        return false;
+    }
+
+    for (t = 0; t < NR_TIERS; t++) {
+        if (h->used[t] > h->nr_blocks[t] || h->head[t] >= h->nr_blocks[t]) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static int recorder_open(const char *path) {
+    size_t len = record_file_len(record_tier_blocks);
+    RecordFileHeader *h;
+    struct stat st;
+    void *map;
+    int fd;
+
+    fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        warn("Can't open record file %s: %s\n", path, strerror(errno));
+        goto err;
+    }
+
+    if (st.st_size == 0 && ftruncate(fd, (off_t)len) < 0) {
+        warn("Can't size record file %s: %s\n", path, strerror(errno));
+        goto err;
+    } else if (st.st_size != 0 && (size_t)st.st_size != len) {
+        /* Don't clobber something which isn't ours */
+        warn("%s isn't a psi-notify recording, not recording\n", path);
+        goto err;
+    }
+
+    map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        warn("Can't map record file %s: %s\n", path, strerror(errno));
+        goto err;
+    }
+
+    h = map;
+    if (st.st_size == 0) {
+        memcpy(h->magic, RECORD_MAGIC, sizeof(RECORD_MAGIC));
+        h->version = RECORD_VERSION;
+        h->block_size = RECORD_BLOCK_SIZE;
+        memcpy(h->nr_blocks, record_tier_blocks, sizeof(h->nr_blocks));
+    } else if (!record_header_valid(h, len)) {
+        warn("%s isn't a psi-notify recording, not recording\n", path);
+        munmap(map, len);
+        goto err;
+    }
+
+    recorder.fd = fd;
+    recorder.map = map;
+    recorder.map_len = len;
+    snprintf_check(recorder.path, sizeof(recorder.path), "%s", path);
+    memset(recorder.block_open, 0, sizeof(recorder.block_open));
+    memset(recorder.rollup_valid, 0, sizeof(recorder.rollup_valid));
+
+    return 0;
+
+err:
+    if (fd >= 0) {
+        close(fd);
+    }
+    return -1;
+}
+
+static RecordBlockHeader *recorder_new_block(RecordTier tier, int64_t ts) {
+    RecordFileHeader *h = (RecordFileHeader *)recorder.map;
+    RecordBlockHeader *b;
 
-        if (*config_path) {
-            if (errno == ENOENT) {
-                info("No config at %s, using defaults.\n", config_path);
-            } else {
-                warn("Using default config, cannot open %s: %s\n",
-                     config_path,
-                     strerror(errno));
-            }
+    if (h->used[tier] > 0) {
+        h->head[tier] = (h->head[tier] + 1) % h->nr_blocks[tier];
+    }
+    if (h->used[tier] < h->nr_blocks[tier]) {
+        h->used[tier]++;
+    }
+
+    b = (RecordBlockHeader *)(recorder.map +
+                              record_block_offset(h, tier, h->head[tier]));
+    b->nr_samples = 0;
+    b->nr_bytes = 0;
+    b->first_ts = ts;
+
+    memset(&recorder.last[tier], 0, sizeof(recorder.last[tier]));
+    recorder.last[tier].ts = ts;
+    recorder.block_open[tier] = true;
+
+    return b;
+}
+
+static void recorder_append(RecordTier tier, const RecordSample *s) {
+    const RecordFileHeader *h = (const RecordFileHeader *)recorder.map;
+    RecordSample *prev = &recorder.last[tier];
+    RecordBlockHeader *b =
+        (RecordBlockHeader *)(recorder.map +
+                              record_block_offset(h, tier, h->head[tier]));
+    uint8_t *p;
+    size_t n, i;
+
+    if (!recorder.block_open[tier] ||
+        b->nr_bytes + RECORD_SAMPLE_MAX > RECORD_PAYLOAD_SIZE) {
+        b = recorder_new_block(tier, s->ts);
+    }
+
+    p = (uint8_t *)(b + 1) + b->nr_bytes;
+    n = varint_put(p, zigzag((uint64_t)s->ts, (uint64_t)prev->ts));
+    for (i = 0; i < RECORD_NR_VALUES; i++) {
+        n += varint_put(p + n, zigzag(s->values[i], prev->values[i]));
+    }
+
+    /* Only count it once it's all there, in case we die halfway through */
+    b->nr_bytes += (uint32_t)n;
+    b->nr_samples++;
+    *prev = *s;
+}
+
+/* Rollups keep the worst avg10 seen in the period, and the last totals. */
+static void recorder_rollup(RecordTier tier, const RecordSample *s) {
+    RecordSample *acc = &recorder.rollup[tier];
+    int64_t period = s->ts - s->ts % record_tier_sec[tier];
+    size_t i;
+
+    if (recorder.rollup_valid[tier] && acc->ts != period) {
+        recorder_append(tier, acc);
+        recorder.rollup_valid[tier] = false;
+    }
+
+    if (!recorder.rollup_valid[tier]) {
+        *acc = *s;
+        acc->ts = period;
+        recorder.rollup_valid[tier] = true;
+        return;
+    }
+
+    for (i = 0; i < RECORD_NR_VALUES; i++) {
+        bool is_avg = i % RECORD_VALUES_PER_RESOURCE < 2;
+        if (!is_avg || s->values[i] > acc->values[i]) {
+            acc->values[i] = s->values[i];
         }
+    }
+}
 
-        config_reset_user_facing();
+static void recorder_add(const RecordSample *s) {
+    if (!recorder.block_open[TIER_SECOND] ||
+        s->ts != recorder.last[TIER_SECOND].ts) {
+        recorder_append(TIER_SECOND, s);
+    }
+    recorder_rollup(TIER_MINUTE, s);
+    recorder_rollup(TIER_HOUR, s);
+}
 
-        cfg.cpu.thresholds.avg10.some = 50.00;
-        cfg.memory.thresholds.avg10.some = 10.00;
-        cfg.io.thresholds.avg10.full = 15.00;
+static void record_current_pressures(void) {
+    RecordSample s;
+    struct timespec ts;
+    size_t i;
 
-        watchdog_update_usec();
-        return ret;
+    expect(clock_gettime(CLOCK_REALTIME, &ts) == 0);
+    s.ts = ts.tv_sec;
+
+    for_each_arr(i, all_res) {
+        const PressureSample *cur = &all_res[i]->current;
+        uint64_t *v = s.values + i * RECORD_VALUES_PER_RESOURCE;
+        v[0] = pct_to_centi(cur->some.avg10);
+        v[1] = pct_to_centi(cur->full.avg10);
+        v[2] = cur->some.total;
+        v[3] = cur->full.total;
     }
 
-    while (fgets(line, sizeof(line), f)) {
-        char lvalue[CONFIG_LINE_MAX];
-        size_t len = strlen(line);
+    recorder_add(&s);
+}
 
-        if (blank_line_or_comment(line)) {
-            continue;
+static void recorder_close(void) {
+    size_t t;
+
+    if (!recorder.map) {
+        return;
+    }
+
+    /* Partial periods are better than nothing, even if they recur later */
+    for (t = TIER_MINUTE; t < NR_TIERS; t++) {
+        if (recorder.rollup_valid[t]) {
+            recorder_append((RecordTier)t, &recorder.rollup[t]);
         }
+    }
 
-        if (len == CONFIG_LINE_MAX - 1 && line[len - 1] != '\n') {
-            int ch;
-            warn("Config line is too long to be valid, ignoring: %s\n", line);
-            while ((ch = fgetc(f)) != EOF && ch != '\n')
-                ;
-            continue;
+    msync(recorder.map, recorder.map_len, MS_ASYNC);
+    munmap(recorder.map, recorder.map_len);
+    close(recorder.fd);
+    recorder.map = NULL;
+    recorder.fd = -1;
+    recorder.path[0] = '\0';
+}
+
+static void recorder_apply_config(void) {
+    if (recorder.map && !streq(recorder.path, cfg.record_path)) {
+        recorder_close();
+    }
+
+    if (*cfg.record_path && !recorder.map &&
+        recorder_open(cfg.record_path) == 0) {
+        info("Recording pressures to %s.\n", cfg.record_path);
+    }
+}
+
+/*
+ * Calls fn on each sample from a tier of a recording between from and to,
+ * oldest first.
+ */
+static int record_foreach(const char *path, RecordTier tier, int64_t from,
+                          int64_t to, RecordSampleFn fn, void *data) {
+    const RecordFileHeader *h;
+    const uint8_t *map;
+    struct stat st;
+    uint32_t blk, first;
+    size_t i;
+    int fd, ret = 0;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        ret = -errno;
+        warn("Can't open %s: %s\n", path, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
         }
+        return ret;
+    }
 
-        if (sscanf(line, "%s", lvalue) != 1) {
-            warn("Invalid config line, ignoring: %s", line);
+    map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        ret = -errno;
+        warn("Can't map %s: %s\n", path, strerror(errno));
+        return ret;
+    }
+
+    h = (const RecordFileHeader *)map;
+    if ((size_t)st.st_size < sizeof(*h) ||
+        !record_header_valid(h, (size_t)st.st_size)) {
+        warn("%s isn't a psi-notify recording\n", path);
+        ret = -EINVAL;
+        goto out;
+    }
+
+    first = h->used[tier] == h->nr_blocks[tier]
+                ? (h->head[tier] + 1) % h->nr_blocks[tier]
+                : 0;
+
+    for (blk = 0; blk < h->used[tier]; blk++) {
+        uint32_t idx = (first + blk) % h->nr_blocks[tier];
+        const RecordBlockHeader *b =
+            (const RecordBlockHeader *)(map +
+                                        record_block_offset(h, tier, idx));
+        const uint8_t *p = (const uint8_t *)(b + 1);
+        size_t len = b->nr_bytes, pos = 0;
+        RecordSample s = {.ts = b->first_ts};
+        uint32_t n;
+
+        if (len > RECORD_PAYLOAD_SIZE) {
+            warn("Block %" PRIu32 " in %s is corrupt, skipping\n", idx, path);
             continue;
         }
 
-        if (streq(lvalue, "threshold")) {
-            config_update_threshold(line);
-        } else if (streq(lvalue, "update")) {
-            config_update_interval(line);
-        } else if (streq(lvalue, "log_pressures")) {
-            config_update_log_pressures(line);
-        } else {
-            warn("Invalid config line, ignoring: %s", line);
-            continue;
+        for (n = 0; n < b->nr_samples; n++) {
+            uint64_t z;
+            size_t used = varint_get(p + pos, len - pos, &z);
+
+            if (!used) {
+                break;
+            }
+            pos += used;
+            s.ts = (int64_t)unzigzag(z, (uint64_t)s.ts);
+
+            for (i = 0; i < RECORD_NR_VALUES; i++) {
+                used = varint_get(p + pos, len - pos, &z);
+                if (!used) {
+                    break;
+                }
+                pos += used;
+                s.values[i] = unzigzag(z, s.values[i]);
+            }
+            if (i < RECORD_NR_VALUES) {
+                warn("Block %" PRIu32 " in %s is truncated\n", idx, path);
+                break;
+            }
+
+            if (s.ts >= from && s.ts <= to) {
+                fn(&s, data);
+            }
         }
     }
 
-    fclose(f);
-    watchdog_update_usec();
+out:
+    munmap((void *)map, (size_t)st.st_size);
     return ret;
 }
 
-static int config_init(FILE **override_config) {
-    int psi_dir_fd;
-    static bool already_ran = false;
+static void record_export_sample(const RecordSample *s, void *data) {
+    FILE *out = data;
+    size_t i;
 
-    expect(!already_ran);
-    already_ran = true;
+    fprintf(out, "%" PRId64, s->ts);
+    for (i = 0; i < RECORD_NR_VALUES; i++) {
+        if (i % RECORD_VALUES_PER_RESOURCE < 2) {
+            fprintf(out, ",%" PRIu64 ".%02" PRIu64, s->values[i] / 100,
+                    s->values[i] % 100);
+        } else {
+            fprintf(out, ",%" PRIu64, s->values[i]);
+        }
+    }
+    fprintf(out, "\n");
+}
 
-    cfg = (Config){0};
+/* Prints samples from a tier of a recording between from and to as CSV. */
+static int record_export(const char *path, RecordTier tier, int64_t from,
+                         int64_t to, FILE *out) {
+    size_t i;
 
-    psi_dir_fd = get_psi_dir_fd();
-    /* Tests should pass even with CONFIG_PSI=n */
-    if (psi_dir_fd < 0 && !override_config) {
-        warn("%s\n",
-             "No pressure dir found. "
-             "Are you using kernel >=4.20 with CONFIG_PSI=y?");
-        return psi_dir_fd;
+    fprintf(out, "time");
+    for_each_arr(i, res_keys) {
+        fprintf(out,
+                ",%s_some_avg10,%s_full_avg10,%s_some_total,%s_full_total",
+                res_keys[i], res_keys[i], res_keys[i], res_keys[i]);
     }
-    cfg.psi_dir_fd = psi_dir_fd;
+    fprintf(out, "\n");
 
-    cfg.cpu.filename = get_psi_filename("cpu", !!override_config);
-    cfg.cpu.type = RT_CPU;
-    cfg.cpu.human_name = "CPU";
-    cfg.cpu.has_full = false;
+    return record_foreach(path, tier, from, to, record_export_sample, out);
+}
 
-    cfg.memory.filename = get_psi_filename("memory", !!override_config);
-    cfg.memory.type = RT_MEMORY;
-    cfg.memory.human_name = "memory";
-    cfg.memory.has_full = true;
+/*
+ * avg60 and avg300 are rebuilt from the recorded totals the same way the
+ * kernel does, see psi_avg_decay. Past an hour, what was there before is long
+ * gone, so there's no point going on.
+ */
+#define REPLAY_AVG_MAX_PERIODS 1800
 
-    cfg.io.filename = get_psi_filename("io", !!override_config);
-    cfg.io.type = RT_IO;
-    cfg.io.human_name = "I/O";
-    cfg.io.has_full = true;
+static void replay_update_avgs(ReplayAvgs *a, int64_t ts, uint64_t total,
+                               double avg10) {
+    int64_t periods;
+    double pct = 0;
+    size_t i;
 
-    /* Currently not user configurable, file an issue if you need it to be. */
-    cfg.io_min_blocked_tasks = 2;
+    if (!a->valid) {
+        /* Better than starting at zero and ramping up for minutes */
+        a->avgs[0] = a->avgs[1] = avg10;
+        a->tick_ts = ts;
+        a->tick_total = total;
+        a->valid = true;
+        return;
+    }
 
-    (void)config_update_from_file(override_config);
+    periods = (ts - a->tick_ts) / PSI_AVG_PERIOD_SEC;
+    if (periods <= 0) {
+        return;
+    }
 
-    return 0;
+    if (total > a->tick_total) {
+        pct = (double)(total - a->tick_total) /
+              (double)((uint64_t)(ts - a->tick_ts) * SEC_TO_USEC) * 100;
+        if (pct > 100) {
+            pct = 100;
+        }
+    }
+
+    if (periods > REPLAY_AVG_MAX_PERIODS) {
+        periods = REPLAY_AVG_MAX_PERIODS;
+    }
+    while (periods--) {
+        for_each_arr(i, a->avgs) {
+            const double decay = psi_avg_decay[i + 1];
+            a->avgs[i] = a->avgs[i] * decay + pct * (1 - decay);
+        }
+    }
+
+    a->tick_ts = ts;
+    a->tick_total = total;
 }
 
-static int32_t get_nr_blocked_tasks(void) {
-    /*
-     * If in future system wide metrics prove not granular enough for purpose,
-     * iterate cgroup.threads recursively inside the seat cgroup.
-     */
-    FILE *f = fopen("/proc/stat", "re");
-    int32_t procs_blocked, ch;
+/*
+ * Sets the clock to when s was taken, and writes out each resource's part of it
+ * the way the kernel would show it, for pressure_check() to read. Returns false
+ * if s should be skipped.
+ */
+static bool replay_open_sample(const RecordSample *s,
+                               FILE *files[NR_RESOURCES]) {
+    static const char *const kinds[] = {"some", "full"};
+    static char bufs[NR_RESOURCES][PRESSURE_BUF_LEN];
+    size_t i, full;
+
+    if (replay.samples && s->ts <= replay.last_ts) {
+        warn("Skipping sample at %" PRId64 ", it's not after %" PRId64 "\n",
+             s->ts, replay.last_ts);
+        return false;
+    }
 
-    expect(f);
+    if (!replay.samples) {
+        replay.first_ts = s->ts;
+    }
+    replay.last_ts = s->ts;
+    replay.samples++;
+    replay.now_usec = (uint64_t)s->ts * SEC_TO_USEC;
 
-    while (!feof(f)) {
-        if (fscanf(f, "procs_blocked %" SCNd32, &procs_blocked) == 1) {
-            fclose(f);
-            return procs_blocked;
-        } else {
-            while ((ch = fgetc(f)) != EOF && ch != '\n');
+    for_each_arr(i, all_res) {
+        const uint64_t *v = s->values + i * RECORD_VALUES_PER_RESOURCE;
+        size_t len = 0;
+
+        for_each_arr(full, kinds) {
+            ReplayAvgs *a = &replay.avgs[i][full];
+            int ret;
+
+            replay_update_avgs(a, s->ts, v[2 + full], (double)v[full] / 100);
+            ret = snprintf(bufs[i] + len, sizeof(bufs[i]) - len,
+                           "%s avg10=%" PRIu64 ".%02" PRIu64
+                           " avg60=%.2f avg300=%.2f total=%" PRIu64 "\n",
+                           kinds[full], v[full] / 100, v[full] % 100,
+                           a->avgs[0], a->avgs[1], v[2 + full]);
+            expect(ret > 0 && (size_t)ret < sizeof(bufs[i]) - len);
+            len += (size_t)ret;
         }
+
+        files[i] = fmemopen(bufs[i], len, "r");
+        expect(files[i]);
     }
 
-    fclose(f);
-    return -ENODATA;
+    return true;
+}
+
+/* Each sample goes through the same checks as a live update would. */
+static void replay_sample(const RecordSample *s, void *data) {
+    FILE *files[NR_RESOURCES];
+    size_t i;
+
+    (void)data;
+
+    if (!replay_open_sample(s, files)) {
+        return;
+    }
+
+    for_each_arr(i, all_res) {
+        pressure_check_notify_if_new(all_res[i], files[i]);
+    }
+
+    if (cfg.nr_rules > 0) {
+        rules_check_all();
+    }
+}
+
+/* Start from nothing, as if psi-notify had just started */
+static void replay_start(FILE *out) {
+    size_t i;
+
+    memset(&replay, 0, sizeof(replay));
+    replay.active = true;
+    replay.out = out;
+
+    for_each_arr(i, all_res) {
+        memset(&all_res[i]->history, 0, sizeof(all_res[i]->history));
+        active_notif[i] = (Alert)DEFAULT_ALERT_STATE;
+    }
+    for_each_arr(i, rule_alerts) {
+        rule_alerts[i] = (Alert)DEFAULT_ALERT_STATE;
+    }
 }
 
 /*
- * 64 is len("some avg10=100.00 avg60=100.00 avg300=100.00") + a bit more to
- * make sure fgets() reads past total= and seeks up to \n.
+ * Runs the current config over a recording as fast as it can, printing each
+ * alert state change with when it happened.
  */
-#define PRESSURE_LINE_LEN 64
-#define PRESSURE_LINE_LEN_STR "%63s"
+static int replay_recording(const char *path, RecordTier tier, int64_t from,
+                            int64_t to, FILE *out) {
+    int ret;
 
-#define COMPARE_THRESH(threshold, current)                                     \
-    (threshold >= 0 && current > threshold)
+    replay_start(out);
+    ret = record_foreach(path, tier, from, to, replay_sample, NULL);
+    replay.active = false;
 
-#define MIN_PSI 1.0
+    if (ret == 0) {
+        info("Replayed %zu samples from %" PRId64 " to %" PRId64
+             ", with %zu state changes.\n",
+             replay.samples, replay.first_ts, replay.last_ts,
+             replay.transitions);
+    }
 
-static double psi_hysteresis(double orig_psi) {
-    const double penalised_psi = orig_psi - alert_clear_hysteresis;
+    return ret;
+}
 
-    if (penalised_psi < MIN_PSI) {
-        /* Too small to make granular volatility decisions. */
-        return MIN_PSI;
+/*
+ * Threshold sweeps. The recording is first replayed once to get the swept
+ * metric at each sample, then every combination of threshold, hysteresis and
+ * expiry is run over that, split across the worker threads. The trace is
+ * walked a chunk at a time, with each combination in a thread's slice going
+ * over the chunk while it's still in cache.
+ */
+#define SWEEP_COMBOS_MAX (1 << 20)
+#define SWEEP_CHUNK 2048 /* Samples, as timestamp and value that's 32KiB */
+#define SWEEP_LOOKBACK_SEC_DEFAULT 3600
+
+static struct {
+    uint32_t metric; /* Into rule_pressures */
+    int64_t *ts;
+    double *values;
+    size_t nr, alloc;
+    int64_t *incidents; /* Sorted */
+    size_t nr_incidents;
+    int64_t lookback_sec;
+    SweepCombo *combos;
+    size_t nr_combos;
+} sweep;
+
+/* Parses "lo:hi:step", or just a single value. */
+static bool sweep_parse_range(const char *s, SweepRange *out) {
+    double lo, hi, step;
+    char trailing;
+    int n = sscanf(s, "%lf:%lf:%lf%c", &lo, &hi, &step, &trailing);
+
+    if (n == 1) {
+        *out = (SweepRange){.lo = lo, .step = 0, .nr = 1};
+        return lo >= 0;
+    }
+
+    if (n != 3 || lo < 0 || hi < lo || step <= 0 ||
+        (hi - lo) / step >= SWEEP_COMBOS_MAX) {
+        return false;
+    }
+
+    /* A little slack, so 0.1 steps still reach hi despite rounding */
+    *out = (SweepRange){.lo = lo,
+                        .step = step,
+                        .nr = (size_t)((hi - lo) / step + 1e-9) + 1};
+    return true;
+}
+
+static double sweep_range_value(const SweepRange *r, size_t i) {
+    return r->lo + r->step * (double)i;
+}
+
+static bool parse_unix_time(const char *s, int64_t *out) {
+    char *end;
+    long long v;
+
+    errno = 0;
+    v = strtoll(s, &end, 10);
+    if (errno || end == s || *end) {
+        return false;
+    }
+
+    *out = v;
+    return true;
+}
+
+static int int64_cmp(const void *a, const void *b) {
+    const int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/* Incident times, one Unix time per line, for lead times */
+static int sweep_load_incidents(const char *path) {
+    char line[CONFIG_LINE_MAX];
+    size_t alloc = 0;
+    FILE *f = fopen(path, "re");
+
+    if (!f) {
+        int ret = -errno;
+        warn("Can't open %s: %s\n", path, strerror(errno));
+        return ret;
+    }
+
+    while (fgets(line, sizeof(line), f)) {
+        int64_t ts;
+
+        if (blank_line_or_comment(line)) {
+            continue;
+        }
+
+        line[strcspn(line, "\n")] = '\0';
+        if (!parse_unix_time(line, &ts)) {
+            warn("Invalid incident time, ignoring: %s\n", line);
+            continue;
+        }
+
+        if (sweep.nr_incidents == alloc) {
+            alloc = alloc ? alloc * 2 : 64;
+            sweep.incidents =
+                realloc(sweep.incidents, alloc * sizeof(*sweep.incidents));
+            expect(sweep.incidents);
+        }
+        sweep.incidents[sweep.nr_incidents++] = ts;
+    }
+
+    fclose(f);
+    qsort(sweep.incidents, sweep.nr_incidents, sizeof(*sweep.incidents),
+          int64_cmp);
+    return 0;
+}
+
+static void sweep_sample(const RecordSample *s, void *data) {
+    FILE *files[NR_RESOURCES];
+    size_t i;
+
+    (void)data;
+
+    if (!replay_open_sample(s, files)) {
+        return;
+    }
+
+    for_each_arr(i, all_res) {
+        (void)pressure_check(all_res[i], files[i]);
+    }
+    rule_pressures_update(rule_pressures);
+
+    if (sweep.nr == sweep.alloc) {
+        sweep.alloc = sweep.alloc ? sweep.alloc * 2 : 4096;
+        sweep.ts = realloc(sweep.ts, sweep.alloc * sizeof(*sweep.ts));
+        sweep.values =
+            realloc(sweep.values, sweep.alloc * sizeof(*sweep.values));
+        expect(sweep.ts && sweep.values);
+    }
+    sweep.ts[sweep.nr] = s->ts;
+    sweep.values[sweep.nr] = rule_pressures[sweep.metric];
+    sweep.nr++;
+}
+
+static void sweep_alert_opened(SweepCombo *c, int64_t ts) {
+    int64_t lead;
+
+    c->alerts++;
+    c->open = true;
+    c->opened_ts = ts;
+
+    while (c->next_incident < sweep.nr_incidents &&
+           sweep.incidents[c->next_incident] < ts) {
+        c->next_incident++;
+        c->next_incident_led = false;
+    }
+
+    if (c->next_incident == sweep.nr_incidents || c->next_incident_led) {
+        return;
+    }
+
+    /* Only the first alert in the lookback counts, as the earliest warning */
+    lead = sweep.incidents[c->next_incident] - ts;
+    if (lead > sweep.lookback_sec) {
+        return;
     }
 
-    return penalised_psi;
+    c->next_incident_led = true;
+    c->incidents_led++;
+    c->lead_sec_total += lead;
+    if (!c->lead_sec_min || lead < c->lead_sec_min) {
+        c->lead_sec_min = lead;
+    }
 }
 
-static AlertState pressure_check_single_line(FILE *f, const Resource *r) {
-    char type[PRESSURE_LINE_LEN];
-    double avg10, avg60, avg300;
+/*
+ * The same as thresholds_state() for one threshold, and then alert_update(),
+ * where an alert being open stands in for notif_id.
+ */
+static void sweep_step(SweepCombo *c, int64_t ts, double val) {
+    AlertState ret;
 
-    if (fscanf(f,
-               PRESSURE_LINE_LEN_STR
-               " avg10=%lf avg60=%lf avg300=%lf total=%*s",
-               type,
-               &avg10,
-               &avg60,
-               &avg300) != 4) {
-        warn("Can't parse pressures from %s\n", strnull(r->filename));
-        return A_ERROR;
+    if (COMPARE_THRESH(c->threshold, val)) {
+        ret = A_ACTIVE;
+    } else if (COMPARE_THRESH(psi_hysteresis_by(c->threshold, c->hysteresis),
+                              val)) {
+        ret = A_STABILISING;
+    } else {
+        ret = A_INACTIVE;
     }
 
-    if (cfg.log_pressures) {
-        info("Current %s pressures: %s avg10=%.2f avg60=%.2f avg300=%.2f\n",
-             strnull(r->human_name),
-             type,
-             avg10,
-             avg60,
-             avg300);
+    if (ret == A_ACTIVE && c->last_state != A_ACTIVE) {
+        if (!c->open) {
+            sweep_alert_opened(c, ts);
+        }
+        c->expires_ts = (double)ts + c->expiry_sec;
+    } else if (ret == A_INACTIVE && c->last_state != A_INACTIVE) {
+        if ((double)ts < c->expires_ts) {
+            ret = A_STABILISING;
+        } else if (c->open) {
+            c->open = false;
+            c->alert_sec += ts - c->opened_ts;
+        }
     }
 
-    if (streq(type, "some")) {
-        if (COMPARE_THRESH(r->thresholds.avg10.some, avg10) ||
-            COMPARE_THRESH(r->thresholds.avg60.some, avg60) ||
-            COMPARE_THRESH(r->thresholds.avg300.some, avg300)) {
-            return A_ACTIVE;
-        }
+    c->last_state = ret;
+}
 
-        if (COMPARE_THRESH(psi_hysteresis(r->thresholds.avg10.some), avg10) ||
-            COMPARE_THRESH(psi_hysteresis(r->thresholds.avg60.some), avg60) ||
-            COMPARE_THRESH(psi_hysteresis(r->thresholds.avg300.some), avg300)) {
-            return A_STABILISING;
-        }
+static void sweep_range(size_t start, size_t end, void *arg) {
+    size_t chunk, i, j;
 
-        return A_INACTIVE;
-    } else if (streq(type, "full")) {
-        if (r->type == RT_IO &&
-            active_notif[r->type].last_state == A_INACTIVE) {
-            int32_t ret;
+    (void)arg;
 
-            /*
-             * On a desktop system there's usually very few runnable tasks,
-             * which means that a single task doing slow I/O can
-             * disproportionately bump IO full for the whole system or user
-             * scope. To work around this, require that at least two tasks are
-             * blocked to issue warnings based on IO metrics. Checking if the
-             * last state was inactive avoids flapping if the blocked number
-             * varies repeatedly.
-             */
-            ret = get_nr_blocked_tasks();
-            if (ret >= 0 && ret < cfg.io_min_blocked_tasks) {
-                return A_INACTIVE;
-            }
-        }
+    for (chunk = 0; chunk < sweep.nr; chunk += SWEEP_CHUNK) {
+        size_t chunk_end = chunk + SWEEP_CHUNK;
 
-        if (COMPARE_THRESH(r->thresholds.avg10.full, avg10) ||
-            COMPARE_THRESH(r->thresholds.avg60.full, avg60) ||
-            COMPARE_THRESH(r->thresholds.avg300.full, avg300)) {
-            return A_ACTIVE;
+        if (chunk_end > sweep.nr) {
+            chunk_end = sweep.nr;
         }
 
-        if (COMPARE_THRESH(psi_hysteresis(r->thresholds.avg10.full), avg10) ||
-            COMPARE_THRESH(psi_hysteresis(r->thresholds.avg60.full), avg60) ||
-            COMPARE_THRESH(psi_hysteresis(r->thresholds.avg300.full), avg300)) {
-            return A_STABILISING;
+        for (i = start; i < end; i++) {
+            SweepCombo *c = &sweep.combos[i];
+            for (j = chunk; j < chunk_end; j++) {
+                sweep_step(c, sweep.ts[j], sweep.values[j]);
+            }
         }
-
-        return A_INACTIVE;
     }
 
-    warn("Invalid type: %s\n", type);
-    return A_ERROR;
+    /* Alerts still open at the end count up to there */
+    for (i = start; i < end; i++) {
+        SweepCombo *c = &sweep.combos[i];
+        if (c->open && sweep.nr) {
+            c->alert_sec += sweep.ts[sweep.nr - 1] - c->opened_ts;
+        }
+    }
 }
 
-static int openat_psi(const char *fn) {
-    int fd = openat(cfg.psi_dir_fd, fn, O_RDONLY | O_CLOEXEC);
-    if (fd >= 0) {
-        return fd;
-    }
+static void sweep_print(FILE *out) {
+    size_t i;
 
-    /* Maybe the cgroup or proc filesystem backing this disappeared? */
-    warn("PSI dir (%s) seems to have gone away, reopening\n",
-         using_seat ? "logind seat" : "global");
-    close(cfg.psi_dir_fd);
+    fprintf(out, "threshold,hysteresis,expiry,alerts,alert_seconds,"
+                 "incidents_led,mean_lead_seconds,min_lead_seconds\n");
 
-    cfg.psi_dir_fd = get_psi_dir_fd();
-    if (cfg.psi_dir_fd < 0) {
-        die("%s\n", "PSI dir disappeared and can't be found again, exiting");
-    }
+    for (i = 0; i < sweep.nr_combos; i++) {
+        const SweepCombo *c = &sweep.combos[i];
 
-    fd = openat(cfg.psi_dir_fd, fn, O_RDONLY | O_CLOEXEC);
-    if (fd >= 0) {
-        return fd;
+        fprintf(out, "%.2f,%.2f,%.0f,%" PRIu32 ",%" PRId64 ",%" PRIu32 ",",
+                c->threshold, c->hysteresis, c->expiry_sec, c->alerts,
+                c->alert_sec, c->incidents_led);
+        if (c->incidents_led) {
+            fprintf(out, "%.0f,%" PRId64 "\n",
+                    (double)c->lead_sec_total / c->incidents_led,
+                    c->lead_sec_min);
+        } else {
+            fprintf(out, ",\n");
+        }
     }
-
-    return -EINVAL;
 }
 
-/* 2: grace threshold, 1: above thresholds, 0: within thresholds, <0: error */
-static AlertState pressure_check(const Resource *r, FILE *override_file) {
-    FILE *f;
-    int fd;
-    AlertState ret;
-    char p_buf[PRESSURE_LINE_LEN * 2]; /* Avoiding slow _IO_doallocbuf */
+/*
+ * Tries every combination of the given thresholds, hysteresis and expiry for
+ * one metric over a recording, printing the results for each as CSV.
+ */
+static int sweep_recording(const char *path, RecordTier tier, int64_t from,
+                           int64_t to, const char *metric,
+                           const SweepRange ranges[3],
+                           const char *incidents_path, int64_t lookback_sec,
+                           FILE *out) {
+    Rule probe = {.name = "sweep"};
+    RuleParser rp = {.p = metric, .rule = &probe};
+    size_t i, nr;
+    int ret;
 
-    if (!r->filename && !override_file) {
-        return A_INACTIVE;
+    if (rule_parse_metric(&rp) != 0 || *rp.p) {
+        warn("Invalid metric to sweep: %s\n", metric);
+        return -EINVAL;
+    }
+    rule_windows_register(&rp);
+    sweep.metric = probe.insns[0].metric;
+
+    nr = ranges[0].nr * ranges[1].nr * ranges[2].nr;
+    if (nr > SWEEP_COMBOS_MAX) {
+        warn("Too many combinations to sweep, the maximum is %d\n",
+             SWEEP_COMBOS_MAX);
+        return -E2BIG;
     }
 
-    if (override_file) {
-        f = override_file;
-        expect(f);
-    } else {
-        fd = openat_psi(r->filename);
-
-        if (fd < 0) {
-            perror(r->filename);
-            return A_ERROR;
+    sweep.lookback_sec = lookback_sec;
+    if (incidents_path) {
+        ret = sweep_load_incidents(incidents_path);
+        if (ret < 0) {
+            goto out;
         }
+    }
 
-        f = fdopen(fd, "r"); /* O_CLOEXEC is passed through */
-        expect(f);
-        expect(setvbuf(f, p_buf, _IOFBF, sizeof(p_buf)) == 0);
+    replay_start(NULL);
+    ret = record_foreach(path, tier, from, to, sweep_sample, NULL);
+    replay.active = false;
+    if (ret < 0) {
+        goto out;
     }
 
-    ret = pressure_check_single_line(f, r);
-    if (ret == A_INACTIVE && r->has_full) {
-        ret = pressure_check_single_line(f, r);
+    sweep.combos = calloc(nr, sizeof(*sweep.combos));
+    expect(sweep.combos);
+    sweep.nr_combos = nr;
+    for (i = 0; i < nr; i++) {
+        SweepCombo *c = &sweep.combos[i];
+        c->threshold = sweep_range_value(&ranges[0], i % ranges[0].nr);
+        c->hysteresis =
+            sweep_range_value(&ranges[1], i / ranges[0].nr % ranges[1].nr);
+        c->expiry_sec =
+            sweep_range_value(&ranges[2], i / ranges[0].nr / ranges[1].nr);
+        c->last_state = A_INACTIVE;
     }
 
-    fclose(f);
+    /* Each combination is a pass over the whole trace, so always worth it */
+    workers_run(sweep_range, NULL, nr, 2);
+    workers_stop();
+    sweep_print(out);
+
+out:
+    free(sweep.ts);
+    free(sweep.values);
+    free(sweep.combos);
+    free(sweep.incidents);
+    sweep.ts = NULL;
+    sweep.values = NULL;
+    sweep.combos = NULL;
+    sweep.incidents = NULL;
+    sweep.nr = sweep.alloc = sweep.nr_combos = sweep.nr_incidents = 0;
     return ret;
 }
 
-#define LOG_ALERT_STATE(r, state)                                              \
-    do {                                                                       \
-        expect(*r->human_name);                                                \
-        info("%c%s alert: %s\n",                                               \
-             toupper(r->human_name[0]),                                        \
-             r->human_name + 1,                                                \
-             state);                                                           \
-    } while (0)
-
-/* 0 means already active, 1 means newly active. */
-static int alert_user_if_new(const Resource *r) {
-    time_t remaining_intervals;
+/*
+ * Called once per update, after alerting. Keeps the baseline fresh while a
+ * memory or I/O alert is close or active, so that when it fires there's
+ * something recent to compare against.
+ */
+static void procstall_tick(void) {
+    const Resource *res[] = {&cfg.memory, &cfg.io};
+    size_t i;
 
-    if (active_notif[r->type].last_state == A_ACTIVE) {
-        return 0;
+    for_each_arr(i, res) {
+        if (active_notif[res[i]->type].last_state != A_INACTIVE ||
+            resource_distance(res[i]) == D_NEAR) {
+            procstall_sample();
+            return;
+        }
     }
+}
+
+/*
+ * Everything done each update. With lock_memory, this must not allocate once
+ * it has run a few times, see test_tick_no_alloc.
+ */
+static void run_checks(void) {
+    static bool ready;
+    char status[NOTIFY_MAX];
+    uint64_t start = now_usec(), took;
+    size_t i;
+    int key_len;
 
-    LOG_ALERT_STATE(r, "active");
+    self_usage_update();
+    sender_flush();
+    actions_flush();
+    tick_reads_batch();
 
-    remaining_intervals = expiry_sec / cfg.update_interval;
-    if (remaining_intervals < 1) {
-        remaining_intervals = 1;
+    for_each_arr(i, all_res) { pressure_check_notify_if_new(all_res[i], NULL); }
+    procstall_tick();
+    if (cfg.nr_rules > 0) {
+        rules_check_all();
     }
-
-    /* A_STABILISING -> A_ACTIVE reuses the existing notification */
-    if (!active_notif[r->type].notif) {
-        active_notif[r->type].notif = alert_user(r->human_name);
+    if (cgroups.root_fd >= 0) {
+        cgroups_check_all(&cgroups);
+    }
+    if (seats.root_fd >= 0) {
+        cgroups_check_all(&seats);
+    }
+    read_batch_end();
+    if (recorder.map) {
+        record_current_pressures();
     }
 
-    active_notif[r->type].remaining_intervals = remaining_intervals;
-    return 1;
-}
-
-/* 0 means already stabilising, 1 means newly stabilising. */
-static void alert_stabilising(const Resource *r) {
-    if (active_notif[r->type].last_state == A_STABILISING) {
-        return;
+    took = now_usec() - start;
+    latency_record(&stats.update, took);
+    stats.checks++;
+    stats.check_usec_total += took;
+    if (took > stats.check_usec_max) {
+        stats.check_usec_max = took;
+    }
+    if (metrics.listen_fd >= 0) {
+        metrics_render();
+    }
+    if (subs.listen_fd >= 0) {
+        subscribers_publish();
     }
 
-    if (active_notif[r->type].last_state == A_ACTIVE) {
-        LOG_ALERT_STATE(r, "stabilising");
+    if (!ready) {
+        sd_notify("READY=1");
+        ready = true;
     }
+    sd_notify_watchdog();
+
+    /* The alerts are what matter, the rest is updated when convenient */
+    key_len = snprintf(status, sizeof(status),
+                       "Waiting. Current alerts: CPU: %s, memory: %s, I/O: %s.",
+                       active_inactive(&active_notif[RT_CPU]),
+                       active_inactive(&active_notif[RT_MEMORY]),
+                       active_inactive(&active_notif[RT_IO]));
+    expect(key_len > 0 && (size_t)key_len < sizeof(status));
+    snprintf_check(status + key_len, sizeof(status) - (size_t)key_len,
+                   " Update p50/p99: %" PRIu64 "/%" PRIu64
+                   "us, last loop: %" PRIu64 "us CPU",
+                   latency_percentile(&stats.update, 50),
+                   latency_percentile(&stats.update, 99), stats.cpu_usec_last);
+    sd_notify_status(status, (size_t)key_len);
+    sd_notify_flush();
 }
 
-static AlertState alert_stop(const Resource *r) {
-    NotifyNotification *n = active_notif[r->type].notif;
+/*
+ * lock_memory: a pressure notifier that needs to page things back in, or
+ * allocate, while memory is short would fail exactly when it's needed. So
+ * fault in some stack and heap up front, keep freed heap around rather than
+ * giving it back, and lock it all in memory.
+ */
+#define PREFAULT_STACK_BYTES (256 * 1024)
+#define PREFAULT_HEAP_BYTES (4 * 1024 * 1024)
+#define MEMORY_MIN_HEADROOM_BYTES (8 * 1024 * 1024)
 
-    if (active_notif[r->type].last_state == A_INACTIVE) {
-        return A_INACTIVE;
+static void __attribute__((noinline)) prefault_stack(void) {
+    volatile char stack[PREFAULT_STACK_BYTES];
+    size_t i;
+    for (i = 0; i < sizeof(stack); i += 4096) {
+        stack[i] = 0;
     }
+}
 
-    if (--active_notif[r->type].remaining_intervals) {
-        /* Still got some more iterations to go before this can be closed. */
-        alert_stabilising(r);
-        return A_STABILISING;
-    }
+static void prefault_heap(void) {
+    char *heap;
 
-    LOG_ALERT_STATE(r, "inactive");
-    active_notif[r->type].notif = NULL;
-    alert_destroy(n);
+    /* Never trim or mmap, so what we free stays in the (locked) arena. */
+    expect(mallopt(M_TRIM_THRESHOLD, -1) == 1);
+    expect(mallopt(M_MMAP_MAX, 0) == 1);
 
-    return A_INACTIVE;
+    heap = malloc(PREFAULT_HEAP_BYTES);
+    expect(heap);
+    memset(heap, 0, PREFAULT_HEAP_BYTES);
+    free(heap);
 }
 
-static void pressure_check_notify_if_new(const Resource *r) {
-    AlertState ret = pressure_check(r, NULL);
-    bool time_stabilising = false;
+/*
+ * Best effort: protect our own cgroup from reclaim. This only has an effect if
+ * the ancestors are protected too, see memory.min in cgroup-v2.rst.
+ */
+static void protect_own_cgroup(void) {
+    char line[PATH_MAX], path[PATH_MAX + sizeof("/sys/fs/cgroup/memory.min")];
+    uint64_t current;
+    FILE *f;
+    int fd;
 
-    switch (ret) {
-        case A_INACTIVE:
-            time_stabilising = alert_stop(r) == A_STABILISING;
-            break;
-        case A_ACTIVE:
-            alert_user_if_new(r);
-            break;
-        case A_STABILISING:
-            /* Grace period where we are hands-off, to avoid volatility. */
-            alert_stabilising(r);
-            break;
-        case A_ERROR:
-            /* Already warned inside pressure_check(). */
-            return;
-        default:
-            unreachable();
+    f = fopen("/proc/self/cgroup", "re");
+    if (!f) {
+        return;
+    }
+    /* On cgroup v2, there's only "0::/path" */
+    if (!fgets(line, sizeof(line), f) || strncmp(line, "0::", 3) != 0) {
+        fclose(f);
+        return;
     }
+    fclose(f);
+    line[strcspn(line, "\n")] = '\0';
 
-    if (time_stabilising) {
-        ret = A_STABILISING;
+    snprintf_check(
+        path, sizeof(path), "/sys/fs/cgroup%s/memory.current", line + 3);
+    f = fopen(path, "re");
+    if (!f || fscanf(f, "%" SCNu64, &current) != 1) {
+        if (f) {
+            fclose(f);
+        }
+        return;
     }
+    fclose(f);
 
-    active_notif[r->type].last_state = ret;
+    snprintf_check(path, sizeof(path), "/sys/fs/cgroup%s/memory.min", line + 3);
+    fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd < 0 || dprintf(fd, "%" PRIu64, current + MEMORY_MIN_HEADROOM_BYTES) <
+                      0) {
+        info("Cannot set memory.min for %s, not protected from reclaim: %s\n",
+             line + 3,
+             strerror(errno));
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
 }
 
-#define SEC_TO_NSEC 1000000000
-
-static void suspend_for_remaining_interval(const struct timespec *in) {
-    struct timespec out, remaining;
-    long cfg_nsec, rem_nsec, sleep_nsec;
+static void lock_memory(void) {
+    prefault_stack();
+    prefault_heap();
 
-    if (cfg.update_interval == 0) {
-        return;
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+        int err = errno;
+        /* Locking all of glib's mappings may be over RLIMIT_MEMLOCK. */
+        if (mlockall(MCL_CURRENT | MCL_FUTURE | MCL_ONFAULT) < 0) {
+            warn("Cannot lock memory, raise LimitMEMLOCK?: %s\n",
+                 strerror(err));
+        }
     }
 
-    expect(clock_gettime(CLOCK_MONOTONIC, &out) == 0);
+    protect_own_cgroup();
+}
 
-    if (out.tv_nsec - in->tv_nsec < 0) {
-        remaining.tv_sec = out.tv_sec - in->tv_sec - 1;
-        remaining.tv_nsec = out.tv_nsec - in->tv_nsec + SEC_TO_NSEC;
-    } else {
-        remaining.tv_sec = out.tv_sec - in->tv_sec;
-        remaining.tv_nsec = out.tv_nsec - in->tv_nsec;
+/*
+ * Called at startup and after each config reload. Once locked, the arena and
+ * memory.min settings stay, so turning it off again takes a restart.
+ */
+static void lock_memory_apply_config(void) {
+    static bool locked;
+
+    if (cfg.lock_memory && !locked) {
+        lock_memory();
+        locked = true;
+    } else if (!cfg.lock_memory && locked) {
+        warn("%s\n", "lock_memory stays on until psi-notify is restarted.");
     }
+}
 
-    cfg_nsec = cfg.update_interval * SEC_TO_NSEC;
-    rem_nsec = remaining.tv_sec * SEC_TO_NSEC + remaining.tv_nsec;
+static void block_all_signals(void) {
+    sigset_t mask;
+    sigfillset(&mask);
+    expect(sigprocmask(SIG_SETMASK, &mask, NULL) == 0);
+}
 
-    if (rem_nsec >= cfg_nsec) {
-        warn("Timer elapsed %lld seconds before we completed one event loop.\n",
-             (long long)cfg.update_interval);
-        return;
-    }
+static void exit_now(int sig) { _exit(128 + sig); }
 
-    sleep_nsec = cfg_nsec - rem_nsec;
-    remaining.tv_sec = sleep_nsec / SEC_TO_NSEC;
-    remaining.tv_nsec = sleep_nsec % SEC_TO_NSEC;
+/*
+ * Teardown waits on the sender and action threads, which can hang on D-Bus or
+ * a cgroup write. Being asked to quit again while that's going on skips it.
+ */
+static void unblock_exit_signals(void) {
+    const struct sigaction sa = {.sa_handler = exit_now};
+    sigset_t mask;
 
-    expect(nanosleep(&remaining, NULL) == 0 || errno == EINTR);
+    expect(sigaction(SIGTERM, &sa, NULL) == 0);
+    expect(sigaction(SIGINT, &sa, NULL) == 0);
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGINT);
+    expect(sigprocmask(SIG_UNBLOCK, &mask, NULL) == 0);
 }
 
-/* If running under AFL, just run the code and exit. Returns 1 if fuzzing. */
-static int check_fuzzers(void) {
-    const char *const fuzz_config_file = getenv("FUZZ_CONFIGS");
-    const char *const fuzz_pressure_file = getenv("FUZZ_PRESSURES");
-
-    if (fuzz_pressure_file) {
-        Resource r = {0};
-        FILE *f = fopen(fuzz_pressure_file, "re");
+#ifndef UNIT_TEST
+static void print_help(void) {
+    printf("psi-notify: Alert on system-wide resource pressure.\n\n");
+    printf("  --export FILE      Print a recording as CSV, then exit\n");
+    printf("  --replay FILE      Print alerts a recording would cause, then "
+           "exit\n");
+    printf("  --config FILE      Config to replay with (default: your own)\n");
+    printf("  --sweep METRIC     With --replay, try thresholds on METRIC "
+           "instead\n");
+    printf("  --thresholds RANGE Thresholds to sweep, as lo:hi:step\n");
+    printf("  --hysteresis RANGE Hysteresis to sweep (default: 5)\n");
+    printf("  --expiry RANGE     Seconds alerts stay up to sweep (default: "
+           "10)\n");
+    printf("  --incidents FILE   Unix times of incidents, to get lead times\n");
+    printf("  --lookback SECS    How early an alert still leads an incident "
+           "(default: 3600)\n");
+    printf("  --tier 1s|1m|1h    Resolution to use (default: 1s)\n");
+    printf("  --from TIME        Only use samples from this Unix time\n");
+    printf("  --to TIME          Only use samples up to this Unix time\n");
+    printf("  --system           Monitor every user's seat from one instance\n");
+    printf("  --help             Show this help\n\n");
+    printf("See the psi-notify(1) man page for details.\n");
+}
 
-        expect(f);
-        (void)pressure_check(&r, f);
-        return 1;
+/* Returns an exit code if we shouldn't go on to monitor, otherwise -1. */
+static int handle_args(int argc, char *argv[]) {
+    static const struct option opts[] = {
+        {"export", required_argument, NULL, 'e'},
+        {"replay", required_argument, NULL, 'r'},
+        {"config", required_argument, NULL, 'c'},
+        {"sweep", required_argument, NULL, 's'},
+        {"thresholds", required_argument, NULL, 'S'},
+        {"hysteresis", required_argument, NULL, 'H'},
+        {"expiry", required_argument, NULL, 'E'},
+        {"incidents", required_argument, NULL, 'i'},
+        {"lookback", required_argument, NULL, 'l'},
+        {"tier", required_argument, NULL, 't'},
+        {"from", required_argument, NULL, 'f'},
+        {"to", required_argument, NULL, 'T'},
+        {"system", no_argument, NULL, 'y'},
+        {"notify-helper", no_argument, NULL, 'N'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0},
+    };
+    const char *export_path = NULL, *replay_path = NULL, *config_path = NULL;
+    const char *sweep_metric = NULL, *incidents_path = NULL;
+    SweepRange ranges[] = {
+        {.nr = 0},
+        {.lo = alert_clear_hysteresis, .nr = 1},
+        {.lo = (double)expiry_sec, .nr = 1},
+    };
+    int64_t lookback_sec = SWEEP_LOOKBACK_SEC_DEFAULT;
+    RecordTier tier = TIER_SECOND;
+    int64_t from = INT64_MIN, to = INT64_MAX;
+    size_t i;
+    int c;
+
+    while ((c = getopt_long(argc, argv, "", opts, NULL)) != -1) {
+        switch (c) {
+            case 'e':
+                export_path = optarg;
+                break;
+            case 'r':
+                replay_path = optarg;
+                break;
+            case 'c':
+                config_path = optarg;
+                break;
+            case 's':
+                sweep_metric = optarg;
+                break;
+            case 'S':
+            case 'H':
+            case 'E':
+                if (!sweep_parse_range(optarg,
+                                       &ranges[c == 'S' ? 0 : c == 'H' ? 1 : 2])) {
+                    warn("Invalid range, must be lo:hi:step: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'i':
+                incidents_path = optarg;
+                break;
+            case 'l':
+                if (!parse_unix_time(optarg, &lookback_sec) ||
+                    lookback_sec < 0) {
+                    warn("Invalid lookback: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 't':
+                for_each_arr(i, record_tier_names) {
+                    if (streq(optarg, record_tier_names[i])) {
+                        break;
+                    }
+                }
+                if (i == NR_TIERS) {
+                    warn("Invalid tier, must be 1s, 1m, or 1h: %s\n", optarg);
+                    return 1;
+                }
+                tier = (RecordTier)i;
+                break;
+            case 'f':
+            case 'T':
+                if (!parse_unix_time(optarg, c == 'f' ? &from : &to)) {
+                    warn("Invalid Unix time: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'y':
+                system_mode = true;
+                break;
+            case 'N':
+                return notify_helper_main();
+            case 'h':
+                print_help();
+                return 0;
+            default:
+                print_help();
+                return 1;
+        }
     }
 
-    if (fuzz_config_file) {
-        FILE *f = fopen(fuzz_config_file, "re");
-
-        expect(f);
-        expect(config_init(&f) == 0);
-        free(cfg.cpu.filename);
-        free(cfg.memory.filename);
-        free(cfg.io.filename);
+    if (optind != argc) {
+        print_help();
         return 1;
     }
 
-    return 0;
-}
+    if (export_path) {
+        return record_export(export_path, tier, from, to, stdout) == 0 ? 0 : 1;
+    }
 
-#define print_single_thresh(res, time, type)                                   \
-    expect(*res->human_name);                                                  \
-    if (res->thresholds.time.type >= 0)                                        \
-    printf("        - %c%s %s %s: %.2f\n",                                     \
-           toupper(res->human_name[0]),                                        \
-           res->human_name + 1,                                                \
-           #time,                                                              \
-           #type,                                                              \
-           res->thresholds.time.type)
+    if (replay_path && sweep_metric) {
+        FILE *f = NULL;
 
-static void print_config(void) {
-    size_t i;
-    const char *header = "Config";
+        if (!ranges[0].nr) {
+            warn("%s\n", "--sweep needs --thresholds");
+            return 1;
+        }
 
-    if (config_reload_pending) {
-        header = "Config reloaded. New config after reload";
+        /* Only the metric matters, not the config */
+        expect(config_init(&f) == 0);
+        return sweep_recording(replay_path, tier, from, to, sweep_metric,
+                               ranges, incidents_path, lookback_sec,
+                               stdout) == 0
+                   ? 0
+                   : 1;
     }
 
-    info("%s:\n\n", header);
+    if (replay_path) {
+        char default_path[PATH_MAX];
+        FILE *f;
 
-    printf("      Log pressures: %s\n", cfg.log_pressures ? "true" : "false");
-    printf("      Update interval: %llds\n\n", (long long)cfg.update_interval);
+        if (!config_path) {
+            config_get_path(default_path);
+        }
+        f = fopen(config_path ? config_path : default_path, "re");
+        if (!f && (config_path || errno != ENOENT)) {
+            warn("Can't open %s: %s\n",
+                 config_path ? config_path : default_path,
+                 strerror(errno));
+            return 1;
+        }
 
-    printf("      Thresholds:\n");
-    for_each_arr(i, all_res) {
-        const Resource *r = all_res[i];
-        print_single_thresh(r, avg10, some);
-        print_single_thresh(r, avg10, full);
-        print_single_thresh(r, avg60, some);
-        print_single_thresh(r, avg60, full);
-        print_single_thresh(r, avg300, some);
-        print_single_thresh(r, avg300, full);
+        /* No pressure files are read, so this works without PSI too */
+        expect(config_init(&f) == 0);
+        print_config();
+        return replay_recording(replay_path, tier, from, to, stdout) == 0 ? 0
+                                                                          : 1;
     }
 
-    printf("\n");
-}
-
-static void block_all_signals(void) {
-    sigset_t mask;
-    sigfillset(&mask);
-    expect(sigprocmask(SIG_SETMASK, &mask, NULL) == 0);
-}
-
-static void unblock_all_signals(void) {
-    sigset_t mask;
-    sigemptyset(&mask);
-    expect(sigprocmask(SIG_SETMASK, &mask, NULL) == 0);
+    return -1;
 }
 
-#ifndef UNIT_TEST
 int main(int argc, char *argv[]) {
     unsigned long num_iters = 0;
+    LoopAction action = LOOP_TICK;
+    size_t i;
+    int ret;
 
-    (void)argv;
-
-    if (argc != 1) {
-        printf("psi-notify: Alert on system-wide resource pressure.\n\n");
-        printf("  [any argument]     Show this help\n\n");
-        printf("See the psi-notify(1) man page for details.\n");
-        return 0;
+    ret = handle_args(argc, argv);
+    if (ret >= 0) {
+        return ret;
     }
 
     if (check_fuzzers()) {
@@ -840,14 +8832,28 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
+    if (system_mode && seats_apply_config() != 0) {
+        return 1;
+    }
+
     expect(setvbuf(stdout, output_buf, _IOLBF, sizeof(output_buf)) == 0);
-    configure_signal_handlers();
 
-    /* Before glib spawns threads, make sure we're blocked. */
+    /*
+     * Before glib spawns threads, make sure we're blocked. They stay blocked,
+     * and the ones we care about are read from the signalfd.
+     */
     block_all_signals();
-    expect(notify_init("psi-notify"));
+    loop_init();
+    if (!system_mode) {
+        expect(notify_init("psi-notify"));
+    }
+    sender_start();
 
-    if (using_seat) {
+    if (system_mode) {
+        info("%s\n",
+             "Using pressures from every systemd-logind seat, and "
+             "system-global ones.");
+    } else if (using_seat) {
         info("%s\n",
              "Using pressures from the current user's systemd-logind seat.");
     } else {
@@ -855,55 +8861,88 @@ int main(int argc, char *argv[]) {
     }
 
     print_config();
-    info("%s\n", "Pressure monitoring started.");
-
-    while (run) {
-        size_t i;
-        struct timespec in;
+    triggers_register_all();
+    rules_apply_config();
+    cgroups_apply_config();
+    recorder_apply_config();
+    metrics_apply_config();
+    subscribers_apply_config();
+    actions_apply_config();
 
-        expect(clock_gettime(CLOCK_MONOTONIC, &in) == 0);
-
-        sd_notify("READY=1\nWATCHDOG=1\n"
-                  "STATUS=Checking current pressures...");
+    if (using_seat) {
+        char seat_path[PATH_MAX];
+        get_seat_cgroup_path(seat_path);
+        if (cgroups_init(&seat_cgroups, seat_path) < 0) {
+            warn("%s\n", "Cannot find culprits for seat alerts.");
+        } else {
+            (void)procstall_init();
+        }
+    }
 
-        for_each_arr(i, all_res) { pressure_check_notify_if_new(all_res[i]); }
+    info("%s\n", "Pressure monitoring started.");
 
-        unblock_all_signals();
+    lock_memory_apply_config();
 
-        if (config_reload_pending) {
-            sd_notify("RELOADING=1\nSTATUS=Reloading config...");
+    while (action != LOOP_EXIT) {
+        if (action == LOOP_RELOAD) {
+            sd_notify("RELOADING=1");
+            sd_notify_status("Reloading config...", SIZE_MAX);
+            sd_notify_flush();
+            config_reloading = true;
             if (config_update_from_file(NULL) == 0) {
                 print_config();
+                triggers_register_all();
+                rules_apply_config();
+                cgroups_apply_config();
+                if (system_mode) {
+                    (void)seats_apply_config();
+                }
+                recorder_apply_config();
+                metrics_apply_config();
+                subscribers_apply_config();
+                actions_apply_config();
+                lock_memory_apply_config();
             }
-            config_reload_pending = 0;
-        } else if (run) {
-            char message[NOTIFY_MAX];
-            snprintf_check(
-                message,
-                sizeof(message),
-                "STATUS=Waiting. Current alerts: CPU: %s, memory: %s, I/O: %s",
-                active_inactive(&active_notif[RT_CPU]),
-                active_inactive(&active_notif[RT_MEMORY]),
-                active_inactive(&active_notif[RT_IO]));
-            sd_notify(message);
-
-            suspend_for_remaining_interval(&in);
+            config_reloading = false;
+            sd_notify("READY=1");
         }
 
-        ++num_iters;
+        run_checks();
 
-        block_all_signals();
+        action = loop_wait();
+        ++num_iters;
     }
 
-    unblock_all_signals();
-
+    unblock_exit_signals();
     info("Terminating after %" PRIu64 " intervals elapsed.\n", num_iters);
-    sd_notify("STOPPING=1\nSTATUS=Tearing down...");
+    self_stats_dump();
+    sd_notify("STOPPING=1");
+    sd_notify_status("Tearing down...", SIZE_MAX);
+    sd_notify_flush();
 
-    free(cfg.cpu.filename);
-    free(cfg.memory.filename);
-    free(cfg.io.filename);
+    for_each_arr(i, all_res) {
+        if (all_res[i]->fd >= 0) {
+            close(all_res[i]->fd);
+        }
+        free(all_res[i]->filename);
+    }
+    triggers_unregister_all();
+    workers_stop();
     alert_destroy_all_active();
-    notify_uninit();
+    cgroups_destroy(&cgroups);
+    cgroups_destroy(&seat_cgroups);
+    cgroups_destroy(&seats);
+    read_batch_close();
+    procstall_close();
+    recorder_close();
+    metrics_close();
+    subscribers_close();
+    actions_stop();
+    sender_stop();
+    loop_destroy();
+    sd_notify_close();
+    if (!system_mode) {
+        notify_uninit();
+    }
 }
 #endif /* UNIT_TEST */
@@ -7,10 +7,12 @@
 /* Data structures */
 
 typedef enum ResourceType { RT_CPU, RT_MEMORY, RT_IO } ResourceType;
+#define NR_RESOURCES (RT_IO + 1)
 typedef enum AlertState {
     A_INACTIVE,
     A_ACTIVE,
     A_STABILISING,
+    A_RISING, /* Below thresholds, but predicted to pass one soon */
     A_ERROR
 } AlertState;
 
@@ -25,30 +27,326 @@ typedef struct {
     TimeResourcePressure avg300;
 } Pressure;
 
+typedef struct {
+    double avg10;
+    double avg60;
+    double avg300;
+    uint64_t total; /* Cumulative stall time in usec */
+} PressureLine;
+
+typedef struct {
+    PressureLine some;
+    PressureLine full;
+} PressureSample;
+
+/* Stall percentages over windows calculated by us from total= */
+#define CUSTOM_WINDOWS_MAX 4
+#define CUSTOM_WINDOW_MAX_SEC 300
+typedef struct {
+    unsigned int window_sec;
+    TimeResourcePressure thresholds;
+    TimeResourcePressure current;
+} CustomWindow;
+
+/* Enough to cover a 64 second window at 0.25 second updates */
+#define TOTALS_HISTORY_LEN 256
+typedef struct {
+    uint64_t ts_usec; /* CLOCK_MONOTONIC */
+    uint64_t some;
+    uint64_t full;
+} TotalsSample;
+
+typedef struct {
+    TotalsSample samples[TOTALS_HISTORY_LEN];
+    size_t head;
+    size_t count;
+} TotalsHistory;
+
+/*
+ * The last samples of a resource, for looking at what led up to an alert.
+ * Averages are in hundredths of a percent, which is all the kernel gives us.
+ * An hour at 1 second updates is about 130KiB per resource.
+ */
+#define SAMPLE_HISTORY_LEN 3600
+typedef struct {
+    uint64_t ts_usec[SAMPLE_HISTORY_LEN]; /* CLOCK_MONOTONIC */
+    uint16_t some_avg[3][SAMPLE_HISTORY_LEN]; /* avg10, avg60, avg300 */
+    uint16_t full_avg[3][SAMPLE_HISTORY_LEN];
+    uint64_t some_total[SAMPLE_HISTORY_LEN];
+    uint64_t full_total[SAMPLE_HISTORY_LEN];
+    _Atomic uint64_t written; /* Samples ever written, bumped after each */
+} SampleHistory;
+
+/*
+ * The stall rate between samples, from total=, smoothed with Holt's linear
+ * method: an EWMA of the level, and one of its slope. That's O(1) per sample
+ * in constant memory, and reacts within a couple of samples rather than the
+ * seconds the kernel's averages take. See trend_update().
+ */
+typedef struct {
+    uint64_t last_total;
+    uint64_t last_usec; /* 0 until there's a sample to take deltas from */
+    bool valid;         /* Whether level and slope mean anything yet */
+    double level;       /* Stall percentage */
+    double slope;       /* Percentage points per second */
+    double eta_sec; /* Until a threshold is predicted to be passed, or -1 */
+} PressureTrend;
+
 typedef struct {
     char *filename;
     const char *human_name;
     bool has_full;
     ResourceType type;
     Pressure thresholds;
+    int fd;                 /* Kept open between reads, -1 if not open */
+    PressureSample current; /* As of the last successful pressure_check() */
+    PressureSample previous; /* And the one before that */
+    CustomWindow windows[CUSTOM_WINDOWS_MAX];
+    size_t nr_windows;
+    TotalsHistory history;
+    PressureTrend trends[2]; /* some, full, only kept up with predict */
 } Resource;
 
+/*
+ * On-disk recording, see the record option. The file is a header block, then
+ * a ring of blocks for each tier. Each block holds samples delta encoded as
+ * zigzag varints against the one before, starting from first_ts and zeroes.
+ * Everything is in host byte order.
+ */
+#define RECORD_MAGIC "PSIREC1"
+#define RECORD_VERSION 1
+#define RECORD_BLOCK_SIZE 4096
+typedef enum { TIER_SECOND, TIER_MINUTE, TIER_HOUR } RecordTier;
+#define NR_TIERS (TIER_HOUR + 1)
+
+/* Per resource: some/full avg10 in centi-percent, then some/full total= */
+#define RECORD_VALUES_PER_RESOURCE 4
+#define RECORD_NR_VALUES (NR_RESOURCES * RECORD_VALUES_PER_RESOURCE)
+typedef struct {
+    int64_t ts; /* Unix time, or the start of the period for rollups */
+    uint64_t values[RECORD_NR_VALUES];
+} RecordSample;
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t block_size;
+    uint32_t nr_blocks[NR_TIERS];
+    uint32_t head[NR_TIERS]; /* Block being appended to */
+    uint32_t used[NR_TIERS]; /* Blocks with data in them, up to nr_blocks */
+} RecordFileHeader;
+
+typedef struct {
+    int64_t first_ts;
+    uint32_t nr_samples;
+    uint32_t nr_bytes; /* Of encoded samples following this header */
+} RecordBlockHeader;
+
+typedef void (*RecordSampleFn)(const RecordSample *s, void *data);
+
+/* A grid axis for --sweep, from lo to hi inclusive */
+typedef struct {
+    double lo;
+    double step;
+    size_t nr;
+} SweepRange;
+
+/* One combination of settings tried by --sweep, and how it went */
+typedef struct {
+    double threshold;
+    double hysteresis;
+    double expiry_sec;
+
+    AlertState last_state;
+    bool open; /* Whether there'd be a notification up */
+    int64_t opened_ts;
+    double expires_ts;
+
+    uint32_t alerts;
+    int64_t alert_sec;
+    size_t next_incident; /* The first incident not yet in the past */
+    bool next_incident_led;
+    uint32_t incidents_led;
+    int64_t lead_sec_total;
+    int64_t lead_sec_min;
+} SweepCombo;
+
+/* Recordings only have avg10, the rest is rebuilt when replaying. */
+typedef struct {
+    bool valid;
+    int64_t tick_ts; /* When avgs last decayed */
+    uint64_t tick_total;
+    double avgs[2]; /* avg60, avg300 */
+} ReplayAvgs;
+
+/*
+ * Rules, see the rule option. Each expression is compiled at config load into
+ * a flat program for a small stack machine, see rule_eval(), which runs over a
+ * vector of the current pressures. Each resource and type has a slot for
+ * avg10, avg60, avg300, and then its custom windows.
+ */
+#define RULES_MAX 16
+#define RULE_NAME_MAX 32
+#define RULE_INSNS_MAX 64
+#define RULE_STACK_MAX 16
+#define RULE_EXPR_MAX 256
+#define RULE_WINDOWS (3 + CUSTOM_WINDOWS_MAX)
+#define RULE_NR_METRICS (NR_RESOURCES * 2 * RULE_WINDOWS)
+typedef enum {
+    ROP_LOAD,
+    ROP_CONST,
+    ROP_MIN,
+    ROP_MAX,
+    ROP_GT,
+    ROP_GE,
+    ROP_LT,
+    ROP_LE,
+    ROP_AND,
+    ROP_OR,
+    ROP_NOT
+} RuleOp;
+
+typedef struct {
+    RuleOp op;
+    uint32_t metric; /* ROP_LOAD: index into the pressure vector */
+    double imm[2];   /* Without and with hysteresis applied */
+} RuleInsn;
+
+typedef struct {
+    char name[RULE_NAME_MAX];
+    char expr[RULE_EXPR_MAX]; /* As written, for print_config() */
+    ResourceType culprits; /* The first resource used, to name culprits */
+    RuleInsn insns[RULE_INSNS_MAX];
+    size_t nr_insns;
+} Rule;
+
+/*
+ * Actions, see the action option. They're run on their own thread when a
+ * resource's alert goes active, and undone when it goes inactive again.
+ */
+#define ACTIONS_MAX 16
+#define ACTION_ARG_MAX 256
+#define ACTION_DEFAULT_COOLDOWN_SEC 60
+typedef enum { ACTION_SET, ACTION_EXEC } ActionKind;
+
+typedef struct {
+    ResourceType resource;
+    ActionKind kind;
+    uint64_t cooldown_usec; /* Since it was last applied */
+    char path[PATH_MAX];      /* The cgroup file to write, or the hook */
+    char arg[ACTION_ARG_MAX]; /* The value to write, or the hook's arguments */
+} Action;
+
+/*
+ * A latency histogram in the style of HdrHistogram, in microseconds. Buckets
+ * are linear within each power of two, so a value is never more than an
+ * eighth out, from 1us to over an hour. There's only ever one writer, so
+ * other threads can read it without locks.
+ */
+#define LATENCY_SUB_BUCKET_BITS 3
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BUCKET_BITS)
+#define LATENCY_BUCKETS ((32 - LATENCY_SUB_BUCKET_BITS + 1) * LATENCY_SUB_BUCKETS)
+typedef struct {
+    _Atomic uint64_t counts[LATENCY_BUCKETS];
+    _Atomic uint64_t count;
+    _Atomic uint64_t max;
+} LatencyHistogram;
+
+/* Thresholds for cgroups matching a glob, in container host mode */
+#define CGROUP_PROFILES_MAX 32
+typedef struct {
+    char pattern[128];
+    Pressure thresholds[NR_RESOURCES];
+} CgroupProfile;
+
 typedef struct {
     Resource cpu;
     Resource memory;
     Resource io;
-    time_t update_interval;
+    int64_t update_interval_ms;
+    int64_t update_min_ms; /* update_adaptive, 0 if not enabled */
+    int64_t update_max_ms;
+    double predict_horizon_sec; /* 0 if not predicting */
     bool log_pressures;
+    bool use_triggers;
+    bool lock_memory;
+    bool use_io_uring;
     int psi_dir_fd;
     int32_t io_min_blocked_tasks;
+    char cgroup_root[PATH_MAX]; /* Empty if not in container host mode */
+    char record_path[PATH_MAX]; /* Empty if not recording */
+    char metrics_path[PATH_MAX]; /* Empty if not exporting metrics */
+    char subscribe_path[PATH_MAX]; /* Empty if not accepting subscribers */
+    CgroupProfile cgroup_profiles[CGROUP_PROFILES_MAX];
+    size_t nr_cgroup_profiles;
+    Rule rules[RULES_MAX];
+    size_t nr_rules;
+    Action actions[ACTIONS_MAX];
+    size_t nr_actions;
 } Config;
 
 typedef struct {
-    NotifyNotification *notif;
-    time_t remaining_intervals;
+    uint32_t notif_id; /* 0 if not shown, see alert_user() */
+    uint64_t expires_usec; /* CLOCK_MONOTONIC, when it may become inactive */
     AlertState last_state;
+    bool alerted; /* Went active since it was last inactive */
 } Alert;
 
+/* Tasks in one cgroup, sorted by tid, with their /proc/<tid>/stat fds */
+typedef struct {
+    pid_t *tids;
+    int *fds;
+    size_t nr;
+    size_t cap;
+    uint64_t hash; /* Of cgroup.threads when tids was built */
+    bool valid;
+} TaskList;
+
+/* A process in the seat, with its delay accounting totals, see procstall */
+typedef struct {
+    pid_t tgid;
+    bool baseline; /* totals are from an earlier sample */
+    char comm[16];
+    uint64_t start_time; /* Of whoever comm was read for, see procstall */
+    uint64_t totals[NR_RESOURCES]; /* Delay ns, only for memory and I/O */
+    uint64_t deltas[NR_RESOURCES]; /* Since the previous sample */
+} ProcStall;
+
+/*
+ * Every cgroup below a root, for container host mode, the seat, or all seats
+ * in system mode. Per-cgroup state is stored as parallel arrays of nr entries
+ * (with room for cap) so that sampling thousands of them stays cache friendly.
+ */
+typedef struct {
+    int root_fd;
+    char root_path[PATH_MAX];
+    int inotify_fd;
+    int root_wd;
+    bool watch_warned;
+    bool track_tasks; /* Keep cgroup.threads open for blocked task counts */
+    const char *match; /* If set, only children of the root matching this */
+    size_t nr;
+    size_t cap;
+    char **paths; /* Relative to the root */
+    int *wds;     /* inotify watch, or -1 */
+    /* Open addressed, hold idx + 1 (0 is empty), 2 * cap slots each */
+    size_t *wd_index;
+    size_t *path_index;
+    uint16_t *profiles;
+    int *threads_fds; /* cgroup.threads, or -1 */
+    int *procs_fds;   /* cgroup.procs, or -1 */
+    TaskList *tasks;
+    int *fds[NR_RESOURCES];
+    Alert *alerts[NR_RESOURCES];
+    AlertState *next[NR_RESOURCES]; /* Filled in by workers each tick */
+    uint64_t *totals[NR_RESOURCES]; /* Last some total=, or UINT64_MAX */
+    uint64_t *deltas[NR_RESOURCES]; /* Stall usec between the last 2 samples */
+    uint64_t sampled_usec[NR_RESOURCES];
+    uint64_t elapsed_usec[NR_RESOURCES];
+    size_t batch_base; /* First read_batch slot of ours this tick */
+    size_t batch_nr;   /* How many cgroups are in it, 0 if not batched */
+} CgroupSet;
+
 /* Utility macros and functions */
 
 #define info(format, ...) printf("INFO: " format, __VA_ARGS__)
@@ -108,5 +406,8 @@ static inline int parse_boolean(const char *s) {
 }
 
 static inline const char *active_inactive(Alert *a) {
-    return a->notif ? "active" : "inactive";
+    if (a->last_state == A_RISING) {
+        return "rising";
+    }
+    return a->notif_id ? "active" : "inactive";
 }
@@ -0,0 +1,597 @@
+#define UNIT_TEST
+
+#include <stdio.h>
+#include <sys/stat.h>
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-function"
+#pragma GCC diagnostic ignored "-Wunused-variable"
+
+#include "../psi-notify.c" /* put it in the same translation unit */
+
+#pragma GCC diagnostic pop
+
+static const char *const raw_psi =
+    "some avg10=5.00 avg60=10.02 avg300=100.00 total=453225698\n"
+    "full avg10=5.00 avg60=20.02 avg300=90.00 total=416296780\n";
+
+static volatile double sink;
+
+/*
+ * Allocations are counted by interposing on the malloc family, which glibc
+ * allows. syscalls/op is only read and write style syscalls, from syscr and
+ * syscw in /proc/self/io: that covers the pressure and cgroup reads, and
+ * writes to stdout and eventfds, but not sendmsg() to systemd, epoll_wait(),
+ * io_uring_enter() or anything else.
+ */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static _Atomic uint64_t b_allocs;
+
+void *malloc(size_t size) {
+    b_allocs++;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size) {
+    b_allocs++;
+    return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    b_allocs++;
+    return __libc_realloc(ptr, size);
+}
+
+static int b_io_fd = -1;
+static uint64_t b_io_overhead; /* Syscalls from reading /proc/self/io itself */
+static FILE *b_out;            /* Tab separated results, if asked for */
+
+static uint64_t b_syscalls(void) {
+    char buf[512];
+    const char *p;
+    uint64_t r = 0, w = 0;
+    ssize_t len = pread(b_io_fd, buf, sizeof(buf) - 1, 0);
+
+    expect(len > 0);
+    buf[len] = '\0';
+    p = strstr(buf, "syscr: ");
+    expect(p && sscanf(p, "syscr: %" SCNu64 "\nsyscw: %" SCNu64, &r, &w) == 2);
+    return r + w;
+}
+
+static void b_init(const char *out_path) {
+    b_io_fd = open("/proc/self/io", O_RDONLY | O_CLOEXEC);
+    expect(b_io_fd >= 0);
+    b_io_overhead = b_syscalls();
+    b_io_overhead = b_syscalls() - b_io_overhead;
+
+    if (out_path) {
+        b_out = fopen(out_path, "we");
+        expect(b_out);
+        fprintf(b_out, "name\tns_per_op\tsyscalls_per_op\tallocs_per_op\n");
+    }
+
+    printf("%-32s %10s %12s %10s\n", "", "ns/op", "syscalls/op",
+           "allocs/op");
+}
+
+static uint64_t b_now_ns(void) {
+    struct timespec ts;
+    expect(clock_gettime(CLOCK_MONOTONIC, &ts) == 0);
+    return (uint64_t)ts.tv_sec * SEC_TO_NSEC + (uint64_t)ts.tv_nsec;
+}
+
+typedef struct {
+    double ns, syscalls, allocs; /* Per op */
+} BenchResult;
+
+static BenchResult b_measure(void (*fn)(void), unsigned long iters) {
+    unsigned long i;
+    uint64_t start, syscalls, allocs;
+    BenchResult res;
+
+    for (i = 0; i < iters / 10; i++) {
+        fn();
+    }
+
+    syscalls = b_syscalls();
+    allocs = b_allocs;
+    start = b_now_ns();
+    for (i = 0; i < iters; i++) {
+        fn();
+    }
+    res.ns = (double)(b_now_ns() - start) / (double)iters;
+    res.allocs = (double)(b_allocs - allocs) / (double)iters;
+    res.syscalls = (double)(b_syscalls() - syscalls - b_io_overhead) /
+                   (double)iters;
+    return res;
+}
+
+static void b_report(const char *name, BenchResult res) {
+    printf("%-32s %10.1f %12.2f %10.2f\n", name, res.ns, res.syscalls,
+           res.allocs);
+    if (b_out) {
+        fprintf(b_out, "%s\t%.1f\t%.2f\t%.2f\n", name, res.ns, res.syscalls,
+                res.allocs);
+    }
+}
+
+static double b_run(const char *name, void (*fn)(void), unsigned long iters) {
+    BenchResult res = b_measure(fn, iters);
+    b_report(name, res);
+    return res.ns;
+}
+
+static void bench_parse_pressures(void) {
+    PressureSample s;
+    expect(parse_pressures(raw_psi, &s) ==
+           (PRESSURE_HAS_SOME | PRESSURE_HAS_FULL));
+    sink = s.full.avg300;
+}
+
+/* What pressure_check_single_line() used to do, for comparison. */
+static void bench_parse_pressures_scanf(void) {
+    char type[64];
+    double avg10, avg60, avg300;
+    const char *s = raw_psi;
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        expect(sscanf(s,
+                      "%63s avg10=%lf avg60=%lf avg300=%lf total=%*s",
+                      type,
+                      &avg10,
+                      &avg60,
+                      &avg300) == 4);
+        s = strchr(s, '\n') + 1;
+    }
+    sink = avg300;
+}
+
+static void bench_pressure_check(void) {
+    expect(pressure_check(&cfg.memory, NULL) != A_ERROR);
+}
+
+static void bench_pressure_check_single_line(void) {
+    sink = pressure_check_single_line(&cfg.memory, &cfg.memory.current.some,
+                                      false);
+}
+
+static void bench_get_nr_blocked_tasks(void) {
+    sink = get_nr_blocked_tasks();
+}
+
+/* A pressure file for every resource, as run_checks() wants them all. */
+static void setup_fixture_dir(char *dir) {
+    static const bool has_full[] = {false, true, true};
+    size_t i;
+    int dir_fd;
+
+    expect(mkdtemp(dir));
+    dir_fd = open(dir, O_RDONLY | O_DIRECTORY);
+    expect(dir_fd >= 0);
+
+    using_seat = true;
+    cfg.psi_dir_fd = dir_fd;
+
+    for_each_arr(i, all_res) {
+        Resource *r = all_res[i];
+        FILE *f;
+
+        r->filename = get_psi_filename(res_keys[i], false);
+        r->human_name = res_keys[i];
+        r->has_full = has_full[i];
+        r->type = (ResourceType)i;
+        r->fd = -1;
+
+        f = fdopen(openat(dir_fd, r->filename, O_WRONLY | O_CREAT, 0644),
+                   "w");
+        expect(f);
+        fputs(raw_psi, f);
+        fclose(f);
+    }
+
+    config_reset_user_facing();
+}
+
+static void teardown_fixture_dir(const char *dir) {
+    size_t i;
+
+    for_each_arr(i, all_res) {
+        close(all_res[i]->fd);
+        all_res[i]->fd = -1;
+        expect(unlinkat(cfg.psi_dir_fd, all_res[i]->filename, 0) == 0);
+        free(all_res[i]->filename);
+    }
+    close(cfg.psi_dir_fd);
+    expect(rmdir(dir) == 0);
+}
+
+/*
+ * A large but valid config: every threshold many times over, the other options
+ * in between, and the maximum number of rules. fmemopen() allocates too, so
+ * not all of allocs/op is config parsing's own.
+ */
+#define BENCH_CONFIG_LINES 2000
+
+static char config_text[BENCH_CONFIG_LINES * 64];
+static size_t config_text_len;
+
+static void config_text_append(const char *fmt, ...)
+    __attribute__((format(printf, 1, 2)));
+static void config_text_append(const char *fmt, ...) {
+    va_list ap;
+    int len;
+
+    va_start(ap, fmt);
+    len = vsnprintf(config_text + config_text_len,
+                    sizeof(config_text) - config_text_len, fmt, ap);
+    va_end(ap);
+    expect(len >= 0 &&
+           (size_t)len < sizeof(config_text) - config_text_len);
+    config_text_len += (size_t)len;
+}
+
+static void setup_config_text(void) {
+    static const char *const windows[] = {"avg10", "avg60", "avg300"};
+    static const char *const types[] = {"some", "full"};
+    size_t i;
+
+    config_text_len = 0;
+    for (i = 0; i < BENCH_CONFIG_LINES - RULES_MAX; i++) {
+        switch (i % 8) {
+            case 0:
+                config_text_append("# comment %zu\n\n", i);
+                break;
+            case 1:
+                config_text_append("update %zu\n", 1 + i % 10);
+                break;
+            case 2:
+                config_text_append("log_pressures %s\n",
+                                    i % 3 ? "false" : "true");
+                break;
+            default:
+                config_text_append("threshold %s %s %s %zu.%02zu\n",
+                                    res_keys[i % NR_RESOURCES],
+                                    i % NR_RESOURCES ? types[i % 2] : "some",
+                                    windows[i % 3], 1 + i % 99, i % 100);
+                break;
+        }
+    }
+
+    for (i = 0; i < RULES_MAX; i++) {
+        config_text_append("rule r%zu hysteresis 2 memory.full.avg10 > 5 && "
+                            "io.some.avg60 > 20 || "
+                            "max(cpu.some.avg10, cpu.some.avg60) > 80\n",
+                            i);
+    }
+}
+
+static void bench_config_update_from_file(void) {
+    FILE *f = fmemopen(config_text, config_text_len, "r");
+
+    expect(f);
+    expect(config_update_from_file(&f) == 0);
+}
+
+static void bench_config(void) {
+    static Config saved;
+    char name[64];
+
+    setup_config_text();
+    saved = cfg;
+
+    snprintf_check(name, sizeof(name), "config_update_from_file (%d)",
+                   BENCH_CONFIG_LINES);
+    b_run(name, bench_config_update_from_file, 2000);
+    expect(cfg.nr_rules == RULES_MAX);
+
+    cfg = saved;
+}
+
+/*
+ * Stands in for the sender thread: takes everything queued as if it had been
+ * shown or closed, without going near D-Bus.
+ */
+static uint64_t b_notify_requests;
+
+static void b_sender_drain(void) {
+    size_t head = atomic_load_explicit(&sender.head, memory_order_acquire);
+    b_notify_requests += head - sender.tail;
+    atomic_store_explicit(&sender.tail, head, memory_order_release);
+}
+
+/*
+ * Memory pressure alternates between passing its threshold and clearing it,
+ * so each update either raises or closes an alert: its state change is
+ * logged, and a notification request goes to the sender.
+ */
+static void bench_run_checks_alerting(void) {
+    Alert *a = &active_notif[RT_MEMORY];
+
+    cfg.memory.thresholds.avg10.some =
+        a->last_state == A_ACTIVE ? 50.00 : 1.00;
+    run_checks();
+    a->expires_usec = 0; /* Don't wait out expiry_sec to close it */
+    b_sender_drain();
+}
+
+/*
+ * A whole update. Thresholds are set so every check runs, including counting
+ * blocked tasks for IO full. First with nothing alerting, then with an alert
+ * raised or closed every time, with the alert logs going to /dev/null rather
+ * than the results.
+ */
+static double bench_run_checks(void) {
+    const unsigned long iters = 100000;
+    BenchResult res;
+    double ns;
+    int null_fd, saved_stdout;
+
+    config_reset_user_facing();
+    cfg.memory.thresholds.avg10.some = 50.00;
+    cfg.io.thresholds.avg10.full = 50.00;
+    cfg.io_min_blocked_tasks = 2;
+
+    ns = b_run("run_checks", run_checks, iters);
+
+    expect(notify_init("psi-notify-bench"));
+    null_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    expect(null_fd >= 0);
+    expect(fflush(stdout) == 0);
+    saved_stdout = dup(STDOUT_FILENO);
+    expect(saved_stdout >= 0);
+    expect(dup2(null_fd, STDOUT_FILENO) == STDOUT_FILENO);
+
+    b_notify_requests = 0;
+    res = b_measure(bench_run_checks_alerting, iters);
+
+    expect(fflush(stdout) == 0);
+    expect(dup2(saved_stdout, STDOUT_FILENO) == STDOUT_FILENO);
+    close(saved_stdout);
+    close(null_fd);
+    b_report("run_checks alerting", res);
+    expect(b_notify_requests == iters + iters / 10);
+    expect(sender.nr_pending == 0);
+
+    if (active_notif[RT_MEMORY].last_state == A_ACTIVE) {
+        cfg.memory.thresholds.avg10.some = 50.00;
+        bench_run_checks_alerting();
+    }
+    notify_uninit();
+    config_reset_user_facing();
+    return ns;
+}
+
+static void bench_cgroups_check_all(void) { cgroups_check_all(&cgroups); }
+
+/* What a new cgroup with existing children costs: every one is a duplicate */
+static void bench_cgroups_rescan(void) { cgroups_scan(&cgroups, ".", true); }
+
+/* After missed inotify events, every cgroup is checked and rescanned */
+static void bench_cgroups_overflow(void) {
+    const struct inotify_event ev = {.wd = -1, .mask = IN_Q_OVERFLOW};
+    cgroups_handle_event(&cgroups, &ev);
+}
+
+/*
+ * The same with the reads batched through io_uring. /proc/self/io only counts
+ * read() and write() style syscalls, so io_uring_enter() doesn't show up in
+ * syscalls/op: it's one per READ_BATCH_ENTRIES_MAX reads. The reads are also
+ * done on the kernel's io-wq workers, whose time isn't in ns/op if they get
+ * another CPU.
+ */
+static void bench_cgroups_check_all_batched(void) {
+    tick_reads_batch();
+    cgroups_check_all(&cgroups);
+    read_batch_end();
+}
+
+/* Seats look like user-<i>.slice, anything else like cg<i> */
+static void cgroup_tree_path(char *out, const CgroupSet *set, const char *dir,
+                             size_t i) {
+    if (set->match) {
+        snprintf_check(out, PATH_MAX, "%s/user-%zu.slice", dir, i);
+    } else {
+        snprintf_check(out, PATH_MAX, "%s/cg%zu", dir, i);
+    }
+}
+
+/* A flat cgroup tree of nr children under dir, each with all pressure files */
+static void setup_cgroup_tree(CgroupSet *set, const char *dir, size_t nr) {
+    size_t i, rt;
+
+    for (i = 0; i < nr; i++) {
+        char path[PATH_MAX];
+        cgroup_tree_path(path, set, dir, i);
+        expect(mkdir(path, 0755) == 0);
+        for (rt = 0; rt < NR_RESOURCES; rt++) {
+            char fn[PATH_MAX];
+            FILE *f;
+            snprintf_check(
+                fn, sizeof(fn), "%s/%s", path, cgroup_pressure_files[rt]);
+            f = fopen(fn, "w");
+            expect(f);
+            fputs(raw_psi, f);
+            fclose(f);
+        }
+    }
+
+    expect(cgroups_init(set, dir) == 0);
+    expect(set->nr == nr);
+}
+
+static void teardown_cgroup_tree(CgroupSet *set, const char *dir, size_t nr) {
+    size_t i, rt;
+
+    cgroups_destroy(set);
+
+    for (i = 0; i < nr; i++) {
+        char path[PATH_MAX];
+        cgroup_tree_path(path, set, dir, i);
+        for (rt = 0; rt < NR_RESOURCES; rt++) {
+            char fn[PATH_MAX];
+            snprintf_check(
+                fn, sizeof(fn), "%s/%s", path, cgroup_pressure_files[rt]);
+            expect(unlink(fn) == 0);
+        }
+        expect(rmdir(path) == 0);
+    }
+}
+
+static void bench_cgroups(const char *dir) {
+    static const size_t sizes[] = {100, 1000, 10000};
+    size_t i;
+
+    /* Nothing should alert, we only want the sampling cost. */
+    cfg.cpu.human_name = "cpu";
+    cfg.io.human_name = "io";
+    config_reset_user_facing();
+
+    for_each_arr(i, sizes) {
+        char name[64];
+
+        setup_cgroup_tree(&cgroups, dir, sizes[i]);
+        snprintf_check(
+            name, sizeof(name), "cgroups_check_all (%zu)", sizes[i]);
+        b_run(name, bench_cgroups_check_all, 100000 / sizes[i]);
+
+        cfg.use_io_uring = true;
+        snprintf_check(
+            name, sizeof(name), "cgroups_check_all uring (%zu)", sizes[i]);
+        b_run(name, bench_cgroups_check_all_batched, 100000 / sizes[i]);
+        cfg.use_io_uring = false;
+        read_batch_close();
+
+        snprintf_check(name, sizeof(name), "cgroups_scan dup (%zu)", sizes[i]);
+        b_run(name, bench_cgroups_rescan, 10000 / sizes[i]);
+        snprintf_check(
+            name, sizeof(name), "cgroups overflow rescan (%zu)", sizes[i]);
+        b_run(name, bench_cgroups_overflow, 10000 / sizes[i]);
+        expect(cgroups.nr == sizes[i]);
+
+        teardown_cgroup_tree(&cgroups, dir, sizes[i]);
+    }
+
+    workers_stop();
+}
+
+static size_t b_rss_kib(void) {
+    char line[256];
+    size_t kib = 0;
+    FILE *f = fopen("/proc/self/status", "re");
+
+    expect(f);
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "VmRSS: %zu kB", &kib) == 1) {
+            break;
+        }
+    }
+    fclose(f);
+    return kib;
+}
+
+static void bench_seats_check_all(void) { cgroups_check_all(&seats); }
+
+/*
+ * System mode against one instance per user. The per-user figures aren't
+ * measured, they're modelled: N times the run_checks time, and N times what we
+ * held before doing anything, without glib and libnotify's own allocations.
+ * Real instances would also wake up separately and share no pages, so these
+ * are lower bounds.
+ */
+static void bench_seats(const char *dir, double run_checks_ns,
+                        size_t base_rss_kib) {
+    static const size_t sizes[] = {10, 100, 1000};
+    size_t i;
+
+    system_mode = true;
+    config_reset_user_facing();
+
+    for_each_arr(i, sizes) {
+        char name[64];
+        size_t before = b_rss_kib(), rss;
+
+        setup_cgroup_tree(&seats, dir, sizes[i]);
+        snprintf_check(name, sizeof(name), "seats_check_all (%zu)", sizes[i]);
+        b_run(name, bench_seats_check_all, 100000 / sizes[i]);
+        rss = base_rss_kib + b_rss_kib() - before;
+        printf("%-32s RSS %zu KiB, modelled %zu instances: >= %.1f ns/op, "
+               ">= %zu KiB\n",
+               "", rss, sizes[i], run_checks_ns * (double)sizes[i],
+               base_rss_kib * sizes[i]);
+        teardown_cgroup_tree(&seats, dir, sizes[i]);
+    }
+
+    system_mode = false;
+    workers_stop();
+}
+
+/* What run_checks() does for rules, less alerting, which is the same as ever */
+static void bench_rules_eval(void) {
+    size_t i;
+
+    rule_pressures_update(rule_pressures);
+    for (i = 0; i < cfg.nr_rules; i++) {
+        sink = rule_state(&cfg.rules[i], rule_pressures);
+    }
+}
+
+static void bench_rules(void) {
+    static const size_t sizes[] = {1, 4, RULES_MAX};
+    const char *expr = "memory.full.avg10 > 5 && io.some.avg60 > 20 || "
+                       "max(cpu.some.avg10, cpu.some.avg60) > 80";
+    size_t i, j;
+
+    cfg.memory.has_full = true;
+    cfg.io.has_full = true;
+
+    for_each_arr(i, sizes) {
+        char name[64];
+        double ns;
+
+        cfg.nr_rules = 0;
+        for (j = 0; j < sizes[i]; j++) {
+            Rule *rule = &cfg.rules[cfg.nr_rules++];
+            snprintf_check(rule->name, sizeof(rule->name), "r%zu", j);
+            expect(rule_compile(rule, expr, alert_clear_hysteresis) == 0);
+        }
+
+        snprintf_check(name, sizeof(name), "rules (%zu)", sizes[i]);
+        ns = b_run(name, bench_rules_eval, 1000000);
+        printf("%-32s %10.1f ns/rule\n", "", ns / (double)sizes[i]);
+    }
+
+    cfg.nr_rules = 0;
+}
+
+/* Usage: bench [output], where output gets the results tab separated. */
+int main(int argc, char *argv[]) {
+    char dir[] = "/tmp/psi-notify-bench.XXXXXX";
+    size_t base_rss_kib = b_rss_kib();
+    double run_checks_ns;
+
+    b_init(argc > 1 ? argv[1] : NULL);
+    setup_fixture_dir(dir);
+
+    b_run("parse_pressures", bench_parse_pressures, 1000000);
+    b_run("parse_pressures (sscanf)", bench_parse_pressures_scanf, 1000000);
+    b_run("pressure_check", bench_pressure_check, 100000);
+    b_run("pressure_check_single_line", bench_pressure_check_single_line,
+          1000000);
+    b_run("get_nr_blocked_tasks", bench_get_nr_blocked_tasks, 100000);
+    bench_rules();
+    bench_config();
+    run_checks_ns = bench_run_checks();
+    bench_cgroups(dir);
+    bench_seats(dir, run_checks_ns, base_rss_kib);
+
+    teardown_fixture_dir(dir);
+    if (b_out) {
+        expect(fclose(b_out) == 0);
+    }
+    return 0;
+}
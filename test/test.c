@@ -2,6 +2,7 @@
 
 #include <math.h>
 #include <stdio.h>
+#include <sys/stat.h>
 
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wunused-function"
@@ -43,14 +44,16 @@ static bool test_config_parse_basic(void) {
                              "threshold cpu some avg10 50.00 #c\n"
                              "threshold memory full avg60 10.00 #c\n"
                              "threshold io full avg300 100.00 #c\n"
-                             "log_pressures yes #c";
+                             "log_pressures yes #c\n"
+                             "triggers on #c";
     FILE *f = fmemopen((void *)raw_config, strlen(raw_config), "r");
 
     memset(&cfg, 0, sizeof(Config));
     config_update_from_file(&f);
 
-    t_assert(cfg.update_interval == 3);
+    t_assert(cfg.update_interval_ms == 3000);
     t_assert(cfg.log_pressures);
+    t_assert(cfg.use_triggers);
 
     t_assert(cfg.cpu.thresholds.avg10.some == 50.00);
     t_assert(cfg.memory.thresholds.avg60.full == 10.00);
@@ -100,10 +103,1695 @@ static bool test_pressure_check(void) {
     return true;
 }
 
+static bool test_parse_pressures(void) {
+    PressureSample s;
+
+    t_assert(parse_pressures("some avg10=5.00 avg60=10.02 avg300=100.00 "
+                             "total=453225698\n"
+                             "full avg10=0.10 avg60=0.00 avg300=1.00 "
+                             "total=18446744073709551615\n",
+                             &s) == (PRESSURE_HAS_SOME | PRESSURE_HAS_FULL));
+    t_assert(s.some.avg10 == 5.00);
+    t_assert(s.some.avg60 == 10.02);
+    t_assert(s.some.avg300 == 100.00);
+    t_assert(s.some.total == 453225698);
+    t_assert(s.full.avg10 == 0.10);
+    t_assert(s.full.total == UINT64_MAX);
+
+    /* CPU on older kernels has no full line, and no trailing \n is ok. */
+    t_assert(parse_pressures("some avg10=1.00 avg60=2.00 avg300=3.00 total=4",
+                             &s) == PRESSURE_HAS_SOME);
+
+    t_assert(parse_pressures("some avg10=1000.00 avg60=0.00 avg300=0.00 "
+                             "total=0\n",
+                             &s) < 0);
+    t_assert(parse_pressures("some avg10=1.00 avg60=0.00 avg300=0.00 "
+                             "total=18446744073709551616\n",
+                             &s) < 0);
+    t_assert(parse_pressures("bogus avg10=1.00\n", &s) < 0);
+
+    return true;
+}
+
+static bool test_custom_windows(void) {
+    const char *raw_config = "update 0.5\n"
+                             "threshold memory some avg1 20.00\n"
+                             "threshold memory full avg3 10.00\n"
+                             "threshold memory some avg3 90.00\n"
+                             "threshold memory bogus avg5 10.00\n"
+                             "threshold cpu full avg5 10.00\n";
+    FILE *f = fmemopen((void *)raw_config, strlen(raw_config), "r");
+    Resource *r = &cfg.memory;
+
+    config_update_from_file(&f);
+
+    t_assert(cfg.update_interval_ms == 500);
+    t_assert(r->nr_windows == 2);
+    t_assert(cfg.cpu.nr_windows == 0); /* Invalid lines don't take a window */
+    t_assert(r->windows[0].window_sec == 1);
+    t_assert(r->windows[0].thresholds.some == 20.00);
+    t_assert(r->windows[1].window_sec == 3);
+    t_assert(r->windows[1].thresholds.full == 10.00);
+    t_assert(r->windows[1].thresholds.some == 90.00);
+
+    /* Nothing to compare against with only one sample. */
+    r->history.count = 0;
+    r->current.some.total = 1000000;
+    r->current.full.total = 0;
+    custom_windows_update(r, 10 * SEC_TO_USEC);
+    t_assert(!custom_windows_above(r, false, false));
+
+    /* 250ms stalled in the last second. */
+    r->current.some.total += 250000;
+    r->current.full.total += 250000;
+    custom_windows_update(r, 11 * SEC_TO_USEC);
+    t_assert(r->windows[0].current.some == 25.00);
+    t_assert(custom_windows_above(r, false, false));
+
+    /* avg3 only has one second of history so far, so it uses that. */
+    t_assert(r->windows[1].current.full == 25.00);
+    t_assert(custom_windows_above(r, true, false));
+
+    /* Quiet for another 3 seconds. */
+    custom_windows_update(r, 12 * SEC_TO_USEC);
+    custom_windows_update(r, 13 * SEC_TO_USEC);
+    custom_windows_update(r, 14 * SEC_TO_USEC);
+    t_assert(r->windows[0].current.some == 0.00);
+    t_assert(r->windows[1].current.full == 0.00);
+    t_assert(!custom_windows_above(r, false, true));
+    t_assert(!custom_windows_above(r, true, true));
+
+    /* A stall in a gap longer than a window can't be placed within it */
+    r->current.some.total += 500000;
+    r->current.full.total += 500000;
+    custom_windows_update(r, 16 * SEC_TO_USEC);
+    t_assert(isnan(r->windows[0].current.some));
+    t_assert(r->windows[1].current.full == 500000.0 * 100 / (3 * SEC_TO_USEC));
+    custom_windows_update(r, 20 * SEC_TO_USEC);
+    t_assert(isnan(r->windows[1].current.full));
+    t_assert(!custom_windows_above(r, true, false));
+
+    return true;
+}
+
+static bool test_trigger_threshold(void) {
+    config_reset_user_facing();
+
+    /* Nothing configured, so nothing to register. */
+    t_assert(trigger_threshold(&cfg.memory, false) < 0);
+
+    /* The most sensitive threshold of the type wins. */
+    cfg.memory.thresholds.avg10.some = 20.00;
+    cfg.memory.thresholds.avg300.some = 5.00;
+    cfg.memory.thresholds.avg60.full = 1.00;
+    t_assert(trigger_threshold(&cfg.memory, false) == 5.00);
+    t_assert(trigger_threshold(&cfg.memory, true) == 1.00);
+
+    /* Triggers don't see cgroups, so those have to keep being polled */
+    nr_triggers = 1;
+    t_assert(triggers_idle_ok());
+    cgroups.root_fd = STDIN_FILENO;
+    t_assert(!triggers_idle_ok());
+    cgroups.root_fd = -1;
+    seats.root_fd = STDIN_FILENO;
+    t_assert(!triggers_idle_ok());
+    seats.root_fd = -1;
+    cfg.nr_rules = 1;
+    t_assert(!triggers_idle_ok());
+    cfg.nr_rules = 0;
+    cfg.predict_horizon_sec = 10;
+    t_assert(!triggers_idle_ok());
+    cfg.predict_horizon_sec = 0;
+    nr_triggers = 0;
+    t_assert(!triggers_idle_ok());
+
+    return true;
+}
+
+static bool test_cgroup_profiles(void) {
+    const char *raw_config =
+        "cgroup_root /sys/fs/cgroup\n"
+        "cgroup_threshold machine.slice/* memory some avg10 30.00\n"
+        "cgroup_threshold machine.slice/* io full avg60 5.00\n"
+        "cgroup_threshold *.scope cpu full avg10 5.00\n"
+        "cgroup_threshold *.scope bogus some avg10 5.00\n"
+        "cgroup_threshold *.slice cpu some avg1 5.00\n";
+    FILE *f = fmemopen((void *)raw_config, strlen(raw_config), "r");
+
+    config_update_from_file(&f);
+
+    t_assert(streq(cfg.cgroup_root, "/sys/fs/cgroup"));
+    t_assert(cfg.nr_cgroup_profiles == 3);
+    t_assert(cfg.cgroup_profiles[0].thresholds[RT_MEMORY].avg10.some == 30.00);
+    t_assert(cfg.cgroup_profiles[0].thresholds[RT_IO].avg60.full == 5.00);
+    t_assert(isnan(cfg.cgroup_profiles[0].thresholds[RT_CPU].avg10.some));
+
+    /* CPU full and unknown resources/intervals are rejected */
+    t_assert(isnan(cfg.cgroup_profiles[1].thresholds[RT_CPU].avg10.full));
+    t_assert(isnan(cfg.cgroup_profiles[2].thresholds[RT_CPU].avg10.some));
+
+    /* First match wins, anything else uses the global thresholds */
+    t_assert(cgroup_profile_match("machine.slice/vm1.scope") == 1);
+    t_assert(cgroup_profile_match("session-1.scope") == 2);
+    t_assert(cgroup_profile_match("init.scope/child") == 0);
+    t_assert(cgroup_thresholds(0, RT_MEMORY) == &cfg.memory.thresholds);
+
+    config_reset_user_facing();
+    t_assert(cfg.nr_cgroup_profiles == 0);
+    t_assert(!*cfg.cgroup_root);
+
+    return true;
+}
+
+static bool test_cgroup_discovery(void) {
+    char dir[] = "/tmp/psi-notify-test.XXXXXX", path[PATH_MAX];
+    ssize_t a;
+    bool ok;
+
+    t_assert(mkdtemp(dir));
+    snprintf_check(path, sizeof(path), "%s/a", dir);
+    t_assert(mkdir(path, 0755) == 0);
+
+    t_assert(cgroups_init(&cgroups, dir) == 0);
+    t_assert(cgroups.nr == 1);
+    t_assert(streq(cgroups.paths[0], "a"));
+
+    /* New cgroups are picked up from inotify, and removed ones dropped */
+    snprintf_check(path, sizeof(path), "%s/a/b", dir);
+    t_assert(mkdir(path, 0755) == 0);
+    cgroups_process_events(&cgroups);
+    ok = cgroups.nr == 2 && cgroups_find_path(&cgroups, "a/b") >= 0;
+    t_assert(rmdir(path) == 0);
+    t_assert(ok);
+    cgroups_process_events(&cgroups);
+    t_assert(cgroups.nr == 1);
+
+    /* Missed events are made up for without losing what's still there */
+    cgroups.alerts[RT_CPU][0].last_state = A_ACTIVE;
+    snprintf_check(path, sizeof(path), "%s/c", dir);
+    t_assert(mkdir(path, 0755) == 0);
+    snprintf_check(path, sizeof(path), "%s/a/b", dir);
+    t_assert(mkdir(path, 0755) == 0);
+    cgroups_rescan(&cgroups);
+    t_assert(cgroups.nr == 3);
+    a = cgroups_find_path(&cgroups, "a");
+    t_assert(a >= 0 && cgroups.alerts[RT_CPU][a].last_state == A_ACTIVE);
+    cgroups.alerts[RT_CPU][a].last_state = A_INACTIVE;
+    t_assert(rmdir(path) == 0);
+    snprintf_check(path, sizeof(path), "%s/c", dir);
+    t_assert(rmdir(path) == 0);
+    cgroups_rescan(&cgroups);
+    t_assert(cgroups.nr == 1 && streq(cgroups.paths[0], "a"));
+
+    cgroups_destroy(&cgroups);
+    snprintf_check(path, sizeof(path), "%s/a", dir);
+    t_assert(rmdir(path) == 0);
+    t_assert(rmdir(dir) == 0);
+
+    return true;
+}
+
+/* Every cgroup must be found at its own slot by both path and wd. */
+static bool cgroup_index_consistent(const CgroupSet *set) {
+    size_t i;
+
+    for (i = 0; i < set->nr; i++) {
+        if (cgroups_find_path(set, set->paths[i]) != (ssize_t)i ||
+            (set->wds[i] >= 0 &&
+             cgroups_find_wd(set, set->wds[i]) != (ssize_t)i)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool test_cgroup_index(void) {
+    char dir[] = "/tmp/psi-notify-test.XXXXXX", path[PATH_MAX];
+    const size_t nr = CGROUPS_INITIAL_CAP * 2 + 3;
+    size_t i;
+
+    t_assert(mkdtemp(dir));
+    for (i = 0; i < nr; i++) {
+        snprintf_check(path, sizeof(path), "%s/cg%zu", dir, i);
+        t_assert(mkdir(path, 0755) == 0);
+    }
+
+    /* Past the initial capacity, so the indexes were rebuilt on growth */
+    t_assert(cgroups_init(&cgroups, dir) == 0);
+    t_assert(cgroups.nr == nr);
+    t_assert(cgroup_index_consistent(&cgroups));
+    t_assert(cgroups_find_path(&cgroups, "nope") < 0);
+    t_assert(cgroups_find_wd(&cgroups, -1) < 0);
+
+    /* Removal moves the last cgroup, which must be found in its new slot */
+    for (i = 0; i < nr / 2; i++) {
+        cgroups_remove(&cgroups, (i * 7) % cgroups.nr);
+    }
+    t_assert(cgroups.nr == nr - nr / 2);
+    t_assert(cgroup_index_consistent(&cgroups));
+
+    /* Rescanning only adds what's missing */
+    cgroups_scan(&cgroups, ".", true);
+    t_assert(cgroups.nr == nr);
+    t_assert(cgroup_index_consistent(&cgroups));
+
+    cgroups_destroy(&cgroups);
+    for (i = 0; i < nr; i++) {
+        snprintf_check(path, sizeof(path), "%s/cg%zu", dir, i);
+        t_assert(rmdir(path) == 0);
+    }
+    t_assert(rmdir(dir) == 0);
+
+    return true;
+}
+
+static void write_cpu_pressure(const char *dir, const char *cg,
+                               unsigned long total) {
+    char fn[PATH_MAX];
+    FILE *f;
+
+    snprintf_check(fn, sizeof(fn), "%s/%s/cpu.pressure", dir, cg);
+    f = fopen(fn, "w");
+    expect(f);
+    fprintf(f,
+            "some avg10=0.00 avg60=0.00 avg300=0.00 total=%lu\n"
+            "full avg10=0.00 avg60=0.00 avg300=0.00 total=0\n",
+            total);
+    fclose(f);
+}
+
+/* Batched reads must match what pread() sees, even as fds get reused. */
+static bool test_read_batch(void) {
+    static const char *const cgs[] = {"a", "b", "c", "d"};
+    char dir[] = "/tmp/psi-notify-test.XXXXXX", path[PATH_MAX], hot[PATH_MAX];
+    size_t i, last;
+    ssize_t d;
+    int hot_fd;
+    FILE *f;
+
+    t_assert(mkdtemp(dir));
+    for (i = 0; i < 3; i++) {
+        snprintf_check(path, sizeof(path), "%s/%s", dir, cgs[i]);
+        t_assert(mkdir(path, 0755) == 0);
+        write_cpu_pressure(dir, cgs[i], 1000);
+    }
+
+    config_reset_user_facing();
+    cfg.cpu.thresholds.avg10.some = 50.00;
+    cfg.use_io_uring = true;
+    t_assert(cgroups_init(&cgroups, dir) == 0);
+    t_assert(cgroups.nr == 3);
+
+    /* Only the last one is over the threshold, so nothing moves later */
+    last = cgroups.nr - 1;
+    snprintf_check(hot, sizeof(hot), "%s", cgroups.paths[last]);
+    snprintf_check(path, sizeof(path), "%s/%s/cpu.pressure", dir, hot);
+    f = fopen(path, "w");
+    t_assert(f);
+    fputs("some avg10=90.00 avg60=0.00 avg300=0.00 total=1000\n", f);
+    fclose(f);
+
+    tick_reads_batch();
+    if (read_batch.unavailable) {
+        printf("  io_uring unavailable, only checking the fallback\n");
+    } else {
+        t_assert(cgroups.batch_nr == 3);
+    }
+    cgroups_sample_range(0, cgroups.nr, &cgroups);
+    read_batch_end();
+    t_assert(cgroups.next[RT_CPU][0] == A_INACTIVE);
+    t_assert(cgroups.next[RT_CPU][1] == A_INACTIVE);
+    t_assert(cgroups.next[RT_CPU][last] == A_ACTIVE);
+
+    /*
+     * d takes the same slot and fd number, but must not be read as the old
+     * file. Our open files keep its directory around on tmpfs, so inotify
+     * wouldn't tell us it went.
+     */
+    hot_fd = cgroups.fds[RT_CPU][last];
+    t_assert(unlink(path) == 0);
+    cgroups_remove(&cgroups, last);
+    snprintf_check(path, sizeof(path), "%s/%s", dir, hot);
+    t_assert(rmdir(path) == 0);
+    snprintf_check(path, sizeof(path), "%s/d", dir);
+    t_assert(mkdir(path, 0755) == 0);
+    write_cpu_pressure(dir, "d", 1000);
+    cgroups_process_events(&cgroups);
+    d = cgroups_find_path(&cgroups, "d");
+    t_assert(d == (ssize_t)last);
+    t_assert(dup2(cgroups.fds[RT_CPU][last], hot_fd) == hot_fd);
+    close(cgroups.fds[RT_CPU][last]);
+    cgroups.fds[RT_CPU][last] = hot_fd;
+
+    tick_reads_batch();
+    cgroups_sample_range(0, cgroups.nr, &cgroups);
+    read_batch_end();
+    t_assert(cgroups.next[RT_CPU][last] == A_INACTIVE);
+
+    /* Turning it off goes back to pread() */
+    cfg.use_io_uring = false;
+    tick_reads_batch();
+    t_assert(read_batch.ring_fd < 0 && read_batch.cap == 0);
+
+    cgroups_destroy(&cgroups);
+    config_reset_user_facing();
+    for_each_arr(i, cgs) {
+        if (streq(cgs[i], hot)) {
+            continue;
+        }
+        snprintf_check(path, sizeof(path), "%s/%s/cpu.pressure", dir, cgs[i]);
+        t_assert(unlink(path) == 0);
+        snprintf_check(path, sizeof(path), "%s/%s", dir, cgs[i]);
+        t_assert(rmdir(path) == 0);
+    }
+    t_assert(rmdir(dir) == 0);
+
+    return true;
+}
+
+static bool test_culprits(void) {
+    static const char *const idle_psi =
+        "some avg10=0.00 avg60=1.00 avg300=0.00 total=1000\n";
+    static const char *const busy_psi =
+        "some avg10=0.50 avg60=1.00 avg300=0.00 total=2000\n";
+    static const char *const cgs[] = {"user@1000.service", "a.service",
+                                      "b.scope", "c.slice", "d.service"};
+    char dir[] = "/tmp/psi-notify-test.XXXXXX", path[PATH_MAX],
+         desc[CULPRITS_DESC_MAX] = "";
+    size_t i, top[CULPRITS_TOP];
+
+    t_assert(mkdtemp(dir));
+    for_each_arr(i, cgs) {
+        snprintf_check(path, sizeof(path), "%s/%s", dir, cgs[i]);
+        t_assert(mkdir(path, 0755) == 0);
+        write_cpu_pressure(dir, cgs[i], 1000);
+    }
+
+    cfg.cpu.human_name = "cpu";
+    cfg.cpu.type = RT_CPU;
+    t_assert(cgroups_init(&seat_cgroups, dir) == 0);
+    culprits_sample(&seat_cgroups, RT_CPU);
+
+    write_cpu_pressure(dir, "user@1000.service", 9000000);
+    write_cpu_pressure(dir, "a.service", 2000);
+    write_cpu_pressure(dir, "b.scope", 501000);
+    write_cpu_pressure(dir, "c.slice", 8000000);
+    write_cpu_pressure(dir, "d.service", 101000);
+    culprits_sample(&seat_cgroups, RT_CPU);
+
+    /* Slices and user@.service contain everything else, so are skipped */
+    t_assert(culprits_find(&seat_cgroups, RT_CPU, top) == 3);
+    t_assert(streq(seat_cgroups.paths[top[0]], "b.scope"));
+    t_assert(streq(seat_cgroups.paths[top[1]], "d.service"));
+    t_assert(streq(seat_cgroups.paths[top[2]], "a.service"));
+
+    seat_cgroups.elapsed_usec[RT_CPU] = SEC_TO_USEC;
+    culprits_describe(&seat_cgroups, &cfg.cpu, desc, sizeof(desc));
+    t_assert(streq(desc,
+                   "Most stalled: b.scope (50%), d.service (10%), "
+                   "a.service (0%). "));
+
+    /* Units are only read while the resource itself has stalled */
+    seat_cgroups.sampled_usec[RT_CPU] = 1;
+    pressure_check_notify_if_new(
+        &cfg.cpu, fmemopen((void *)idle_psi, strlen(idle_psi), "r"));
+    t_assert(seat_cgroups.sampled_usec[RT_CPU] == 1);
+    pressure_check_notify_if_new(
+        &cfg.cpu, fmemopen((void *)busy_psi, strlen(busy_psi), "r"));
+    t_assert(seat_cgroups.sampled_usec[RT_CPU] > 1);
+    active_notif[RT_CPU] = (Alert)DEFAULT_ALERT_STATE;
+
+    cgroups_destroy(&seat_cgroups);
+    for_each_arr(i, cgs) {
+        snprintf_check(path, sizeof(path), "%s/%s/cpu.pressure", dir, cgs[i]);
+        t_assert(unlink(path) == 0);
+        snprintf_check(path, sizeof(path), "%s/%s", dir, cgs[i]);
+        t_assert(rmdir(path) == 0);
+    }
+    t_assert(rmdir(dir) == 0);
+
+    return true;
+}
+
+static bool test_procstall(void) {
+    ProcStall procs[] = {
+        {.tgid = 10, .comm = "firefox", .deltas[RT_MEMORY] = 2500000000},
+        {.tgid = 20, .comm = "make", .deltas[RT_MEMORY] = 200000000},
+        {.tgid = 30, .comm = "idle"},
+        {.tgid = 40, .comm = "ld", .deltas[RT_MEMORY] = 1000000000},
+        {.tgid = 50, .comm = "cc", .deltas[RT_MEMORY] = 1000000,
+         .deltas[RT_IO] = 3000000},
+    };
+    char dir[] = "/tmp/psi-notify-test.XXXXXX", path[PATH_MAX],
+         desc[CULPRITS_DESC_MAX + PROCSTALL_DESC_MAX] = "Most stalled: x. ";
+    ProcStall *saved;
+    size_t saved_nr, i;
+    FILE *f;
+
+    /* Querying works if we're allowed to, otherwise it's just turned off */
+    t_assert(mkdtemp(dir));
+    snprintf_check(path, sizeof(path), "%s/a.service", dir);
+    t_assert(mkdir(path, 0755) == 0);
+    snprintf_check(path, sizeof(path), "%s/a.service/cgroup.procs", dir);
+    f = fopen(path, "w");
+    t_assert(f);
+    fprintf(f, "%d\n", getpid());
+    fclose(f);
+    t_assert(cgroups_init(&seat_cgroups, dir) == 0);
+
+    procstall_sample();
+    if (procstall.unavailable) {
+        printf("  taskstats unavailable, only checking the report\n");
+    } else {
+        t_assert(procstall.nr == 1);
+        t_assert(procstall.procs[0].tgid == getpid());
+        t_assert(procstall.procs[0].baseline);
+        /* Names are only looked up for the processes which get named */
+        t_assert(procstall.procs[0].comm[0] == '\0');
+        t_assert(procstall_identify(&procstall.procs[0]));
+        t_assert(streq(procstall.procs[0].comm, "test"));
+        t_assert(procstall.procs[0].start_time == proc_start_time(getpid()));
+    }
+
+    saved = procstall.procs;
+    saved_nr = procstall.nr;
+    procstall.procs = procs;
+    procstall.nr = sizeof(procs) / sizeof(procs[0]);
+    procstall.elapsed_usec = 5 * SEC_TO_USEC;
+    procstall.sampled_check = stats.checks + 1;
+    for_each_arr(i, procs) {
+        procs[i].start_time = proc_start_time(procs[i].tgid);
+    }
+
+    cfg.memory.type = RT_MEMORY;
+    cfg.io.type = RT_IO;
+    cfg.cpu.type = RT_CPU;
+    procstall_describe(&cfg.memory, desc, sizeof(desc));
+    t_assert(streq(desc, "Most stalled: x. Waited most: firefox[10] (2.5s), "
+                         "ld[40] (1.0s), make[20] (200ms). "));
+    desc[0] = '\0';
+    procstall_describe(&cfg.io, desc, sizeof(desc));
+    t_assert(streq(desc, "Waited most: cc[50] (3ms). "));
+    desc[0] = '\0';
+    procstall_describe(&cfg.cpu, desc, sizeof(desc));
+    t_assert(streq(desc, ""));
+
+    /* A reused pid isn't named after the process it used to be */
+    procs[4] = (ProcStall){.tgid = getpid(), .comm = "old", .start_time = 1,
+                           .deltas[RT_IO] = 3000000};
+    desc[0] = '\0';
+    procstall_describe(&cfg.io, desc, sizeof(desc));
+    t_assert(streq(desc, ""));
+    t_assert(procs[4].deltas[RT_IO] == 0 && !procs[4].comm[0]);
+
+    procstall.procs = saved;
+    procstall.nr = saved_nr;
+    procstall_close();
+    cgroups_destroy(&seat_cgroups);
+    t_assert(unlink(path) == 0);
+    snprintf_check(path, sizeof(path), "%s/a.service", dir);
+    t_assert(rmdir(path) == 0);
+    t_assert(rmdir(dir) == 0);
+
+    return true;
+}
+
+static bool test_blocked_tasks(void) {
+    char buf[64];
+    TaskList tl = {0};
+    int fd;
+    int len = snprintf(buf, sizeof(buf), "%d\n", getpid());
+
+    t_assert(get_nr_blocked_tasks_system() >= 0);
+
+    task_list_update(&tl, buf, (size_t)len);
+    t_assert(tl.nr == 1 && tl.fds[0] >= 0);
+    fd = tl.fds[0];
+
+    /* We're running, not in D state */
+    t_assert(task_list_nr_blocked(&tl) == 0);
+
+    /* Existing tasks keep their fd, and gone ones are tolerated */
+    len = snprintf(buf, sizeof(buf), "%d\n%d\n", INT32_MAX, getpid());
+    task_list_update(&tl, buf, (size_t)len);
+    t_assert(tl.nr == 2);
+    t_assert(tl.tids[0] == getpid() && tl.fds[0] == fd);
+    t_assert(tl.fds[1] < 0);
+    t_assert(task_list_nr_blocked(&tl) == 0);
+
+    /* A reused tid's fd is still the dead task's, so it's reopened */
+    fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    t_assert(fd >= 0);
+    close(tl.fds[0]);
+    tl.fds[0] = fd;
+    t_assert(task_list_nr_blocked(&tl) == 0);
+    t_assert(tl.fds[0] >= 0);
+    t_assert(pread(tl.fds[0], buf, sizeof(buf), 0) > 0);
+
+    task_list_destroy(&tl);
+    return true;
+}
+
+static bool test_adaptive_interval(void) {
+    const char *raw_config = "update_adaptive 0.5 30\n";
+    FILE *f = fmemopen((void *)raw_config, strlen(raw_config), "r");
+    const TimeResourcePressure t = {20.00, -1}, off = {-1, -1};
+    PressureLine prev = {1.00, 1.00, 1.00, 0}, cur = prev;
+
+    config_update_from_file(&f);
+    t_assert(cfg.update_min_ms == 500);
+    t_assert(cfg.update_max_ms == 30000);
+
+    /* Hysteresis for 20.00 is 15.00, and half of that is "far" */
+    t_assert(threshold_distance(20.00, 1.00) == D_FAR);
+    t_assert(threshold_distance(20.00, 10.00) == D_MID);
+    t_assert(threshold_distance(20.00, 16.00) == D_NEAR);
+    t_assert(threshold_distance(-1, 99.00) == D_FAR);
+
+    /* Rising towards a threshold counts as near */
+    cur.avg10 = prev.avg10 = 10.00;
+    t_assert(line_distance(&t, &off, &off, &cur, &prev, false) == D_MID);
+    cur.avg10 = 12.00;
+    t_assert(line_distance(&t, &off, &off, &cur, &prev, false) == D_NEAR);
+    t_assert(line_distance(&t, &off, &off, &cur, &prev, true) == D_FAR);
+
+    return true;
+}
+
+static bool test_sample_history(void) {
+    static SampleHistory h, snap;
+    PressureSample s = {{12.34, 5.00, 100.00, 0}, {0.01, 0, 0, 0}};
+    uint64_t i;
+
+    for (i = 0; i < 10; i++) {
+        s.some.total = i;
+        sample_history_add(&h, i * SEC_TO_USEC, &s);
+    }
+    t_assert(sample_history_snapshot(&h, &snap) == 10);
+    t_assert(snap.ts_usec[0] == 0 && snap.some_total[9] == 9);
+    t_assert(snap.some_avg[0][0] == 1234);
+    t_assert(snap.some_avg[1][0] == 500);
+    t_assert(snap.some_avg[2][0] == 10000);
+    t_assert(snap.full_avg[0][0] == 1);
+
+    /* After wrapping, the oldest entry is the first one not overwritten */
+    for (; i < SAMPLE_HISTORY_LEN + 5; i++) {
+        s.some.total = i;
+        sample_history_add(&h, i * SEC_TO_USEC, &s);
+    }
+    t_assert(sample_history_snapshot(&h, &snap) == SAMPLE_HISTORY_LEN - 1);
+    t_assert(snap.some_total[0] == 6);
+    t_assert(snap.some_total[SAMPLE_HISTORY_LEN - 2] ==
+             SAMPLE_HISTORY_LEN + 4);
+
+    return true;
+}
+
+static bool test_recording(void) {
+    char path[] = "/tmp/psi-notify-test.XXXXXX";
+    RecordSample s = {0};
+    char *out = NULL;
+    size_t out_len = 0, i;
+    FILE *f;
+    int fd;
+
+    fd = mkstemp(path);
+    t_assert(fd >= 0);
+    close(fd);
+    t_assert(recorder_open(path) == 0);
+
+    /* Two minutes and a bit, with avg10 peaking in the first minute */
+    for (i = 0; i < 130; i++) {
+        s.ts = 1800000000 + (int64_t)i;
+        s.values[0] = i == 30 ? 9000 : 1234;
+        s.values[2] = 1000000 + i * 777;
+        recorder_add(&s);
+    }
+    recorder_close();
+
+    /* Reopening keeps what's there */
+    t_assert(recorder_open(path) == 0);
+    recorder_close();
+
+    f = open_memstream(&out, &out_len);
+    t_assert(f);
+    t_assert(record_export(path, TIER_SECOND, 1800000128, INT64_MAX, f) == 0);
+    fclose(f);
+    t_assert(strstr(out, "\n1800000128,12.34,0.00,1099456,0,"));
+    t_assert(strstr(out, "\n1800000129,12.34,0.00,1100233,0,"));
+    t_assert(!strstr(out, "\n1800000127,"));
+    free(out);
+
+    f = open_memstream(&out, &out_len);
+    t_assert(f);
+    t_assert(record_export(path, TIER_MINUTE, INT64_MIN, INT64_MAX, f) == 0);
+    fclose(f);
+    t_assert(strstr(out, "\n1800000000,90.00,0.00,1045843,0,"));
+    t_assert(strstr(out, "\n1800000060,12.34,0.00,1092463,0,"));
+    t_assert(strstr(out, "\n1800000120,12.34,0.00,1100233,0,"));
+    free(out);
+
+    t_assert(unlink(path) == 0);
+
+    return true;
+}
+
+/* Memory stalls half the time for five minutes, after a quiet spell */
+static bool write_stall_recording(char *path) {
+    const uint64_t mem_some = RT_MEMORY * RECORD_VALUES_PER_RESOURCE;
+    RecordSample s = {0};
+    size_t i;
+    int fd;
+
+    fd = mkstemp(path);
+    t_assert(fd >= 0);
+    close(fd);
+    t_assert(recorder_open(path) == 0);
+
+    for (i = 0; i < 600; i++) {
+        bool stalling = i >= 100 && i < 400;
+        s.ts = 1800000000 + (int64_t)i;
+        s.values[mem_some] = stalling ? 5000 : 0;
+        s.values[mem_some + 2] += stalling ? 500000 : 0;
+        recorder_add(&s);
+    }
+    recorder_close();
+
+    return true;
+}
+
+static bool test_replay(void) {
+    char path[] = "/tmp/psi-notify-test.XXXXXX";
+    unsigned long long ts[4];
+    char *out = NULL;
+    size_t out_len = 0;
+    FILE *f;
+
+    t_assert(write_stall_recording(path));
+
+    /* Only avg60 is checked, which has to be rebuilt from the totals */
+    config_reset_user_facing();
+    cfg.memory.thresholds.avg60.some = 40.00;
+
+    f = open_memstream(&out, &out_len);
+    t_assert(f);
+    t_assert(replay_recording(path, TIER_SECOND, INT64_MIN, INT64_MAX, f) ==
+             0);
+    fclose(f);
+    t_assert(!replay.active);
+    t_assert(replay.samples == 600);
+    t_assert(replay.transitions == 4);
+
+    /*
+     * 50% decays towards 40% over about 48 periods of 2 seconds, and the same
+     * on the way back down, with a grace period each side of the threshold.
+     */
+    t_assert(sscanf(out,
+                    "%llu memory: inactive -> stabilising\n"
+                    "%llu memory: stabilising -> active\n"
+                    "%llu memory: active -> stabilising\n"
+                    "%llu memory: stabilising -> inactive\n",
+                    &ts[0],
+                    &ts[1],
+                    &ts[2],
+                    &ts[3]) == 4);
+    t_assert(ts[0] > 1800000100 && ts[0] < ts[1]);
+    t_assert(ts[1] >= 1800000190 && ts[1] <= 1800000200);
+    t_assert(ts[2] > 1800000400 && ts[2] < ts[3]);
+    t_assert(ts[3] < 1800000599);
+    t_assert(active_notif[RT_MEMORY].notif_id == 0);
+    free(out);
+
+    t_assert(unlink(path) == 0);
+    config_reset_user_facing();
+    active_notif[RT_MEMORY] = (Alert)DEFAULT_ALERT_STATE;
+
+    return true;
+}
+
+static bool test_predict(void) {
+    char path[] = "/tmp/psi-notify-test.XXXXXX";
+    const PressureLine quiet = {0};
+    PressureTrend t = {0};
+    unsigned long long ts[3];
+    uint64_t total = 0;
+    char *out = NULL;
+    size_t out_len = 0;
+    Pressure thresholds;
+    /* level, slope, avg, threshold */
+    static const double eta_cases[][4] = {
+        {20, 0, 0, 19.5},    {20, 0, 0, 25},    {-30, 1.5, 0, 60},
+        {80, 2, 0, 99},      {60, -0.5, 10, 40}, {60, -0.5, 10, 70},
+        {0, 0.1, 50, 50},    {0, 0.1, 50, 55},  {150, -3, 0, 90},
+        {10, 0.02, 5, 12.3},
+    };
+    FILE *f;
+    size_t c, d;
+    int i;
+
+    /* A steady 20% settles with no slope */
+    for (i = 1; i <= 30; i++) {
+        total += 200000;
+        trend_update(&t, total, (uint64_t)i * SEC_TO_USEC);
+    }
+    t_assert(t.valid);
+    t_assert(fabs(t.level - 20) < 0.01 && fabs(t.slope) < 0.01);
+
+    /* Then rising by 2 points a second, which Holt's tracks without lag */
+    for (i = 31; i <= 60; i++) {
+        total += (uint64_t)(200000 + (i - 30) * 20000);
+        trend_update(&t, total, (uint64_t)i * SEC_TO_USEC);
+    }
+    t_assert(fabs(t.level - 80) < 1 && fabs(t.slope - 2) < 0.1);
+
+    /* avg10 starting from nothing passes 30 in 3 periods at that rate */
+    cfg.predict_horizon_sec = 10;
+    memset(&thresholds, 0xff, sizeof(thresholds));
+    thresholds.avg10.some = 30;
+    t_assert(trend_eta(&t, &quiet, &thresholds, false) == 6);
+    t_assert(trend_eta(&t, &quiet, &thresholds, true) < 0);
+    thresholds.avg10.some = 90;
+    t_assert(trend_eta(&t, &quiet, &thresholds, false) < 0);
+
+    /* The closed form agrees with stepping, through clamping and turning */
+    cfg.predict_horizon_sec = 600;
+    for_each_arr(c, eta_cases) {
+        const PressureTrend et = {
+            .level = eta_cases[c][0], .slope = eta_cases[c][1]};
+        double avg, want, elapsed;
+
+        for_each_arr(d, psi_avg_decay) {
+            avg = eta_cases[c][2];
+            want = avg > eta_cases[c][3] ? 0 : -1;
+            for (elapsed = PSI_AVG_PERIOD_SEC; want < 0 && elapsed <= 600;
+                 elapsed += PSI_AVG_PERIOD_SEC) {
+                double rate = et.level + et.slope * (elapsed - 1);
+                rate = rate < 0 ? 0 : rate > 100 ? 100 : rate;
+                avg = avg * psi_avg_decay[d] + rate * (1 - psi_avg_decay[d]);
+                if (avg > eta_cases[c][3]) {
+                    want = elapsed;
+                    break;
+                }
+            }
+            t_assert(trend_eta_one(&et, eta_cases[c][2], psi_avg_decay[d],
+                                   eta_cases[c][3]) == want);
+        }
+    }
+
+    /* Over the same recording as test_replay, it warns a horizon early */
+    t_assert(write_stall_recording(path));
+    config_reset_user_facing();
+    cfg.memory.thresholds.avg60.some = 40.00;
+    cfg.predict_horizon_sec = 10;
+
+    f = open_memstream(&out, &out_len);
+    t_assert(f);
+    t_assert(replay_recording(path, TIER_SECOND, INT64_MIN, INT64_MAX, f) ==
+             0);
+    fclose(f);
+    t_assert(sscanf(out,
+                    "%llu memory: inactive -> stabilising\n"
+                    "%llu memory: stabilising -> rising\n"
+                    "%llu memory: rising -> active\n",
+                    &ts[0],
+                    &ts[1],
+                    &ts[2]) == 3);
+    t_assert(ts[2] - ts[1] >= 8 && ts[2] - ts[1] <= 12);
+    /* And not again on the way down */
+    t_assert(replay.transitions == 5);
+    free(out);
+
+    t_assert(unlink(path) == 0);
+    config_reset_user_facing();
+    active_notif[RT_MEMORY] = (Alert)DEFAULT_ALERT_STATE;
+
+    return true;
+}
+
+static bool test_sweep(void) {
+    char path[] = "/tmp/psi-notify-test.XXXXXX";
+    char incidents[] = "/tmp/psi-notify-test.XXXXXX";
+    const SweepRange ranges[] = {
+        {.lo = 30, .step = 10, .nr = 3}, /* 30, 40, 50 */
+        {.lo = 5, .nr = 1},
+        {.lo = 10, .step = 290, .nr = 2}, /* 10, 300 */
+    };
+    SweepRange r;
+    unsigned long long ts[4];
+    char *out = NULL, *line;
+    size_t out_len = 0;
+    FILE *f;
+    int fd;
+
+    t_assert(sweep_parse_range("1:2:0.1", &r) && r.nr == 11);
+    t_assert(sweep_parse_range("7", &r) && r.nr == 1 && r.lo == 7);
+    t_assert(!sweep_parse_range("2:1:1", &r));
+    t_assert(!sweep_parse_range("1:2:0", &r));
+    t_assert(!sweep_parse_range("1:2", &r));
+
+    t_assert(write_stall_recording(path));
+    fd = mkstemp(incidents);
+    t_assert(fd >= 0);
+    t_assert(write(fd, "# Two\n1800000250\n1800000550\n", 29) == 29);
+    close(fd);
+
+    /* What the alert logic itself makes of one of the combinations */
+    config_reset_user_facing();
+    cfg.memory.thresholds.avg60.some = 40.00;
+    f = open_memstream(&out, &out_len);
+    t_assert(f);
+    t_assert(replay_recording(path, TIER_SECOND, INT64_MIN, INT64_MAX, f) ==
+             0);
+    fclose(f);
+    t_assert(sscanf(out,
+                    "%llu memory: inactive -> stabilising\n"
+                    "%llu memory: stabilising -> active\n"
+                    "%llu memory: active -> stabilising\n"
+                    "%llu memory: stabilising -> inactive\n",
+                    &ts[0],
+                    &ts[1],
+                    &ts[2],
+                    &ts[3]) == 4);
+    free(out);
+    config_reset_user_facing();
+    active_notif[RT_MEMORY] = (Alert)DEFAULT_ALERT_STATE;
+
+    f = open_memstream(&out, &out_len);
+    t_assert(f);
+    t_assert(sweep_recording(path, TIER_SECOND, INT64_MIN, INT64_MAX,
+                             "memory.some.avg60", ranges, incidents, 3600,
+                             f) == 0);
+    fclose(f);
+
+    /* Same alert, which leads the first incident but not the second */
+    line = strstr(out, "\n40.00,5.00,10,");
+    t_assert(line);
+    t_assert(sscanf(line, "\n40.00,5.00,10,1,%llu,1,%llu,", &ts[0],
+                    &ts[2]) == 2);
+    t_assert(ts[0] == ts[3] - ts[1]);
+    t_assert(ts[2] == 1800000250 - ts[1]);
+
+    /* Too high to ever alert, and low enough to alert for longer */
+    t_assert(strstr(out, "\n50.00,5.00,10,0,0,0,,\n"));
+    t_assert(strstr(out, "\n30.00,5.00,300,1,"));
+    t_assert(!replay.active);
+    free(out);
+
+    t_assert(unlink(path) == 0);
+    t_assert(unlink(incidents) == 0);
+
+    return true;
+}
+
+static bool test_rules(void) {
+    const char *raw_config =
+        "rule swap memory.full.avg10 > 5 && io.some.avg60 > 20 # c\n"
+        "rule peak hysteresis 2 max(cpu.some.avg10, memory.some.avg2) >= 50\n"
+        "rule calm !(io.some.avg10 > 1) || cpu.some.avg300 < io.some.avg300\n"
+        "rule bad1 cpu.full.avg10 > 5\n"
+        "rule bad2 memory.some.avg10 > \n"
+        "rule bad3 max(memory.some.avg10) > 5\n"
+        "rule bad4 (memory.some.avg10 > 5\n"
+        "rule bad5 memory.some.avg10 > 5 extra\n"
+        "rule bad6 cpu.some.avg3 > 5 && memory.some.avg7 >\n"
+        "rule same io.some.avg4 > 5 || io.some.avg4 < 1\n";
+    const char *reload_config =
+        "rule peak hysteresis 2 max(cpu.some.avg10, memory.some.avg2) >= 60\n"
+        "rule swap memory.full.avg10 > 5 && io.some.avg60 > 20\n";
+    FILE *f = fmemopen((void *)raw_config, strlen(raw_config), "r");
+    double p[RULE_NR_METRICS] = {0};
+    const size_t mem_full = (RT_MEMORY * 2 + 1) * RULE_WINDOWS;
+    const size_t io_some = RT_IO * 2 * RULE_WINDOWS;
+    const size_t cpu_some = RT_CPU * 2 * RULE_WINDOWS;
+    const size_t mem_some = RT_MEMORY * 2 * RULE_WINDOWS;
+
+    config_update_from_file(&f);
+
+    t_assert(cfg.nr_rules == 4);
+    t_assert(streq(cfg.rules[0].name, "swap"));
+    t_assert(streq(cfg.rules[0].expr,
+                   "memory.full.avg10 > 5 && io.some.avg60 > 20"));
+    t_assert(cfg.rules[0].culprits == RT_MEMORY);
+    t_assert(cfg.memory.nr_windows == 1);
+    t_assert(cfg.memory.windows[0].window_sec == 2);
+    t_assert(isnan(cfg.memory.windows[0].thresholds.some));
+
+    /* Rules that don't compile don't take custom windows */
+    t_assert(cfg.cpu.nr_windows == 0);
+    t_assert(cfg.io.nr_windows == 1);
+    t_assert(cfg.rules[3].insns[0].metric == io_some + 3);
+    t_assert(cfg.rules[3].insns[3].metric == io_some + 3);
+
+    /* Hysteresis is folded into constants: 5 - 5 clamps to 1, 20 - 5 = 15 */
+    p[mem_full] = 6;
+    p[io_some + 1] = 21;
+    t_assert(rule_state(&cfg.rules[0], p) == A_ACTIVE);
+    p[io_some + 1] = 16;
+    t_assert(rule_state(&cfg.rules[0], p) == A_STABILISING);
+    p[mem_full] = 0.5;
+    t_assert(rule_state(&cfg.rules[0], p) == A_INACTIVE);
+
+    /* Custom windows have their own slot after the kernel's */
+    p[mem_some + 3] = 50;
+    t_assert(rule_state(&cfg.rules[1], p) == A_ACTIVE);
+    p[mem_some + 3] = 48.5;
+    t_assert(rule_state(&cfg.rules[1], p) == A_STABILISING);
+    p[cpu_some] = 47.9;
+    t_assert(rule_state(&cfg.rules[1], p) == A_STABILISING);
+    p[mem_some + 3] = 0;
+    t_assert(rule_state(&cfg.rules[1], p) == A_INACTIVE);
+
+    /* Neither side is constant, so hysteresis is applied when evaluated */
+    p[io_some] = 5;
+    p[cpu_some + 2] = 10;
+    p[io_some + 2] = 8;
+    t_assert(rule_state(&cfg.rules[2], p) == A_STABILISING);
+    p[io_some + 2] = 20;
+    t_assert(rule_state(&cfg.rules[2], p) == A_ACTIVE);
+    p[io_some] = 0.5;
+    p[io_some + 2] = 0;
+    t_assert(rule_state(&cfg.rules[2], p) == A_ACTIVE);
+
+    /* Over a reload, only unchanged rules keep their alerts, wherever moved */
+    rules_apply_config();
+    rule_alerts[0].last_state = A_ACTIVE;
+    rule_alerts[1].last_state = A_ACTIVE;
+    f = fmemopen((void *)reload_config, strlen(reload_config), "r");
+    config_update_from_file(&f);
+    t_assert(cfg.nr_rules == 2);
+    rules_apply_config();
+    t_assert(rule_alerts[0].last_state == A_INACTIVE);
+    t_assert(rule_alerts[1].last_state == A_ACTIVE);
+    t_assert(rule_alerts[2].last_state == A_INACTIVE);
+    rule_alerts[1] = (Alert)DEFAULT_ALERT_STATE;
+
+    return true;
+}
+
+static void actions_drain(void) {
+    while (actions.tail != actions.head) {
+        action_handle(&actions.ring[actions.tail % ACTION_QUEUE_LEN]);
+        actions.tail++;
+    }
+}
+
+static bool test_actions(void) {
+    char dir[] = "/tmp/psi-notify-test.XXXXXX";
+    char cg[PATH_MAX], file[PATH_MAX], hook[PATH_MAX], out[PATH_MAX];
+    char raw_config[4 * PATH_MAX], buf[128];
+    ActionRequest *req;
+    size_t head;
+    int status;
+    FILE *f;
+
+    t_assert(mkdtemp(dir));
+    snprintf_check(cg, sizeof(cg), "%s/background.slice", dir);
+    t_assert(mkdir(cg, 0755) == 0);
+    snprintf_check(file, sizeof(file), "%s/cpu.weight", cg);
+    f = fopen(file, "w");
+    t_assert(f);
+    fputs("100\n", f);
+    fclose(f);
+    snprintf_check(out, sizeof(out), "%s/out", dir);
+    snprintf_check(hook, sizeof(hook), "%s/hook", dir);
+    f = fopen(hook, "w");
+    t_assert(f);
+    fputs("#!/bin/sh\necho \"$1 $PSI_RESOURCE $PSI_STATE $PSI_SOME_AVG10\" "
+          ">> \"$2\"\n",
+          f);
+    fclose(f);
+    t_assert(chmod(hook, 0755) == 0);
+
+    snprintf_check(raw_config, sizeof(raw_config),
+                   "action memory cooldown 60 set %s cpu.weight 10\n"
+                   "action io exec %s hi %s # c\n"
+                   "action cpu set background.slice cgroup.freeze 1\n"
+                   "action cpu cooldown inf exec /bin/true\n"
+                   "action cpu set background.slice a/b 1\n"
+                   "action cpu set background.slice cgroup.freeze\n"
+                   "action cpu exec hook\n"
+                   "action cpu freeze background.slice\n"
+                   "action cpu cooldown -1 exec /bin/true\n"
+                   "action disk exec /bin/true\n",
+                   cg, hook, out);
+    f = fmemopen(raw_config, strlen(raw_config), "r");
+    config_update_from_file(&f);
+
+    t_assert(cfg.nr_actions == 4);
+    t_assert(cfg.actions[0].resource == RT_MEMORY);
+    t_assert(cfg.actions[0].kind == ACTION_SET);
+    t_assert(cfg.actions[0].cooldown_usec == 60 * SEC_TO_USEC);
+    t_assert(streq(cfg.actions[0].path, file));
+    t_assert(streq(cfg.actions[0].arg, "10"));
+    t_assert(cfg.actions[1].kind == ACTION_EXEC);
+    t_assert(cfg.actions[1].cooldown_usec ==
+             ACTION_DEFAULT_COOLDOWN_SEC * SEC_TO_USEC);
+    t_assert(strncmp(cfg.actions[1].arg, "hi /", strlen("hi /")) == 0);
+    t_assert(streq(cfg.actions[2].path,
+                   "/sys/fs/cgroup/background.slice/cgroup.freeze"));
+    t_assert(cfg.actions[3].cooldown_usec ==
+             (uint64_t)ACTION_COOLDOWN_MAX_SEC * SEC_TO_USEC);
+
+    /* Applied when active, left be when stabilising, undone when inactive */
+    actions_transition(&cfg.memory, A_INACTIVE, A_ACTIVE);
+    actions_drain();
+    t_assert(action_read(file, buf, sizeof(buf)) && streq(buf, "10"));
+    actions_transition(&cfg.memory, A_ACTIVE, A_STABILISING);
+    t_assert(actions.tail == actions.head);
+    actions_transition(&cfg.memory, A_STABILISING, A_INACTIVE);
+    actions_drain();
+    t_assert(action_read(file, buf, sizeof(buf)) && streq(buf, "100"));
+    t_assert(actions.nr_applied == 0);
+
+    /* Not again within the cooldown, and so nothing to undo either */
+    actions_transition(&cfg.memory, A_INACTIVE, A_ACTIVE);
+    t_assert(actions.tail == actions.head);
+    actions_transition(&cfg.memory, A_ACTIVE, A_INACTIVE);
+    t_assert(actions.tail == actions.head);
+
+    /* Hooks run again with the state inactive to undo */
+    cfg.io.current.some.avg10 = 12.5;
+    actions_transition(&cfg.io, A_INACTIVE, A_ACTIVE);
+    actions_drain();
+    t_assert(waitpid(-1, &status, 0) > 0 && WIFEXITED(status) &&
+             WEXITSTATUS(status) == 0);
+    actions_transition(&cfg.io, A_ACTIVE, A_INACTIVE);
+    actions_drain();
+    t_assert(waitpid(-1, &status, 0) > 0 && WIFEXITED(status) &&
+             WEXITSTATUS(status) == 0);
+    t_assert(action_read(out, buf, sizeof(buf)));
+    t_assert(streq(buf, "hi io active 12.50\nhi io inactive 12.50"));
+
+    /* An undo waits for room rather than being dropped, applies are skipped */
+    actions.last_usec[0] = 0;
+    actions_transition(&cfg.memory, A_INACTIVE, A_ACTIVE);
+    actions_drain();
+    while ((req = actions_reserve(ACTION_UNDO, 0))) {
+        actions_commit();
+    }
+    actions_transition(&cfg.memory, A_ACTIVE, A_INACTIVE);
+    t_assert(actions.nr_pending == 1 && actions.applied_id[0] == 0);
+    actions.last_usec[0] = 0;
+    actions_transition(&cfg.memory, A_INACTIVE, A_ACTIVE);
+    t_assert(actions.applied_id[0] == 0 && actions.nr_pending == 1);
+    actions_drain();
+    actions_flush();
+    actions_drain();
+    t_assert(action_read(file, buf, sizeof(buf)) && streq(buf, "100"));
+    t_assert(actions.nr_pending == 0 && actions.nr_applied == 0);
+
+    /* On its own thread, started with the config */
+    actions_apply_config();
+    t_assert(actions.started);
+    t_assert(actions.last_usec[0] == 0);
+    actions_transition(&cfg.memory, A_INACTIVE, A_ACTIVE);
+    while (actions.tail != actions.head) {
+        sched_yield();
+    }
+    t_assert(action_read(file, buf, sizeof(buf)) && streq(buf, "10"));
+
+    /* A reload leaves it be if it's unchanged, cooldown and all */
+    head = actions.head;
+    f = fmemopen(raw_config, strlen(raw_config), "r");
+    config_update_from_file(&f);
+    active_notif[RT_MEMORY].last_state = A_ACTIVE;
+    actions_apply_config();
+    t_assert(actions.head == head);
+    t_assert(actions.applied_id[0] != 0 && actions.last_usec[0] != 0);
+
+    /* Otherwise it's undone, and the new one applied if still alerting */
+    snprintf_check(raw_config, sizeof(raw_config),
+                   "action memory set %s cpu.weight 20\n", cg);
+    f = fmemopen(raw_config, strlen(raw_config), "r");
+    config_update_from_file(&f);
+    actions_apply_config();
+    while (actions.tail != actions.head) {
+        sched_yield();
+    }
+    t_assert(action_read(file, buf, sizeof(buf)) && streq(buf, "20"));
+
+    /* And everything is put back when stopping */
+    active_notif[RT_MEMORY].last_state = A_INACTIVE;
+    actions_stop();
+    t_assert(action_read(file, buf, sizeof(buf)) && streq(buf, "100"));
+    t_assert(actions.nr_applied == 0);
+
+    cfg.nr_actions = 0;
+    memset(&cfg.io.current, 0, sizeof(cfg.io.current));
+    t_assert(unlink(out) == 0);
+    t_assert(unlink(hook) == 0);
+    t_assert(unlink(file) == 0);
+    t_assert(rmdir(cg) == 0);
+    t_assert(rmdir(dir) == 0);
+    return true;
+}
+
+static bool test_notify_queue(void) {
+    uint32_t first, second, extra[NOTIFY_QUEUE_LEN], late[2];
+    size_t nr_extra = 0, i;
+
+    expect(notify_init("psi-notify-test"));
+
+    /* Shown and closed before the sender got to it, so never delivered */
+    first = alert_user("memory", NULL, "", -1);
+    t_assert(first != 0);
+    alert_destroy(first);
+    second = alert_user("io", "machine.slice", "", -1);
+    t_assert(second != 0 && second != first);
+
+    sender_coalesce(sender.tail, sender.head);
+    t_assert(sender.ring[0].op == NOTIFY_SKIP);
+    t_assert(sender.ring[1].op == NOTIFY_SKIP);
+    t_assert(sender.ring[2].op == NOTIFY_SHOW);
+    t_assert(strstr(sender.ring[2].body, "In machine.slice."));
+
+    /* With the ring full, shows and closes wait for room, not dropped */
+    while (!sender_full()) {
+        extra[nr_extra++] = alert_user("cpu", NULL, "", -1);
+    }
+    for_each_arr(i, late) {
+        late[i] = alert_user("cpu", NULL, "", -1);
+        t_assert(late[i] != 0);
+    }
+    t_assert(sender.nr_pending == 2);
+    alert_destroy(late[1]); /* Never shown, so nothing to close either */
+    t_assert(sender.nr_pending == 1);
+    for (i = 0; i < nr_extra; i++) {
+        alert_destroy(extra[i]);
+    }
+    t_assert(sender.nr_pending == 1 + nr_extra);
+
+    /* Queued before the thread started, it should still be picked up */
+    sender_start();
+    while (sender.tail != sender.head) {
+        sched_yield();
+    }
+    t_assert(sender.nr_live == 1 + nr_extra);
+    while (sender.nr_pending > 0 || sender.tail != sender.head) {
+        sender_flush();
+        sched_yield();
+    }
+    t_assert(sender.nr_live == 2);
+    alert_destroy(second);
+    alert_destroy(late[0]);
+    sender_stop();
+    t_assert(sender.tail == sender.head);
+    t_assert(sender.delivered == 2 + nr_extra);
+    t_assert(sender.nr_live == 0);
+
+    notify_uninit();
+    return true;
+}
+
+static bool test_seats(void) {
+    static const char *const dirs[] = {"user-1000.slice", "init.scope",
+                                       "user-1000.slice/session-1.scope"};
+    char dir[] = "/tmp/psi-notify-test.XXXXXX", path[PATH_MAX];
+    const NotifyRequest *req;
+    uid_t uid;
+    size_t i;
+    bool ok;
+
+    t_assert(mkdtemp(dir));
+    for_each_arr(i, dirs) {
+        snprintf_check(path, sizeof(path), "%s/%s", dir, dirs[i]);
+        t_assert(mkdir(path, 0755) == 0);
+    }
+
+    /* Only seats directly below the root, and they come and go */
+    t_assert(cgroups_init(&seats, dir) == 0);
+    t_assert(seats.nr == 1);
+    t_assert(streq(seats.paths[0], "user-1000.slice"));
+
+    snprintf_check(path, sizeof(path), "%s/user-1001.slice", dir);
+    t_assert(mkdir(path, 0755) == 0);
+    snprintf_check(path, sizeof(path), "%s/user-1001.slice/a.scope", dir);
+    t_assert(mkdir(path, 0755) == 0);
+    cgroups_process_events(&seats);
+    ok = seats.nr == 2 && cgroups_find_path(&seats, "user-1001.slice") >= 0;
+    t_assert(rmdir(path) == 0);
+    snprintf_check(path, sizeof(path), "%s/user-1001.slice", dir);
+    t_assert(rmdir(path) == 0);
+    t_assert(ok);
+    cgroups_process_events(&seats);
+    t_assert(seats.nr == 1);
+
+    cgroups_destroy(&seats);
+    t_assert(seats.match);
+    for (i = sizeof(dirs) / sizeof(dirs[0]); i > 0; i--) {
+        snprintf_check(path, sizeof(path), "%s/%s", dir, dirs[i - 1]);
+        t_assert(rmdir(path) == 0);
+    }
+    t_assert(rmdir(dir) == 0);
+
+    t_assert(seat_uid("user-1000.slice", &uid) && uid == 1000);
+    t_assert(!seat_uid("user-1000.slice/a.scope", &uid));
+    t_assert(!seat_uid("machine.slice", &uid));
+
+    /* Seat alerts go to their owner, and nothing else has anyone to go to */
+    system_mode = true;
+    t_assert(alert_user("CPU", NULL, "", -1) == 0);
+    t_assert(alert_user("CPU", "machine.slice", "", -1) == 0);
+    t_assert(alert_user("CPU", "user-1000.slice", "", -1) != 0);
+    req = &sender.ring[(sender.head - 1) % NOTIFY_QUEUE_LEN];
+    t_assert(req->op == NOTIFY_SHOW && req->uid == 1000);
+    t_assert(!strstr(req->body, "user-1000.slice"));
+    sender.tail = sender.head;
+    system_mode = false;
+
+    return true;
+}
+
+/* From <sanitizer/allocator_interface.h>, which isn't always installed */
+int __sanitizer_install_malloc_and_free_hooks(
+    void (*malloc_hook)(const volatile void *, size_t),
+    void (*free_hook)(const volatile void *));
+
+static bool count_allocs;
+static size_t nr_allocs;
+
+static void count_malloc_hook(const volatile void *ptr, size_t size) {
+    (void)ptr;
+    (void)size;
+    if (count_allocs) {
+        nr_allocs++;
+    }
+}
+
+/* Both hooks are required, or nothing is installed */
+static void count_free_hook(const volatile void *ptr) { (void)ptr; }
+
+static bool sd_notify_recv(int fd, const char *want) {
+    char buf[NOTIFY_BATCH_MAX + 1];
+    ssize_t len = recv(fd, buf, sizeof(buf) - 1, MSG_DONTWAIT);
+
+    if (!want) {
+        t_assert(len < 0 && errno == EAGAIN);
+        return true;
+    }
+
+    t_assert(len > 0);
+    buf[len] = '\0';
+    t_assert(streq(buf, want));
+    return true;
+}
+
+static bool test_sd_notify(void) {
+    char dir[] = "/tmp/psi-notify-test.XXXXXX";
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    int fd;
+
+    t_assert(mkdtemp(dir));
+    snprintf_check(addr.sun_path, sizeof(addr.sun_path), "%s/notify", dir);
+    fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    t_assert(fd >= 0);
+    t_assert(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+    t_assert(setenv("NOTIFY_SOCKET", addr.sun_path, 1) == 0);
+    sd_notify_close();
+
+    /* Everything in one datagram */
+    sd_notify("READY=1");
+    sd_notify_status("Alerts: none. 5us", strlen("Alerts: none."));
+    sd_notify_flush();
+    t_assert(sd_notify_recv(fd, "READY=1\nSTATUS=Alerts: none. 5us\n"));
+
+    /* Only the unimportant part changed, so it waits for something else */
+    sd_notify_status("Alerts: none. 7us", strlen("Alerts: none."));
+    sd_notify_flush();
+    t_assert(sd_notify_recv(fd, NULL));
+    sd_notify("WATCHDOG=1");
+    sd_notify_flush();
+    t_assert(sd_notify_recv(fd, "WATCHDOG=1\nSTATUS=Alerts: none. 7us\n"));
+
+    sd_notify_status("Alerts: memory. 7us", strlen("Alerts: memory."));
+    sd_notify_flush();
+    t_assert(sd_notify_recv(fd, "STATUS=Alerts: memory. 7us\n"));
+    sd_notify_flush();
+    t_assert(sd_notify_recv(fd, NULL));
+
+    /* Updates every second against a 6 second watchdog: ping every 2s or so */
+    sdn.watchdog_usec = 6 * SEC_TO_USEC;
+    sdn.max_interval_usec = SEC_TO_USEC;
+    sdn.last_ping_usec = now_usec();
+    sd_notify_watchdog();
+    sd_notify_flush();
+    t_assert(sd_notify_recv(fd, NULL));
+    sdn.last_ping_usec = now_usec() - 2 * SEC_TO_USEC;
+    sd_notify_watchdog();
+    sd_notify_flush();
+    t_assert(sd_notify_recv(fd, "WATCHDOG=1\n"));
+
+    sd_notify_close();
+    t_assert(unsetenv("NOTIFY_SOCKET") == 0);
+    close(fd);
+    t_assert(unlink(addr.sun_path) == 0);
+    t_assert(rmdir(dir) == 0);
+    memset(&sdn, 0, sizeof(sdn));
+    sdn.fd = -1;
+
+    return true;
+}
+
+static bool test_latency_histogram(void) {
+    static LatencyHistogram h;
+    uint64_t i;
+
+    /* Exact below the sub-buckets, then within an eighth */
+    t_assert(latency_bucket(7) == 7);
+    t_assert(latency_bucket(8) == 8);
+    t_assert(latency_bucket(16) == latency_bucket(17));
+    t_assert(latency_bucket(17) != latency_bucket(18));
+    t_assert(latency_bucket_max(latency_bucket(1000)) >= 1000);
+    t_assert(latency_bucket_max(latency_bucket(1000)) < 1000 + 1000 / 8);
+    t_assert(latency_bucket(UINT64_MAX) == LATENCY_BUCKETS - 1);
+
+    t_assert(latency_percentile(&h, 50) == 0);
+
+    for (i = 1; i <= 1000; i++) {
+        latency_record(&h, i);
+    }
+    t_assert(h.count == 1000);
+    t_assert(latency_percentile(&h, 50) >= 500);
+    t_assert(latency_percentile(&h, 50) < 500 + 500 / 8);
+    t_assert(latency_percentile(&h, 99) >= 990);
+    t_assert(latency_percentile(&h, 100) == 1000);
+
+    return true;
+}
+
+static bool test_tick_no_alloc(void) {
+    static const char *const res[] = {"cpu", "memory", "io"};
+    const char *raw_psi =
+        "some avg10=5.00 avg60=10.02 avg300=100.00 total=453225698\n"
+        "full avg10=5.00 avg60=20.02 avg300=90.00 total=416296780\n";
+    char dir[] = "/tmp/psi-notify-test.XXXXXX", fn[PATH_MAX];
+    int dir_fd, i, sv[2];
+    size_t j;
+    FILE *f;
+
+    t_assert(mkdtemp(dir));
+    dir_fd = open(dir, O_RDONLY | O_DIRECTORY);
+    t_assert(dir_fd >= 0);
+
+    for_each_arr(j, res) {
+        snprintf_check(fn, sizeof(fn), "%s/%s.pressure", dir, res[j]);
+        f = fopen(fn, "w");
+        t_assert(f);
+        fputs(raw_psi, f);
+        fclose(f);
+    }
+
+    close(cfg.psi_dir_fd);
+    cfg.psi_dir_fd = dir_fd;
+    using_seat = true;
+    for_each_arr(j, all_res) {
+        if (all_res[j]->fd >= 0) {
+            close(all_res[j]->fd);
+            all_res[j]->fd = -1;
+        }
+        free(all_res[j]->filename);
+        all_res[j]->filename = get_psi_filename(res[j], false);
+    }
+
+    /* Nothing alerts, but the IO full gate has to count blocked tasks. */
+    config_reset_user_facing();
+    cfg.memory.thresholds.avg10.some = 50.00;
+    cfg.io.thresholds.avg10.full = 50.00;
+    cfg.io_min_blocked_tasks = 2;
+
+    /* The first ticks may open files and size buffers. */
+    for (i = 0; i < 3; i++) {
+        run_checks();
+    }
+
+    t_assert(__sanitizer_install_malloc_and_free_hooks(count_malloc_hook,
+                                                       count_free_hook));
+    count_allocs = true;
+    for (i = 0; i < 10; i++) {
+        run_checks();
+    }
+    count_allocs = false;
+    t_assert(nr_allocs == 0);
+    t_assert(stats.update.count >= 13);
+    t_assert(stats.pressure_check.count >= 13 * NR_RESOURCES);
+
+    /* Likewise once the read batch is sized */
+    cfg.use_io_uring = true;
+    run_checks();
+    count_allocs = true;
+    for (i = 0; i < 10; i++) {
+        run_checks();
+    }
+    count_allocs = false;
+    t_assert(nr_allocs == 0);
+    cfg.use_io_uring = false;
+    read_batch_close();
+
+    /*
+     * And when memory is close to alerting, so processes in the seat are
+     * sampled. taskstats is faked with a socket nobody answers on.
+     */
+    snprintf_check(fn, sizeof(fn), "%s/a.service", dir);
+    t_assert(mkdir(fn, 0755) == 0);
+    snprintf_check(fn, sizeof(fn), "%s/a.service/cgroup.procs", dir);
+    f = fopen(fn, "w");
+    t_assert(f);
+    fprintf(f, "%d\n%d\n1\n", getpid(), getppid());
+    fclose(f);
+    t_assert(cgroups_init(&seat_cgroups, dir) == 0);
+    t_assert(socketpair(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0,
+                        sv) == 0);
+    procstall.fd = sv[0];
+    procstall.unavailable = false;
+    procstall.procs = calloc(PROCSTALL_MAX, sizeof(*procstall.procs));
+    procstall.next = calloc(PROCSTALL_MAX, sizeof(*procstall.next));
+    procstall.tgids = calloc(PROCSTALL_MAX, sizeof(*procstall.tgids));
+    cfg.memory.thresholds.avg10.some = 6.00;
+    active_notif[RT_MEMORY] = (Alert)DEFAULT_ALERT_STATE;
+    run_checks();
+    t_assert(active_notif[RT_MEMORY].notif_id == 0);
+    t_assert(procstall.nr == 3 && procstall.procs[0].tgid == 1);
+    count_allocs = true;
+    for (i = 0; i < 10; i++) {
+        run_checks();
+    }
+    count_allocs = false;
+    t_assert(nr_allocs == 0);
+    t_assert(procstall.sampled_check == stats.checks);
+
+    /* Far from alerting, so they're left alone */
+    cfg.memory.thresholds.avg10.some = 50.00;
+    active_notif[RT_MEMORY] = (Alert)DEFAULT_ALERT_STATE;
+    run_checks();
+    t_assert(procstall.sampled_check == stats.checks - 1);
+
+    /* Coming back to them much later starts again from a new baseline */
+    procstall.sampled_usec = now_usec() - procstall_stale_usec() - 1;
+    cfg.memory.thresholds.avg10.some = 6.00;
+    active_notif[RT_MEMORY] = (Alert)DEFAULT_ALERT_STATE;
+    run_checks();
+    t_assert(procstall.sampled_check == stats.checks);
+    t_assert(procstall.elapsed_usec == 0);
+    cfg.memory.thresholds.avg10.some = 50.00;
+    active_notif[RT_MEMORY] = (Alert)DEFAULT_ALERT_STATE;
+
+    procstall_close();
+    close(sv[1]);
+    cgroups_destroy(&seat_cgroups);
+    t_assert(unlink(fn) == 0);
+    snprintf_check(fn, sizeof(fn), "%s/a.service", dir);
+    t_assert(rmdir(fn) == 0);
+
+    for_each_arr(j, res) {
+        close(all_res[j]->fd);
+        all_res[j]->fd = -1;
+        snprintf_check(fn, sizeof(fn), "%s.pressure", res[j]);
+        t_assert(unlinkat(dir_fd, fn, 0) == 0);
+    }
+    t_assert(rmdir(dir) == 0);
+
+    return true;
+}
+
+static bool test_metrics(void) {
+    char path[] = "/tmp/psi-notify-test.XXXXXX", sock[PATH_MAX], buf[8192];
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    ssize_t len;
+    int fd;
+
+    t_assert(mkdtemp(path));
+    snprintf_check(sock, sizeof(sock), "%s/metrics", path);
+    snprintf_check(addr.sun_path, sizeof(addr.sun_path), "%s", sock);
+
+    loop.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    t_assert(loop.epoll_fd >= 0);
+    t_assert(metrics_open(sock) == 0);
+
+    config_reset_user_facing();
+    cfg.memory.thresholds.avg10.some = 10.00;
+    cfg.memory.current.some.avg10 = 12.50;
+    cfg.memory.current.full.total = 1500000;
+    active_notif[RT_MEMORY].last_state = A_ACTIVE;
+    stats.transitions[RT_MEMORY][A_ACTIVE] = 3;
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    t_assert(fd >= 0);
+    t_assert(connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+
+    /* Serving a scrape must not allocate, or wait for the client */
+    t_assert(__sanitizer_install_malloc_and_free_hooks(count_malloc_hook,
+                                                       count_free_hook));
+    nr_allocs = 0;
+    count_allocs = true;
+    metrics_render();
+    metrics_serve();
+    count_allocs = false;
+    t_assert(nr_allocs == 0);
+
+    len = read(fd, buf, sizeof(buf) - 1);
+    t_assert(len > 0);
+    buf[len] = '\0';
+    close(fd);
+
+    t_assert(strstr(buf, "\npsi_notify_pressure_percent{resource=\"memory\","
+                         "kind=\"some\",window=\"avg10\"} 12.50\n"));
+    t_assert(strstr(buf, "\npsi_notify_threshold_percent{resource=\"memory\","
+                         "kind=\"some\",window=\"avg10\"} 10.00\n"));
+    t_assert(!strstr(buf, "psi_notify_threshold_percent{resource=\"cpu\""));
+    t_assert(strstr(buf, "\npsi_notify_stall_seconds_total{resource=\"memory\","
+                         "kind=\"full\"} 1.500000\n"));
+    t_assert(strstr(buf, "\npsi_notify_alert{resource=\"memory\","
+                         "psi_notify_alert=\"active\"} 1\n"));
+    t_assert(strstr(buf, "\npsi_notify_alert{resource=\"cpu\","
+                         "psi_notify_alert=\"active\"} 0\n"));
+    t_assert(strstr(buf, "\npsi_notify_alert_transitions_total{resource="
+                         "\"memory\",state=\"active\"} 3\n"));
+    t_assert(strstr(buf, "\n# EOF\n"));
+
+    active_notif[RT_MEMORY].last_state = A_INACTIVE;
+    metrics_close();
+    t_assert(access(sock, F_OK) < 0);
+    t_assert(rmdir(path) == 0);
+    close(loop.epoll_fd);
+    loop.epoll_fd = -1;
+
+    return true;
+}
+
+static int subscribe_connect(const char *path) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    snprintf_check(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        return -1;
+    }
+    subscribers_accept();
+    return fd;
+}
+
+static bool test_subscribers(void) {
+    char path[] = "/tmp/psi-notify-test.XXXXXX", sock[PATH_MAX], buf[1024];
+    const char cmd[] = "samples on\n";
+    ssize_t len;
+    int fast, slow, i;
+
+    t_assert(mkdtemp(path));
+    snprintf_check(sock, sizeof(sock), "%s/subscribe", path);
+
+    loop.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    t_assert(loop.epoll_fd >= 0);
+    active_notif[RT_IO].last_state = A_STABILISING;
+    t_assert(subscribers_open(sock) == 0);
+
+    /* New subscribers are told the current state straight away */
+    fast = subscribe_connect(sock);
+    t_assert(fast >= 0);
+    len = read(fast, buf, sizeof(buf) - 1);
+    t_assert(len > 0);
+    buf[len] = '\0';
+    t_assert(streq(buf, "alert cpu inactive\nalert memory inactive\n"
+                        "alert io stabilising\n"));
+
+    t_assert(write(fast, cmd, strlen(cmd)) == (ssize_t)strlen(cmd));
+    subscriber_event(0, EPOLLIN);
+    t_assert(subs.clients[0].samples);
+
+    slow = subscribe_connect(sock);
+    t_assert(slow >= 0);
+    t_assert(subs.clients[1].used && !subs.clients[1].samples);
+
+    active_notif[RT_IO].last_state = A_INACTIVE;
+    memset(&cfg.memory.current, 0, sizeof(cfg.memory.current));
+    cfg.memory.current.some.avg10 = 12.50;
+    cfg.memory.current.full.total = 42;
+    subscribers_publish();
+    len = read(fast, buf, sizeof(buf) - 1);
+    t_assert(len > 0);
+    buf[len] = '\0';
+    t_assert(strstr(buf, "alert io inactive\n"));
+    t_assert(strstr(buf, "\nsample memory some avg10=12.50 "));
+    t_assert(strstr(buf, " full avg10=0.00 avg60=0.00 avg300=0.00 total=42\n"));
+
+    /* Samples only go to those who asked, state changes to everyone */
+    len = read(slow, buf, sizeof(buf) - 1);
+    t_assert(len > 0);
+    buf[len] = '\0';
+    t_assert(streq(buf, "alert cpu inactive\nalert memory inactive\n"
+                        "alert io stabilising\nalert io inactive\n"));
+
+    /* Someone who stops reading is dropped, rather than holding us up */
+    t_assert(write(slow, cmd, strlen(cmd)) == (ssize_t)strlen(cmd));
+    subscriber_event(1, EPOLLIN);
+    for (i = 0; i < 100000 && subs.clients[1].used; i++) {
+        subscribers_publish();
+        while (recv(fast, buf, sizeof(buf), MSG_DONTWAIT) > 0) {
+        }
+    }
+    t_assert(!subs.clients[1].used);
+    t_assert(subs.clients[0].used);
+
+    close(fast);
+    close(slow);
+    subscribers_close();
+    t_assert(!subs.clients[0].used);
+    t_assert(access(sock, F_OK) < 0);
+    t_assert(rmdir(path) == 0);
+    close(loop.epoll_fd);
+    loop.epoll_fd = -1;
+
+    return true;
+}
+
 static bool run_tests(void) {
     t_run(test_config_parse_basic);
     t_run(test_config_parse_init_no_file_uses_defaults);
+    t_run(test_parse_pressures);
     t_run(test_pressure_check);
+    t_run(test_custom_windows);
+    t_run(test_trigger_threshold);
+    t_run(test_cgroup_profiles);
+    t_run(test_cgroup_discovery);
+    t_run(test_cgroup_index);
+    t_run(test_read_batch);
+    t_run(test_culprits);
+    t_run(test_procstall);
+    t_run(test_blocked_tasks);
+    t_run(test_adaptive_interval);
+    t_run(test_sample_history);
+    t_run(test_recording);
+    t_run(test_replay);
+    t_run(test_predict);
+    t_run(test_sweep);
+    t_run(test_rules);
+    t_run(test_actions);
+    t_run(test_notify_queue);
+    t_run(test_seats);
+    t_run(test_sd_notify);
+    t_run(test_latency_histogram);
+    t_run(test_tick_no_alloc);
+    t_run(test_metrics);
+    t_run(test_subscribers);
     return true;
 }
 